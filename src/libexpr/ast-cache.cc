@@ -0,0 +1,624 @@
+#include "ast-cache.hh"
+#include "globals.hh"
+#include "hash.hh"
+#include "util.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+
+namespace nix {
+
+
+unsigned long nrAstCacheHits = 0;
+unsigned long nrAstCacheMisses = 0;
+unsigned long nrAstCacheBytesRead = 0;
+unsigned long nrAstCacheBytesWritten = 0;
+
+
+/* Bump the version whenever the encoding or the output of the parser
+   changes. */
+static const std::string astCacheVersion = "2";
+static const std::string astCacheMagic = "nix-ast-" + astCacheVersion + "\n";
+
+
+enum class Tag : uint8_t {
+    Null,
+    Ref,            // a node that has already been written (e.g. the 'e' in 'inherit (e) a b;')
+    Int,
+    Float,
+    String,
+    Path,
+    Var,
+    Select,
+    HasAttr,
+    Attrs,
+    List,
+    Lambda,
+    Let,
+    With,
+    If,
+    Assert,
+    OpNot,
+    App,
+    OpEq,
+    OpNEq,
+    OpAnd,
+    OpOr,
+    OpImpl,
+    OpUpdate,
+    OpConcatLists,
+    ConcatStrings,
+    Pos,
+};
+
+
+/* Nodes and symbols are numbered in the order in which they're
+   first written.  A symbol is written as 0 if it's unset, as its
+   number plus one if it has been written before, or otherwise as the
+   next number followed by its name.  All positions are in the same
+   file, so they're stored as their offset in the file plus one, or 0
+   for noPos. */
+struct AstWriter
+{
+    const PosTable::Origin & origin;
+    std::string out;
+    std::unordered_map<const Expr *, size_t> exprs;
+    std::unordered_map<Symbol, size_t> symbols;
+
+    void tag(Tag t)
+    {
+        out.push_back((char) t);
+    }
+
+    void num(uint64_t n)
+    {
+        while (n >= 0x80) {
+            out.push_back((char) (n | 0x80));
+            n >>= 7;
+        }
+        out.push_back((char) n);
+    }
+
+    void str(std::string_view s)
+    {
+        num(s.size());
+        out.append(s);
+    }
+
+    void sym(const Symbol & s)
+    {
+        if (!s.set()) { num(0); return; }
+        auto i = symbols.find(s);
+        if (i != symbols.end()) { num(i->second + 1); return; }
+        size_t n = symbols.size();
+        symbols.emplace(s, n);
+        num(n + 1);
+        str(s);
+    }
+
+    void pos(const Pos & p)
+    {
+        if (!p) { num(0); return; }
+        assert(p.id - origin.start < origin.size);
+        num(p.id - origin.start + 1);
+    }
+
+    void attrPath(const AttrPath & attrPath)
+    {
+        num(attrPath.size());
+        for (auto & i : attrPath) {
+            sym(i.symbol);
+            if (!i.symbol.set()) expr(i.expr);
+        }
+    }
+
+    void attrs(const ExprAttrs & e)
+    {
+        out.push_back(e.recursive);
+        num(e.attrs.size());
+        for (auto & i : e.attrs) {
+            sym(i.first);
+            out.push_back(i.second.inherited);
+            pos(i.second.pos);
+            expr(i.second.e);
+        }
+        num(e.dynamicAttrs.size());
+        for (auto & i : e.dynamicAttrs) {
+            pos(i.pos);
+            expr(i.nameExpr);
+            expr(i.valueExpr);
+        }
+    }
+
+    void expr(const Expr * e)
+    {
+        if (!e) { tag(Tag::Null); return; }
+
+        auto i = exprs.find(e);
+        if (i != exprs.end()) {
+            tag(Tag::Ref);
+            num(i->second);
+            return;
+        }
+        exprs.emplace(e, exprs.size());
+
+        if (auto e2 = dynamic_cast<const ExprInt *>(e)) {
+            tag(Tag::Int);
+            out.append((const char *) &e2->n, sizeof(e2->n));
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprFloat *>(e)) {
+            tag(Tag::Float);
+            out.append((const char *) &e2->nf, sizeof(e2->nf));
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprString *>(e)) {
+            tag(Tag::String);
+            sym(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprPath *>(e)) {
+            tag(Tag::Path);
+            str(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprVar *>(e)) {
+            tag(Tag::Var);
+            pos(e2->pos);
+            sym(e2->name);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprSelect *>(e)) {
+            tag(Tag::Select);
+            pos(e2->pos);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+            expr(e2->def);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprOpHasAttr *>(e)) {
+            tag(Tag::HasAttr);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprAttrs *>(e)) {
+            tag(Tag::Attrs);
+            attrs(*e2);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprList *>(e)) {
+            tag(Tag::List);
+            num(e2->elems.size());
+            for (auto & i : e2->elems)
+                expr(i);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprLambda *>(e)) {
+            tag(Tag::Lambda);
+            pos(e2->pos);
+            sym(e2->name);
+            sym(e2->arg);
+            out.push_back(e2->matchAttrs);
+            if (e2->matchAttrs) {
+                num(e2->formals->formals.size());
+                for (auto & i : e2->formals->formals) {
+                    pos(i.pos);
+                    sym(i.name);
+                    expr(i.def);
+                }
+                out.push_back(e2->formals->ellipsis);
+            }
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprLet *>(e)) {
+            tag(Tag::Let);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprWith *>(e)) {
+            tag(Tag::With);
+            pos(e2->pos);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprIf *>(e)) {
+            tag(Tag::If);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->then);
+            expr(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprAssert *>(e)) {
+            tag(Tag::Assert);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprOpNot *>(e)) {
+            tag(Tag::OpNot);
+            expr(e2->e);
+        }
+
+#define BINOP(T, t) \
+        else if (auto e2 = dynamic_cast<const T *>(e)) { \
+            tag(t); \
+            pos(e2->pos); \
+            expr(e2->e1); \
+            expr(e2->e2); \
+        }
+        BINOP(ExprApp, Tag::App)
+        BINOP(ExprOpEq, Tag::OpEq)
+        BINOP(ExprOpNEq, Tag::OpNEq)
+        BINOP(ExprOpAnd, Tag::OpAnd)
+        BINOP(ExprOpOr, Tag::OpOr)
+        BINOP(ExprOpImpl, Tag::OpImpl)
+        BINOP(ExprOpUpdate, Tag::OpUpdate)
+        BINOP(ExprOpConcatLists, Tag::OpConcatLists)
+#undef BINOP
+
+        else if (auto e2 = dynamic_cast<const ExprConcatStrings *>(e)) {
+            tag(Tag::ConcatStrings);
+            pos(e2->pos);
+            out.push_back(e2->forceString);
+            num(e2->es->size());
+            for (auto & i : *e2->es)
+                expr(i);
+        }
+
+        else if (auto e2 = dynamic_cast<const ExprPos *>(e)) {
+            tag(Tag::Pos);
+            pos(e2->pos);
+        }
+
+        else
+            throw Error("cannot serialise expression '%s'", *e);
+    }
+};
+
+
+struct AstReader
+{
+    SymbolTable & symbolTable;
+    const PosTable::Origin & origin;
+    std::string_view in;
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    AstReader(SymbolTable & symbolTable, const PosTable::Origin & origin, std::string_view in)
+        : symbolTable(symbolTable), origin(origin), in(in)
+    { }
+
+    [[noreturn]] void corrupt()
+    {
+        throw Error("AST cache entry is corrupt");
+    }
+
+    uint8_t byte()
+    {
+        if (in.empty()) corrupt();
+        uint8_t c = in[0];
+        in.remove_prefix(1);
+        return c;
+    }
+
+    bool flag()
+    {
+        return byte();
+    }
+
+    uint64_t num()
+    {
+        uint64_t n = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            uint8_t c = byte();
+            n |= (uint64_t) (c & 0x7f) << shift;
+            if (!(c & 0x80)) return n;
+        }
+        corrupt();
+    }
+
+    std::string_view str()
+    {
+        auto n = num();
+        if (n > in.size()) corrupt();
+        auto s = in.substr(0, n);
+        in.remove_prefix(n);
+        return s;
+    }
+
+    template<typename T>
+    T raw()
+    {
+        T x;
+        if (in.size() < sizeof(x)) corrupt();
+        memcpy(&x, in.data(), sizeof(x));
+        in.remove_prefix(sizeof(x));
+        return x;
+    }
+
+    Symbol sym()
+    {
+        auto n = num();
+        if (!n) return Symbol();
+        if (n <= symbols.size()) return symbols[n - 1];
+        if (n != symbols.size() + 1) corrupt();
+        symbols.push_back(symbolTable.create(str()));
+        return symbols.back();
+    }
+
+    Pos pos()
+    {
+        auto n = num();
+        if (!n) return noPos;
+        if (n > origin.size) corrupt();
+        return origin[n - 1];
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath res;
+        auto n = num();
+        for (uint64_t i = 0; i < n; i++) {
+            auto s = sym();
+            if (s.set())
+                res.emplace_back(s);
+            else
+                res.emplace_back(child());
+        }
+        return res;
+    }
+
+    ExprAttrs * attrs()
+    {
+        auto e = new ExprAttrs;
+        e->recursive = flag();
+        auto n = num();
+        for (uint64_t i = 0; i < n; i++) {
+            auto name = sym();
+            bool inherited = flag();
+            auto p = pos();
+            e->attrs[name] = ExprAttrs::AttrDef(child(), p, inherited);
+        }
+        n = num();
+        for (uint64_t i = 0; i < n; i++) {
+            auto p = pos();
+            auto nameExpr = child();
+            e->dynamicAttrs.emplace_back(nameExpr, child(), p);
+        }
+        return e;
+    }
+
+    /* Read a node that must not be null. */
+    Expr * child()
+    {
+        auto e = expr();
+        if (!e) corrupt();
+        return e;
+    }
+
+    Expr * expr()
+    {
+        auto tag = (Tag) byte();
+
+        if (tag == Tag::Null) return nullptr;
+
+        if (tag == Tag::Ref) {
+            auto n = num();
+            if (n >= exprs.size() || !exprs[n]) corrupt();
+            return exprs[n];
+        }
+
+        auto n = exprs.size();
+        exprs.push_back(nullptr);
+        auto e = node(tag);
+        exprs[n] = e;
+        return e;
+    }
+
+    Expr * node(Tag tag)
+    {
+        switch (tag) {
+
+        case Tag::Int:
+            return new ExprInt(raw<NixInt>());
+
+        case Tag::Float:
+            return new ExprFloat(raw<NixFloat>());
+
+        case Tag::String:
+            return new ExprString(sym());
+
+        case Tag::Path:
+            return new ExprPath(string(str()));
+
+        case Tag::Var: {
+            auto p = pos();
+            return new ExprVar(p, sym());
+        }
+
+        case Tag::Select: {
+            auto p = pos();
+            auto e = child();
+            auto path = attrPath();
+            return new ExprSelect(p, e, path, expr());
+        }
+
+        case Tag::HasAttr: {
+            auto e = child();
+            return new ExprOpHasAttr(e, attrPath());
+        }
+
+        case Tag::Attrs:
+            return attrs();
+
+        case Tag::List: {
+            auto e = new ExprList;
+            auto n = num();
+            for (uint64_t i = 0; i < n; i++)
+                e->elems.push_back(child());
+            return e;
+        }
+
+        case Tag::Lambda: {
+            auto p = pos();
+            auto name = sym();
+            auto arg = sym();
+            bool matchAttrs = flag();
+            Formals * formals = nullptr;
+            if (matchAttrs) {
+                formals = new Formals;
+                auto n = num();
+                for (uint64_t i = 0; i < n; i++) {
+                    auto p2 = pos();
+                    auto name2 = sym();
+                    formals->formals.emplace_back(p2, name2, expr());
+                    formals->argNames.insert(name2);
+                }
+                formals->ellipsis = flag();
+            }
+            auto e = new ExprLambda(p, arg, matchAttrs, formals, child());
+            e->name = name;
+            return e;
+        }
+
+        case Tag::Let: {
+            auto attrs = dynamic_cast<ExprAttrs *>(child());
+            if (!attrs) corrupt();
+            return new ExprLet(attrs, child());
+        }
+
+        case Tag::With: {
+            auto p = pos();
+            auto attrs = child();
+            return new ExprWith(p, attrs, child());
+        }
+
+        case Tag::If: {
+            auto p = pos();
+            auto cond = child();
+            auto then = child();
+            return new ExprIf(p, cond, then, child());
+        }
+
+        case Tag::Assert: {
+            auto p = pos();
+            auto cond = child();
+            return new ExprAssert(p, cond, child());
+        }
+
+        case Tag::OpNot:
+            return new ExprOpNot(child());
+
+#define BINOP(T, t) \
+        case t: { \
+            auto p = pos(); \
+            auto e1 = child(); \
+            return new T(p, e1, child()); \
+        }
+        BINOP(ExprApp, Tag::App)
+        BINOP(ExprOpEq, Tag::OpEq)
+        BINOP(ExprOpNEq, Tag::OpNEq)
+        BINOP(ExprOpAnd, Tag::OpAnd)
+        BINOP(ExprOpOr, Tag::OpOr)
+        BINOP(ExprOpImpl, Tag::OpImpl)
+        BINOP(ExprOpUpdate, Tag::OpUpdate)
+        BINOP(ExprOpConcatLists, Tag::OpConcatLists)
+#undef BINOP
+
+        case Tag::ConcatStrings: {
+            auto p = pos();
+            bool forceString = flag();
+            auto es = new vector<Expr *>;
+            auto n = num();
+            for (uint64_t i = 0; i < n; i++)
+                es->push_back(child());
+            return new ExprConcatStrings(p, forceString, es);
+        }
+
+        case Tag::Pos:
+            return new ExprPos(pos());
+
+        default:
+            corrupt();
+        }
+    }
+};
+
+
+Path getAstCacheFile(const Path & path, std::string_view contents)
+{
+    /* Besides the file itself, the parse tree depends on the home
+       directory (for '~/...' paths) and on whether URL literals are
+       allowed. */
+    HashSink sink(htSHA256);
+    sink(astCacheMagic);
+    sink(path);
+    sink(std::string(1, 0));
+    sink((const unsigned char *) contents.data(), contents.size());
+    sink(std::string(1, 0));
+    sink(getHome());
+    sink(settings.isExperimentalFeatureEnabled("no-url-literals") ? "1" : "0");
+    auto hash = sink.finish().first;
+    return getCacheDir() + "/nix/ast-v" + astCacheVersion + "/" + hash.to_string(Base32, false);
+}
+
+
+Expr * lookupAstCache(SymbolTable & symbols, const PosTable::Origin & origin, const Path & cacheFile)
+{
+    string data;
+    try {
+        data = readFile(cacheFile);
+    } catch (SysError &) {
+        nrAstCacheMisses++;
+        return nullptr;
+    }
+
+    try {
+        if (!hasPrefix(data, astCacheMagic))
+            throw Error("AST cache entry has the wrong version");
+        AstReader reader(symbols, origin,
+            std::string_view(data).substr(astCacheMagic.size()));
+        auto e = reader.child();
+        if (!reader.in.empty()) reader.corrupt();
+        nrAstCacheHits++;
+        nrAstCacheBytesRead += data.size();
+        return e;
+    } catch (Error & e) {
+        debug("ignoring AST cache entry '%s' for '%s': %s", cacheFile, origin.file, e.msg());
+        nrAstCacheMisses++;
+        return nullptr;
+    }
+}
+
+
+void insertAstCache(const Path & cacheFile, const PosTable::Origin & origin, Expr * e)
+{
+    try {
+        AstWriter writer { .origin = origin };
+        writer.out = astCacheMagic;
+        writer.expr(e);
+
+        createDirs(dirOf(cacheFile));
+        auto tmpFile = fmt("%s.tmp-%d", cacheFile, getpid());
+        writeFile(tmpFile, writer.out);
+        if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1) {
+            SysError err("renaming '%s' to '%s'", tmpFile, cacheFile);
+            unlink(tmpFile.c_str());
+            throw err;
+        }
+
+        nrAstCacheBytesWritten += writer.out.size();
+    } catch (Error & e) {
+        debug("cannot write AST cache entry '%s': %s", cacheFile, e.msg());
+    }
+}
+
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+
+/* A persistent cache of parse trees, stored under
+   ~/.cache/nix/ast-v2.  Entries are keyed by a hash of the file name,
+   the file contents and everything else the parser depends on (such
+   as the home directory, which '~/...' paths are expanded against).
+   An entry contains the expression as it came out of the parser,
+   i.e. before bindVars(), so the same entry can be used with any
+   static environment (e.g. by scopedImport). */
+
+/* Return the name of the cache entry for 'path', which has contents
+   'contents'. */
+Path getAstCacheFile(const Path & path, std::string_view contents);
+
+/* Return the parse tree stored in cache entry 'cacheFile' of the file
+   that has been added to the position table as 'origin', or nullptr
+   if there is no such entry (or if it's unreadable). */
+Expr * lookupAstCache(SymbolTable & symbols, const PosTable::Origin & origin, const Path & cacheFile);
+
+/* Store the parse tree 'e' of the file 'origin' in cache entry
+   'cacheFile'.  Errors are ignored, since the cache is only an
+   optimisation. */
+void insertAstCache(const Path & cacheFile, const PosTable::Origin & origin, Expr * e);
+
+
+/* Statistics. */
+extern unsigned long nrAstCacheHits;
+extern unsigned long nrAstCacheMisses;
+extern unsigned long nrAstCacheBytesRead;
+extern unsigned long nrAstCacheBytesWritten;
+
+
+}
@@ -2,6 +2,7 @@
 #include "eval-inline.hh"
 
 #include <algorithm>
+#include <cstring>
 
 
 namespace nix {
@@ -14,7 +15,7 @@ Bindings * EvalState::allocBindings(size_t capacity)
 {
     if (capacity > std::numeric_limits<Bindings::size_t>::max())
         throw Error("attribute set of size %d is too big", capacity);
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    return new (allocObject(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
 }
 
 
@@ -25,7 +26,7 @@ void EvalState::mkAttrs(Value & v, size_t capacity)
         return;
     }
     clearValue(v);
-    v.type = tAttrs;
+    v.setType(tAttrs);
     v.attrs = allocBindings(capacity);
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
@@ -52,6 +53,115 @@ Value * EvalState::allocAttr(Value & vAttrs, const std::string & name)
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    index_ = nullptr;
+}
+
+
+unsigned long Bindings::nrLayered = 0;
+unsigned long Bindings::nrFlattened = 0;
+unsigned long Bindings::nrFlattenedAttrs = 0;
+
+
+/* Merge the sorted attribute arrays 'a1' and 'a2' into 'out',
+   preferring attributes from 'a2', and return the number of
+   attributes written. */
+static size_t mergeAttrs(Attr * out,
+    const Attr * i, const Attr * end1,
+    const Attr * j, const Attr * end2)
+{
+    Attr * p = out;
+
+    while (i != end1 && j != end2) {
+        if (i->name == j->name) {
+            *p++ = *j;
+            ++i; ++j;
+        }
+        else if (i->name < j->name)
+            *p++ = *i++;
+        else
+            *p++ = *j++;
+    }
+
+    while (i != end1) *p++ = *i++;
+    while (j != end2) *p++ = *j++;
+
+    return p - out;
+}
+
+
+Bindings * Bindings::layer(Bindings & b1, Bindings & b2)
+{
+    /* If 'b1' is itself layered, merge its overlay with 'b2' so that
+       lookups never have to go through more than one overlay. */
+    size_t n1 = b1.base_ ? b1.overlaySize() : 0;
+    Bindings * base = b1.base_ ? b1.base() : &b1;
+
+    /* Only layer small overlays on top of big sets. Otherwise a
+       flat copy is cheap enough, and lookups in it are faster. */
+    size_t capacity = n1 + b2.size();
+    if (base->size() < 16 || capacity * 4 > base->size())
+        return nullptr;
+
+    auto & f2 = b2.flat();
+
+    auto res = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings(capacity);
+    res->capacity_ = mergeAttrs(res->attrs, &b1.attrs[0], &b1.attrs[n1], &f2.attrs[0], &f2.attrs[f2.size_]);
+    res->base_ = base;
+    res->size_ = base->size_;
+    for (size_t n = 0; n < res->capacity_; n++)
+        if (!base->lookup(res->attrs[n].name)) res->size_++;
+
+    nrLayered++;
+
+    return res;
+}
+
+
+void Bindings::flatten()
+{
+    auto f = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * size_)) Bindings(size_);
+    auto n = overlaySize();
+    auto b = base();
+    f->size_ = mergeAttrs(f->attrs, &b->attrs[0], &b->attrs[b->size_], &attrs[0], &attrs[n]);
+    assert(f->size_ == size_);
+
+    __atomic_store_n(&base_, f, __ATOMIC_RELEASE);
+    __atomic_store_n(&capacity_, 0, __ATOMIC_RELEASE);
+
+    nrFlattened++;
+    nrFlattenedAttrs += size_;
+}
+
+
+unsigned long Bindings::nrIndexes = 0;
+unsigned long Bindings::nrIndexBytes = 0;
+unsigned long Bindings::nrIndexedLookups = 0;
+unsigned long Bindings::nrSortedLookups = 0;
+
+
+uint32_t * Bindings::buildIndex()
+{
+    /* Use a load factor of at most 1/2. */
+    uint32_t bits = 1;
+    while ((1U << bits) < 2 * size_) bits++;
+    auto mask = (1U << bits) - 1;
+
+    auto bytes = ((1U << bits) + 1) * sizeof(uint32_t);
+    auto index = (uint32_t *) allocBytesAtomic(bytes);
+    memset(index, 0, bytes);
+    index[0] = bits;
+
+    for (size_t n = 0; n < size_; n++) {
+        auto slot = hashSlot(attrs[n].name, bits);
+        while (index[slot + 1]) slot = (slot + 1) & mask;
+        index[slot + 1] = n + 1;
+    }
+
+    __atomic_store_n(&index_, index, __ATOMIC_RELEASE);
+    nrIndexes++;
+    nrIndexBytes += bytes;
+
+    return index;
 }
 
 
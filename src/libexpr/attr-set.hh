@@ -17,10 +17,10 @@ struct Attr
 {
     Symbol name;
     Value * value;
-    Pos * pos;
-    Attr(Symbol name, Value * value, Pos * pos = &noPos)
+    Pos pos;
+    Attr(Symbol name, Value * value, Pos pos = noPos)
         : name(name), value(value), pos(pos) { };
-    Attr() : pos(&noPos) { };
+    Attr() { };
     bool operator < (const Attr & a) const
     {
         return name < a.name;
@@ -30,19 +30,123 @@ struct Attr
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
-   the number of elements already inserted in this structure. */
+   the number of elements already inserted in this structure.
+
+   Lookups do a binary search on the (sorted) attributes. For sets of
+   at least `indexThreshold' attributes, the first lookup builds a hash
+   index keyed on the symbol pointers, which is used for subsequent
+   lookups. Any change to the set invalidates the index.
+
+   A Bindings can also be "layered": the result of `base // overlay'
+   where the overlay is small compared to the base (see layer()). In
+   that case the attributes allocated after this structure are the
+   (sorted) overlay, `capacity_' is the size of the overlay, `base_'
+   points to the shared base set and `size_' is the size of the merged
+   set. get() looks in the overlay and then in the base, without
+   copying anything. Iteration, find() and operator[] need a
+   contiguous array, so they first flatten the set into a newly
+   allocated one, which then replaces the base (and the overlay
+   becomes empty). The base of a layered set is never layered
+   itself.
+
+   Sets can be shared between evaluation threads, so the index and
+   the flattened base are published atomically. The base is replaced
+   before the overlay is emptied, and readers load the overlay size
+   before the base, so they always see either the old or the new
+   state of a layered set. */
 class Bindings
 {
 public:
     typedef uint32_t size_t;
 
+    static constexpr size_t indexThreshold = 32;
+
+    /* Statistics: the number and total size of the indexes built,
+       the number of lookups that went through an index, and the
+       number that did a binary search because the set is too small
+       to have one. These count lookups, whether or not they find
+       the attribute. */
+    static unsigned long nrIndexes, nrIndexBytes, nrIndexedLookups, nrSortedLookups;
+
+    /* Statistics: the number of layered sets created, the number of
+       them that had to be flattened, and the number of attributes
+       copied in doing so. */
+    static unsigned long nrLayered, nrFlattened, nrFlattenedAttrs;
+
 private:
     size_t size_, capacity_;
+
+    /* Open-addressed hash table with linear probing. The first
+       element is the log2 of the number of slots; each slot contains
+       the position of an attribute plus one, or 0 if it's empty. */
+    uint32_t * index_;
+
+    /* If set, this is a layered set on top of `base_'. */
+    Bindings * base_;
+
     Attr attrs[0];
 
-    Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
+    Bindings(size_t capacity) : size_(0), capacity_(capacity), index_(nullptr), base_(nullptr) { }
     Bindings(const Bindings & bindings) = delete;
 
+    uint32_t * buildIndex();
+
+    size_t overlaySize() const
+    {
+        return __atomic_load_n(&capacity_, __ATOMIC_ACQUIRE);
+    }
+
+    Bindings * base() const
+    {
+        return __atomic_load_n(&base_, __ATOMIC_ACQUIRE);
+    }
+
+    static size_t hashSlot(const Symbol & name, uint32_t bits)
+    {
+        return (std::hash<Symbol>()(name) * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+    }
+
+    Attr * lookup(const Symbol & name)
+    {
+        Attr key(name, 0);
+
+        if (base_) {
+            auto n = overlaySize();
+            Attr * i = std::lower_bound(&attrs[0], &attrs[n], key);
+            if (i != &attrs[n] && i->name == name) return i;
+            return base()->lookup(name);
+        }
+
+        if (size_ >= indexThreshold) {
+            auto index = __atomic_load_n(&index_, __ATOMIC_ACQUIRE);
+            if (!index) index = buildIndex();
+            nrIndexedLookups++;
+            auto bits = index[0];
+            auto mask = (1U << bits) - 1;
+            for (auto slot = hashSlot(name, bits); ; slot = (slot + 1) & mask) {
+                auto n = index[slot + 1];
+                if (!n) return nullptr;
+                if (attrs[n - 1].name == name) return &attrs[n - 1];
+            }
+        }
+
+        nrSortedLookups++;
+        Attr * i = std::lower_bound(&attrs[0], &attrs[size_], key);
+        if (i != &attrs[size_] && i->name == name) return i;
+        return nullptr;
+    }
+
+    void flatten();
+
+    /* Return the set that contains the attributes of this one in a
+       contiguous array, i.e. this set itself unless it's layered. */
+    Bindings & flat()
+    {
+        if (!base_) return *this;
+        if (overlaySize()) flatten();
+        return *base();
+    }
+
 public:
     size_t size() const { return size_; }
 
@@ -52,24 +156,23 @@ public:
 
     void push_back(const Attr & attr)
     {
-        assert(size_ < capacity_);
+        assert(size_ < capacity_ && !base_);
         attrs[size_++] = attr;
+        index_ = nullptr;
     }
 
+    /* Note: this flattens layered sets. Use get() unless you need an
+       iterator. */
     iterator find(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
-        return end();
+        auto & f = flat();
+        auto a = f.lookup(name);
+        return a ? a : f.end();
     }
 
     Attr * get(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        return lookup(name);
     }
 
     Attr & need(const Symbol & name, const Pos & pos = noPos)
@@ -84,25 +187,32 @@ public:
         return *a;
     }
 
-    iterator begin() { return &attrs[0]; }
-    iterator end() { return &attrs[size_]; }
+    iterator begin() { return &flat().attrs[0]; }
+    iterator end() { auto & f = flat(); return &f.attrs[f.size_]; }
 
     Attr & operator[](size_t pos)
     {
-        return attrs[pos];
+        auto & f = flat();
+        f.index_ = nullptr;
+        return f.attrs[pos];
     }
 
     void sort();
 
     size_t capacity() { return capacity_; }
 
+    /* Return a layered set `base // overlay', or nullptr if it's
+       cheaper to copy both sets into a new one. */
+    static Bindings * layer(Bindings & base, Bindings & overlay);
+
     /* Returns the attributes in lexicographically sorted order. */
     std::vector<const Attr *> lexicographicOrder() const
     {
+        auto & f = const_cast<Bindings *>(this)->flat();
         std::vector<const Attr *> res;
         res.reserve(size_);
         for (size_t n = 0; n < size_; n++)
-            res.emplace_back(&attrs[n]);
+            res.emplace_back(&f.attrs[n]);
         std::sort(res.begin(), res.end(), [](const Attr * a, const Attr * b) {
             return (const string &) a->name < (const string &) b->name;
         });
@@ -0,0 +1,347 @@
+#include "bytecode.hh"
+
+namespace nix {
+
+
+unsigned long nrBytecodeIslands = 0;
+unsigned long nrBytecodeInstrs = 0;
+
+
+static bool hasStaticAttrPath(const AttrPath & attrPath)
+{
+    for (auto & i : attrPath)
+        if (!i.symbol.set()) return false;
+    return true;
+}
+
+
+/* Return whether 'e' can be evaluated by the stack machine directly
+   (rather than through a PushExpr instruction). */
+static bool isInline(Expr * e)
+{
+    if (dynamic_cast<ExprInt *>(e)
+        || dynamic_cast<ExprFloat *>(e)
+        || dynamic_cast<ExprString *>(e)
+        || dynamic_cast<ExprPath *>(e)
+        || dynamic_cast<ExprVar *>(e)
+        || dynamic_cast<ExprApp *>(e)
+        || dynamic_cast<ExprOpEq *>(e)
+        || dynamic_cast<ExprOpNEq *>(e)
+        || dynamic_cast<ExprOpAnd *>(e)
+        || dynamic_cast<ExprOpOr *>(e)
+        || dynamic_cast<ExprOpImpl *>(e)
+        || dynamic_cast<ExprOpNot *>(e)
+        || dynamic_cast<ExprIf *>(e)
+        || dynamic_cast<ExprAssert *>(e))
+        return true;
+    if (auto e2 = dynamic_cast<ExprSelect *>(e))
+        return hasStaticAttrPath(e2->attrPath);
+    if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e))
+        return hasStaticAttrPath(e2->attrPath);
+    return false;
+}
+
+
+/* Return the number of nodes in the island rooted at 'e'. */
+static size_t islandSize(Expr * e)
+{
+    if (!isInline(e)) return 0;
+    if (auto e2 = dynamic_cast<ExprSelect *>(e))
+        return 1 + islandSize(e2->e);
+    if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e))
+        return 1 + islandSize(e2->e);
+    if (auto e2 = dynamic_cast<ExprApp *>(e))
+        return 1 + islandSize(e2->e1);
+    if (auto e2 = dynamic_cast<ExprOpNot *>(e))
+        return 1 + islandSize(e2->e);
+    if (auto e2 = dynamic_cast<ExprIf *>(e))
+        return 1 + islandSize(e2->cond) + islandSize(e2->then) + islandSize(e2->else_);
+    if (auto e2 = dynamic_cast<ExprAssert *>(e))
+        return 1 + islandSize(e2->cond) + islandSize(e2->body);
+#define BINOP(T) \
+    if (auto e2 = dynamic_cast<T *>(e)) \
+        return 1 + islandSize(e2->e1) + islandSize(e2->e2);
+    BINOP(ExprOpEq)
+    BINOP(ExprOpNEq)
+    BINOP(ExprOpAnd)
+    BINOP(ExprOpOr)
+    BINOP(ExprOpImpl)
+#undef BINOP
+    return 1;
+}
+
+
+static void compileChildren(Expr * e);
+
+
+static Expr * compile(Expr * e);
+
+
+struct Compiler
+{
+    ExprBytecode & res;
+    size_t depth = 0;
+
+    Compiler(ExprBytecode & res) : res(res) { }
+
+    size_t add(Instr && i, int delta)
+    {
+        res.code.push_back(std::move(i));
+        depth += delta;
+        res.maxStack = std::max(res.maxStack, depth);
+        return res.code.size() - 1;
+    }
+
+    size_t jump(OpCode op, int delta)
+    {
+        return add(Instr(op), delta);
+    }
+
+    void patch(size_t jump)
+    {
+        res.code[jump].target = res.code.size();
+    }
+
+    void checkBool(Pos pos)
+    {
+        Instr i(OpCode::CheckBool);
+        i.pos = pos;
+        add(std::move(i), 0);
+    }
+
+    void emit(Expr * e)
+    {
+        if (!isInline(e)) {
+            add(Instr(OpCode::PushExpr, compile(e)), 1);
+            return;
+        }
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e))
+            pushConst(e2->v);
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e))
+            pushConst(e2->v);
+        else if (auto e2 = dynamic_cast<ExprString *>(e))
+            pushConst(e2->v);
+        else if (auto e2 = dynamic_cast<ExprPath *>(e))
+            pushConst(e2->v);
+
+        else if (dynamic_cast<ExprVar *>(e))
+            add(Instr(OpCode::PushVar, e), 1);
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            emit(e2->e);
+            if (e2->def) e2->def = compile(e2->def);
+            add(Instr(OpCode::Select, e), 0);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            emit(e2->e);
+            add(Instr(OpCode::HasAttr, e), 0);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprApp *>(e)) {
+            emit(e2->e1);
+            e2->e2 = compile(e2->e2);
+            add(Instr(OpCode::Call, e), 0);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpEq *>(e)) {
+            emit(e2->e1);
+            emit(e2->e2);
+            add(Instr(OpCode::Eq), -1);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNEq *>(e)) {
+            emit(e2->e1);
+            emit(e2->e2);
+            add(Instr(OpCode::NEq), -1);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpAnd *>(e)) {
+            emit(e2->e1);
+            checkBool(e2->pos);
+            auto j = jump(OpCode::JumpIfFalseKeep, -1);
+            emit(e2->e2);
+            checkBool(e2->pos);
+            patch(j);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpOr *>(e)) {
+            emit(e2->e1);
+            checkBool(e2->pos);
+            auto j = jump(OpCode::JumpIfTrueKeep, -1);
+            emit(e2->e2);
+            checkBool(e2->pos);
+            patch(j);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpImpl *>(e)) {
+            emit(e2->e1);
+            checkBool(e2->pos);
+            add(Instr(OpCode::Not), 0);
+            auto j = jump(OpCode::JumpIfTrueKeep, -1);
+            emit(e2->e2);
+            checkBool(e2->pos);
+            patch(j);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            emit(e2->e);
+            checkBool(noPos);
+            add(Instr(OpCode::Not), 0);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            emit(e2->cond);
+            checkBool(e2->pos);
+            auto j1 = jump(OpCode::JumpIfFalse, -1);
+            emit(e2->then);
+            auto j2 = jump(OpCode::Jump, -1);
+            patch(j1);
+            emit(e2->else_);
+            patch(j2);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            emit(e2->cond);
+            checkBool(e2->pos);
+            add(Instr(OpCode::Assert, e), -1);
+            emit(e2->body);
+        }
+
+        else
+            abort();
+    }
+
+    void pushConst(Value & v)
+    {
+        Instr i(OpCode::PushConst);
+        i.constant = &v;
+        add(std::move(i), 1);
+    }
+};
+
+
+static Expr * compile(Expr * e)
+{
+    if (isInline(e) && islandSize(e) >= 2) {
+        auto res = new ExprBytecode(e);
+        Compiler(*res).emit(e);
+        nrBytecodeIslands++;
+        nrBytecodeInstrs += res->code.size();
+        return res;
+    }
+
+    compileChildren(e);
+    return e;
+}
+
+
+static void compileAttrPath(AttrPath & attrPath)
+{
+    for (auto & i : attrPath)
+        if (!i.symbol.set())
+            i.expr = compile(i.expr);
+}
+
+
+static void compileChildren(Expr * e)
+{
+    if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+        e2->e = compile(e2->e);
+        if (e2->def) e2->def = compile(e2->def);
+        compileAttrPath(e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        e2->e = compile(e2->e);
+        compileAttrPath(e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+        for (auto & i : e2->attrs)
+            i.second.e = compile(i.second.e);
+        for (auto & i : e2->dynamicAttrs) {
+            i.nameExpr = compile(i.nameExpr);
+            i.valueExpr = compile(i.valueExpr);
+        }
+    }
+
+    else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+        for (auto & i : e2->elems)
+            i = compile(i);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+        if (e2->matchAttrs)
+            for (auto & i : e2->formals->formals)
+                if (i.def) i.def = compile(i.def);
+        e2->body = compile(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+        for (auto & i : e2->attrs->attrs)
+            i.second.e = compile(i.second.e);
+        e2->body = compile(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+        e2->attrs = compile(e2->attrs);
+        e2->body = compile(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+        e2->cond = compile(e2->cond);
+        e2->then = compile(e2->then);
+        e2->else_ = compile(e2->else_);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+        e2->cond = compile(e2->cond);
+        e2->body = compile(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNot *>(e))
+        e2->e = compile(e2->e);
+
+    else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        for (auto & i : *e2->es)
+            i = compile(i);
+    }
+
+#define BINOP(T) \
+    else if (auto e2 = dynamic_cast<T *>(e)) { \
+        e2->e1 = compile(e2->e1); \
+        e2->e2 = compile(e2->e2); \
+    }
+    BINOP(ExprApp)
+    BINOP(ExprOpEq)
+    BINOP(ExprOpNEq)
+    BINOP(ExprOpAnd)
+    BINOP(ExprOpOr)
+    BINOP(ExprOpImpl)
+    BINOP(ExprOpUpdate)
+    BINOP(ExprOpConcatLists)
+#undef BINOP
+}
+
+
+Expr * compileBytecode(Expr * e)
+{
+    return compile(e);
+}
+
+
+void ExprBytecode::show(std::ostream & str) const
+{
+    orig->show(str);
+}
+
+
+void ExprBytecode::bindVars(const StaticEnv & env)
+{
+    orig->bindVars(env);
+}
+
+
+}
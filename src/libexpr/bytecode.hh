@@ -0,0 +1,85 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+
+/* An optional compilation stage for the evaluator.  After variables
+   have been resolved by bindVars(), compileBytecode() looks for
+   "islands" of strict expressions (variables, constants, attribute
+   selection, boolean operators, comparisons, conditionals, asserts
+   and function application) and lowers each island to a flat
+   sequence of instructions for a small stack machine, replacing the
+   island's root in the AST by an ExprBytecode node.  Everything else
+   (sets, lists, lambdas, let, with, string concatenation) is still
+   evaluated by the tree-walker, but the compiler recurses into those
+   expressions as well, so islands nested inside them get compiled
+   too.
+
+   The instructions perform exactly the same operations in the same
+   order as the corresponding Expr::eval() methods, so compiled and
+   tree-walked evaluation produce identical values and errors. */
+
+enum class OpCode : uint8_t {
+    PushConst,      // push *constant
+    PushVar,        // push the value of variable 'e' (forced)
+    PushExpr,       // push the result of e->eval() (tree-walker fallback)
+    Select,         // replace the top by the selection 'e' applied to it
+    HasAttr,        // replace the top by the result of '?' test 'e'
+    Call,           // replace the top (a function) by its application to e->e2
+    CheckBool,      // type-check the top as a Boolean (reporting 'pos', if set)
+    Not,            // negate the top (a Boolean)
+    Eq,             // pop two values, push whether they're equal
+    NEq,            // pop two values, push whether they're not equal
+    Assert,         // pop a Boolean, fail assertion 'e' if it's false
+    Jump,           // continue at 'target'
+    JumpIfFalse,    // pop a Boolean, continue at 'target' if it's false
+    JumpIfFalseKeep, // if the top is false, continue at 'target', otherwise pop it
+    JumpIfTrueKeep, // if the top is true, continue at 'target', otherwise pop it
+};
+
+
+struct Instr
+{
+    OpCode op;
+    uint32_t target = 0;
+    union {
+        Expr * e;
+        Value * constant;
+    };
+    Pos pos;
+
+    Instr(OpCode op, Expr * e = nullptr) : op(op), e(e) { };
+};
+
+
+struct ExprBytecode : Expr
+{
+    /* The expression that this code was compiled from; only used for
+       showing the expression. */
+    Expr * orig;
+
+    std::vector<Instr> code;
+
+    /* Maximum number of values on the stack while running 'code'. */
+    size_t maxStack = 0;
+
+    ExprBytecode(Expr * orig) : orig(orig) { };
+
+    COMMON_METHODS
+};
+
+
+/* Compile the strict islands in 'e' (which must already have been
+   passed through bindVars()) and return the resulting expression,
+   which may be 'e' itself. */
+Expr * compileBytecode(Expr * e);
+
+
+/* Statistics. */
+extern unsigned long nrBytecodeIslands;
+extern unsigned long nrBytecodeInstrs;
+
+
+}
@@ -0,0 +1,191 @@
+#include "context-table.hh"
+#include "eval-inline.hh"
+
+#include <cstring>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+namespace nix {
+
+
+ContextTable contextTable;
+
+
+template<typename Equal>
+const void * WeakSet::find(size_t hash, const Equal & equal)
+{
+    auto range = entries.equal_range(hash);
+    if (range.first == range.second) return nullptr;
+
+    auto lookup = [&]() -> const void * {
+        for (auto i = range.first; i != range.second; ++i)
+            if (i->second->p && equal(i->second->p)) return i->second->p;
+        return nullptr;
+    };
+
+#if HAVE_BOEHMGC
+    /* Read the links while holding the allocation lock, so that the
+       collector can't clear a link between us reading it and the
+       caller storing the pointer somewhere it can see. */
+    typedef decltype(lookup) Lookup;
+    return GC_call_with_alloc_lock(
+        [](void * data) -> void * { return (void *) (*(Lookup *) data)(); },
+        &lookup);
+#else
+    return lookup();
+#endif
+}
+
+
+void WeakSet::insert(size_t hash, const void * p)
+{
+    if (entries.size() >= sweepAt) sweep();
+
+    auto link = (Link *) malloc(sizeof(Link));
+    if (!link) throw std::bad_alloc();
+    link->p = p;
+
+#if HAVE_BOEHMGC
+    if (GC_general_register_disappearing_link((void * *) &link->p, p) != GC_SUCCESS) {
+        free(link);
+        throw std::bad_alloc();
+    }
+#endif
+
+    entries.emplace(hash, link);
+}
+
+
+void WeakSet::sweep()
+{
+    /* A cleared link stays cleared and is no longer registered with
+       the collector, so it can be freed without taking the
+       allocation lock. */
+    for (auto i = entries.begin(); i != entries.end(); )
+        if (!i->second->p) {
+            free(i->second);
+            i = entries.erase(i);
+        } else
+            ++i;
+
+    sweepAt = std::max(sweepAt, entries.size() * 2);
+}
+
+
+static size_t hashContext(const ContextTable::Elems & c)
+{
+    size_t h = 0;
+    for (auto p : c)
+        h = h * 31 + std::hash<const char *>()(p);
+    return h;
+}
+
+
+ContextTable::ContextTable()
+    : unions(maxUnions)
+{
+}
+
+
+const char * ContextTable::internElem(std::string_view s)
+{
+    auto hash = std::hash<std::string_view>()(s);
+
+    if (auto p = elems.find(hash, [&](const void * p) {
+        return strncmp((const char *) p, s.data(), s.size()) == 0
+            && ((const char *) p)[s.size()] == 0;
+    }))
+        return (const char *) p;
+
+    auto res = (char *) allocBytesAtomic(s.size() + 1);
+    memcpy(res, s.data(), s.size());
+    res[s.size()] = 0;
+    elems.insert(hash, res);
+    return res;
+}
+
+
+ContextTable::Context ContextTable::internUnlocked(const Elems & c)
+{
+    auto hash = hashContext(c);
+
+    if (auto p = contexts.find(hash, [&](const void * p) {
+        auto q = (Context) p;
+        for (auto i : c)
+            if (*q++ != i) return false;
+        return true;
+    }))
+        return (Context) p;
+
+    /* The array holds the only references to its elements, so it
+       has to be scanned by the collector. */
+    auto res = (Context) allocBytes(c.size() * sizeof(const char *));
+    memcpy(res, c.data(), c.size() * sizeof(const char *));
+    contexts.insert(hash, res);
+    return res;
+}
+
+
+ContextTable::Context ContextTable::intern(const PathSet & context)
+{
+    if (context.empty()) return nullptr;
+
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (concurrent) lock.lock();
+
+    /* A PathSet is already sorted. */
+    Elems c;
+    c.reserve(context.size() + 1);
+    for (auto & i : context)
+        c.push_back(internElem(i));
+    c.push_back(nullptr);
+
+    return internUnlocked(c);
+}
+
+
+ContextTable::Context ContextTable::merge(Context a, Context b)
+{
+    if (!a || a == b) return b;
+    if (!b) return a;
+
+    /* Unions are commutative. */
+    if (b < a) std::swap(a, b);
+
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (concurrent) lock.lock();
+
+    /* The cache refers to 'a' and 'b', so they can't have been freed
+       and reused for another context. */
+    nrUnionLookups++;
+    auto & slot = unions[
+        (((uint64_t) a * 31 + (uint64_t) b) * 0x9e3779b97f4a7c15ULL) >> (64 - unionBits)];
+    if (slot.a == a && slot.b == b) {
+        nrUnionHits++;
+        return slot.res;
+    }
+
+    /* Merge the sorted arrays. Equal elements are the same pointer, so
+       only distinct elements need to be compared. */
+    Elems c;
+    auto p = a, q = b;
+    while (*p && *q) {
+        if (*p == *q) { c.push_back(*p++); ++q; }
+        else if (strcmp(*p, *q) < 0) c.push_back(*p++);
+        else c.push_back(*q++);
+    }
+    for (; *p; ++p) c.push_back(*p);
+    for (; *q; ++q) c.push_back(*q);
+    c.push_back(nullptr);
+
+    auto res = internUnlocked(c);
+
+    slot = {a, b, res};
+
+    return res;
+}
+
+
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "types.hh"
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#if HAVE_BOEHMGC
+#include <gc/gc_allocator.h>
+#endif
+
+namespace nix {
+
+/* A set of garbage-collected objects that doesn't keep its members
+   alive. Each member is referenced through a disappearing link, which
+   the collector clears when it frees the member; cleared entries are
+   swept out as the set grows. Without the garbage collector, members
+   are never freed and the set is an ordinary set. */
+class WeakSet
+{
+public:
+
+    /* Return a member with hash 'hash' that satisfies 'equal', or
+       null. 'equal' must not allocate. */
+    template<typename Equal>
+    const void * find(size_t hash, const Equal & equal);
+
+    void insert(size_t hash, const void * p);
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+private:
+
+    /* The link lives in memory that the collector doesn't scan, so it
+       doesn't keep the member alive. */
+    struct Link
+    {
+        const void * p;
+    };
+
+    std::unordered_multimap<size_t, Link *> entries;
+
+    /* Sweep out cleared entries when the set reaches this size. */
+    size_t sweepAt = 1024;
+
+    void sweep();
+};
+
+/* Table of string contexts. A context is represented by a pointer to a
+   null-terminated array of context elements (see Value::string) in
+   sorted order, or by a null pointer if it's empty. The table stores
+   only one copy of each live element and of each live context, so two
+   contexts (or elements) are equal iff they are the same pointer.
+   Contexts and elements are allocated in garbage-collected memory and
+   the table refers to them weakly, so contexts that are no longer used
+   by any string (such as the intermediate results of building a string
+   piece by piece) are freed. Unions of contexts are memoized in a
+   fixed-size cache, since concatenation tends to merge the same
+   contexts over and over. If `concurrent' is set, the table takes a
+   lock, so that it can be used from several evaluation threads. */
+class ContextTable
+{
+public:
+
+    typedef const char * * Context;
+
+    /* A context under construction. Its elements may not be referred
+       to from anywhere else yet, so the collector has to scan it. */
+#if HAVE_BOEHMGC
+    typedef std::vector<const char *, traceable_allocator<const char *>> Elems;
+#else
+    typedef std::vector<const char *> Elems;
+#endif
+
+    ContextTable();
+
+    /* Return the context containing the elements of 'context'. */
+    Context intern(const PathSet & context);
+
+    /* Return the union of two contexts returned by this table. */
+    Context merge(Context a, Context b);
+
+    bool concurrent = false;
+
+    size_t size() const
+    {
+        return contexts.size();
+    }
+
+    size_t unionLookups() const
+    {
+        return nrUnionLookups;
+    }
+
+    size_t unionHits() const
+    {
+        return nrUnionHits;
+    }
+
+private:
+
+    WeakSet elems;
+    WeakSet contexts;
+
+    /* The memoized unions, indexed by a hash of the operands. A new
+       union replaces whatever was in its slot. The cache holds
+       strong references, so it keeps at most `maxUnions' unions and
+       their operands alive. */
+    struct Union
+    {
+        Context a, b, res;
+    };
+
+    static constexpr unsigned int unionBits = 16;
+    static constexpr size_t maxUnions = 1 << unionBits;
+
+#if HAVE_BOEHMGC
+    std::vector<Union, traceable_allocator<Union>> unions;
+#else
+    std::vector<Union> unions;
+#endif
+
+    /* Statistics. */
+    size_t nrUnionLookups = 0;
+    size_t nrUnionHits = 0;
+
+    std::mutex mutex;
+
+    const char * internElem(std::string_view s);
+
+    /* Return the context with the (null-terminated, sorted) elements
+       'c'. */
+    Context internUnlocked(const Elems & c);
+};
+
+extern ContextTable contextTable;
+
+}
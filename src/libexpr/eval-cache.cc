@@ -10,64 +10,152 @@ static const char * schema = R"sql(
 create table if not exists Attributes (
     parent      integer not null,
     name        text,
+    deps        integer not null,
     type        integer not null,
     value       text,
     context     text,
-    primary key (parent, name)
+    primary key (parent, name, deps)
+);
+
+create table if not exists DepSets (
+    id          integer primary key autoincrement not null,
+    deps        text unique not null
 );
 )sql";
 
+/* The cache of a flake is shared by all its revisions and lock files.
+   The same attribute can therefore have several rows, one for each
+   set of sources that it has been computed from; a row is used only
+   if the sources that it depends on are unchanged.
+
+   Dependency sets are newline-separated lists of dependencies, which
+   are:
+
+   * 'lock:<fingerprint>': the structure of the lock file.
+   * 'node:<fingerprint>': a lock file node.
+   * 'root:<fingerprint>': the entire root source tree.
+   * 'file:<hash>:<path>': a file in the root source tree.
+
+   Since values computed earlier in the evaluation can be reused by
+   later ones, the dependencies of a value are all the sources that
+   have been accessed when it's stored. */
 struct AttrDb
 {
     std::atomic_bool failed{false};
 
+    EvalState & evalState;
+    const Sources sources;
+    Path rootRealPath;
+
+    typedef int64_t DepSetId;
+
+    /* Attributes are not written to the database one at a time, but
+       are queued and then inserted in batches of this many rows using
+       a single statement. Row IDs are assigned by us rather than by
+       SQLite, so that callers get the ID of an attribute right away. */
+    static constexpr size_t batchSize = 128;
+
+    struct Row
+    {
+        AttrId rowId, parent;
+        std::string name;
+        DepSetId deps;
+        AttrType type;
+        std::optional<std::string> value, context;
+    };
+
     struct State
     {
         SQLite db;
         SQLiteStmt insertAttribute;
-        SQLiteStmt insertAttributeWithContext;
+        SQLiteStmt insertAttributes;
         SQLiteStmt queryAttribute;
         SQLiteStmt queryAttributes;
+        SQLiteStmt insertDepSet;
+        SQLiteStmt queryDepSetId;
+        SQLiteStmt queryDepSet;
         std::unique_ptr<SQLiteTxn> txn;
+        AttrId nextRowId = 1;
+        std::vector<Row> pending;
+
+        /* The dependencies of the values computed so far, derived
+           from the first 'nrEvents' events of the access log. */
+        size_t nrEvents = 0;
+        std::set<std::string> deps;
+        std::optional<DepSetId> depSet;
+
+        std::map<DepSetId, bool> validDepSets;
+        std::map<std::string, std::optional<std::string>> fileHashes;
     };
 
     std::unique_ptr<Sync<State>> _state;
 
-    AttrDb(const Hash & fingerprint)
-        : _state(std::make_unique<Sync<State>>())
+    AttrDb(const Sources & sources, EvalState & evalState)
+        : evalState(evalState)
+        , sources(sources)
+        , rootRealPath(evalState.store->toRealPath(sources.rootPath))
+        , _state(std::make_unique<Sync<State>>())
     {
         auto state(_state->lock());
 
-        Path cacheDir = getCacheDir() + "/nix/eval-cache-v2";
+        Path cacheDir = getCacheDir() + "/nix/eval-cache-v4";
         createDirs(cacheDir);
 
-        Path dbPath = cacheDir + "/" + fingerprint.to_string(Base16, false) + ".sqlite";
+        Path dbPath = cacheDir + "/" + sources.cacheKey.to_string(Base16, false) + ".sqlite";
 
         state->db = SQLite(dbPath);
         state->db.isCache();
         state->db.exec(schema);
 
-        state->insertAttribute.create(state->db,
-            "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
+        static const std::string insert =
+            "insert or replace into Attributes(rowid, parent, name, deps, type, value, context) values ";
+        static const std::string row = "(?, ?, ?, ?, ?, ?, ?)";
 
-        state->insertAttributeWithContext.create(state->db,
-            "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
+        state->insertAttribute.create(state->db, insert + row);
+
+        std::string rows;
+        for (size_t n = 0; n < batchSize; ++n) {
+            if (n) rows += ", ";
+            rows += row;
+        }
+        state->insertAttributes.create(state->db, insert + rows);
 
         state->queryAttribute.create(state->db,
-            "select rowid, type, value, context from Attributes where parent = ? and name = ?");
+            "select rowid, type, value, context, deps from Attributes where parent = ? and name = ? order by type = 0");
 
         state->queryAttributes.create(state->db,
-            "select name from Attributes where parent = ?");
+            "select distinct name from Attributes where parent = ? order by name");
+
+        state->insertDepSet.create(state->db,
+            "insert or ignore into DepSets(deps) values (?)");
+
+        state->queryDepSetId.create(state->db,
+            "select id from DepSets where deps = ?");
+
+        state->queryDepSet.create(state->db,
+            "select deps from DepSets where id = ?");
 
         state->txn = std::make_unique<SQLiteTxn>(state->db);
+
+        /* This is done inside the transaction, so no other process
+           can add rows with the same IDs. */
+        SQLiteStmt queryMaxRowId(state->db, "select max(rowid) from Attributes");
+        auto query(queryMaxRowId.use());
+        if (query.next() && !query.isNull(0))
+            state->nextRowId = query.getInt(0) + 1;
+
+        state->deps.insert("lock:" + sources.lockGraph);
     }
 
     ~AttrDb()
     {
         try {
             auto state(_state->lock());
-            if (!failed)
+            if (!failed) {
+                flush(*state);
+                collectGarbage(*state);
                 state->txn->commit();
+            }
             state->txn.reset();
         } catch (...) {
             ignoreException();
@@ -87,6 +175,219 @@ struct AttrDb
         }
     }
 
+    /* Return the relative path of 'path' in the root source tree,
+       if it's inside it. */
+    std::optional<std::string> rootRelative(std::string_view path)
+    {
+        for (auto & root : {sources.rootPath, rootRealPath}) {
+            if (path == root) return "";
+            if (hasPrefix(path, root) && path[root.size()] == '/')
+                return std::string(path.substr(root.size() + 1));
+        }
+        return std::nullopt;
+    }
+
+    /* Return the hash of the file 'path' in the root source tree, or
+       nothing if it doesn't exist or can't be read. */
+    std::optional<std::string> hashRootFile(State & state, const std::string & path)
+    {
+        auto i = state.fileHashes.find(path);
+        if (i != state.fileHashes.end()) return i->second;
+
+        std::optional<std::string> hash;
+        try {
+            auto path2 = rootRealPath + "/" + path;
+            if (pathExists(path2))
+                hash = hashFile(htSHA256, resolveExprPath(path2)).to_string(Base32, false);
+        } catch (Error &) {
+        }
+
+        state.fileHashes.emplace(path, hash);
+        return hash;
+    }
+
+    /* Add the dependencies implied by the new events in the access
+       log. */
+    void updateDeps(State & state)
+    {
+        auto rootDep = "root:" + sources.rootFingerprint;
+
+        for (auto & [kind, s] : evalState.accessLog->since(state.nrEvents)) {
+            state.nrEvents++;
+
+            /* Files outside of the root source tree belong to lock
+               file nodes, or to store paths that are determined by
+               the sources that produced them. */
+            std::optional<std::string> dep;
+            switch (kind) {
+                case AccessLog::Kind::FileRead:
+                    if (auto path = rootRelative(s)) {
+                        auto hash = path->empty() || path->find('\n') != std::string::npos
+                            ? std::nullopt : hashRootFile(state, *path);
+                        dep = hash ? "file:" + *hash + ":" + *path : rootDep;
+                    }
+                    break;
+                case AccessLog::Kind::PathUsed:
+                    if (rootRelative(s))
+                        dep = rootDep;
+                    break;
+                case AccessLog::Kind::NodeFetched:
+                    /* Nodes of other flakes (e.g. from
+                       'builtins.getFlake') are identified by the
+                       sources that refer to them. */
+                    if (sources.nodes.count(s))
+                        dep = "node:" + s;
+                    break;
+            }
+
+            if (dep && state.deps.insert(*dep).second)
+                state.depSet.reset();
+        }
+    }
+
+    /* Return the ID of the set of dependencies of the values computed
+       so far. */
+    DepSetId currentDepSet(State & state)
+    {
+        updateDeps(state);
+
+        if (!state.depSet) {
+            auto deps = concatStringsSep("\n", state.deps);
+            state.insertDepSet.use()(deps).exec();
+            auto query(state.queryDepSetId.use()(deps));
+            if (!query.next()) throw Error("cannot find dependency set in evaluation cache");
+            state.depSet = query.getInt(0);
+            state.validDepSets.insert_or_assign(*state.depSet, true);
+        }
+
+        return *state.depSet;
+    }
+
+    bool isValid(State & state, std::string_view dep)
+    {
+        if (hasPrefix(dep, "lock:"))
+            return dep.substr(5) == sources.lockGraph;
+        if (hasPrefix(dep, "node:"))
+            return sources.nodes.count(std::string(dep.substr(5)));
+        if (hasPrefix(dep, "root:"))
+            return dep.substr(5) == sources.rootFingerprint;
+        if (hasPrefix(dep, "file:")) {
+            auto colon = dep.find(':', 5);
+            if (colon == dep.npos) return false;
+            auto hash = hashRootFile(state, std::string(dep.substr(colon + 1)));
+            return hash && *hash == dep.substr(5, colon - 5);
+        }
+        return false;
+    }
+
+    bool isValidDepSet(State & state, DepSetId id, std::optional<std::string> deps = {})
+    {
+        auto i = state.validDepSets.find(id);
+        if (i != state.validDepSets.end()) return i->second;
+
+        if (!deps) {
+            auto query(state.queryDepSet.use()(id));
+            if (query.next()) deps = query.getStr(0);
+        }
+
+        bool valid = (bool) deps;
+        if (deps)
+            for (auto & dep : tokenizeString<std::vector<std::string>>(*deps, "\n"))
+                if (!isValid(state, dep)) {
+                    valid = false;
+                    break;
+                }
+
+        state.validDepSets.emplace(id, valid);
+        return valid;
+    }
+
+    /* Delete the attributes that depend on sources that have
+       changed, and the attributes below them. This means that only
+       the cache for the most recently used lock file of a flake is
+       kept. */
+    void collectGarbage(State & state)
+    {
+        std::vector<DepSetId> invalid;
+
+        {
+            SQLiteStmt queryDepSets(state.db, "select id, deps from DepSets");
+            auto query(queryDepSets.use());
+            while (query.next()) {
+                auto id = query.getInt(0);
+                if (!isValidDepSet(state, id, query.getStr(1)))
+                    invalid.push_back(id);
+            }
+        }
+
+        if (invalid.empty()) return;
+
+        debug("removing %d obsolete dependency sets from the evaluation cache", invalid.size());
+
+        SQLiteStmt deleteAttributes(state.db, "delete from Attributes where deps = ?");
+        SQLiteStmt deleteDepSet(state.db, "delete from DepSets where id = ?");
+        for (auto id : invalid) {
+            deleteAttributes.use()(id).exec();
+            deleteDepSet.use()(id).exec();
+        }
+
+        SQLiteStmt deleteOrphans(state.db,
+            "delete from Attributes where parent != 0 and parent not in (select rowid from Attributes)");
+        SQLiteStmt queryChanges(state.db, "select changes()");
+        while (true) {
+            deleteOrphans.use().exec();
+            auto query(queryChanges.use());
+            if (!query.next() || query.getInt(0) == 0) break;
+        }
+    }
+
+    static void bindRow(SQLiteStmt::Use & use, const Row & row)
+    {
+        use
+            (row.rowId)
+            (row.parent)
+            (row.name)
+            (row.deps)
+            (row.type)
+            (row.value ? *row.value : "", (bool) row.value)
+            (row.context ? *row.context : "", (bool) row.context);
+    }
+
+    /* Write the queued attributes to the database. */
+    void flush(State & state)
+    {
+        auto i = state.pending.begin();
+
+        for (; state.pending.end() - i >= (ptrdiff_t) batchSize; i += batchSize) {
+            auto use(state.insertAttributes.use());
+            for (auto j = i; j != i + batchSize; ++j)
+                bindRow(use, *j);
+            use.exec();
+        }
+
+        for (; i != state.pending.end(); ++i) {
+            auto use(state.insertAttribute.use());
+            bindRow(use, *i);
+            use.exec();
+        }
+
+        state.pending.clear();
+    }
+
+    AttrId addRow(
+        State & state,
+        AttrKey key,
+        AttrType type,
+        std::optional<std::string> value = {},
+        std::optional<std::string> context = {})
+    {
+        auto deps = currentDepSet(state);
+        auto rowId = state.nextRowId++;
+        state.pending.push_back(Row{rowId, key.first, key.second, deps, type, std::move(value), std::move(context)});
+        if (state.pending.size() >= batchSize) flush(state);
+        return rowId;
+    }
+
     AttrId setAttrs(
         AttrKey key,
         const std::vector<Symbol> & attrs)
@@ -95,21 +396,10 @@ struct AttrDb
         {
             auto state(_state->lock());
 
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::FullAttrs)
-                (0, false).exec();
-
-            AttrId rowId = state->db.getLastInsertedRowId();
-            assert(rowId);
+            auto rowId = addRow(*state, key, AttrType::FullAttrs);
 
             for (auto & attr : attrs)
-                state->insertAttribute.use()
-                    (rowId)
-                    (attr)
-                    (AttrType::Placeholder)
-                    (0, false).exec();
+                addRow(*state, {rowId, attr}, AttrType::Placeholder);
 
             return rowId;
         });
@@ -124,27 +414,16 @@ struct AttrDb
         {
             auto state(_state->lock());
 
+            std::optional<std::string> ctx;
             if (context) {
-                std::string ctx;
+                ctx = "";
                 for (const char * * p = context; *p; ++p) {
-                    if (p != context) ctx.push_back(' ');
-                    ctx.append(*p);
+                    if (p != context) ctx->push_back(' ');
+                    ctx->append(*p);
                 }
-                state->insertAttributeWithContext.use()
-                    (key.first)
-                    (key.second)
-                    (AttrType::String)
-                    (s)
-                    (ctx).exec();
-            } else {
-                state->insertAttribute.use()
-                    (key.first)
-                    (key.second)
-                    (AttrType::String)
-                (s).exec();
             }
 
-            return state->db.getLastInsertedRowId();
+            return addRow(*state, key, AttrType::String, std::string(s), std::move(ctx));
         });
     }
 
@@ -155,14 +434,29 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            return addRow(*state, key, AttrType::Bool, b ? "1" : "0");
+        });
+    }
 
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Bool)
-                (b ? 1 : 0).exec();
+    AttrId setInt(
+        AttrKey key,
+        NixInt n)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+            return addRow(*state, key, AttrType::Int, std::to_string(n));
+        });
+    }
 
-            return state->db.getLastInsertedRowId();
+    AttrId setListOfStrings(
+        AttrKey key,
+        const std::vector<std::string> & l)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+            return addRow(*state, key, AttrType::ListOfStrings, concatStringsSep("\t", l));
         });
     }
 
@@ -171,14 +465,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Placeholder)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+            return addRow(*state, key, AttrType::Placeholder);
         });
     }
 
@@ -187,14 +474,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Missing)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+            return addRow(*state, key, AttrType::Missing);
         });
     }
 
@@ -203,14 +483,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Misc)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+            return addRow(*state, key, AttrType::Misc);
         });
     }
 
@@ -219,14 +492,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (key.second)
-                (AttrType::Failed)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
+            return addRow(*state, key, AttrType::Failed);
         });
     }
 
@@ -236,10 +502,29 @@ struct AttrDb
     {
         auto state(_state->lock());
 
+        /* Queued attributes must be visible to the query. */
+        if (!state->pending.empty()) {
+            try {
+                flush(*state);
+            } catch (SQLiteError &) {
+                ignoreException();
+                failed = true;
+            }
+        }
+
         auto queryAttribute(state->queryAttribute.use()(key.first)(key.second));
-        if (!queryAttribute.next()) return {};
 
-        auto rowId = (AttrType) queryAttribute.getInt(0);
+        /* Use the first row whose dependencies are unchanged. Rows
+           with actual values come before placeholders. */
+        bool found = false;
+        while (queryAttribute.next())
+            if (isValidDepSet(*state, queryAttribute.getInt(4))) {
+                found = true;
+                break;
+            }
+        if (!found) return {};
+
+        auto rowId = (AttrId) queryAttribute.getInt(0);
         auto type = (AttrType) queryAttribute.getInt(1);
 
         switch (type) {
@@ -256,12 +541,20 @@ struct AttrDb
             case AttrType::String: {
                 std::vector<std::pair<Path, std::string>> context;
                 if (!queryAttribute.isNull(3))
-                    for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), ";"))
+                    for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), " "))
                         context.push_back(decodeContext(s));
                 return {{rowId, string_t{queryAttribute.getStr(2), context}}};
             }
             case AttrType::Bool:
                 return {{rowId, queryAttribute.getInt(2) != 0}};
+            case AttrType::Int:
+                return {{rowId, int_t{queryAttribute.getInt(2)}}};
+            case AttrType::ListOfStrings: {
+                auto s = queryAttribute.getStr(2);
+                std::vector<std::string> l;
+                if (!s.empty()) l = tokenizeString<std::vector<std::string>>(s, "\t");
+                return {{rowId, l}};
+            }
             case AttrType::Missing:
                 return {{rowId, missing_t()}};
             case AttrType::Misc:
@@ -274,10 +567,14 @@ struct AttrDb
     }
 };
 
-static std::shared_ptr<AttrDb> makeAttrDb(const Hash & fingerprint)
+static std::shared_ptr<AttrDb> makeAttrDb(const Sources & sources, EvalState & state)
 {
+    /* Without the access log, we can't tell what cached values
+       depend on. */
+    if (!state.accessLog) return nullptr;
+
     try {
-        return std::make_shared<AttrDb>(fingerprint);
+        return std::make_shared<AttrDb>(sources, state);
     } catch (SQLiteError &) {
         ignoreException();
         return nullptr;
@@ -285,10 +582,10 @@ static std::shared_ptr<AttrDb> makeAttrDb(const Hash & fingerprint)
 }
 
 EvalCache::EvalCache(
-    std::optional<std::reference_wrapper<const Hash>> useCache,
+    std::optional<std::reference_wrapper<const Sources>> useCache,
     EvalState & state,
     RootLoader rootLoader)
-    : db(useCache ? makeAttrDb(*useCache) : nullptr)
+    : db(useCache ? makeAttrDb(*useCache, state) : nullptr)
     , state(state)
     , rootLoader(rootLoader)
 {
@@ -374,6 +671,26 @@ std::string AttrCursor::getAttrPathStr(Symbol name) const
     return concatStringsSep(".", getAttrPath(name));
 }
 
+/* Return the elements of 'v' if it's a list of strings without
+   context that can be stored in the cache, i.e. that are non-empty
+   and don't contain tabs. Only elements that are already evaluated
+   are considered, since the cache shouldn't force anything. */
+static std::optional<std::vector<std::string>> listOfStrings(Value & v)
+{
+    if (!v.isList()) return std::nullopt;
+    std::vector<std::string> res;
+    for (size_t n = 0; n < v.listSize(); ++n) {
+        auto & elem = *v.listElems()[n];
+        if (elem.type() != tString) return std::nullopt;
+        elem.flattenString();
+        if (elem.string.context()) return std::nullopt;
+        std::string_view s(elem.string.s);
+        if (s.empty() || s.find('\t') != s.npos) return std::nullopt;
+        res.emplace_back(s);
+    }
+    return res;
+}
+
 Value & AttrCursor::forceValue()
 {
     debug("evaluating uncached attribute %s", getAttrPathStr());
@@ -390,14 +707,22 @@ Value & AttrCursor::forceValue()
     }
 
     if (root->db && (!cachedValue || std::get_if<placeholder_t>(&cachedValue->second))) {
-        if (v.type == tString)
-            cachedValue = {root->db->setString(getKey(), v.string.s, v.string.context),
+        v.flattenString();
+        if (v.type() == tString)
+            cachedValue = {root->db->setString(getKey(), v.string.s, v.string.context()),
                            string_t{v.string.s, {}}};
-        else if (v.type == tPath)
-            cachedValue = {root->db->setString(getKey(), v.path), v.path};
-        else if (v.type == tBool)
+        else if (v.type() == tPath) {
+            /* The cached string contains the location of the path. */
+            root->state.accessLog->add(AccessLog::Kind::PathUsed, v.path);
+            cachedValue = {root->db->setString(getKey(), v.path), string_t{v.path, {}}};
+        }
+        else if (v.type() == tBool)
             cachedValue = {root->db->setBool(getKey(), v.boolean), v.boolean};
-        else if (v.type == tAttrs)
+        else if (v.type() == tInt)
+            cachedValue = {root->db->setInt(getKey(), v.integer), int_t{v.integer}};
+        else if (auto l = listOfStrings(v))
+            cachedValue = {root->db->setListOfStrings(getKey(), *l), *l};
+        else if (v.type() == tAttrs)
             ; // FIXME: do something?
         else
             cachedValue = {root->db->setMisc(getKey()), misc_t()};
@@ -442,7 +767,7 @@ std::shared_ptr<AttrCursor> AttrCursor::maybeGetAttr(Symbol name, bool forceErro
 
     auto & v = forceValue();
 
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         return nullptr;
         //throw TypeError("'%s' is not an attribute set", getAttrPathStr());
 
@@ -512,10 +837,11 @@ std::string AttrCursor::getString()
 
     auto & v = forceValue();
 
-    if (v.type != tString && v.type != tPath)
-        throw TypeError("'%s' is not a string but %s", getAttrPathStr(), showType(v.type));
+    if (v.type() != tString && v.type() != tPath)
+        throw TypeError("'%s' is not a string but %s", getAttrPathStr(), showType(v.type()));
 
-    return v.type == tString ? v.string.s : v.path;
+    v.flattenString();
+    return v.type() == tString ? v.string.s : v.path;
 }
 
 string_t AttrCursor::getStringWithContext()
@@ -534,12 +860,12 @@ string_t AttrCursor::getStringWithContext()
 
     auto & v = forceValue();
 
-    if (v.type == tString)
+    if (v.type() == tString)
         return {v.string.s, v.getContext()};
-    else if (v.type == tPath)
+    else if (v.type() == tPath)
         return {v.path, {}};
     else
-        throw TypeError("'%s' is not a string but %s", getAttrPathStr(), showType(v.type));
+        throw TypeError("'%s' is not a string but %s", getAttrPathStr(), showType(v.type()));
 }
 
 bool AttrCursor::getBool()
@@ -558,12 +884,60 @@ bool AttrCursor::getBool()
 
     auto & v = forceValue();
 
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throw TypeError("'%s' is not a Boolean", getAttrPathStr());
 
     return v.boolean;
 }
 
+NixInt AttrCursor::getInt()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto i = std::get_if<int_t>(&cachedValue->second)) {
+                debug("using cached integer attribute '%s'", getAttrPathStr());
+                return i->x;
+            } else
+                throw TypeError("'%s' is not an integer", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != tInt)
+        throw TypeError("'%s' is not an integer", getAttrPathStr());
+
+    return v.integer;
+}
+
+std::vector<std::string> AttrCursor::getListOfStrings()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto l = std::get_if<std::vector<std::string>>(&cachedValue->second)) {
+                debug("using cached list of strings attribute '%s'", getAttrPathStr());
+                return *l;
+            } else if (!std::get_if<misc_t>(&cachedValue->second))
+                throw TypeError("'%s' is not a list", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (!v.isList())
+        throw TypeError("'%s' is not a list", getAttrPathStr());
+
+    std::vector<std::string> res;
+    for (size_t n = 0; n < v.listSize(); ++n)
+        res.push_back(root->state.forceStringNoCtx(*v.listElems()[n]));
+
+    return res;
+}
+
 std::vector<Symbol> AttrCursor::getAttrs()
 {
     if (root->db) {
@@ -580,7 +954,7 @@ std::vector<Symbol> AttrCursor::getAttrs()
 
     auto & v = forceValue();
 
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throw TypeError("'%s' is not an attribute set", getAttrPathStr());
 
     std::vector<Symbol> attrs;
@@ -606,10 +980,12 @@ StorePath AttrCursor::forceDerivation()
 {
     auto aDrvPath = getAttr(root->state.sDrvPath, true);
     auto drvPath = root->state.store->parseStorePath(aDrvPath->getString());
+    root->state.flushDerivations();
     if (!root->state.store->isValidPath(drvPath) && !settings.readOnlyMode) {
         /* The eval cache contains 'drvPath', but the actual path has
            been garbage-collected. So force it to be regenerated. */
         aDrvPath->forceValue();
+        root->state.flushDerivations();
         if (!root->state.store->isValidPath(drvPath))
             throw Error("don't know how to recreate store derivation '%s'!",
                 root->state.store->printStorePath(drvPath));
@@ -14,6 +14,33 @@ MakeError(CachedEvalError, EvalError);
 struct AttrDb;
 class AttrCursor;
 
+/* The sources that the evaluation of a flake can depend on. Every
+   cached attribute records which of these had been accessed when it
+   was computed (see EvalState::accessLog); it remains valid as long
+   as those are unchanged, even if other inputs of the flake have been
+   updated. */
+struct Sources
+{
+    /* Identifies the cache database. */
+    Hash cacheKey;
+
+    /* The root source tree. Cached attributes depend on the contents
+       of the files in it that they read, or on the whole tree (as
+       identified by 'rootFingerprint') if they used it in any other
+       way. */
+    Path rootPath;
+    std::string rootFingerprint;
+
+    /* A fingerprint of the structure of the lock file, which all
+       cached attributes depend on. */
+    std::string lockGraph;
+
+    /* The fingerprints of the lock file nodes. */
+    std::set<std::string> nodes;
+
+    Sources() : cacheKey(htSHA256) { }
+};
+
 class EvalCache : public std::enable_shared_from_this<EvalCache>
 {
     friend class AttrCursor;
@@ -29,7 +56,7 @@ class EvalCache : public std::enable_shared_from_this<EvalCache>
 public:
 
     EvalCache(
-        std::optional<std::reference_wrapper<const Hash>> useCache,
+        std::optional<std::reference_wrapper<const Sources>> useCache,
         EvalState & state,
         RootLoader rootLoader);
 
@@ -44,12 +71,15 @@ enum AttrType {
     Misc = 4,
     Failed = 5,
     Bool = 6,
+    Int = 7,
+    ListOfStrings = 8,
 };
 
 struct placeholder_t {};
 struct missing_t {};
 struct misc_t {};
 struct failed_t {};
+struct int_t { NixInt x; };
 typedef uint64_t AttrId;
 typedef std::pair<AttrId, Symbol> AttrKey;
 typedef std::pair<std::string, std::vector<std::pair<Path, std::string>>> string_t;
@@ -61,7 +91,9 @@ typedef std::variant<
     missing_t,
     misc_t,
     failed_t,
-    bool
+    bool,
+    int_t,
+    std::vector<std::string>
     > AttrValue;
 
 class AttrCursor : public std::enable_shared_from_this<AttrCursor>
@@ -110,6 +142,10 @@ public:
 
     bool getBool();
 
+    NixInt getInt();
+
+    std::vector<std::string> getListOfStrings();
+
     std::vector<Symbol> getAttrs();
 
     bool isDerivation();
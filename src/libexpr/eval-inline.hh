@@ -32,23 +32,26 @@ LocalNoInlineNoReturn(void throwTypeError(const Pos & pos, const char * s, const
 
 void EvalState::forceValue(Value & v, const Pos & pos)
 {
-    if (v.type == tThunk) {
-        Env * env = v.thunk.env;
+    if (executor) {
+        forceValueShared(v, pos);
+        return;
+    }
+
+    if (v.type() == tThunk) {
+        Env * env = v.thunk.env();
         Expr * expr = v.thunk.expr;
         try {
-            v.type = tBlackhole;
+            v.setType(tBlackhole);
             //checkInterrupt();
             expr->eval(*this, *env, v);
         } catch (...) {
-            v.type = tThunk;
-            v.thunk.env = env;
-            v.thunk.expr = expr;
+            v.setThunk(env, expr);
             throw;
         }
     }
-    else if (v.type == tApp)
-        callFunction(*v.app.left, *v.app.right, v, noPos);
-    else if (v.type == tBlackhole)
+    else if (v.type() == tApp)
+        callFunction(*v.app.left(), *v.app.right, v, noPos);
+    else if (v.type() == tBlackhole)
         throwEvalError(pos, "infinite recursion encountered");
 }
 
@@ -56,7 +59,7 @@ void EvalState::forceValue(Value & v, const Pos & pos)
 inline void EvalState::forceAttrs(Value & v)
 {
     forceValue(v);
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throwTypeError("value is %1% while a set was expected", v);
 }
 
@@ -64,7 +67,7 @@ inline void EvalState::forceAttrs(Value & v)
 inline void EvalState::forceAttrs(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throwTypeError(pos, "value is %1% while a set was expected", v);
 }
 
@@ -97,5 +100,19 @@ inline void * allocBytes(size_t n)
     return p;
 }
 
+/* Allocate memory that the garbage collector doesn't scan for
+   pointers. Unlike allocBytes(), this memory is not zeroed. */
+inline void * allocBytesAtomic(size_t n)
+{
+    void * p;
+#if HAVE_BOEHMGC
+    p = GC_MALLOC_ATOMIC(n);
+#else
+    p = malloc(n);
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
 
 }
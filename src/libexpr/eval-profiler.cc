@@ -0,0 +1,235 @@
+#include "eval-profiler.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <fstream>
+
+namespace nix {
+
+
+EvalProfiler::EvalProfiler(EvalState & state, Format format, const Path & outFile, unsigned int frequency)
+    : state(state)
+    , format(format)
+    , outFile(outFile)
+    , interval(std::chrono::nanoseconds(1000000000) / std::max(frequency, 1U))
+    , startTime(std::chrono::steady_clock::now())
+{
+    lastBytes = state.bytesAllocated();
+
+    ticker = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto next = std::chrono::steady_clock::now();
+        while (!quit) {
+            next += interval;
+            if (wakeup.wait_until(lock, next, [&]() { return quit; })) break;
+            ticks.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+}
+
+
+EvalProfiler::~EvalProfiler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeup.notify_all();
+    ticker.join();
+
+    account();
+
+    try {
+        std::ofstream str(outFile, std::ios::binary);
+        if (!str) throw SysError("opening '%s'", outFile);
+        if (format == Format::Flamegraph)
+            writeFlamegraph(str);
+        else
+            writePprof(str);
+        str.close();
+        if (!str) throw SysError("writing '%s'", outFile);
+        printInfo("wrote evaluation profile to '%s'", outFile);
+    } catch (Error & e) {
+        logError(e.info());
+    }
+}
+
+
+std::string EvalProfiler::funName(uintptr_t fun)
+{
+    if (fun & 1)
+        return "builtins." + (std::string) ((PrimOp *) (fun & ~(uintptr_t) 1))->name;
+    auto lambda = (ExprLambda *) fun;
+    return lambda->name.set() ? (std::string) lambda->name : "«lambda»";
+}
+
+
+void EvalProfiler::writeFlamegraph(std::ostream & str)
+{
+    std::vector<std::string> stack;
+
+    std::function<void(const Node &)> recurse;
+    recurse = [&](const Node & node) {
+        if (node.samples) {
+            bool first = true;
+            for (auto & frame : stack) {
+                if (!first) str << ';';
+                first = false;
+                str << frame;
+            }
+            if (stack.empty()) str << "«toplevel»";
+            str << ' ' << node.samples << '\n';
+        }
+        for (auto & [fun, child] : node.children) {
+            auto name = funName(fun);
+            if (!(fun & 1)) {
+                auto pos = ((ExprLambda *) fun)->pos.resolve();
+                if (pos) name += fmt(" %s:%d", pos.file, pos.line);
+            }
+            /* Semicolons separate the frames. */
+            std::replace(name.begin(), name.end(), ';', ',');
+            stack.push_back(std::move(name));
+            recurse(child);
+            stack.pop_back();
+        }
+    };
+
+    recurse(root);
+}
+
+
+/* A minimal encoder for the protocol buffer messages of the pprof
+   format (https://github.com/google/pprof/blob/master/proto/profile.proto). */
+struct ProtoWriter
+{
+    std::string buf;
+
+    void varint(uint64_t n)
+    {
+        while (n >= 0x80) {
+            buf.push_back((char) (n | 0x80));
+            n >>= 7;
+        }
+        buf.push_back((char) n);
+    }
+
+    void tag(unsigned int field, unsigned int wireType)
+    {
+        varint(field << 3 | wireType);
+    }
+
+    void uint(unsigned int field, uint64_t n)
+    {
+        tag(field, 0);
+        varint(n);
+    }
+
+    void bytes(unsigned int field, std::string_view s)
+    {
+        tag(field, 2);
+        varint(s.size());
+        buf.append(s);
+    }
+
+    void packed(unsigned int field, const std::vector<uint64_t> & ns)
+    {
+        ProtoWriter w;
+        for (auto n : ns) w.varint(n);
+        bytes(field, w.buf);
+    }
+};
+
+
+void EvalProfiler::writePprof(std::ostream & str)
+{
+    ProtoWriter profile;
+
+    std::vector<std::string> strings{""};
+    std::map<std::string, uint64_t> stringIds{{"", 0}};
+    auto stringId = [&](const std::string & s) {
+        auto i = stringIds.find(s);
+        if (i != stringIds.end()) return i->second;
+        strings.push_back(s);
+        return stringIds[s] = strings.size() - 1;
+    };
+
+    auto valueType = [&](unsigned int field, const std::string & type, const std::string & unit) {
+        ProtoWriter w;
+        w.uint(1, stringId(type));
+        w.uint(2, stringId(unit));
+        profile.bytes(field, w.buf);
+    };
+
+    valueType(1, "samples", "count");
+    valueType(1, "cpu", "nanoseconds");
+    valueType(1, "calls", "count");
+    valueType(1, "alloc_space", "bytes");
+
+    /* Every function gets one location, with the same ID. */
+    std::map<uintptr_t, uint64_t> funIds;
+    std::vector<uint64_t> stack;
+
+    std::function<void(const Node &)> recurse;
+    recurse = [&](const Node & node) {
+        if (node.samples || node.calls || node.bytes) {
+            ProtoWriter sample;
+            /* Locations are listed from the leaf to the root. */
+            sample.packed(1, std::vector<uint64_t>(stack.rbegin(), stack.rend()));
+            sample.packed(2, {
+                node.samples,
+                node.samples * (uint64_t) interval.count(),
+                node.calls,
+                node.bytes
+            });
+            profile.bytes(2, sample.buf);
+        }
+        for (auto & [fun, child] : node.children) {
+            auto i = funIds.find(fun);
+            if (i == funIds.end())
+                i = funIds.emplace(fun, funIds.size() + 1).first;
+            stack.push_back(i->second);
+            recurse(child);
+            stack.pop_back();
+        }
+    };
+
+    recurse(root);
+
+    for (auto & [fun, id] : funIds) {
+        Pos::Resolved pos;
+        if (!(fun & 1)) pos = ((ExprLambda *) fun)->pos.resolve();
+
+        ProtoWriter function;
+        function.uint(1, id);
+        function.uint(2, stringId(funName(fun)));
+        if (pos) {
+            function.uint(4, stringId(pos.file));
+            function.uint(5, pos.line);
+        }
+        profile.bytes(5, function.buf);
+
+        ProtoWriter line;
+        line.uint(1, id);
+        if (pos) line.uint(2, pos.line);
+
+        ProtoWriter location;
+        location.uint(1, id);
+        location.bytes(4, line.buf);
+        profile.bytes(4, location.buf);
+    }
+
+    auto duration = std::chrono::steady_clock::now() - startTime;
+    profile.uint(10, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+
+    valueType(11, "cpu", "nanoseconds");
+    profile.uint(12, interval.count());
+
+    /* Only now are all strings known. */
+    for (auto & s : strings)
+        profile.bytes(6, s);
+
+    str << profile.buf;
+}
+
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "eval.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+namespace nix {
+
+
+/* A low-overhead profiler for Nix expressions (see the
+   `eval-profiler' setting). The evaluator reports every call of a
+   function or built-in function, and the profiler maintains a tree of
+   the call stacks that have been seen, recording for each the number
+   of calls and the number of bytes allocated directly in it. A
+   background thread advances a tick counter at a fixed frequency;
+   ticks that pass while a stack is at the top are counted as samples
+   of that stack.
+
+   When the evaluator is done, the tree is written either as collapsed
+   stacks (one line per stack with its number of samples, as consumed
+   by `flamegraph.pl') or as a pprof profile with samples, time, calls
+   and allocated bytes for each stack. */
+
+class EvalProfiler
+{
+public:
+
+    enum class Format { Flamegraph, Pprof };
+
+    EvalProfiler(EvalState & state, Format format, const Path & outFile, unsigned int frequency);
+
+    /* Stop sampling and write the profile. */
+    ~EvalProfiler();
+
+    /* Called before and after a call of a lambda or a built-in
+       function. */
+    void enter(uintptr_t fun)
+    {
+        account();
+        auto & child = current->children[fun];
+        if (!child.parent) {
+            child.parent = current;
+            child.fun = fun;
+        }
+        current = &child;
+        current->calls++;
+    }
+
+    void exit()
+    {
+        account();
+        current = current->parent;
+    }
+
+    static uintptr_t key(ExprLambda * fun) { return (uintptr_t) fun; }
+    static uintptr_t key(PrimOp * fun) { return (uintptr_t) fun | 1; }
+
+    /* Scoped enter()/exit() that does nothing if the profiler is
+       disabled. */
+    template<typename Fun>
+    struct Frame
+    {
+        EvalProfiler * profiler;
+        Frame(EvalProfiler * profiler, Fun * fun) : profiler(profiler)
+        {
+            if (profiler) profiler->enter(key(fun));
+        }
+        ~Frame()
+        {
+            if (profiler) profiler->exit();
+        }
+    };
+
+private:
+
+    struct Node
+    {
+        Node * parent = nullptr;
+        uintptr_t fun = 0;
+        uint64_t calls = 0;
+        uint64_t samples = 0;
+        uint64_t bytes = 0;
+        std::map<uintptr_t, Node> children;
+    };
+
+    EvalState & state;
+    Format format;
+    Path outFile;
+    std::chrono::nanoseconds interval;
+
+    Node root;
+    Node * current = &root;
+
+    std::atomic<uint64_t> ticks{0};
+    uint64_t lastTicks = 0;
+    uint64_t lastBytes = 0;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool quit = false;
+    std::thread ticker;
+
+    std::chrono::time_point<std::chrono::steady_clock> startTime;
+
+    /* Attribute the ticks and allocations since the last event to the
+       current stack. */
+    void account()
+    {
+        auto t = ticks.load(std::memory_order_relaxed);
+        current->samples += t - lastTicks;
+        lastTicks = t;
+        auto b = state.bytesAllocated();
+        current->bytes += b - lastBytes;
+        lastBytes = b;
+    }
+
+    std::string funName(uintptr_t fun);
+
+    void writeFlamegraph(std::ostream & str);
+    void writePprof(std::ostream & str);
+};
+
+
+}
@@ -8,6 +8,13 @@
 #include "filetransfer.hh"
 #include "json.hh"
 #include "function-trace.hh"
+#include "ast-cache.hh"
+#include "bytecode.hh"
+#include "parallel-eval.hh"
+#include "eval-profiler.hh"
+#include "source-cache.hh"
+#include "context-table.hh"
+#include "local-fs-store.hh"
 
 #include <algorithm>
 #include <chrono>
@@ -58,6 +65,141 @@ static char * dupStringWithLen(const char * s, size_t size)
 }
 
 
+/* Strings resulting from concatenation that are at least this long
+   are represented as ropes. */
+static const size_t ropeThreshold = 1024;
+
+static unsigned long nrRopes = 0;
+static unsigned long nrRopeFlattens = 0;
+static unsigned long nrRopeBytesFlattened = 0;
+
+
+static StringRope * allocRope(size_t size, const char * s,
+    StringRope * left, StringRope * right)
+{
+    auto rope = (StringRope *) allocBytes(sizeof(StringRope));
+    rope->size = size;
+    rope->s = s;
+    rope->left = left;
+    rope->right = right;
+    rope->context = 0;
+    return rope;
+}
+
+
+/* Ropes and list trees can be shared between evaluation threads, so
+   they're flattened under a lock. */
+static std::mutex flattenMutex;
+
+
+static const char * flattenRopeNode(StringRope * rope)
+{
+    if (auto s = __atomic_load_n(&rope->s, __ATOMIC_ACQUIRE)) return s;
+
+    std::lock_guard<std::mutex> lock(flattenMutex);
+
+    if (rope->s) return rope->s;
+
+    /* Use an explicit stack rather than recursion, since ropes built
+       by repeated appending are as deep as they are long. */
+    char * buf = (char *) allocBytesAtomic(rope->size + 1);
+    char * p = buf;
+    std::vector<StringRope *> todo{rope};
+    while (!todo.empty()) {
+        auto node = todo.back();
+        todo.pop_back();
+        if (node->s) {
+            memcpy(p, node->s, node->size);
+            p += node->size;
+        } else {
+            todo.push_back(node->right);
+            todo.push_back(node->left);
+        }
+    }
+    *p = 0;
+    assert((size_t) (p - buf) == rope->size);
+
+    /* Cache the result in the node, and drop the children so that
+       they can be garbage-collected. */
+    __atomic_store_n(&rope->s, buf, __ATOMIC_RELEASE);
+    rope->left = rope->right = 0;
+
+    nrRopeFlattens++;
+    nrRopeBytesFlattened += rope->size;
+
+    return buf;
+}
+
+
+void Value::flattenRope()
+{
+    auto r = rope.rope();
+#if NIX_TAGGED_VALUES
+    __atomic_store_n(&rope.s, flattenRopeNode(r), __ATOMIC_RELEASE);
+#else
+    setString(flattenRopeNode(r), r->context);
+#endif
+}
+
+
+/* Lists resulting from concatenation that have at least this many
+   elements are represented as trees. */
+static const size_t listTreeThreshold = 32;
+
+static unsigned long nrListTrees = 0;
+static unsigned long nrListTreeFlattens = 0;
+static unsigned long nrListTreeElemsFlattened = 0;
+
+
+static ListTree * allocListTree(size_t size, Value * * elems,
+    ListTree * left, ListTree * right)
+{
+    auto tree = (ListTree *) allocBytes(sizeof(ListTree));
+    tree->size = size;
+    tree->elems = elems;
+    tree->left = left;
+    tree->right = right;
+    return tree;
+}
+
+
+Value * * Value::flattenList()
+{
+    auto tree = listTree.tree();
+
+    if (auto elems = __atomic_load_n(&tree->elems, __ATOMIC_ACQUIRE))
+        return elems;
+
+    std::lock_guard<std::mutex> lock(flattenMutex);
+
+    if (!tree->elems) {
+        auto elems = (Value * *) allocBytes(tree->size * sizeof(Value *));
+        auto p = elems;
+        std::vector<ListTree *> todo{tree};
+        while (!todo.empty()) {
+            auto node = todo.back();
+            todo.pop_back();
+            if (node->elems) {
+                memcpy(p, node->elems, node->size * sizeof(Value *));
+                p += node->size;
+            } else {
+                todo.push_back(node->right);
+                todo.push_back(node->left);
+            }
+        }
+        assert((size_t) (p - elems) == tree->size);
+
+        __atomic_store_n(&tree->elems, elems, __ATOMIC_RELEASE);
+        tree->left = tree->right = 0;
+
+        nrListTreeFlattens++;
+        nrListTreeElemsFlattened += tree->size;
+    }
+
+    return tree->elems;
+}
+
+
 RootValue allocRootValue(Value * v)
 {
     return std::allocate_shared<Value *>(traceable_allocator<Value *>(), v);
@@ -73,7 +215,7 @@ static void printValue(std::ostream & str, std::set<const Value *> & active, con
         return;
     }
 
-    switch (v.type) {
+    switch (v.type()) {
     case tInt:
         str << v.integer;
         break;
@@ -82,7 +224,7 @@ static void printValue(std::ostream & str, std::set<const Value *> & active, con
         break;
     case tString:
         str << "\"";
-        for (const char * i = v.string.s; *i; i++)
+        for (const char * i = v.string.s ? v.string.s : flattenRopeNode(v.rope.rope()); *i; i++)
             if (*i == '\"' || *i == '\\') str << "\\" << *i;
             else if (*i == '\n') str << "\\n";
             else if (*i == '\r') str << "\\r";
@@ -154,10 +296,10 @@ std::ostream & operator << (std::ostream & str, const Value & v)
 
 const Value *getPrimOp(const Value &v) {
     const Value * primOp = &v;
-    while (primOp->type == tPrimOpApp) {
-        primOp = primOp->primOpApp.left;
+    while (primOp->type() == tPrimOpApp) {
+        primOp = primOp->primOpApp.left();
     }
-    assert(primOp->type == tPrimOp);
+    assert(primOp->type() == tPrimOp);
     return primOp;
 }
 
@@ -185,17 +327,26 @@ string showType(ValueType type)
 }
 
 
+/* Return the context of a string, which may be an unflattened
+   rope. */
+static inline const char * * stringContext(const Value & v)
+{
+    return v.string.s ? v.string.context() : v.rope.rope()->context;
+}
+
+
 string showType(const Value & v)
 {
-    switch (v.type) {
-        case tString: return v.string.context ? "a string with context" : "a string";
+    switch (v.type()) {
+        case tString:
+            return stringContext(v) ? "a string with context" : "a string";
         case tPrimOp:
             return fmt("the built-in function '%s'", string(v.primOp->name));
         case tPrimOpApp:
             return fmt("the partially applied built-in function '%s'", string(getPrimOp(v)->primOp->name));
         case tExternal: return v.external->showType();
     default:
-        return showType(v.type);
+        return showType(v.type());
     }
 }
 
@@ -203,9 +354,9 @@ string showType(const Value & v)
 bool Value::isTrivial() const
 {
     return
-        type != tApp
-        && type != tPrimOpApp
-        && (type != tThunk
+        type() != tApp
+        && type() != tPrimOpApp
+        && (type() != tThunk
             || (dynamic_cast<ExprAttrs *>(thunk.expr)
                 && ((ExprAttrs *) thunk.expr)->dynamicAttrs.empty())
             || dynamic_cast<ExprLambda *>(thunk.expr));
@@ -254,6 +405,13 @@ void initGC()
 
     GC_INIT();
 
+#if NIX_TAGGED_VALUES
+    /* Values store their type in the lower bits of a pointer (see
+       value.hh), so such pointers must keep their target alive. */
+    for (int tag = 1; tag < 8; ++tag)
+        GC_register_displacement(tag);
+#endif
+
     GC_set_oom_fn(oomHandler);
 
     /* Set the initial heap size to something fairly big (25% of
@@ -357,6 +515,10 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , repair(NoRepair)
     , store(store)
     , regexCache(makeRegexCache())
+    , pendingDerivations(makePendingDerivations())
+#if NIX_EVAL_ARENA
+    , arena(evalSettings.useArena ? std::make_unique<EvalArena>() : nullptr)
+#endif
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
 {
@@ -364,6 +526,34 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 
     assert(gcInitialised);
 
+    if (evalSettings.evalProfiler != "") {
+        EvalProfiler::Format format;
+        if (evalSettings.evalProfiler == "flamegraph")
+            format = EvalProfiler::Format::Flamegraph;
+        else if (evalSettings.evalProfiler == "pprof")
+            format = EvalProfiler::Format::Pprof;
+        else
+            throw UsageError("unknown profile format '%s'", evalSettings.evalProfiler);
+        profiler = std::make_unique<EvalProfiler>(*this, format,
+            absPath(evalSettings.evalProfileFile), evalSettings.evalProfilerFrequency);
+    }
+
+    if (evalSettings.pureEval && evalSettings.useEvalCache)
+        accessLog = std::make_unique<AccessLog>();
+
+#if NIX_TAGGED_VALUES
+    /* Call counting and the profiler aren't thread-safe, and the
+       arena isn't shared between threads. */
+    if (evalSettings.evalCores > 1 && !countCalls && !profiler) {
+#if NIX_EVAL_ARENA
+        arena.reset();
+#endif
+        symbols.concurrent = true;
+        contextTable.concurrent = true;
+        executor = std::make_unique<Executor>(evalSettings.evalCores - 1);
+    }
+#endif
+
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
 
     /* Initialise the Nix expression search path. */
@@ -401,7 +591,7 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     }
 
     clearValue(vEmptySet);
-    vEmptySet.type = tAttrs;
+    vEmptySet.setType(tAttrs);
     vEmptySet.attrs = allocBindings(0);
 
     createBaseEnv();
@@ -410,16 +600,48 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 
 EvalState::~EvalState()
 {
+    try {
+        flushDerivations();
+    } catch (...) {
+        ignoreException();
+    }
 }
 
 
-Path EvalState::checkSourcePath(const Path & path_)
+void EvalState::allowPath(const Path & path)
 {
-    if (!allowedPaths) return path_;
+    std::lock_guard<std::mutex> lock(allowedPathsMutex);
+    if (allowedPaths)
+        allowedPaths->insert(path);
+}
+
+
+Path EvalState::checkSourcePath(const Path & path_, bool readContents)
+{
+    auto logged = [&](const Path & path) {
+        if (accessLog)
+            accessLog->add(readContents ? AccessLog::Kind::FileRead : AccessLog::Kind::PathUsed, path);
+        return path;
+    };
+
+    /* The path may be a derivation that has been queued but not
+       written yet, and whose context has been discarded, so that
+       realiseContext() didn't write it. (This doesn't check that the
+       path is in the store, since it may be in the physical location
+       of a chroot store.) */
+    if (nix::isDerivation(path_))
+        flushDerivations();
+
+    if (!allowedPaths) return logged(path_);
+
+    {
+        auto resolvedPaths_(resolvedPaths.lock());
+        auto i = resolvedPaths_->find(path_);
+        if (i != resolvedPaths_->end())
+            return logged(i->second);
+    }
 
-    auto i = resolvedPaths.find(path_);
-    if (i != resolvedPaths.end())
-        return i->second;
+    std::unique_lock<std::mutex> lock(allowedPathsMutex);
 
     bool found = false;
 
@@ -440,13 +662,15 @@ Path EvalState::checkSourcePath(const Path & path_)
         throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", abspath);
 
     /* Resolve symlinks. */
+    lock.unlock();
     debug(format("checking access to '%s'") % abspath);
     Path path = canonPath(abspath, true);
+    lock.lock();
 
     for (auto & i : *allowedPaths) {
         if (isDirOrInDir(path, i)) {
-            resolvedPaths[path_] = path;
-            return path;
+            resolvedPaths.lock()->insert_or_assign(path_, path);
+            return logged(path);
         }
     }
 
@@ -518,7 +742,7 @@ Value * EvalState::addPrimOp(const string & name,
        the primop to a dummy value. */
     if (arity == 0) {
         auto vPrimOp = allocValue();
-        vPrimOp->type = tPrimOp;
+        vPrimOp->setType(tPrimOp);
         vPrimOp->primOp = new PrimOp { .fun = primOp, .arity = 1, .name = sym };
         Value v;
         mkApp(v, *vPrimOp, *vPrimOp);
@@ -526,7 +750,7 @@ Value * EvalState::addPrimOp(const string & name,
     }
 
     Value * v = allocValue();
-    v->type = tPrimOp;
+    v->setType(tPrimOp);
     v->primOp = new PrimOp { .fun = primOp, .arity = arity, .name = sym };
     staticBaseEnv.vars[symbols.create(name)] = baseEnvDispl;
     baseEnv.values[baseEnvDispl++] = v;
@@ -542,7 +766,7 @@ Value * EvalState::addPrimOp(PrimOp && primOp)
     if (primOp.arity == 0) {
         primOp.arity = 1;
         auto vPrimOp = allocValue();
-        vPrimOp->type = tPrimOp;
+        vPrimOp->setType(tPrimOp);
         vPrimOp->primOp = new PrimOp(std::move(primOp));
         Value v;
         mkApp(v, *vPrimOp, *vPrimOp);
@@ -554,7 +778,7 @@ Value * EvalState::addPrimOp(PrimOp && primOp)
         primOp.name = symbols.create(std::string(primOp.name, 2));
 
     Value * v = allocValue();
-    v->type = tPrimOp;
+    v->setType(tPrimOp);
     v->primOp = new PrimOp(std::move(primOp));
     staticBaseEnv.vars[envName] = baseEnvDispl;
     baseEnv.values[baseEnvDispl++] = v;
@@ -565,16 +789,16 @@ Value * EvalState::addPrimOp(PrimOp && primOp)
 
 Value & EvalState::getBuiltin(const string & name)
 {
-    return *baseEnv.values[0]->attrs->find(symbols.create(name))->value;
+    return *baseEnv.values[0]->attrs->get(symbols.create(name))->value;
 }
 
 
 std::optional<EvalState::Doc> EvalState::getDoc(Value & v)
 {
-    if (v.type == tPrimOp || v.type == tPrimOpApp) {
+    if (v.type() == tPrimOp || v.type() == tPrimOpApp) {
         auto v2 = &v;
-        while (v2->type == tPrimOpApp)
-            v2 = v2->primOpApp.left;
+        while (v2->type() == tPrimOpApp)
+            v2 = v2->primOpApp.left();
         if (v2->primOp->doc)
             return Doc {
                 .pos = noPos,
@@ -682,19 +906,15 @@ void mkString(Value & v, const char * s)
 }
 
 
+static const char * * encodeContext(const PathSet & context)
+{
+    return contextTable.intern(context);
+}
+
+
 Value & mkString(Value & v, std::string_view s, const PathSet & context)
 {
-    v.type = tString;
-    v.string.s = dupStringWithLen(s.data(), s.size());
-    v.string.context = 0;
-    if (!context.empty()) {
-        size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
-        for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
-        v.string.context[n] = 0;
-    }
+    v.setString(dupStringWithLen(s.data(), s.size()), encodeContext(context));
     return v;
 }
 
@@ -712,16 +932,13 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
     if (!var.fromWith) return env->values[var.displ];
 
     while (1) {
-        if (env->type == Env::HasWithExpr) {
+        Value * vAttrs = env->values[0];
+        if (vAttrs->type() != tAttrs) {
             if (noEval) return 0;
-            Value * v = allocValue();
-            evalAttrs(*env->up, (Expr *) env->values[0], *v);
-            env->values[0] = v;
-            env->type = Env::HasWithAttrs;
+            forceAttrs(*vAttrs);
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
-            if (countCalls && j->pos) attrSelects[*j->pos]++;
+        if (auto j = vAttrs->attrs->get(var.name)) {
+            if (countCalls) attrSelects[j->pos]++;
             return j->value;
         }
         if (!env->prevWith)
@@ -738,10 +955,59 @@ void finalizeValue(void * obj, void * data)
     nrValuesFreed++;
 }
 
+#if NIX_EVAL_ARENA
+/* A bump allocator for objects that live until the end of the
+   evaluation. Memory is obtained from the garbage collector in large
+   chunks, which are scanned for pointers like any other object, so
+   objects in the arena can refer to objects outside of it. */
+struct EvalArena
+{
+    static constexpr size_t chunkSize = 1024 * 1024;
+
+    char * pos = 0, * end = 0;
+
+    /* The collector doesn't recognise pointers into the middle of a
+       chunk, so the chunks are kept alive by this list. */
+#if HAVE_BOEHMGC
+    std::vector<void *, traceable_allocator<void *>> chunks;
+#else
+    std::vector<void *> chunks;
+#endif
+
+    uint64_t bytesUsed = 0;
+
+    void * alloc(size_t n)
+    {
+        /* Keep objects aligned, which tagged values rely on. */
+        n = (n + 7) & ~(size_t) 7;
+        if ((size_t) (end - pos) < n) {
+            if (n > chunkSize / 8) return allocBytes(n);
+            pos = (char *) allocBytes(chunkSize);
+            end = pos + chunkSize;
+            chunks.push_back(pos);
+        }
+        auto p = pos;
+        pos += n;
+        bytesUsed += n;
+        return p;
+    }
+};
+#endif
+
+
+void * EvalState::allocObject(size_t n)
+{
+#if NIX_EVAL_ARENA
+    if (arena) return arena->alloc(n);
+#endif
+    return allocBytes(n);
+}
+
+
 Value * EvalState::allocValue()
 {
     nrValues++;
-    auto v = (Value *) allocBytes(sizeof(Value));
+    auto v = (Value *) allocObject(sizeof(Value));
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
     return v;
 }
@@ -751,7 +1017,7 @@ Env & EvalState::allocEnv(size_t size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+    Env * env = (Env *) allocObject(sizeof(Env) + size * sizeof(Value *));
     env->type = Env::Plain;
 
     /* We assume that env->values has been cleared by the allocator; maybeThunk() and lookupVar fromWith expect this. */
@@ -764,14 +1030,9 @@ void EvalState::mkList(Value & v, size_t size)
 {
     clearValue(v);
     if (size == 1)
-        v.type = tList1;
-    else if (size == 2)
-        v.type = tList2;
-    else {
-        v.type = tListN;
-        v.bigList.size = size;
-        v.bigList.elems = size ? (Value * *) allocBytes(size * sizeof(Value *)) : 0;
-    }
+        v.setType(tList1);
+    else
+        v.setList(size ? (Value * *) allocObject(size * sizeof(Value *)) : 0, size);
     nrListElems += size;
 }
 
@@ -780,9 +1041,7 @@ unsigned long nrThunks = 0;
 
 static inline void mkThunk(Value & v, Env & env, Expr * expr)
 {
-    v.type = tThunk;
-    v.thunk.env = &env;
-    v.thunk.expr = expr;
+    v.setThunk(&env, expr);
     nrThunks++;
 }
 
@@ -793,13 +1052,15 @@ void EvalState::mkThunk_(Value & v, Expr * expr)
 }
 
 
-void EvalState::mkPos(Value & v, Pos * pos)
+void EvalState::mkPos(Value & v, Pos pos_)
 {
-    if (pos && pos->file.set()) {
+    auto pos = pos_.resolve();
+    if (pos.file.set()) {
+        if (accessLog) accessLog->add(AccessLog::Kind::PathUsed, pos.file);
         mkAttrs(v, 3);
-        mkString(*allocAttr(v, sFile), pos->file);
-        mkInt(*allocAttr(v, sLine), pos->line);
-        mkInt(*allocAttr(v, sColumn), pos->column);
+        mkString(*allocAttr(v, sFile), pos.file);
+        mkInt(*allocAttr(v, sLine), pos.line);
+        mkInt(*allocAttr(v, sColumn), pos.column);
         v.attrs->sort();
     } else
         mkNull(v);
@@ -857,31 +1118,35 @@ Value * ExprPath::maybeThunk(EvalState & state, Env & env)
 
 void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
 {
-    auto path = checkSourcePath(path_);
+    auto path = checkSourcePath(path_, true);
 
-    FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
+    auto lookup = [&](const Path & path) {
+        auto fileEvalCache_(fileEvalCache.lock());
+        auto i = fileEvalCache_->find(path);
+        if (i == fileEvalCache_->end()) return false;
         v = i->second;
-        return;
-    }
+        return true;
+    };
+
+    if (lookup(path)) return;
 
     Path path2 = resolveExprPath(path);
-    if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
-    }
+    if (lookup(path2)) return;
 
     printTalkative("evaluating file '%1%'", path2);
     Expr * e = nullptr;
 
-    auto j = fileParseCache.find(path2);
-    if (j != fileParseCache.end())
-        e = j->second;
+    {
+        auto fileParseCache_(fileParseCache.lock());
+        auto j = fileParseCache_->find(path2);
+        if (j != fileParseCache_->end())
+            e = j->second;
+    }
 
     if (!e)
-        e = parseExprFromFile(checkSourcePath(path2));
+        e = parseExprFromFile(checkSourcePath(path2, true));
 
-    fileParseCache[path2] = e;
+    fileParseCache.lock()->insert_or_assign(path2, e);
 
     try {
         // Enforce that 'flake.nix' is a direct attrset, not a
@@ -895,15 +1160,16 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
         throw;
     }
 
-    fileEvalCache[path2] = v;
-    if (path != path2) fileEvalCache[path] = v;
+    auto fileEvalCache_(fileEvalCache.lock());
+    fileEvalCache_->insert_or_assign(path2, v);
+    if (path != path2) fileEvalCache_->insert_or_assign(path, v);
 }
 
 
 void EvalState::resetFileCache()
 {
-    fileEvalCache.clear();
-    fileParseCache.clear();
+    fileEvalCache.lock()->clear();
+    fileParseCache.lock()->clear();
 }
 
 
@@ -917,7 +1183,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e)
 {
     Value v;
     e->eval(*this, env, v);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError("value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
@@ -927,7 +1193,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e, const Pos & pos)
 {
     Value v;
     e->eval(*this, env, v);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError(pos, "value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
@@ -936,7 +1202,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e, const Pos & pos)
 inline void EvalState::evalAttrs(Env & env, Expr * e, Value & v)
 {
     e->eval(*this, env, v);
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throwTypeError("value is %1% while a set was expected", v);
 }
 
@@ -997,7 +1263,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
             } else
                 vAttr = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
             env2.values[displ++] = vAttr;
-            v.attrs->push_back(Attr(i.first, vAttr, &i.second.pos));
+            v.attrs->push_back(Attr(i.first, vAttr, i.second.pos));
         }
 
         /* If the rec contains an attribute called `__overrides', then
@@ -1029,24 +1295,24 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 
     else
         for (auto & i : attrs)
-            v.attrs->push_back(Attr(i.first, i.second.e->maybeThunk(state, env), &i.second.pos));
+            v.attrs->push_back(Attr(i.first, i.second.e->maybeThunk(state, env), i.second.pos));
 
     /* Dynamic attrs apply *after* rec and __overrides. */
     for (auto & i : dynamicAttrs) {
         Value nameVal;
         i.nameExpr->eval(state, *dynamicEnv, nameVal);
         state.forceValue(nameVal, i.pos);
-        if (nameVal.type == tNull)
+        if (nameVal.type() == tNull)
             continue;
         state.forceStringNoCtx(nameVal);
         Symbol nameSym = state.symbols.create(nameVal.string.s);
         Bindings::iterator j = v.attrs->find(nameSym);
         if (j != v.attrs->end())
-            throwEvalError(i.pos, "dynamic attribute '%1%' already defined at %2%", nameSym, *j->pos);
+            throwEvalError(i.pos, "dynamic attribute '%1%' already defined at %2%", nameSym, j->pos);
 
         i.valueExpr->setName(nameSym);
         /* Keep sorted order so find can catch duplicates */
-        v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), &i.pos));
+        v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), i.pos));
         v.attrs->sort(); // FIXME: inefficient
     }
 }
@@ -1108,7 +1374,7 @@ unsigned long nrLookups = 0;
 void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
-    Pos * pos2 = 0;
+    std::optional<Pos> pos2;
     Value * vAttrs = &vTmp;
 
     e->eval(state, env, vTmp);
@@ -1117,30 +1383,30 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 
         for (auto & i : attrPath) {
             nrLookups++;
-            Bindings::iterator j;
+            Attr * j;
             Symbol name = getName(i, state, env);
             if (def) {
                 state.forceValue(*vAttrs, pos);
-                if (vAttrs->type != tAttrs ||
-                    (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if (vAttrs->type() != tAttrs ||
+                    !(j = vAttrs->attrs->get(name)))
                 {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs, pos);
-                if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if (!(j = vAttrs->attrs->get(name)))
                     throwEvalError(pos, "attribute '%1%' missing", name);
             }
             vAttrs = j->value;
             pos2 = j->pos;
-            if (state.countCalls && pos2) state.attrSelects[*pos2]++;
+            if (state.countCalls) state.attrSelects[*pos2]++;
         }
 
-        state.forceValue(*vAttrs, ( pos2 != NULL ? *pos2 : this->pos ) );
+        state.forceValue(*vAttrs, (pos2 ? *pos2 : this->pos));
 
     } catch (Error & e) {
-        if (pos2 && pos2->file != state.sDerivationNix)
+        if (pos2 && pos2->resolve().file != state.sDerivationNix)
             addErrorTrace(e, *pos2, "while evaluating the attribute '%1%'",
                 showAttrPath(state, env, attrPath));
         throw;
@@ -1159,10 +1425,10 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 
     for (auto & i : attrPath) {
         state.forceValue(*vAttrs);
-        Bindings::iterator j;
+        Attr * j;
         Symbol name = getName(i, state, env);
-        if (vAttrs->type != tAttrs ||
-            (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+        if (vAttrs->type() != tAttrs ||
+            !(j = vAttrs->attrs->get(name)))
         {
             mkBool(v, false);
             return;
@@ -1177,9 +1443,7 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 
 void ExprLambda::eval(EvalState & state, Env & env, Value & v)
 {
-    v.type = tLambda;
-    v.lambda.env = &env;
-    v.lambda.fun = this;
+    v.setLambda(&env, this);
 }
 
 
@@ -1197,11 +1461,11 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
     /* Figure out the number of arguments still needed. */
     size_t argsDone = 0;
     Value * primOp = &fun;
-    while (primOp->type == tPrimOpApp) {
+    while (primOp->type() == tPrimOpApp) {
         argsDone++;
-        primOp = primOp->primOpApp.left;
+        primOp = primOp->primOpApp.left();
     }
-    assert(primOp->type == tPrimOp);
+    assert(primOp->type() == tPrimOp);
     auto arity = primOp->primOp->arity;
     auto argsLeft = arity - argsDone;
 
@@ -1212,19 +1476,18 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
         Value * vArgs[arity];
         auto n = arity - 1;
         vArgs[n--] = &arg;
-        for (Value * arg = &fun; arg->type == tPrimOpApp; arg = arg->primOpApp.left)
+        for (Value * arg = &fun; arg->type() == tPrimOpApp; arg = arg->primOpApp.left())
             vArgs[n--] = arg->primOpApp.right;
 
         /* And call the primop. */
         nrPrimOpCalls++;
         if (countCalls) primOpCalls[primOp->primOp->name]++;
+        EvalProfiler::Frame frame(profiler.get(), primOp->primOp);
         primOp->primOp->fun(*this, pos, vArgs, v);
     } else {
         Value * fun2 = allocValue();
         *fun2 = fun;
-        v.type = tPrimOpApp;
-        v.primOpApp.left = fun2;
-        v.primOpApp.right = &arg;
+        v.setPrimOpApp(fun2, &arg);
     }
 }
 
@@ -1234,14 +1497,14 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
 
     forceValue(fun, pos);
 
-    if (fun.type == tPrimOp || fun.type == tPrimOpApp) {
+    if (fun.type() == tPrimOp || fun.type() == tPrimOpApp) {
         callPrimOp(fun, arg, v, pos);
         return;
     }
 
-    if (fun.type == tAttrs) {
-      auto found = fun.attrs->find(sFunctor);
-      if (found != fun.attrs->end()) {
+    if (fun.type() == tAttrs) {
+      auto found = fun.attrs->get(sFunctor);
+      if (found) {
         /* fun may be allocated on the stack of the calling function,
          * but for functors we may keep a reference, so heap-allocate
          * a copy and use that instead.
@@ -1255,7 +1518,7 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
       }
     }
 
-    if (fun.type != tLambda)
+    if (fun.type() != tLambda)
         throwTypeError(pos, "attempt to call something which is not a function but %1%", fun);
 
     ExprLambda & lambda(*fun.lambda.fun);
@@ -1264,7 +1527,7 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
         (lambda.arg.empty() ? 0 : 1) +
         (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
     Env & env2(allocEnv(size));
-    env2.up = fun.lambda.env;
+    env2.up = fun.lambda.env();
 
     size_t displ = 0;
 
@@ -1282,8 +1545,8 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
            argument has a default, use the default. */
         size_t attrsUsed = 0;
         for (auto & i : lambda.formals->formals) {
-            Bindings::iterator j = arg.attrs->find(i.name);
-            if (j == arg.attrs->end()) {
+            auto j = arg.attrs->get(i.name);
+            if (!j) {
                 if (!i.def) throwTypeError(pos, "%1% called without required argument '%2%'",
                     lambda, i.name);
                 env2.values[displ++] = i.def->maybeThunk(*this, env2);
@@ -1308,6 +1571,8 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     nrFunctionCalls++;
     if (countCalls) incrFunctionCall(&lambda);
 
+    EvalProfiler::Frame frame(profiler.get(), &lambda);
+
     /* Evaluate the body.  This is conditional on showTrace, because
        catching exceptions makes this function not tail-recursive. */
     if (loggerSettings.showTrace.get())
@@ -1338,9 +1603,9 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
 {
     forceValue(fun);
 
-    if (fun.type == tAttrs) {
-        auto found = fun.attrs->find(sFunctor);
-        if (found != fun.attrs->end()) {
+    if (fun.type() == tAttrs) {
+        auto found = fun.attrs->get(sFunctor);
+        if (found) {
             Value * v = allocValue();
             callFunction(*found->value, fun, *v, noPos);
             forceValue(*v);
@@ -1348,7 +1613,7 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
         }
     }
 
-    if (fun.type != tLambda || !fun.lambda.fun->matchAttrs) {
+    if (fun.type() != tLambda || !fun.lambda.fun->matchAttrs) {
         res = fun;
         return;
     }
@@ -1366,8 +1631,8 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
     } else {
         // Otherwise, only pass the arguments that the function accepts
         for (auto & i : fun.lambda.fun->formals->formals) {
-            Bindings::iterator j = args.find(i.name);
-            if (j != args.end()) {
+            auto j = args.get(i.name);
+            if (j) {
                 actualArgs->attrs->push_back(*j);
             } else if (!i.def) {
                 throwTypeError("cannot auto-call a function that has an argument without a default value ('%1%')", i.name);
@@ -1383,11 +1648,14 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
 
 void ExprWith::eval(EvalState & state, Env & env, Value & v)
 {
+    /* The set is only evaluated when a variable is looked up in it,
+       by forcing the thunk (rather than by updating the environment,
+       which may be shared between evaluation threads). */
     Env & env2(state.allocEnv(1));
     env2.up = &env;
     env2.prevWith = prevWith;
-    env2.type = Env::HasWithExpr;
-    env2.values[0] = (Value *) attrs;
+    env2.type = Env::HasWithAttrs;
+    env2.values[0] = attrs->maybeThunk(state, env);
 
     body->eval(state, env2, v);
 }
@@ -1461,6 +1729,18 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
+    /* If the second set is small, put it on top of the first one
+       rather than copying both. */
+    if (auto layered = Bindings::layer(*v1.attrs, *v2.attrs)) {
+        clearValue(v);
+        v.setType(tAttrs);
+        v.attrs = layered;
+        state.nrAttrsets++;
+        state.nrAttrsInAttrsets += layered->capacity();
+        state.nrOpUpdateValuesCopied += layered->capacity();
+        return;
+    }
+
     state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
 
     /* Merge the sets, preferring values from the second set.  Make
@@ -1513,6 +1793,56 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
         return;
     }
 
+    /* If the result is large and some of the operands are large,
+       build a tree that shares the large operands, so that appending
+       to a list repeatedly doesn't take quadratic time. Runs of small
+       operands are copied into a single leaf. */
+    auto isLarge = [&](Value & l) {
+        return l.isListTree() || l.listSize() >= listTreeThreshold;
+    };
+
+    if (len >= listTreeThreshold && std::any_of(lists, lists + nrLists, [&](Value * l) { return isLarge(*l); })) {
+        ListTree * tree = 0;
+
+        auto append = [&](ListTree * t) {
+            if (tree) {
+                tree = allocListTree(tree->size + t->size, 0, tree, t);
+                nrListTrees++;
+            } else
+                tree = t;
+        };
+
+        for (size_t n = 0; n < nrLists; ) {
+            auto & l = *lists[n];
+            if (isLarge(l)) {
+                append(l.isListTree()
+                    ? l.listTree.tree()
+                    : allocListTree(l.listSize(), l.bigList.elems(), 0, 0));
+                n++;
+                continue;
+            }
+
+            size_t end = n, size = 0;
+            while (end < nrLists && !isLarge(*lists[end]))
+                size += lists[end++]->listSize();
+            if (size) {
+                auto elems = (Value * *) allocBytes(size * sizeof(Value *));
+                for (size_t pos = 0; n < end; ++n) {
+                    auto l2 = lists[n]->listSize();
+                    if (l2)
+                        memcpy(elems + pos, lists[n]->listElems(), l2 * sizeof(Value *));
+                    pos += l2;
+                }
+                nrListElems += size;
+                append(allocListTree(size, elems, 0, 0));
+            }
+            n = end;
+        }
+
+        v.setListTree(tree, len);
+        return;
+    }
+
     mkList(v, len);
     auto out = v.listElems();
     for (size_t n = 0, pos = 0; n < nrLists; ++n) {
@@ -1526,11 +1856,28 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
+    /* The context of the string pieces is merged directly; 'context'
+       holds the context of other values coerced to a string. */
+    const char * * stringsContext = nullptr;
     PathSet context;
-    std::ostringstream s;
     NixInt n = 0;
     NixFloat nf = 0;
 
+    /* The strings to be concatenated. These point either to the
+       contents of string values (which are immutable, so we don't
+       need to copy them), to ropes, or to strings in 'owned'. */
+    struct Piece
+    {
+        const char * s;
+        size_t size;
+        StringRope * rope;
+        bool owned;
+    };
+    Piece pieces[es->size()];
+    size_t nrPieces = 0, size = 0;
+    std::vector<string> owned;
+    owned.reserve(es->size());
+
     bool first = !forceString;
     ValueType firstType = tString;
 
@@ -1543,14 +1890,14 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
            since paths are copied when they are used in a derivation),
            and none of the strings are allowed to have contexts. */
         if (first) {
-            firstType = vTmp.type;
+            firstType = vTmp.type();
             first = false;
         }
 
         if (firstType == tInt) {
-            if (vTmp.type == tInt) {
+            if (vTmp.type() == tInt) {
                 n += vTmp.integer;
-            } else if (vTmp.type == tFloat) {
+            } else if (vTmp.type() == tFloat) {
                 // Upgrade the type from int to float;
                 firstType = tFloat;
                 nf = n;
@@ -1558,14 +1905,31 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
             } else
                 throwEvalError(pos, "cannot add %1% to an integer", showType(vTmp));
         } else if (firstType == tFloat) {
-            if (vTmp.type == tInt) {
+            if (vTmp.type() == tInt) {
                 nf += vTmp.integer;
-            } else if (vTmp.type == tFloat) {
+            } else if (vTmp.type() == tFloat) {
                 nf += vTmp.fpoint;
             } else
                 throwEvalError(pos, "cannot add %1% to a float", showType(vTmp));
-        } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
+        } else if (firstType == tString && vTmp.type() == tString) {
+            stringsContext = contextTable.merge(stringsContext, stringContext(vTmp));
+            auto & piece = pieces[nrPieces++];
+            piece.owned = false;
+            if (!vTmp.isRope()) {
+                piece.s = vTmp.string.s;
+                piece.size = strlen(vTmp.string.s);
+                piece.rope = 0;
+            } else {
+                piece.s = 0;
+                piece.size = vTmp.rope.rope()->size;
+                piece.rope = vTmp.rope.rope();
+            }
+            size += piece.size;
+        } else {
+            owned.push_back(state.coerceToString(pos, vTmp, context, false, firstType == tString));
+            pieces[nrPieces++] = {owned.back().c_str(), owned.back().size(), 0, true};
+            size += owned.back().size();
+        }
     }
 
     if (firstType == tInt)
@@ -1575,43 +1939,270 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     else if (firstType == tPath) {
         if (!context.empty())
             throwEvalError(pos, "a string that refers to a store path cannot be appended to a path");
-        auto path = canonPath(s.str());
+        string s;
+        s.reserve(size);
+        for (size_t i = 0; i < nrPieces; ++i)
+            s.append(pieces[i].s, pieces[i].size);
+        auto path = canonPath(s);
         mkPath(v, path.c_str());
-    } else
-        mkString(v, s.str(), context);
+    }
+
+    else if (nrPieces == 1 && pieces[0].rope) {
+        v.setRope(pieces[0].rope);
+    }
+
+    /* Build a rope if the result is large, so that appending to it
+       repeatedly doesn't take quadratic time. */
+    else if (size >= ropeThreshold && nrPieces >= 2) {
+        auto toRope = [&](Piece & piece) {
+            if (piece.rope) return piece.rope;
+            /* Pieces in 'owned' don't live in garbage-collected
+               memory, so they have to be copied. */
+            return allocRope(piece.size,
+                piece.owned ? dupStringWithLen(piece.s, piece.size) : piece.s, 0, 0);
+        };
+        auto rope = toRope(pieces[0]);
+        for (size_t i = 1; i < nrPieces; ++i) {
+            /* Skip empty pieces, but always allocate a new root,
+               since that's where the context is stored. */
+            if (!pieces[i].size && i + 1 < nrPieces) continue;
+            rope = allocRope(rope->size + pieces[i].size, 0, rope, toRope(pieces[i]));
+            nrRopes++;
+        }
+        rope->context = contextTable.merge(stringsContext, encodeContext(context));
+        v.setRope(rope);
+    }
+
+    else {
+        char * s = (char *) allocBytesAtomic(size + 1);
+        char * p = s;
+        for (size_t i = 0; i < nrPieces; ++i) {
+            auto & piece = pieces[i];
+            memcpy(p, piece.rope ? flattenRopeNode(piece.rope) : piece.s, piece.size);
+            p += piece.size;
+        }
+        *p = 0;
+        v.setString(s, contextTable.merge(stringsContext, encodeContext(context)));
+    }
 }
 
 
 void ExprPos::eval(EvalState & state, Env & env, Value & v)
 {
-    state.mkPos(v, &pos);
+    state.mkPos(v, pos);
+}
+
+
+void ExprBytecode::eval(EvalState & state, Env & env, Value & v)
+{
+    /* One extra slot for the result of Call. */
+    Value stack[maxStack + 1];
+    size_t sp = 0;
+
+    for (size_t pc = 0; pc < code.size(); ) {
+        auto & i = code[pc++];
+
+        switch (i.op) {
+
+        case OpCode::PushConst:
+            stack[sp++] = *i.constant;
+            break;
+
+        case OpCode::PushVar: {
+            auto & var = *(ExprVar *) i.e;
+            Value * v2 = state.lookupVar(&env, var, false);
+            state.forceValue(*v2, var.pos);
+            stack[sp++] = *v2;
+            break;
+        }
+
+        case OpCode::PushExpr:
+            i.e->eval(state, env, stack[sp++]);
+            break;
+
+        case OpCode::Select: {
+            /* Same as ExprSelect::eval(), except that the attribute
+               path is known to consist of symbols. */
+            auto & sel = *(ExprSelect *) i.e;
+            Value & vTop(stack[sp - 1]);
+            Value * vAttrs = &vTop;
+            std::optional<Pos> pos2;
+
+            try {
+
+                for (auto & j : sel.attrPath) {
+                    nrLookups++;
+                    Attr * k;
+                    if (sel.def) {
+                        state.forceValue(*vAttrs, sel.pos);
+                        if (vAttrs->type() != tAttrs ||
+                            !(k = vAttrs->attrs->get(j.symbol)))
+                        {
+                            Value vDef;
+                            sel.def->eval(state, env, vDef);
+                            vTop = vDef;
+                            goto next;
+                        }
+                    } else {
+                        state.forceAttrs(*vAttrs, sel.pos);
+                        if (!(k = vAttrs->attrs->get(j.symbol)))
+                            throwEvalError(sel.pos, "attribute '%1%' missing", j.symbol);
+                    }
+                    vAttrs = k->value;
+                    pos2 = k->pos;
+                    if (state.countCalls) state.attrSelects[*pos2]++;
+                }
+
+                state.forceValue(*vAttrs, (pos2 ? *pos2 : sel.pos));
+
+            } catch (Error & e) {
+                if (pos2 && pos2->resolve().file != state.sDerivationNix)
+                    addErrorTrace(e, *pos2, "while evaluating the attribute '%1%'",
+                        showAttrPath(sel.attrPath));
+                throw;
+            }
+
+            vTop = *vAttrs;
+            break;
+        }
+
+        case OpCode::HasAttr: {
+            auto & hasAttr = *(ExprOpHasAttr *) i.e;
+            Value & vTop(stack[sp - 1]);
+            Value * vAttrs = &vTop;
+            bool res = true;
+
+            for (auto & j : hasAttr.attrPath) {
+                state.forceValue(*vAttrs);
+                Attr * k;
+                if (vAttrs->type() != tAttrs ||
+                    !(k = vAttrs->attrs->get(j.symbol)))
+                {
+                    res = false;
+                    break;
+                } else {
+                    vAttrs = k->value;
+                }
+            }
+
+            mkBool(vTop, res);
+            break;
+        }
+
+        case OpCode::Call: {
+            auto & app = *(ExprApp *) i.e;
+            Value & vFun(stack[sp - 1]);
+            Value & vRes(stack[sp]);
+            state.callFunction(vFun, *(app.e2->maybeThunk(state, env)), vRes, app.pos);
+            vFun = vRes;
+            break;
+        }
+
+        case OpCode::CheckBool: {
+            auto & vTop(stack[sp - 1]);
+            if (vTop.type() != tBool) {
+                if (i.pos)
+                    throwTypeError(i.pos, "value is %1% while a Boolean was expected", vTop);
+                else
+                    throwTypeError("value is %1% while a Boolean was expected", vTop);
+            }
+            break;
+        }
+
+        case OpCode::Not:
+            mkBool(stack[sp - 1], !stack[sp - 1].boolean);
+            break;
+
+        case OpCode::Eq:
+            sp--;
+            mkBool(stack[sp - 1], state.eqValues(stack[sp - 1], stack[sp]));
+            break;
+
+        case OpCode::NEq:
+            sp--;
+            mkBool(stack[sp - 1], !state.eqValues(stack[sp - 1], stack[sp]));
+            break;
+
+        case OpCode::Assert:
+            if (!stack[--sp].boolean) {
+                auto & assert_ = *(ExprAssert *) i.e;
+                std::ostringstream out;
+                assert_.cond->show(out);
+                throwAssertionError(assert_.pos, "assertion '%1%' failed at %2%", out.str());
+            }
+            break;
+
+        case OpCode::Jump:
+            pc = i.target;
+            break;
+
+        case OpCode::JumpIfFalse:
+            if (!stack[--sp].boolean) pc = i.target;
+            break;
+
+        case OpCode::JumpIfFalseKeep:
+            if (!stack[sp - 1].boolean) pc = i.target; else sp--;
+            break;
+
+        case OpCode::JumpIfTrueKeep:
+            if (stack[sp - 1].boolean) pc = i.target; else sp--;
+            break;
+        }
+
+    next:
+        ;
+    }
+
+    assert(sp == 1);
+    v = stack[0];
 }
 
 
 void EvalState::forceValueDeep(Value & v)
 {
-    std::set<const Value *> seen;
+    /* In parallel mode, several threads traverse the value, so the
+       set of values already seen is split into shards with their own
+       locks. */
+    constexpr size_t nrShards = 64;
+    std::vector<Sync<std::unordered_set<const Value *>>> seen(executor ? nrShards : 1);
+
+    auto markSeen = [&](const Value & v) {
+        auto shard = seen.size() == 1 ? 0 : (((uintptr_t) &v) >> 4) % nrShards;
+        return seen[shard].lock()->insert(&v).second;
+    };
 
     std::function<void(Value & v)> recurse;
 
     recurse = [&](Value & v) {
-        if (!seen.insert(&v).second) return;
+        if (!markSeen(v)) return;
 
         forceValue(v);
 
-        if (v.type == tAttrs) {
-            for (auto & i : *v.attrs)
+        if (v.type() == tAttrs) {
+            auto forceAttr = [&](const Attr & i) {
                 try {
                     recurse(*i.value);
                 } catch (Error & e) {
-                    addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
+                    addErrorTrace(e, i.pos, "while evaluating the attribute '%1%'", i.name);
                     throw;
                 }
+            };
+            if (v.attrs->size() > 1 && haveIdleThreads()) {
+                std::vector<const Attr *> attrs;
+                for (auto & i : *v.attrs) attrs.push_back(&i);
+                parallelFor(attrs.size(), [&](size_t n) { forceAttr(*attrs[n]); });
+            } else
+                for (auto & i : *v.attrs)
+                    forceAttr(i);
         }
 
         else if (v.isList()) {
-            for (size_t n = 0; n < v.listSize(); ++n)
-                recurse(*v.listElems()[n]);
+            auto elems = v.listElems();
+            if (v.listSize() > 1 && haveIdleThreads())
+                parallelFor(v.listSize(), [&](size_t n) { recurse(*elems[n]); });
+            else
+                for (size_t n = 0; n < v.listSize(); ++n)
+                    recurse(*elems[n]);
         }
     };
 
@@ -1622,7 +2213,7 @@ void EvalState::forceValueDeep(Value & v)
 NixInt EvalState::forceInt(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tInt)
+    if (v.type() != tInt)
         throwTypeError(pos, "value is %1% while an integer was expected", v);
     return v.integer;
 }
@@ -1631,9 +2222,9 @@ NixInt EvalState::forceInt(Value & v, const Pos & pos)
 NixFloat EvalState::forceFloat(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type == tInt)
+    if (v.type() == tInt)
         return v.integer;
-    else if (v.type != tFloat)
+    else if (v.type() != tFloat)
         throwTypeError(pos, "value is %1% while a float was expected", v);
     return v.fpoint;
 }
@@ -1642,7 +2233,7 @@ NixFloat EvalState::forceFloat(Value & v, const Pos & pos)
 bool EvalState::forceBool(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError(pos, "value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
@@ -1650,14 +2241,14 @@ bool EvalState::forceBool(Value & v, const Pos & pos)
 
 bool EvalState::isFunctor(Value & fun)
 {
-    return fun.type == tAttrs && fun.attrs->find(sFunctor) != fun.attrs->end();
+    return fun.type() == tAttrs && fun.attrs->get(sFunctor);
 }
 
 
 void EvalState::forceFunction(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tLambda && v.type != tPrimOp && v.type != tPrimOpApp && !isFunctor(v))
+    if (v.type() != tLambda && v.type() != tPrimOp && v.type() != tPrimOpApp && !isFunctor(v))
         throwTypeError(pos, "value is %1% while a function was expected", v);
 }
 
@@ -1665,12 +2256,13 @@ void EvalState::forceFunction(Value & v, const Pos & pos)
 string EvalState::forceString(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tString) {
+    if (v.type() != tString) {
         if (pos)
             throwTypeError(pos, "value is %1% while a string was expected", v);
         else
             throwTypeError("value is %1% while a string was expected", v);
     }
+    v.flattenString();
     return string(v.string.s);
 }
 
@@ -1689,8 +2281,9 @@ std::pair<string, string> decodeContext(std::string_view s)
 
 void copyContext(const Value & v, PathSet & context)
 {
-    if (v.string.context)
-        for (const char * * p = v.string.context; *p; ++p)
+    auto c = stringContext(v);
+    if (c)
+        for (const char * * p = c; *p; ++p)
             context.insert(*p);
 }
 
@@ -1698,9 +2291,10 @@ void copyContext(const Value & v, PathSet & context)
 std::vector<std::pair<Path, std::string>> Value::getContext()
 {
     std::vector<std::pair<Path, std::string>> res;
-    assert(type == tString);
-    if (string.context)
-        for (const char * * p = string.context; *p; ++p)
+    assert(type() == tString);
+    flattenString();
+    if (string.context())
+        for (const char * * p = string.context(); *p; ++p)
             res.push_back(decodeContext(*p));
     return res;
 }
@@ -1717,13 +2311,13 @@ string EvalState::forceString(Value & v, PathSet & context, const Pos & pos)
 string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
 {
     string s = forceString(v, pos);
-    if (v.string.context) {
+    if (v.string.context()) {
         if (pos)
             throwEvalError(pos, "the string '%1%' is not allowed to refer to a store path (such as '%2%')",
-                v.string.s, v.string.context[0]);
+                v.string.s, v.string.context()[0]);
         else
             throwEvalError("the string '%1%' is not allowed to refer to a store path (such as '%2%')",
-                v.string.s, v.string.context[0]);
+                v.string.s, v.string.context()[0]);
     }
     return s;
 }
@@ -1731,11 +2325,12 @@ string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
 
 bool EvalState::isDerivation(Value & v)
 {
-    if (v.type != tAttrs) return false;
-    Bindings::iterator i = v.attrs->find(sType);
-    if (i == v.attrs->end()) return false;
+    if (v.type() != tAttrs) return false;
+    auto i = v.attrs->get(sType);
+    if (!i) return false;
     forceValue(*i->value);
-    if (i->value->type != tString) return false;
+    if (i->value->type() != tString) return false;
+    i->value->flattenString();
     return strcmp(i->value->string.s, "derivation") == 0;
 }
 
@@ -1743,8 +2338,8 @@ bool EvalState::isDerivation(Value & v)
 std::optional<string> EvalState::tryAttrsToString(const Pos & pos, Value & v,
     PathSet & context, bool coerceMore, bool copyToStore)
 {
-    auto i = v.attrs->find(sToString);
-    if (i != v.attrs->end()) {
+    auto i = v.attrs->get(sToString);
+    if (i) {
         Value v1;
         callFunction(*i->value, v, v1, pos);
         return coerceToString(pos, v1, context, coerceMore, copyToStore);
@@ -1760,38 +2355,41 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
 
     string s;
 
-    if (v.type == tString) {
+    if (v.type() == tString) {
+        v.flattenString();
         copyContext(v, context);
         return v.string.s;
     }
 
-    if (v.type == tPath) {
+    if (v.type() == tPath) {
         Path path(canonPath(v.path));
-        return copyToStore ? copyPathToStore(context, path) : path;
+        if (copyToStore) return copyPathToStore(context, path);
+        if (accessLog) accessLog->add(AccessLog::Kind::PathUsed, path);
+        return path;
     }
 
-    if (v.type == tAttrs) {
+    if (v.type() == tAttrs) {
         auto maybeString = tryAttrsToString(pos, v, context, coerceMore, copyToStore);
         if (maybeString) {
             return *maybeString;
         }
-        auto i = v.attrs->find(sOutPath);
-        if (i == v.attrs->end()) throwTypeError(pos, "cannot coerce a set to a string");
+        auto i = v.attrs->get(sOutPath);
+        if (!i) throwTypeError(pos, "cannot coerce a set to a string");
         return coerceToString(pos, *i->value, context, coerceMore, copyToStore);
     }
 
-    if (v.type == tExternal)
+    if (v.type() == tExternal)
         return v.external->coerceToString(pos, context, coerceMore, copyToStore);
 
     if (coerceMore) {
 
         /* Note that `false' is represented as an empty string for
            shell scripting convenience, just like `null'. */
-        if (v.type == tBool && v.boolean) return "1";
-        if (v.type == tBool && !v.boolean) return "";
-        if (v.type == tInt) return std::to_string(v.integer);
-        if (v.type == tFloat) return std::to_string(v.fpoint);
-        if (v.type == tNull) return "";
+        if (v.type() == tBool && v.boolean) return "1";
+        if (v.type() == tBool && !v.boolean) return "";
+        if (v.type() == tInt) return std::to_string(v.integer);
+        if (v.type() == tFloat) return std::to_string(v.fpoint);
+        if (v.type() == tNull) return "";
 
         if (v.isList()) {
             string result;
@@ -1817,15 +2415,18 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
         throwEvalError("file names are not allowed to end in '%1%'", drvExtension);
 
     Path dstPath;
-    auto i = srcToStore.find(path);
-    if (i != srcToStore.end())
-        dstPath = store->printStorePath(i->second);
+    std::optional<StorePath> cached;
+    {
+        auto srcToStore_(srcToStore.lock());
+        auto i = srcToStore_->find(path);
+        if (i != srcToStore_->end()) cached = i->second;
+    }
+    if (cached)
+        dstPath = store->printStorePath(*cached);
     else {
-        auto p = settings.readOnlyMode
-            ? store->computeStorePathForPath(std::string(baseNameOf(path)), checkSourcePath(path)).first
-            : store->addToStore(std::string(baseNameOf(path)), checkSourcePath(path), FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
+        auto p = addSourceToStore(std::string(baseNameOf(path)), checkSourcePath(path), FileIngestionMethod::Recursive);
         dstPath = store->printStorePath(p);
-        srcToStore.insert_or_assign(path, std::move(p));
+        srcToStore.lock()->insert_or_assign(path, std::move(p));
         printMsg(lvlChatty, "copied source '%1%' -> '%2%'", path, dstPath);
     }
 
@@ -1834,6 +2435,63 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
 }
 
 
+StorePath EvalState::addSourceToStore(const string & name, const Path & path,
+    FileIngestionMethod method, PathFilter * filter)
+{
+    /* Call 'filter' only once per file, since it may be an expensive
+       Nix function. */
+    std::unordered_map<Path, bool> decisions;
+    PathFilter memoFilter = [&](const Path & p) {
+        auto i = decisions.find(p);
+        if (i != decisions.end()) return i->second;
+        auto res = (*filter)(p);
+        decisions.emplace(p, res);
+        return res;
+    };
+    PathFilter & filter2 = filter ? memoFilter : defaultPathFilter;
+
+    /* On a cache hit, we must be able to protect the store path from
+       the garbage collector. */
+    std::shared_ptr<SourcePathCache> cache;
+    if (evalSettings.useSourceCache
+        && !repair
+        && (settings.readOnlyMode || store.dynamic_pointer_cast<LocalFSStore>()))
+        cache = getSourcePathCache();
+
+    std::optional<Hash> key;
+    bool racy = false;
+
+    if (cache) {
+        HashSink sink(htSHA256);
+        sink << store->storeDir << name << (uint64_t) method << path;
+        racy = fingerprintSourcePath(sink, path, method != FileIngestionMethod::Flat, filter2);
+        key = sink.finish().first;
+
+        if (auto s = cache->lookup(*key)) {
+            try {
+                auto storePath = store->parseStorePath(*s);
+                if (settings.readOnlyMode) return storePath;
+                store->addTempRoot(storePath);
+                if (store->isValidPath(storePath)) {
+                    debug("source path '%s' is unchanged", path);
+                    return storePath;
+                }
+            } catch (BadStorePath &) {
+            }
+        }
+    }
+
+    auto storePath = settings.readOnlyMode
+        ? store->computeStorePathForPath(name, path, method, htSHA256, filter2).first
+        : store->addToStore(name, path, method, htSHA256, filter2, repair);
+
+    if (key && !racy)
+        cache->upsert(*key, store->printStorePath(storePath));
+
+    return storePath;
+}
+
+
 Path EvalState::coerceToPath(const Pos & pos, Value & v, PathSet & context)
 {
     string path = coerceToString(pos, v, context, false, false);
@@ -1854,15 +2512,15 @@ bool EvalState::eqValues(Value & v1, Value & v2)
     if (&v1 == &v2) return true;
 
     // Special case type-compatibility between float and int
-    if (v1.type == tInt && v2.type == tFloat)
+    if (v1.type() == tInt && v2.type() == tFloat)
         return v1.integer == v2.fpoint;
-    if (v1.type == tFloat && v2.type == tInt)
+    if (v1.type() == tFloat && v2.type() == tInt)
         return v1.fpoint == v2.integer;
 
     // All other types are not compatible with each other.
-    if (v1.type != v2.type) return false;
+    if (v1.type() != v2.type()) return false;
 
-    switch (v1.type) {
+    switch (v1.type()) {
 
         case tInt:
             return v1.integer == v2.integer;
@@ -1871,6 +2529,8 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             return v1.boolean == v2.boolean;
 
         case tString:
+            v1.flattenString();
+            v2.flattenString();
             return strcmp(v1.string.s, v2.string.s) == 0;
 
         case tPath:
@@ -1891,9 +2551,9 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             /* If both sets denote a derivation (type = "derivation"),
                then compare their outPaths. */
             if (isDerivation(v1) && isDerivation(v2)) {
-                Bindings::iterator i = v1.attrs->find(sOutPath);
-                Bindings::iterator j = v2.attrs->find(sOutPath);
-                if (i != v1.attrs->end() && j != v2.attrs->end())
+                auto i = v1.attrs->get(sOutPath);
+                auto j = v2.attrs->get(sOutPath);
+                if (i && j)
                     return eqValues(*i->value, *j->value);
             }
 
@@ -1925,6 +2585,15 @@ bool EvalState::eqValues(Value & v1, Value & v2)
     }
 }
 
+uint64_t EvalState::bytesAllocated()
+{
+    return nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *)
+        + nrListElems * sizeof(Value *)
+        + nrValues * sizeof(Value)
+        + nrAttrsets * sizeof(Bindings) + nrAttrsInAttrsets * sizeof(Attr);
+}
+
+
 void EvalState::printStats()
 {
     bool showStats = getEnv("NIX_SHOW_STATS").value_or("0") != "0";
@@ -1960,6 +2629,9 @@ void EvalState::printStats()
             lists.attr("elements", nrListElems);
             lists.attr("bytes", bLists);
             lists.attr("concats", nrListConcats);
+            lists.attr("trees", nrListTrees);
+            lists.attr("treesFlattened", nrListTreeFlattens);
+            lists.attr("treeElementsFlattened", nrListTreeElemsFlattened);
         }
         {
             auto values = topObj.object("values");
@@ -1970,6 +2642,15 @@ void EvalState::printStats()
             auto syms = topObj.object("symbols");
             syms.attr("number", symbols.size());
             syms.attr("bytes", symbols.totalSize());
+            syms.attr("lookups", symbols.lookups());
+            syms.attr("probes", symbols.probes());
+            syms.attr("tableSize", symbols.capacity());
+        }
+        {
+            auto contexts = topObj.object("stringContexts");
+            contexts.attr("number", contextTable.size());
+            contexts.attr("unionLookups", contextTable.unionLookups());
+            contexts.attr("unionHits", contextTable.unionHits());
         }
         {
             auto sets = topObj.object("sets");
@@ -1989,8 +2670,57 @@ void EvalState::printStats()
         topObj.attr("nrThunks", nrThunks);
         topObj.attr("nrAvoided", nrAvoided);
         topObj.attr("nrLookups", nrLookups);
+        topObj.attr("nrIndexedLookups", Bindings::nrIndexedLookups);
+        topObj.attr("nrSortedLookups", Bindings::nrSortedLookups);
+        {
+            auto index = topObj.object("attrIndex");
+            index.attr("number", Bindings::nrIndexes);
+            index.attr("bytes", Bindings::nrIndexBytes);
+        }
+        {
+            auto layered = topObj.object("layeredSets");
+            layered.attr("number", Bindings::nrLayered);
+            layered.attr("flattened", Bindings::nrFlattened);
+            layered.attr("flattenedElements", Bindings::nrFlattenedAttrs);
+        }
+        {
+            auto ropes = topObj.object("ropes");
+            ropes.attr("number", nrRopes);
+            ropes.attr("flattened", nrRopeFlattens);
+            ropes.attr("flattenedBytes", nrRopeBytesFlattened);
+        }
         topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
         topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        if (evalSettings.useBytecode) {
+            auto bytecode = topObj.object("bytecode");
+            bytecode.attr("islands", nrBytecodeIslands);
+            bytecode.attr("instructions", nrBytecodeInstrs);
+        }
+        if (evalSettings.useAstCache) {
+            auto astCache = topObj.object("astCache");
+            astCache.attr("hits", nrAstCacheHits);
+            astCache.attr("misses", nrAstCacheMisses);
+            astCache.attr("bytesRead", nrAstCacheBytesRead);
+            astCache.attr("bytesWritten", nrAstCacheBytesWritten);
+        }
+#if NIX_EVAL_ARENA
+        if (arena) {
+            auto obj = topObj.object("arena");
+            obj.attr("chunks", arena->chunks.size());
+            obj.attr("bytes", arena->chunks.size() * EvalArena::chunkSize);
+            obj.attr("bytesUsed", arena->bytesUsed);
+        }
+#endif
+        if (executor) {
+            auto obj = topObj.object("parallel");
+            obj.attr("threads", executor->threads.size() + 1);
+            obj.attr("batches", executor->nrBatches.load());
+            obj.attr("tasks", executor->nrTasks.load());
+            obj.attr("tasksStolen", executor->nrTasksStolen.load());
+            obj.attr("waits", executor->nrWaits.load());
+            obj.attr("realisations", executor->nrRealisations.load());
+            obj.attr("realisationBatches", executor->nrRealisationBatches.load());
+        }
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
@@ -2013,10 +2743,10 @@ void EvalState::printStats()
                         obj.attr("name", (const string &) i.first->name);
                     else
                         obj.attr("name", nullptr);
-                    if (i.first->pos) {
-                        obj.attr("file", (const string &) i.first->pos.file);
-                        obj.attr("line", i.first->pos.line);
-                        obj.attr("column", i.first->pos.column);
+                    if (auto pos = i.first->pos.resolve()) {
+                        obj.attr("file", (const string &) pos.file);
+                        obj.attr("line", pos.line);
+                        obj.attr("column", pos.column);
                     }
                     obj.attr("count", i.second);
                 }
@@ -2025,10 +2755,10 @@ void EvalState::printStats()
                 auto list = topObj.list("attributes");
                 for (auto & i : attrSelects) {
                     auto obj = list.object();
-                    if (i.first) {
-                        obj.attr("file", (const string &) i.first.file);
-                        obj.attr("line", i.first.line);
-                        obj.attr("column", i.first.column);
+                    if (auto pos = i.first.resolve()) {
+                        obj.attr("file", (const string &) pos.file);
+                        obj.attr("line", pos.line);
+                        obj.attr("column", pos.column);
                     }
                     obj.attr("count", i.second);
                 }
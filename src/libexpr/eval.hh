@@ -5,7 +5,9 @@
 #include "nixexpr.hh"
 #include "symbol-table.hh"
 #include "config.hh"
+#include "sync.hh"
 
+#include <functional>
 #include <map>
 #include <optional>
 #include <unordered_map>
@@ -17,7 +19,12 @@ namespace nix {
 
 class Store;
 class EvalState;
+struct EvalArena;
+struct Executor;
+class EvalProfiler;
 class StorePath;
+struct Derivation;
+enum struct FileIngestionMethod : uint8_t;
 enum RepairFlag : bool;
 
 
@@ -38,7 +45,7 @@ struct Env
 {
     Env * up;
     unsigned short prevWith:14; // nr of levels up to next `with' environment
-    enum { Plain = 0, HasWithExpr, HasWithAttrs } type:2;
+    enum { Plain = 0, HasWithAttrs } type:2;
     Value * values[0];
 };
 
@@ -69,6 +76,59 @@ struct RegexCache;
 std::shared_ptr<RegexCache> makeRegexCache();
 
 
+struct PendingDerivations;
+
+std::shared_ptr<PendingDerivations> makePendingDerivations();
+
+
+/* A log of the sources that evaluation has accessed, used by the
+   evaluation cache to determine what a cached value may depend on.
+   Every distinct event is recorded once, in the order in which it
+   first happened. */
+struct AccessLog
+{
+    enum class Kind {
+        /* The contents of a file were read. For a directory, this
+           refers to the file that importing it reads (usually
+           'default.nix'). */
+        FileRead,
+        /* A file or directory was used in some other way, e.g. by
+           listing it, copying it to the store or turning its path
+           into a string. */
+        PathUsed,
+        /* A lock file node was fetched. The event holds the node's
+           fingerprint (see callFlake()). */
+        NodeFetched,
+    };
+
+    typedef std::pair<Kind, std::string> Event;
+
+    struct State
+    {
+        std::vector<Event> events;
+        std::set<Event> seen;
+    };
+
+    Sync<State> state;
+
+    void add(Kind kind, std::string_view s)
+    {
+        Event event{kind, std::string(s)};
+        auto state_(state.lock());
+        if (state_->seen.insert(event).second)
+            state_->events.push_back(std::move(event));
+    }
+
+    /* Return the events after the first 'from' ones. */
+    std::vector<Event> since(size_t from)
+    {
+        auto state_(state.lock());
+        if (from >= state_->events.size()) return {};
+        return std::vector<Event>(state_->events.begin() + from, state_->events.end());
+    }
+};
+
+
 class EvalState
 {
 public:
@@ -89,16 +149,20 @@ public:
     RepairFlag repair;
 
     /* The allowed filesystem paths in restricted or pure evaluation
-       mode. */
+       mode. Use allowPath() to add to it during evaluation. */
     std::optional<PathSet> allowedPaths;
 
     Value vEmptySet;
 
     const ref<Store> store;
 
+    /* If the evaluation cache can be used (i.e. in pure evaluation
+       mode), the log of the sources accessed so far. */
+    std::unique_ptr<AccessLog> accessLog;
+
 
 private:
-    SrcToStore srcToStore;
+    Sync<SrcToStore> srcToStore;
 
     /* A cache from path names to parse trees. */
 #if HAVE_BOEHMGC
@@ -106,7 +170,7 @@ private:
 #else
     typedef std::map<Path, Expr *> FileParseCache;
 #endif
-    FileParseCache fileParseCache;
+    Sync<FileParseCache> fileParseCache;
 
     /* A cache from path names to values. */
 #if HAVE_BOEHMGC
@@ -114,18 +178,43 @@ private:
 #else
     typedef std::map<Path, Value> FileEvalCache;
 #endif
-    FileEvalCache fileEvalCache;
+    Sync<FileEvalCache> fileEvalCache;
 
     SearchPath searchPath;
 
-    std::map<std::string, std::pair<bool, std::string>> searchPathResolved;
+    Sync<std::map<std::string, std::pair<bool, std::string>>> searchPathResolved;
+
+    /* Protects 'allowedPaths'. */
+    std::mutex allowedPathsMutex;
 
     /* Cache used by checkSourcePath(). */
-    std::unordered_map<Path, Path> resolvedPaths;
+    Sync<std::unordered_map<Path, Path>> resolvedPaths;
 
     /* Cache used by prim_match(). */
     std::shared_ptr<RegexCache> regexCache;
 
+    /* Store derivations queued by writeDerivation(). */
+    std::shared_ptr<PendingDerivations> pendingDerivations;
+
+#if NIX_EVAL_ARENA
+    /* If `eval-arena' is enabled, the arena from which values,
+       environments, sets and lists are allocated. */
+    std::unique_ptr<EvalArena> arena;
+#endif
+
+    /* Allocate zeroed memory for a value, environment, set or list,
+       from the arena if enabled. */
+    void * allocObject(size_t n);
+
+    /* If `eval-cores' is greater than 1, the thread pool used for
+       parallel evaluation. Values may then be forced by several
+       threads at the same time, see forceValueShared(). */
+    std::unique_ptr<Executor> executor;
+
+    /* If `eval-profiler' is set, the profiler that is told about
+       every function call. */
+    std::unique_ptr<EvalProfiler> profiler;
+
 public:
 
     EvalState(const Strings & _searchPath, ref<Store> store);
@@ -135,7 +224,15 @@ public:
 
     SearchPath getSearchPath() { return searchPath; }
 
-    Path checkSourcePath(const Path & path);
+    /* Check that access to 'path' is allowed and resolve its
+       symlinks. 'readContents' means that the caller only reads the
+       contents of the file (as opposed to e.g. listing or copying
+       it), which is all that the access log then records. */
+    Path checkSourcePath(const Path & path, bool readContents = false);
+
+    /* Allow access to `path' in restricted or pure evaluation
+       mode. */
+    void allowPath(const Path & path);
 
     void checkURI(const std::string & uri);
 
@@ -188,10 +285,31 @@ public:
        result.  Otherwise, this is a no-op. */
     inline void forceValue(Value & v, const Pos & pos = noPos);
 
+    /* Like forceValue(), but safe when other threads may be forcing
+       `v' at the same time. A thread that finds `v' being forced by
+       another thread waits for the result, unless this would
+       deadlock, in which case it's an infinite recursion. Only used
+       in parallel mode. */
+    void forceValueShared(Value & v, const Pos & pos);
+
     /* Force a value, then recursively force list elements and
-       attributes. */
+       attributes. In parallel mode, the elements and attributes are
+       forced by all threads. */
     void forceValueDeep(Value & v);
 
+    /* Call `work(0)' to `work(count - 1)', in parallel if parallel
+       evaluation is enabled. If any calls throw an exception, the
+       one with the lowest index is rethrown once all calls have
+       finished. */
+    void parallelFor(size_t count, std::function<void(size_t)> work);
+
+    /* Whether parallelFor() would currently run anything in
+       parallel, i.e. whether there are idle threads. */
+    bool haveIdleThreads();
+
+    /* Whether values may be forced by several threads. */
+    bool isParallel() const { return (bool) executor; }
+
     /* Force `v', and then verify that it has the expected type. */
     NixInt forceInt(Value & v, const Pos & pos);
     NixFloat forceFloat(Value & v, const Pos & pos);
@@ -221,6 +339,15 @@ public:
 
     string copyPathToStore(PathSet & context, const Path & path);
 
+    /* Add the source tree 'path' to the store, or in read-only mode
+       just compute its store path. If `eval-source-cache' is enabled
+       and the tree hasn't changed since it was last added, the store
+       path is taken from the persistent source path cache without
+       reading the files. 'filter' is nullptr for the default
+       filter. */
+    StorePath addSourceToStore(const string & name, const Path & path,
+        FileIngestionMethod method, std::function<bool(const Path &)> * filter = nullptr);
+
     /* Path coercion.  Converts strings, paths and derivations to a
        path.  The result is guaranteed to be a canonicalised, absolute
        path.  Nothing is copied to the store. */
@@ -274,6 +401,20 @@ private:
     Expr * parse(const char * text, FileOrigin origin, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
+    /* Add the source text 'text' of a file or string to the position
+       table. */
+    const PosTable::Origin & addOrigin(std::string_view text, FileOrigin origin, const Path & path);
+
+    /* Parse 'text', which has been added to the position table as
+       'origin', without resolving variables, i.e. return the parse
+       tree as it comes out of the parser. */
+    Expr * parseSyntax(const char * text, const PosTable::Origin & origin,
+        const Path & basePath);
+
+    /* Resolve the variables in the parse tree 'e' and optionally
+       compile it to bytecode. */
+    Expr * finishParse(Expr * e, StaticEnv & staticEnv);
+
 public:
 
     /* Do a deep equality test between two values.  That is, list
@@ -301,15 +442,34 @@ public:
     void mkList(Value & v, size_t length);
     void mkAttrs(Value & v, size_t capacity);
     void mkThunk_(Value & v, Expr * expr);
-    void mkPos(Value & v, Pos * pos);
+    void mkPos(Value & v, Pos pos);
 
     void concatLists(Value & v, size_t nrLists, Value * * lists, const Pos & pos);
 
     /* Print statistics. */
     void printStats();
 
+    /* The number of bytes allocated for values, environments, lists
+       and attribute sets so far. */
+    uint64_t bytesAllocated();
+
     void realiseContext(const PathSet & context);
 
+    /* Write the store derivation for 'drv' and return its path. If
+       `eval-batch-drv-writes' is enabled, the derivation is queued
+       instead, and written together with others by
+       flushDerivations(). Floating content-addressed derivations are
+       always written immediately. */
+    StorePath writeDerivation(const Derivation & drv);
+
+    /* Write all queued store derivations. This must happen before
+       their paths are passed to the store or returned to the user;
+       realiseContext(), checkSourcePath(), DrvInfo::queryDrvPath()
+       and AttrCursor::forceDerivation() do this, and commands must do it
+       before printing evaluation results. The destructor only does it
+       as a fallback, ignoring errors. */
+    void flushDerivations();
+
 private:
 
     unsigned long nrEnvs = 0;
@@ -340,8 +500,10 @@ private:
     friend struct ExprOpUpdate;
     friend struct ExprOpConcatLists;
     friend struct ExprSelect;
+    friend struct ExprBytecode;
     friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
     friend void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v);
+    friend void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v);
 };
 
 
@@ -428,6 +590,124 @@ struct EvalSettings : Config
 
     Setting<bool> useEvalCache{this, true, "eval-cache",
         "Whether to use the flake evaluation cache."};
+
+    Setting<bool> useBytecode{this, false, "eval-bytecode",
+        R"(
+          If set to `true`, the Nix evaluator will compile strict
+          subexpressions (variables, attribute selections, Boolean
+          operators, comparisons, conditionals and function calls) of
+          every parsed file to bytecode and run them in a stack
+          machine instead of walking the syntax tree. The results are
+          identical to those of the tree-walking evaluator.
+        )"};
+
+    Setting<bool> useArena{this, true, "eval-arena",
+        R"(
+          If set to `true` and Nix was built with `--enable-eval-arena`,
+          the evaluator allocates values, environments, attribute sets
+          and lists by bumping a pointer in large blocks of memory,
+          rather than asking the garbage collector for every object.
+          This makes evaluation faster, but the memory is only
+          reclaimed when the evaluation ends, so it is not used by
+          long-running commands such as `nix repl`. Otherwise, this
+          setting has no effect.
+        )"};
+
+    Setting<bool> useAstCache{this, true, "eval-ast-cache",
+        R"(
+          If set to `true`, the parse trees of Nix files are cached in
+          `~/.cache/nix`, keyed by the file name and contents, so that
+          subsequent evaluations don't have to parse them again.
+        )"};
+
+    Setting<bool> useRegexAutomaton{this, true, "eval-regex-automaton",
+        R"(
+          If set to `true`, the regular expressions of `builtins.match`
+          and `builtins.split` are executed by an automaton that takes
+          time linear in the length of the input, rather than by the
+          backtracking matcher of the C++ standard library, which takes
+          exponential time in the worst case. The results are
+          identical.
+        )"};
+
+    Setting<bool> useFastJSON{this, true, "eval-fast-json",
+        R"(
+          If set to `true`, `builtins.fromJSON` parses well-formed
+          documents with a parser that allocates lists and attribute
+          sets directly at their final size, and only uses the slower
+          general-purpose JSON parser to report errors. The results are
+          identical.
+        )"};
+
+    Setting<bool> useFastTOML{this, true, "eval-fast-toml",
+        R"(
+          If set to `true`, `builtins.fromTOML` parses documents that
+          only use common TOML features (such as `Cargo.lock` files)
+          directly into Nix values, and only uses the cpptoml library
+          for the others. The results are identical.
+        )"};
+
+    Setting<bool> batchDrvWrites{this, true, "eval-batch-drv-writes",
+        R"(
+          If set to `true`, the store derivations produced by
+          `derivation` are written to the store in batches, which on a
+          local store takes one SQLite transaction per batch and
+          through the daemon one round-trip, instead of one per
+          derivation. Derivations are always written before the store
+          is asked to build or read them and before their paths are
+          printed.
+        )"};
+
+    Setting<bool> useSourceCache{this, true, "eval-source-cache",
+        R"(
+          If set to `true`, Nix records the store paths of the source
+          trees that evaluation copies to the store (path literals,
+          `builtins.path` and `builtins.filterSource`) in a database
+          under `~/.cache/nix`, together with a fingerprint of the
+          size, timestamps, inode number and permissions of every file
+          in the tree. A tree whose fingerprint hasn't changed is then
+          not read and hashed again.
+        )"};
+
+    Setting<std::string> evalProfiler{this, "", "eval-profiler",
+        R"(
+          If set to `flamegraph` or `pprof`, Nix samples the call stack
+          of the Nix expressions it evaluates, and when evaluation
+          finishes writes the result to `eval-profile-file`. A
+          `flamegraph` profile contains a line for every call stack
+          with the number of samples taken in it, suitable for
+          `flamegraph.pl`. A `pprof` profile also records the number of
+          calls and the bytes allocated in every call stack, and can be
+          analysed with `pprof`. Enabling the profiler disables
+          parallel evaluation.
+        )"};
+
+    Setting<std::string> evalProfileFile{this, "nix.profile", "eval-profile-file",
+        "The file to which `eval-profiler` writes the profile."};
+
+    Setting<unsigned int> evalProfilerFrequency{this, 99, "eval-profiler-frequency",
+        "The number of samples per second taken by `eval-profiler`."};
+
+    Setting<bool> batchImportFromDerivation{this, true, "eval-batch-ifd",
+        R"(
+          If set to `true` and `eval-cores` is greater than 1, an
+          evaluation thread that needs to build a derivation for import
+          from derivation waits until the other evaluation threads
+          can't make progress anymore (or for at most 100 ms), and then
+          builds the derivations that all threads need in a single
+          build, which runs up to `max-jobs` builds in parallel.
+        )"};
+
+    Setting<unsigned int> evalCores{this, 1, "eval-cores",
+        R"(
+          The number of threads used to evaluate Nix expressions. If
+          greater than 1, values that are forced deeply (for instance
+          by `nix-instantiate --strict` or `builtins.deepSeq`) are
+          forced by several threads in parallel. The result of the
+          evaluation doesn't depend on this setting. Parallel
+          evaluation is only supported on 64-bit platforms, and is
+          disabled when `NIX_COUNT_CALLS` is set.
+        )"};
 };
 
 extern EvalSettings evalSettings;
@@ -1,4 +1,9 @@
-lockFileStr: rootSrc: rootSubdir:
+# 'fetchNode key attrs' fetches the source tree of the lock file node
+# 'key'. 'rootSrcTracked' is 'rootSrc' with attributes that record
+# their use in the evaluator's access log (see callFlake()); the root
+# flake.nix is imported through 'rootSrc', since reading files is
+# recorded separately.
+lockFileStr: rootSrc: rootSrcTracked: rootSubdir: fetchNode:
 
 let
 
@@ -11,12 +16,12 @@ let
 
           sourceInfo =
             if key == lockFile.root
-            then rootSrc
-            else fetchTree (node.info or {} // removeAttrs node.locked ["dir"]);
+            then rootSrcTracked
+            else fetchNode key (node.info or {} // removeAttrs node.locked ["dir"]);
 
           subdir = if key == lockFile.root then rootSubdir else node.locked.dir or "";
 
-          flake = import (sourceInfo + (if subdir != "" then "/" else "") + subdir + "/flake.nix");
+          flake = import ((if key == lockFile.root then rootSrc else sourceInfo) + (if subdir != "" then "/" else "") + subdir + "/flake.nix");
 
           inputs = builtins.mapAttrs
             (inputName: inputSpec: allNodes.${resolveInput inputSpec})
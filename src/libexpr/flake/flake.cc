@@ -5,6 +5,9 @@
 #include "store-api.hh"
 #include "fetchers.hh"
 #include "finally.hh"
+#include "eval-cache.hh"
+
+#include <nlohmann/json.hpp>
 
 namespace nix {
 
@@ -63,8 +66,7 @@ static std::tuple<fetchers::Tree, FlakeRef, FlakeRef> fetchOrSubstituteTree(
     debug("got tree '%s' from '%s'",
         state.store->printStorePath(state.store->makeFixedOutputPathFromCA(tree.storePath)), lockedRef);
 
-    if (state.allowedPaths)
-        state.allowedPaths->insert(tree.actualPath);
+    state.allowPath(tree.actualPath);
 
     assert(!originalRef.input.getNarHash() || tree.storePath == originalRef.input.computeStorePath(*state.store));
 
@@ -74,11 +76,11 @@ static std::tuple<fetchers::Tree, FlakeRef, FlakeRef> fetchOrSubstituteTree(
 static void expectType(EvalState & state, ValueType type,
     Value & value, const Pos & pos)
 {
-    if (value.type == tThunk && value.isTrivial())
+    if (value.type() == tThunk && value.isTrivial())
         state.forceValue(value, pos);
-    if (value.type != type)
+    if (value.type() != type)
         throw Error("expected %s but got %s at %s",
-            showType(type), showType(value.type), pos);
+            showType(type), showType(value.type()), pos);
 }
 
 static std::map<FlakeId, FlakeInput> parseFlakeInputs(
@@ -102,27 +104,30 @@ static FlakeInput parseFlakeInput(EvalState & state,
     for (nix::Attr attr : *(value->attrs)) {
         try {
             if (attr.name == sUrl) {
-                expectType(state, tString, *attr.value, *attr.pos);
+                expectType(state, tString, *attr.value, attr.pos);
+                attr.value->flattenString();
                 url = attr.value->string.s;
                 attrs.emplace("url", *url);
             } else if (attr.name == sFlake) {
-                expectType(state, tBool, *attr.value, *attr.pos);
+                expectType(state, tBool, *attr.value, attr.pos);
                 input.isFlake = attr.value->boolean;
             } else if (attr.name == sInputs) {
-                input.overrides = parseFlakeInputs(state, attr.value, *attr.pos);
+                input.overrides = parseFlakeInputs(state, attr.value, attr.pos);
             } else if (attr.name == sFollows) {
-                expectType(state, tString, *attr.value, *attr.pos);
+                expectType(state, tString, *attr.value, attr.pos);
+                attr.value->flattenString();
                 input.follows = parseInputPath(attr.value->string.s);
             } else {
                 state.forceValue(*attr.value);
-                if (attr.value->type == tString)
+                attr.value->flattenString();
+                if (attr.value->type() == tString)
                     attrs.emplace(attr.name, attr.value->string.s);
                 else
                     throw TypeError("flake input attribute '%s' is %s while a string is expected",
                         attr.name, showType(*attr.value));
             }
         } catch (Error & e) {
-            e.addTrace(*attr.pos, hintfmt("in flake attribute '%s'", attr.name));
+            e.addTrace(attr.pos, hintfmt("in flake attribute '%s'", attr.name));
             throw;
         }
     }
@@ -160,7 +165,7 @@ static std::map<FlakeId, FlakeInput> parseFlakeInputs(
             parseFlakeInput(state,
                 inputAttr.name,
                 inputAttr.value,
-                *inputAttr.pos));
+                inputAttr.pos));
     }
 
     return inputs;
@@ -195,7 +200,9 @@ static Flake getFlake(
     Value vInfo;
     state.evalFile(flakeFile, vInfo, true); // FIXME: symlink attack
 
-    expectType(state, tAttrs, vInfo, Pos(foFile, state.symbols.create(flakeFile), 0, 0));
+    if (vInfo.type() != tAttrs)
+        throw Error("expected %s but got %s in '%s'",
+            showType(tAttrs), showType(vInfo.type()), flakeFile);
 
     auto sEdition = state.symbols.create("edition"); // FIXME: remove soon
 
@@ -203,19 +210,20 @@ static Flake getFlake(
         warn("flake '%s' has deprecated attribute 'edition'", lockedRef);
 
     if (auto description = vInfo.attrs->get(state.sDescription)) {
-        expectType(state, tString, *description->value, *description->pos);
+        expectType(state, tString, *description->value, description->pos);
+        description->value->flattenString();
         flake.description = description->value->string.s;
     }
 
     auto sInputs = state.symbols.create("inputs");
 
     if (auto inputs = vInfo.attrs->get(sInputs))
-        flake.inputs = parseFlakeInputs(state, inputs->value, *inputs->pos);
+        flake.inputs = parseFlakeInputs(state, inputs->value, inputs->pos);
 
     auto sOutputs = state.symbols.create("outputs");
 
     if (auto outputs = vInfo.attrs->get(sOutputs)) {
-        expectType(state, tLambda, *outputs->value, *outputs->pos);
+        expectType(state, tLambda, *outputs->value, outputs->pos);
 
         if (outputs->value->lambda.fun->matchAttrs) {
             for (auto & formal : outputs->value->lambda.fun->formals->formals) {
@@ -235,7 +243,7 @@ static Flake getFlake(
             attr.name != sInputs &&
             attr.name != sOutputs)
             throw Error("flake '%s' has an unsupported attribute '%s', at %s",
-                lockedRef, attr.name, *attr.pos);
+                lockedRef, attr.name, attr.pos);
     }
 
     return flake;
@@ -540,34 +548,109 @@ LockedFlake lockFlake(
     return LockedFlake { .flake = std::move(flake), .lockFile = std::move(newLockFile) };
 }
 
+/* The fingerprint of a lock file node. The evaluation cache uses it
+   to check whether a node that a cached value depends on has
+   changed. */
+static std::string nodeFingerprint(const std::string & key, const nlohmann::json & node)
+{
+    return hashString(htSHA256, key + ";" + node.dump()).to_string(Base32, false);
+}
+
+/* 'fetchNode fingerprints key attrs': log that the lock file node
+   'key' is fetched, and fetch it. */
+static void prim_fetchNode(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    if (state.accessLog) {
+        auto key = state.forceStringNoCtx(*args[1], pos);
+        state.forceAttrs(*args[0], pos);
+        auto fingerprint = args[0]->attrs->get(state.symbols.create(key));
+        assert(fingerprint);
+        state.accessLog->add(AccessLog::Kind::NodeFetched,
+            state.forceStringNoCtx(*fingerprint->value, pos));
+    }
+
+    state.callFunction(state.getBuiltin("fetchTree"), *args[2], v, pos);
+}
+
+/* 'trackRoot path value': log that the root source tree 'path' is
+   used, and return 'value'. */
+static void prim_trackRoot(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.accessLog->add(AccessLog::Kind::PathUsed, state.forceStringNoCtx(*args[0], pos));
+    state.forceValue(*args[1], pos);
+    v = *args[1];
+}
+
 void callFlake(EvalState & state,
     const LockedFlake & lockedFlake,
     Value & vRes)
 {
     auto vLocks = state.allocValue();
     auto vRootSrc = state.allocValue();
+    auto vRootSrcTracked = vRootSrc;
     auto vRootSubdir = state.allocValue();
+    auto vFingerprints = state.allocValue();
+    auto vFetchNode = state.allocValue();
     auto vTmp1 = state.allocValue();
     auto vTmp2 = state.allocValue();
+    auto vTmp3 = state.allocValue();
+    auto vTmp4 = state.allocValue();
 
-    mkString(*vLocks, lockedFlake.lockFile.to_string());
+    auto lockFileJson = lockedFlake.lockFile.toJson();
+
+    mkString(*vLocks, lockFileJson.dump());
 
     emitTreeAttrs(state, *lockedFlake.flake.sourceInfo, lockedFlake.flake.lockedRef.input, *vRootSrc);
 
     mkString(*vRootSubdir, lockedFlake.flake.lockedRef.subdir);
 
     static RootValue vCallFlake = nullptr;
+    static RootValue vFetchNodePrimOp = nullptr;
+    static RootValue vTrackRootPrimOp = nullptr;
 
     if (!vCallFlake) {
         vCallFlake = allocRootValue(state.allocValue());
         state.eval(state.parseExprFromString(
             #include "call-flake.nix.gen.hh"
             , "/"), **vCallFlake);
+
+        vFetchNodePrimOp = allocRootValue(state.allocValue());
+        (*vFetchNodePrimOp)->setType(tPrimOp);
+        (*vFetchNodePrimOp)->primOp = new PrimOp { .fun = prim_fetchNode, .arity = 3, .name = state.symbols.create("fetchNode") };
+
+        vTrackRootPrimOp = allocRootValue(state.allocValue());
+        (*vTrackRootPrimOp)->setType(tPrimOp);
+        (*vTrackRootPrimOp)->primOp = new PrimOp { .fun = prim_trackRoot, .arity = 2, .name = state.symbols.create("trackRoot") };
+    }
+
+    auto & nodes = lockFileJson["nodes"];
+    state.mkAttrs(*vFingerprints, nodes.size());
+    for (auto & node : nodes.items())
+        mkString(*state.allocAttr(*vFingerprints, state.symbols.create(node.key())),
+            nodeFingerprint(node.key(), node.value()));
+    vFingerprints->attrs->sort();
+    mkApp(*vFetchNode, **vFetchNodePrimOp, *vFingerprints);
+
+    if (state.accessLog) {
+        /* The attributes of the root source tree (like 'outPath' or
+           'rev') identify the whole tree, so using them makes a value
+           depend on all of it. */
+        auto vPath = state.allocValue();
+        mkString(*vPath, lockedFlake.flake.sourceInfo->actualPath);
+        auto vTrack = state.allocValue();
+        mkApp(*vTrack, **vTrackRootPrimOp, *vPath);
+        vRootSrcTracked = state.allocValue();
+        state.mkAttrs(*vRootSrcTracked, vRootSrc->attrs->size());
+        for (auto & attr : *vRootSrc->attrs)
+            mkApp(*state.allocAttr(*vRootSrcTracked, attr.name), *vTrack, *attr.value);
+        vRootSrcTracked->attrs->sort();
     }
 
     state.callFunction(**vCallFlake, *vLocks, *vTmp1, noPos);
     state.callFunction(*vTmp1, *vRootSrc, *vTmp2, noPos);
-    state.callFunction(*vTmp2, *vRootSubdir, vRes, noPos);
+    state.callFunction(*vTmp2, *vRootSrcTracked, *vTmp3, noPos);
+    state.callFunction(*vTmp3, *vRootSubdir, *vTmp4, noPos);
+    state.callFunction(*vTmp4, *vFetchNode, vRes, noPos);
 }
 
 static void prim_getFlake(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -593,9 +676,6 @@ static RegisterPrimOp r2("__getFlake", 1, prim_getFlake, "flakes");
 
 Fingerprint LockedFlake::getFingerprint(const Store & store) const
 {
-    // FIXME: as an optimization, if the flake contains a lock file
-    // and we haven't changed it, then it's sufficient to use
-    // flake.sourceInfo.storePath for the fingerprint.
     return hashString(htSHA256,
         fmt("%s;%d;%d;%s",
             store.makeFixedOutputPathFromCA(flake.sourceInfo->storePath).to_string(),
@@ -604,6 +684,43 @@ Fingerprint LockedFlake::getFingerprint(const Store & store) const
             lockFile));
 }
 
+eval_cache::Sources LockedFlake::getCacheSources(const Store & store) const
+{
+    eval_cache::Sources sources;
+
+    /* All revisions and lock files of a flake share a cache. */
+    sources.cacheKey = hashString(htSHA256, flake.originalRef.to_string());
+
+    auto rootPath = store.makeFixedOutputPathFromCA(flake.sourceInfo->storePath);
+    sources.rootPath = store.printStorePath(rootPath);
+    sources.rootFingerprint = hashString(htSHA256,
+        fmt("%s;%s",
+            rootPath.to_string(),
+            fetchers::attrsToJson(flake.lockedRef.input.toAttrs()).dump())).to_string(Base32, false);
+
+    auto lockFileJson = lockFile.toJson();
+
+    for (auto & i : lockFileJson["nodes"].items()) {
+        sources.nodes.insert(nodeFingerprint(i.key(), i.value()));
+
+        /* Apart from fetching the nodes, call-flake.nix only uses
+           the structure of the lock file and the subdirectories of
+           the flakes. */
+        auto & node = i.value();
+        std::optional<std::string> dir;
+        if (node.contains("locked") && node["locked"].contains("dir"))
+            dir = node["locked"]["dir"];
+        node.erase("locked");
+        node.erase("info");
+        node.erase("original");
+        if (dir) node["dir"] = *dir;
+    }
+
+    sources.lockGraph = hashString(htSHA256, lockFileJson.dump()).to_string(Base32, false);
+
+    return sources;
+}
+
 Flake::~Flake() { }
 
 }
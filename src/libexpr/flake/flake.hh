@@ -11,6 +11,8 @@ class EvalState;
 
 namespace fetchers { struct Tree; }
 
+namespace eval_cache { struct Sources; }
+
 namespace flake {
 
 struct FlakeInput;
@@ -39,7 +41,8 @@ struct Flake
 
 Flake getFlake(EvalState & state, const FlakeRef & flakeRef, bool allowLookup);
 
-/* Fingerprint of a locked flake; used as a cache key. */
+/* Fingerprint of a locked flake, i.e. of its source tree and its
+   entire lock file. */
 typedef Hash Fingerprint;
 
 struct LockedFlake
@@ -47,7 +50,15 @@ struct LockedFlake
     Flake flake;
     LockFile lockFile;
 
+    /* Used as a cache key by caches that must be discarded when
+       anything in the flake or its inputs changes, such as the search
+       index. */
     Fingerprint getFingerprint(const Store & store) const;
+
+    /* The sources that the evaluation of this flake can depend on,
+       for the evaluation cache, which unlike the fingerprint can
+       survive changes to unrelated inputs. */
+    eval_cache::Sources getCacheSources(const Store & store) const;
 };
 
 struct LockFlags
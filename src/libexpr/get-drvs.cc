@@ -49,8 +49,8 @@ DrvInfo::DrvInfo(EvalState & state, ref<Store> store, const std::string & drvPat
 string DrvInfo::queryName() const
 {
     if (name == "" && attrs) {
-        auto i = attrs->find(state->sName);
-        if (i == attrs->end()) throw TypeError("derivation name missing");
+        auto i = attrs->get(state->sName);
+        if (!i) throw TypeError("derivation name missing");
         name = state->forceStringNoCtx(*i->value);
     }
     return name;
@@ -60,8 +60,8 @@ string DrvInfo::queryName() const
 string DrvInfo::querySystem() const
 {
     if (system == "" && attrs) {
-        auto i = attrs->find(state->sSystem);
-        system = i == attrs->end() ? "unknown" : state->forceStringNoCtx(*i->value, *i->pos);
+        auto i = attrs->get(state->sSystem);
+        system = !i ? "unknown" : state->forceStringNoCtx(*i->value, i->pos);
     }
     return system;
 }
@@ -70,9 +70,10 @@ string DrvInfo::querySystem() const
 string DrvInfo::queryDrvPath() const
 {
     if (drvPath == "" && attrs) {
-        Bindings::iterator i = attrs->find(state->sDrvPath);
+        auto i = attrs->get(state->sDrvPath);
         PathSet context;
-        drvPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
+        drvPath = i ? state->coerceToPath(i->pos, *i->value, context) : "";
+        state->flushDerivations();
     }
     return drvPath;
 }
@@ -81,10 +82,10 @@ string DrvInfo::queryDrvPath() const
 string DrvInfo::queryOutPath() const
 {
     if (!outPath && attrs) {
-        Bindings::iterator i = attrs->find(state->sOutPath);
+        auto i = attrs->get(state->sOutPath);
         PathSet context;
-        if (i != attrs->end())
-            outPath = state->coerceToPath(*i->pos, *i->value, context);
+        if (i)
+            outPath = state->coerceToPath(i->pos, *i->value, context);
     }
     if (!outPath)
         throw UnimplementedError("CA derivations are not yet supported");
@@ -96,23 +97,23 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
 {
     if (outputs.empty()) {
         /* Get the ‘outputs’ list. */
-        Bindings::iterator i;
-        if (attrs && (i = attrs->find(state->sOutputs)) != attrs->end()) {
-            state->forceList(*i->value, *i->pos);
+        Attr * i;
+        if (attrs && (i = attrs->get(state->sOutputs))) {
+            state->forceList(*i->value, i->pos);
 
             /* For each output... */
             for (unsigned int j = 0; j < i->value->listSize(); ++j) {
                 /* Evaluate the corresponding set. */
-                string name = state->forceStringNoCtx(*i->value->listElems()[j], *i->pos);
-                Bindings::iterator out = attrs->find(state->symbols.create(name));
-                if (out == attrs->end()) continue; // FIXME: throw error?
+                string name = state->forceStringNoCtx(*i->value->listElems()[j], i->pos);
+                auto out = attrs->get(state->symbols.create(name));
+                if (!out) continue; // FIXME: throw error?
                 state->forceAttrs(*out->value);
 
                 /* And evaluate its ‘outPath’ attribute. */
-                Bindings::iterator outPath = out->value->attrs->find(state->sOutPath);
-                if (outPath == out->value->attrs->end()) continue; // FIXME: throw error?
+                auto outPath = out->value->attrs->get(state->sOutPath);
+                if (!outPath) continue; // FIXME: throw error?
                 PathSet context;
-                outputs[name] = state->coerceToPath(*outPath->pos, *outPath->value, context);
+                outputs[name] = state->coerceToPath(outPath->pos, *outPath->value, context);
             }
         } else
             outputs["out"] = queryOutPath();
@@ -121,14 +122,15 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
         return outputs;
 
     /* Check for `meta.outputsToInstall` and return `outputs` reduced to that. */
-    const Value * outTI = queryMeta("outputsToInstall");
+    Value * outTI = queryMeta("outputsToInstall");
     if (!outTI) return outputs;
     const auto errMsg = Error("this derivation has bad 'meta.outputsToInstall'");
         /* ^ this shows during `nix-env -i` right under the bad derivation */
     if (!outTI->isList()) throw errMsg;
     Outputs result;
     for (auto i = outTI->listElems(); i != outTI->listElems() + outTI->listSize(); ++i) {
-        if ((*i)->type != tString) throw errMsg;
+        if ((*i)->type() != tString) throw errMsg;
+        (*i)->flattenString();
         auto out = outputs.find((*i)->string.s);
         if (out == outputs.end()) throw errMsg;
         result.insert(*out);
@@ -140,8 +142,8 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
 string DrvInfo::queryOutputName() const
 {
     if (outputName == "" && attrs) {
-        Bindings::iterator i = attrs->find(state->sOutputName);
-        outputName = i != attrs->end() ? state->forceStringNoCtx(*i->value) : "";
+        auto i = attrs->get(state->sOutputName);
+        outputName = i ? state->forceStringNoCtx(*i->value) : "";
     }
     return outputName;
 }
@@ -151,9 +153,9 @@ Bindings * DrvInfo::getMeta()
 {
     if (meta) return meta;
     if (!attrs) return 0;
-    Bindings::iterator a = attrs->find(state->sMeta);
-    if (a == attrs->end()) return 0;
-    state->forceAttrs(*a->value, *a->pos);
+    auto a = attrs->get(state->sMeta);
+    if (!a) return 0;
+    state->forceAttrs(*a->value, a->pos);
     meta = a->value->attrs;
     return meta;
 }
@@ -177,23 +179,23 @@ bool DrvInfo::checkMeta(Value & v)
             if (!checkMeta(*v.listElems()[n])) return false;
         return true;
     }
-    else if (v.type == tAttrs) {
-        Bindings::iterator i = v.attrs->find(state->sOutPath);
-        if (i != v.attrs->end()) return false;
+    else if (v.type() == tAttrs) {
+        auto i = v.attrs->get(state->sOutPath);
+        if (i) return false;
         for (auto & i : *v.attrs)
             if (!checkMeta(*i.value)) return false;
         return true;
     }
-    else return v.type == tInt || v.type == tBool || v.type == tString ||
-                v.type == tFloat;
+    else return v.type() == tInt || v.type() == tBool || v.type() == tString ||
+                v.type() == tFloat;
 }
 
 
 Value * DrvInfo::queryMeta(const string & name)
 {
     if (!getMeta()) return 0;
-    Bindings::iterator a = meta->find(state->symbols.create(name));
-    if (a == meta->end() || !checkMeta(*a->value)) return 0;
+    auto a = meta->get(state->symbols.create(name));
+    if (!a || !checkMeta(*a->value)) return 0;
     return a->value;
 }
 
@@ -201,7 +203,8 @@ Value * DrvInfo::queryMeta(const string & name)
 string DrvInfo::queryMetaString(const string & name)
 {
     Value * v = queryMeta(name);
-    if (!v || v->type != tString) return "";
+    if (!v || v->type() != tString) return "";
+    v->flattenString();
     return v->string.s;
 }
 
@@ -210,10 +213,11 @@ NixInt DrvInfo::queryMetaInt(const string & name, NixInt def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tInt) return v->integer;
-    if (v->type == tString) {
+    if (v->type() == tInt) return v->integer;
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            integer meta fields. */
+        v->flattenString();
         NixInt n;
         if (string2Int(v->string.s, n)) return n;
     }
@@ -224,10 +228,11 @@ NixFloat DrvInfo::queryMetaFloat(const string & name, NixFloat def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tFloat) return v->fpoint;
-    if (v->type == tString) {
+    if (v->type() == tFloat) return v->fpoint;
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            float meta fields. */
+        v->flattenString();
         NixFloat n;
         if (string2Float(v->string.s, n)) return n;
     }
@@ -239,10 +244,11 @@ bool DrvInfo::queryMetaBool(const string & name, bool def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tBool) return v->boolean;
-    if (v->type == tString) {
+    if (v->type() == tBool) return v->boolean;
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            Boolean meta fields. */
+        v->flattenString();
         if (strcmp(v->string.s, "true") == 0) return true;
         if (strcmp(v->string.s, "false") == 0) return false;
     }
@@ -331,11 +337,11 @@ static void getDerivations(EvalState & state, Value & vIn,
     /* Process the expression. */
     if (!getDerivation(state, v, pathPrefix, drvs, done, ignoreAssertionFailures)) ;
 
-    else if (v.type == tAttrs) {
+    else if (v.type() == tAttrs) {
 
         /* !!! undocumented hackery to support combining channels in
            nix-env.cc. */
-        bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != v.attrs->end();
+        bool combineChannels = v.attrs->get(state.symbols.create("_combineChannels"));
 
         /* Consider the attributes in sorted order to get more
            deterministic behaviour in nix-env operations (e.g. when
@@ -353,9 +359,9 @@ static void getDerivations(EvalState & state, Value & vIn,
                 /* If the value of this attribute is itself a set,
                    should we recurse into it?  => Only if it has a
                    `recurseForDerivations = true' attribute. */
-                if (i->value->type == tAttrs) {
-                    Bindings::iterator j = i->value->attrs->find(state.sRecurseForDerivations);
-                    if (j != i->value->attrs->end() && state.forceBool(*j->value, *j->pos))
+                if (i->value->type() == tAttrs) {
+                    auto j = i->value->attrs->get(state.sRecurseForDerivations);
+                    if (j && state.forceBool(*j->value, j->pos))
                         getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
                 }
             }
@@ -1,5 +1,7 @@
 #include "json-to-value.hh"
 
+#include <cmath>
+#include <cstring>
 #include <variant>
 #include <nlohmann/json.hpp>
 
@@ -157,8 +159,429 @@ public:
     }
 };
 
+/* A fast parser for the common case of well-formed input. It is a
+   non-recursive descent parser that keeps the elements of the lists
+   and attribute sets that are being parsed on two stacks, so that
+   they can be allocated at their final size when they're closed.
+   Strings are scanned a word at a time for the few bytes that need
+   attention (quotes, backslashes, control characters and non-ASCII
+   bytes), and strings without escapes are copied directly from the
+   input.
+
+   It accepts exactly the documents that nlohmann::json accepts and
+   produces the same values. It doesn't produce error messages,
+   though: if it returns false, the caller has to parse the input with
+   JSONSax to get the error. */
+class JSONParser
+{
+    EvalState & state;
+    const char * p;
+    const char * const end;
+
+#if HAVE_BOEHMGC
+    typedef std::vector<Attr, traceable_allocator<Attr>> AttrVector;
+#else
+    typedef std::vector<Attr> AttrVector;
+#endif
+
+    /* The elements of the lists and the attributes of the attribute
+       sets that are still open. */
+    ValueVector elems;
+    AttrVector attrs;
+
+    struct Frame
+    {
+        Value * v;
+        bool isAttrs;
+        size_t base;
+    };
+
+    std::vector<Frame> frames;
+
+    /* The string being unescaped. */
+    std::string buf;
+
+    void skipWhitespace()
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+    }
+
+    /* Return whether any byte of 'w' is a quote, a backslash, a
+       control character or a non-ASCII byte. */
+    static bool special(uint64_t w)
+    {
+        constexpr uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+        auto hasZero = [&](uint64_t x) { return (x - ones) & ~x; };
+        return (hasZero(w ^ (ones * '"')) | hasZero(w ^ (ones * '\\')) | (w - ones * 0x20) | w) & highs;
+    }
+
+    /* Check that the bytes at 'p' are a well-formed UTF-8 sequence
+       starting with a non-ASCII byte, and skip them. */
+    bool skipUTF8()
+    {
+        auto c = (unsigned char) *p;
+        unsigned char lo = 0x80, hi = 0xbf;
+        size_t n;
+        if (c >= 0xc2 && c <= 0xdf) n = 1;
+        else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            if (c == 0xe0) lo = 0xa0;
+            else if (c == 0xed) hi = 0x9f;
+        }
+        else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            if (c == 0xf0) lo = 0x90;
+            else if (c == 0xf4) hi = 0x8f;
+        }
+        else return false;
+        if ((size_t) (end - p) <= n) return false;
+        p++;
+        for (size_t i = 0; i < n; ++i, ++p) {
+            auto d = (unsigned char) *p;
+            if (d < lo || d > hi) return false;
+            lo = 0x80; hi = 0xbf;
+        }
+        return true;
+    }
+
+    bool parseHex4(unsigned int & n)
+    {
+        if (end - p < 4) return false;
+        n = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *p++;
+            n <<= 4;
+            if (c >= '0' && c <= '9') n |= c - '0';
+            else if (c >= 'a' && c <= 'f') n |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') n |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+
+    /* Parse the string starting after the opening quote at 'p'. The
+       result either points into the input or to 'buf'. */
+    bool parseString(std::string_view & s)
+    {
+        auto start = p;
+        bool escaped = false;
+
+        while (true) {
+            while (end - p >= 8) {
+                uint64_t w;
+                memcpy(&w, p, 8);
+                if (special(w)) break;
+                p += 8;
+            }
+
+            if (p == end) return false;
+
+            auto c = (unsigned char) *p;
+
+            if (c == '"') {
+                if (escaped) {
+                    buf.append(start, p);
+                    s = buf;
+                } else
+                    s = std::string_view(start, p - start);
+                p++;
+                return true;
+            }
+
+            else if (c == '\\') {
+                if (!escaped) {
+                    buf.clear();
+                    escaped = true;
+                }
+                buf.append(start, p);
+                if (++p == end) return false;
+                switch (*p++) {
+                    case '"': buf.push_back('"'); break;
+                    case '\\': buf.push_back('\\'); break;
+                    case '/': buf.push_back('/'); break;
+                    case 'b': buf.push_back('\b'); break;
+                    case 'f': buf.push_back('\f'); break;
+                    case 'n': buf.push_back('\n'); break;
+                    case 'r': buf.push_back('\r'); break;
+                    case 't': buf.push_back('\t'); break;
+                    case 'u': {
+                        unsigned int n;
+                        if (!parseHex4(n)) return false;
+                        if (n >= 0xd800 && n <= 0xdbff) {
+                            unsigned int m;
+                            if (end - p < 2 || p[0] != '\\' || p[1] != 'u') return false;
+                            p += 2;
+                            if (!parseHex4(m) || m < 0xdc00 || m > 0xdfff) return false;
+                            n = 0x10000 + ((n - 0xd800) << 10) + (m - 0xdc00);
+                        } else if (n >= 0xdc00 && n <= 0xdfff)
+                            return false;
+                        if (n < 0x80)
+                            buf.push_back(n);
+                        else if (n < 0x800) {
+                            buf.push_back(0xc0 | (n >> 6));
+                            buf.push_back(0x80 | (n & 0x3f));
+                        } else if (n < 0x10000) {
+                            buf.push_back(0xe0 | (n >> 12));
+                            buf.push_back(0x80 | ((n >> 6) & 0x3f));
+                            buf.push_back(0x80 | (n & 0x3f));
+                        } else {
+                            buf.push_back(0xf0 | (n >> 18));
+                            buf.push_back(0x80 | ((n >> 12) & 0x3f));
+                            buf.push_back(0x80 | ((n >> 6) & 0x3f));
+                            buf.push_back(0x80 | (n & 0x3f));
+                        }
+                        break;
+                    }
+                    default: return false;
+                }
+                start = p;
+            }
+
+            else if (c < 0x20)
+                return false;
+
+            else if (c >= 0x80) {
+                if (!skipUTF8()) return false;
+            }
+
+            else
+                p++;
+        }
+    }
+
+    /* Parse a number the way nlohmann::json does: integers that fit
+       in an int64_t or (if positive) a uint64_t are integers, and
+       everything else is a float. */
+    bool parseNumber(Value & v)
+    {
+        auto start = p;
+        bool isFloat = false;
+
+        if (*p == '-') p++;
+        if (p == end) return false;
+        if (*p == '0') p++;
+        else if (*p >= '1' && *p <= '9')
+            while (p < end && *p >= '0' && *p <= '9') p++;
+        else return false;
+
+        if (p < end && *p == '.') {
+            isFloat = true;
+            if (++p == end || *p < '0' || *p > '9') return false;
+            while (p < end && *p >= '0' && *p <= '9') p++;
+        }
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            isFloat = true;
+            if (++p < end && (*p == '+' || *p == '-')) p++;
+            if (p == end || *p < '0' || *p > '9') return false;
+            while (p < end && *p >= '0' && *p <= '9') p++;
+        }
+
+        /* strtod() and friends need a terminated string. */
+        char tmp[64];
+        std::string big;
+        const char * token;
+        size_t len = p - start;
+        if (len < sizeof(tmp)) {
+            memcpy(tmp, start, len);
+            tmp[len] = 0;
+            token = tmp;
+        } else {
+            big.assign(start, len);
+            token = big.c_str();
+        }
+
+        char * endPtr;
+
+        if (!isFloat) {
+            errno = 0;
+            if (*start == '-') {
+                auto n = strtoll(token, &endPtr, 10);
+                if (errno == 0) {
+                    mkInt(v, n);
+                    return true;
+                }
+            } else {
+                auto n = strtoull(token, &endPtr, 10);
+                if (errno == 0) {
+                    mkInt(v, n);
+                    return true;
+                }
+            }
+        }
+
+        auto f = strtod(token, &endPtr);
+        if (!std::isfinite(f)) return false;
+        mkFloat(v, f);
+        return true;
+    }
+
+    bool parseLiteral(std::string_view lit)
+    {
+        if ((size_t) (end - p) < lit.size() || std::string_view(p, lit.size()) != lit) return false;
+        p += lit.size();
+        return true;
+    }
+
+    /* Parse the key of an attribute at 'p', and the colon after it. */
+    bool parseKey()
+    {
+        std::string_view key;
+        if (p == end || *p != '"') return false;
+        p++;
+        if (!parseString(key)) return false;
+        skipWhitespace();
+        if (p == end || *p != ':') return false;
+        p++;
+        attrs.emplace_back(state.symbols.create(key), nullptr);
+        return true;
+    }
+
+    void closeList(Frame & frame)
+    {
+        auto n = elems.size() - frame.base;
+        state.mkList(*frame.v, n);
+        std::copy(elems.begin() + frame.base, elems.end(), frame.v->listElems());
+        elems.resize(frame.base);
+    }
+
+    void closeAttrs(Frame & frame)
+    {
+        auto first = attrs.begin() + frame.base;
+
+        /* If a name occurs more than once, the last value wins. */
+        std::stable_sort(first, attrs.end());
+        size_t n = 0;
+        for (auto i = first; i != attrs.end(); ++i)
+            if (i + 1 == attrs.end() || i[1].name != i->name) n++;
+
+        state.mkAttrs(*frame.v, n);
+        for (auto i = first; i != attrs.end(); ++i)
+            if (i + 1 == attrs.end() || i[1].name != i->name)
+                frame.v->attrs->push_back(*i);
+
+        attrs.resize(frame.base);
+    }
+
+public:
+
+    JSONParser(EvalState & state, std::string_view s)
+        : state(state), p(s.data()), end(s.data() + s.size())
+    { }
+
+    bool parse(Value & root)
+    {
+        while (true) {
+            skipWhitespace();
+            if (p == end) return false;
+
+            /* Allocate the value and add it to the enclosing list or
+               attribute set. */
+            Value * v;
+            if (frames.empty())
+                v = &root;
+            else {
+                v = state.allocValue();
+                if (frames.back().isAttrs)
+                    attrs.back().value = v;
+                else
+                    elems.push_back(v);
+            }
+
+            switch (*p) {
+
+                case '{':
+                    p++;
+                    skipWhitespace();
+                    if (p < end && *p == '}') {
+                        p++;
+                        state.mkAttrs(*v, 0);
+                        break;
+                    }
+                    frames.push_back({v, true, attrs.size()});
+                    if (!parseKey()) return false;
+                    continue;
+
+                case '[':
+                    p++;
+                    skipWhitespace();
+                    if (p < end && *p == ']') {
+                        p++;
+                        state.mkList(*v, 0);
+                        break;
+                    }
+                    frames.push_back({v, false, elems.size()});
+                    continue;
+
+                case '"': {
+                    p++;
+                    std::string_view s;
+                    if (!parseString(s)) return false;
+                    mkString(*v, s);
+                    break;
+                }
+
+                case 't':
+                    if (!parseLiteral("true")) return false;
+                    mkBool(*v, true);
+                    break;
+
+                case 'f':
+                    if (!parseLiteral("false")) return false;
+                    mkBool(*v, false);
+                    break;
+
+                case 'n':
+                    if (!parseLiteral("null")) return false;
+                    mkNull(*v);
+                    break;
+
+                default:
+                    if (!parseNumber(*v)) return false;
+                    break;
+            }
+
+            /* A value has been parsed. Close the lists and attribute
+               sets that end after it. */
+            while (true) {
+                skipWhitespace();
+
+                if (frames.empty())
+                    return p == end;
+
+                auto & frame = frames.back();
+
+                if (p == end) return false;
+
+                if (*p == ',') {
+                    p++;
+                    if (frame.isAttrs) {
+                        skipWhitespace();
+                        if (!parseKey()) return false;
+                    }
+                    break;
+                }
+
+                if (*p != (frame.isAttrs ? '}' : ']')) return false;
+                p++;
+
+                if (frame.isAttrs)
+                    closeAttrs(frame);
+                else
+                    closeList(frame);
+                frames.pop_back();
+            }
+        }
+    }
+};
+
 void parseJSON(EvalState & state, const string & s_, Value & v)
 {
+    if (evalSettings.useFastJSON) {
+        JSONParser parser(state, s_);
+        if (parser.parse(v)) return;
+    }
+
     JSONSax parser(state, v);
     bool res = json::sax_parse(s_, &parser);
     if (!res)
@@ -3,6 +3,7 @@
 #include "util.hh"
 
 #include <cstdlib>
+#include <limits>
 
 
 namespace nix {
@@ -192,8 +193,9 @@ void ExprPos::show(std::ostream & str) const
 }
 
 
-std::ostream & operator << (std::ostream & str, const Pos & pos)
+std::ostream & operator << (std::ostream & str, const Pos & pos_)
 {
+    auto pos = pos_.resolve();
     if (!pos)
         str << "undefined position";
     else
@@ -232,8 +234,95 @@ string showAttrPath(const AttrPath & attrPath)
 }
 
 
+/* Positions. */
+
 Pos noPos;
 
+PosTable positions;
+
+
+Pos::Resolved Pos::resolve() const
+{
+    return positions.resolve(*this);
+}
+
+
+bool Pos::operator < (const Pos & p2) const
+{
+    auto a = resolve(), b = p2.resolve();
+    if (!a.line) return b.line;
+    if (!b.line) return false;
+    int d = ((string) a.file).compare((string) b.file);
+    if (d < 0) return true;
+    if (d > 0) return false;
+    if (a.line < b.line) return true;
+    if (a.line > b.line) return false;
+    return a.column < b.column;
+}
+
+
+const PosTable::Origin & PosTable::add(std::unique_ptr<Origin> origin)
+{
+    auto state(_state.lock());
+    if (origin->size > std::numeric_limits<uint32_t>::max() - state->next)
+        throw Error("too many positions in Nix expressions");
+    origin->start = state->next;
+    state->next += origin->size;
+    state->origins.push_back(std::move(origin));
+    return *state->origins.back();
+}
+
+
+const PosTable::Origin & PosTable::addOrigin(FileOrigin origin, const Symbol & file, std::string_view source)
+{
+    if (source.size() >= std::numeric_limits<uint32_t>::max())
+        throw Error("Nix expression is too large");
+
+    auto o = std::make_unique<Origin>();
+    o->origin = origin;
+    o->file = file;
+
+    /* One position for every byte, plus one for the end of the
+       text. */
+    o->size = source.size() + 1;
+
+    /* Like the lexer, treat LF, CR and CR/LF as line endings. */
+    o->lines.push_back(0);
+    for (size_t i = 0; i < source.size(); i++) {
+        if (source[i] == '\r' && i + 1 < source.size() && source[i + 1] == '\n') i++;
+        if (source[i] == '\n' || source[i] == '\r') o->lines.push_back(i + 1);
+    }
+
+    return add(std::move(o));
+}
+
+
+Pos::Resolved PosTable::resolve(Pos pos)
+{
+    if (!pos) return {};
+
+    const Origin * origin;
+    {
+        auto state(_state.lock());
+        auto i = std::upper_bound(state->origins.begin(), state->origins.end(), pos.id,
+            [](uint32_t id, const std::unique_ptr<Origin> & o) { return id < o->start; });
+        assert(i != state->origins.begin());
+        origin = (--i)->get();
+    }
+    assert(pos.id - origin->start < origin->size);
+
+    Pos::Resolved res;
+    res.origin = origin->origin;
+    res.file = origin->file;
+
+    auto offset = pos.id - origin->start;
+    auto line = std::upper_bound(origin->lines.begin(), origin->lines.end(), offset) - origin->lines.begin();
+    res.line = line;
+    res.column = offset - origin->lines[line - 1] + 1;
+
+    return res;
+}
+
 
 /* Computing levels/displacements for variables. */
 
@@ -447,7 +536,7 @@ string ExprLambda::showNamePos() const
 size_t SymbolTable::totalSize() const
 {
     size_t n = 0;
-    for (auto & i : symbols)
+    for (auto & i : store)
         n += i.size();
     return n;
 }
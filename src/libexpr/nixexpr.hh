@@ -3,6 +3,7 @@
 #include "value.hh"
 #include "symbol-table.hh"
 #include "error.hh"
+#include "sync.hh"
 
 #include <map>
 
@@ -20,35 +21,104 @@ MakeError(UndefinedVarError, Error);
 MakeError(RestrictedPathError, Error);
 
 
-/* Position objects. */
+/* Position objects. A position is stored as a 32-bit index into the
+   global position table (see PosTable below), which is resolved to a
+   file, line and column only when needed, e.g. to show an error
+   message. */
 
 struct Pos
 {
-    FileOrigin origin;
-    Symbol file;
-    unsigned int line, column;
-    Pos() : origin(foString), line(0), column(0) { };
-    Pos(FileOrigin origin, const Symbol & file, unsigned int line, unsigned int column)
-        : origin(origin), file(file), line(line), column(column) { };
-    operator bool() const
+    /* A position resolved to its file, line and column. */
+    struct Resolved
     {
-        return line != 0;
-    }
-    bool operator < (const Pos & p2) const
+        FileOrigin origin = foString;
+        Symbol file;
+        unsigned int line = 0, column = 0;
+
+        operator bool() const
+        {
+            return line != 0;
+        }
+
+        /* So that an ErrPos can be created from a resolved position
+           without going through the position table. */
+        const Resolved & resolve() const
+        {
+            return *this;
+        }
+    };
+
+    uint32_t id;
+
+    Pos() : id(0) { };
+    explicit Pos(uint32_t id) : id(id) { };
+
+    operator bool() const
     {
-        if (!line) return p2.line;
-        if (!p2.line) return false;
-        int d = ((string) file).compare((string) p2.file);
-        if (d < 0) return true;
-        if (d > 0) return false;
-        if (line < p2.line) return true;
-        if (line > p2.line) return false;
-        return column < p2.column;
+        return id != 0;
     }
+
+    bool operator < (const Pos & p2) const;
+
+    Resolved resolve() const;
 };
 
 extern Pos noPos;
 
+/* The positions of all parsed expressions. Each parsed file or string
+   (an "origin") gets a range of position indices, one per byte of its
+   source text, and the start of each of its lines, from which the line
+   and column of a position are computed. This table can be used
+   concurrently by multiple threads. */
+class PosTable
+{
+public:
+
+    struct Origin
+    {
+        /* The index of the first position of this origin, and the
+           number of positions. */
+        uint32_t start, size;
+
+        FileOrigin origin;
+        Symbol file;
+
+        /* The offsets of the lines in the source text. */
+        std::vector<uint32_t> lines;
+
+        /* Return the position at 'offset' in the source text. */
+        Pos operator [] (uint32_t offset) const
+        {
+            assert(offset < size);
+            return Pos(start + offset);
+        }
+    };
+
+private:
+
+    struct State
+    {
+        /* Position 0 is noPos. */
+        uint32_t next = 1;
+
+        /* Sorted by 'start'. */
+        std::vector<std::unique_ptr<Origin>> origins;
+    };
+
+    Sync<State> _state;
+
+    const Origin & add(std::unique_ptr<Origin> origin);
+
+public:
+
+    /* Allocate the positions of a parsed file or string. */
+    const Origin & addOrigin(FileOrigin origin, const Symbol & file, std::string_view source);
+
+    Pos::Resolved resolve(Pos pos);
+};
+
+extern PosTable positions;
+
 std::ostream & operator << (std::ostream & str, const Pos & pos);
 
 
@@ -0,0 +1,417 @@
+#include "parallel-eval.hh"
+#include "eval-inline.hh"
+#include "finally.hh"
+#include "store-api.hh"
+
+#include <algorithm>
+#include <chrono>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+namespace nix {
+
+
+/* The context of the task that this thread is running, if any. */
+static thread_local EvalContext * currentTask = nullptr;
+
+
+Executor::Executor(size_t nrThreads)
+{
+#if HAVE_BOEHMGC
+    GC_allow_register_threads();
+#endif
+
+    contexts.insert(&rootContext);
+
+    for (size_t n = 0; n < nrThreads; ++n)
+        threads.emplace_back([this]() { worker(); });
+}
+
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeup.notify_all();
+    for (auto & thread : threads)
+        thread.join();
+}
+
+
+EvalContext & Executor::currentContext()
+{
+    return currentTask ? *currentTask : rootContext;
+}
+
+
+void Executor::worker()
+{
+#if HAVE_BOEHMGC
+    /* Worker threads allocate and hold pointers to garbage-collected
+       objects, so the collector must know about them. */
+    GC_stack_base sb;
+    GC_get_stack_base(&sb);
+    GC_register_my_thread(&sb);
+    Finally unregister([]() { GC_unregister_my_thread(); });
+#endif
+
+    while (true) {
+        Batch * batch;
+        size_t i;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            nrIdle++;
+            wakeup.wait(lock, [&]() { return quit || !batches.empty(); });
+            nrIdle--;
+            if (quit) return;
+            batch = batches.back();
+            i = batch->next++;
+            if (batch->next == batch->count) batches.pop_back();
+        }
+
+        nrTasksStolen++;
+        runTask(*batch, i);
+    }
+}
+
+
+void Executor::runTask(Batch & batch, size_t i)
+{
+    EvalContext context(batch.parent);
+
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        contexts.insert(&context);
+        batch.running.insert(&context);
+    }
+
+    auto prev = currentTask;
+    currentTask = &context;
+
+    try {
+        batch.work(i);
+    } catch (...) {
+        batch.errors[i] = std::current_exception();
+    }
+
+    currentTask = prev;
+    nrTasks++;
+
+    bool done;
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        contexts.erase(&context);
+        batch.running.erase(&context);
+        done = --batch.remaining == 0;
+    }
+
+    if (done) waitDone.notify_all();
+}
+
+
+void Executor::run(size_t count, const std::function<void(size_t)> & work)
+{
+    auto & self = currentContext();
+
+    Batch batch(work, count, &self);
+    nrBatches++;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        batches.push_back(&batch);
+    }
+    wakeup.notify_all();
+
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        self.waitingForBatch = &batch;
+    }
+
+    /* Run the tasks that haven't been taken by other threads. */
+    while (true) {
+        size_t i;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (batch.next == batch.count) break;
+            i = batch.next++;
+            if (batch.next == batch.count)
+                batches.erase(std::find(batches.begin(), batches.end(), &batch));
+        }
+        runTask(batch, i);
+    }
+
+    /* Wait for the tasks that other threads are running. */
+    {
+        std::unique_lock<std::mutex> lock(waitMutex);
+        nrWaiters++;
+        waitDone.wait(lock, [&]() { return batch.remaining == 0; });
+        nrWaiters--;
+        self.waitingForBatch = nullptr;
+    }
+
+    for (auto & error : batch.errors)
+        if (error) std::rethrow_exception(error);
+}
+
+
+/* Return the owner of 'v' if it's a black hole, and nullptr
+   otherwise. The owner is also nullptr right after 'v' has been
+   claimed, until the owner has stored itself in 'v'. */
+static EvalContext * getOwner(Value & v, const std::unordered_set<EvalContext *> & contexts)
+{
+#if !NIX_TAGGED_VALUES
+    return nullptr;
+#else
+    if (v.loadTypeWord() != Value::singleTypeWord(tBlackhole)) return nullptr;
+    auto owner = (EvalContext *) __atomic_load_n(&v.payloadWord, __ATOMIC_RELAXED);
+    return contexts.count(owner) ? owner : nullptr;
+#endif
+}
+
+
+bool Executor::dependsOn(EvalContext * context, EvalContext * target,
+    std::unordered_set<EvalContext *> & visited)
+{
+    if (context == target) return true;
+    if (!visited.insert(context).second) return false;
+
+    if (context->waitingForValue
+        && getOwner(*context->waitingForValue, contexts) == context->waitingForOwner
+        && dependsOn(context->waitingForOwner, target, visited))
+        return true;
+
+    if (context->waitingForBatch)
+        for (auto running : context->waitingForBatch->running)
+            if (dependsOn(running, target, visited)) return true;
+
+    return false;
+}
+
+
+void Executor::waitFor(Value & v, const Pos & pos)
+{
+    auto & self = currentContext();
+
+    std::unique_lock<std::mutex> lock(waitMutex);
+
+    nrWaiters++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    Finally done([&]() {
+        nrWaiters--;
+        self.waitingForValue = nullptr;
+        self.waitingForOwner = nullptr;
+    });
+
+#if NIX_TAGGED_VALUES
+    while (v.loadTypeWord() == Value::singleTypeWord(tBlackhole)) {
+        auto owner = getOwner(v, contexts);
+        if (owner) {
+            std::unordered_set<EvalContext *> visited;
+            if (dependsOn(owner, &self, visited))
+                throwEvalError(pos, "infinite recursion encountered");
+            self.waitingForValue = &v;
+            self.waitingForOwner = owner;
+            nrWaits++;
+            waitDone.wait(lock);
+        } else
+            /* The owner hasn't stored itself in the value yet. */
+            waitDone.wait_for(lock, std::chrono::milliseconds(1));
+    }
+#endif
+}
+
+
+struct Realisation
+{
+    std::vector<StorePathWithOutputs> paths;
+
+    /* Protected by Executor::realiseMutex. */
+    bool done = false;
+    std::exception_ptr error;
+};
+
+
+/* How long a thread waits for the other evaluation threads to stall
+   before building the pending realisations anyway. */
+static constexpr auto maxRealiseDelay = std::chrono::milliseconds(100);
+
+
+bool Executor::isStalled()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!batches.empty()) return false;
+    }
+    return nrIdle + nrWaiters + nrRealising >= threads.size() + 1;
+}
+
+
+/* Whether the outputs in 'paths' are valid. */
+static bool isRealised(Store & store, const std::vector<StorePathWithOutputs> & paths)
+{
+    for (auto & [drvPath, outputs] : paths) {
+        auto outputMap = store.queryPartialDerivationOutputMap(drvPath);
+        for (auto & [outputName, outputPath] : outputMap)
+            if ((outputs.empty() || outputs.count(outputName))
+                && (!outputPath || !store.isValidPath(*outputPath)))
+                return false;
+    }
+    return true;
+}
+
+
+void Executor::realise(Store & store, const std::vector<StorePathWithOutputs> & paths)
+{
+    auto realisation = std::make_shared<Realisation>();
+    realisation->paths = paths;
+    nrRealisations++;
+
+    std::unique_lock<std::mutex> lock(realiseMutex);
+
+    pendingRealisations.push_back(realisation);
+    nrRealising++;
+    Finally done([&]() { nrRealising--; });
+
+    auto deadline = std::chrono::steady_clock::now() + maxRealiseDelay;
+
+    while (!realisation->done) {
+        checkInterrupt();
+
+        if (pendingRealisations.empty()
+            || (!isStalled() && std::chrono::steady_clock::now() < deadline))
+        {
+            /* Threads don't tell us when they become idle or start
+               waiting, so poll. */
+            realiseDone.wait_for(lock, std::chrono::milliseconds(1));
+            continue;
+        }
+
+        /* Build everything that has been requested so far. */
+        auto batch = std::move(pendingRealisations);
+        pendingRealisations.clear();
+        nrRealisationBatches++;
+        lock.unlock();
+
+        std::exception_ptr error;
+        try {
+            /* Merge the requested outputs of each derivation. An empty
+               set means all outputs. */
+            std::map<StorePath, std::optional<StringSet>> outputs;
+            for (auto & r : batch)
+                for (auto & [drvPath, outputNames] : r->paths) {
+                    auto & o = outputs.emplace(drvPath, StringSet()).first->second;
+                    if (!o || outputNames.empty())
+                        o.reset();
+                    else
+                        o->insert(outputNames.begin(), outputNames.end());
+                }
+
+            std::vector<StorePathWithOutputs> allPaths;
+            for (auto & [drvPath, outputNames] : outputs)
+                allPaths.push_back({drvPath, outputNames.value_or(StringSet())});
+
+            /* For performance, prefetch all substitute info. */
+            StorePathSet willBuild, willSubstitute, unknown;
+            uint64_t downloadSize, narSize;
+            store.queryMissing(allPaths, willBuild, willSubstitute, unknown, downloadSize, narSize);
+
+            store.buildPaths(allPaths);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        /* If the batch failed, the realisations whose outputs were
+           built anyway still succeed. */
+        std::vector<std::exception_ptr> errors(batch.size());
+        if (error)
+            for (size_t n = 0; n < batch.size(); ++n) {
+                try {
+                    if (isRealised(store, batch[n]->paths)) continue;
+                } catch (...) {
+                }
+                errors[n] = error;
+            }
+
+        lock.lock();
+        for (size_t n = 0; n < batch.size(); ++n) {
+            batch[n]->error = errors[n];
+            batch[n]->done = true;
+        }
+        realiseDone.notify_all();
+    }
+
+    if (realisation->error)
+        std::rethrow_exception(realisation->error);
+}
+
+
+void EvalState::forceValueShared(Value & v, const Pos & pos)
+{
+#if !NIX_TAGGED_VALUES
+    /* The executor is only created on platforms with tagged
+       values. */
+    abort();
+#else
+    auto blackhole = Value::singleTypeWord(tBlackhole);
+
+    while (true) {
+        Value old;
+        old.typeWord = v.loadTypeWord();
+
+        if (old.typeWord == blackhole) {
+            executor->waitFor(v, pos);
+            continue;
+        }
+
+        if (old.type() != tThunk && old.type() != tApp) return;
+
+        if (!v.claim(old.typeWord, blackhole)) continue;
+
+        /* Now that we own 'v', its second word can't change
+           anymore. */
+        old.payloadWord = __atomic_load_n(&v.payloadWord, __ATOMIC_RELAXED);
+        __atomic_store_n(&v.payloadWord, (uintptr_t) &executor->currentContext(), __ATOMIC_RELAXED);
+
+        Value res;
+        try {
+            if (old.type() == tThunk)
+                old.thunk.expr->eval(*this, *old.thunk.env(), res);
+            else
+                callFunction(*old.app.left(), *old.app.right, res, noPos);
+        } catch (...) {
+            v.publish(old.typeWord, old.payloadWord);
+            executor->notifyWaiters();
+            throw;
+        }
+
+        v.publish(res.typeWord, res.payloadWord);
+        executor->notifyWaiters();
+        return;
+    }
+#endif
+}
+
+
+void EvalState::parallelFor(size_t count, std::function<void(size_t)> work)
+{
+    if (executor && count > 1)
+        executor->run(count, work);
+    else
+        for (size_t i = 0; i < count; ++i)
+            work(i);
+}
+
+
+bool EvalState::haveIdleThreads()
+{
+    return executor && executor->nrIdle.load(std::memory_order_relaxed) > 0;
+}
+
+
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "eval.hh"
+#include "path.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <unordered_set>
+
+namespace nix {
+
+
+/* Support for evaluating with several threads (see the `eval-cores'
+   setting).
+
+   Work is submitted as a batch of tasks by EvalState::parallelFor().
+   Idle worker threads take tasks from the most recently submitted
+   batch that still has unclaimed tasks; the submitting thread runs
+   the remaining tasks of its own batch and then waits for the ones
+   that other threads are running.
+
+   Values that can be reached by several threads are forced by
+   forceValueShared(), which claims a thunk by atomically replacing it
+   by a black hole that records the evaluation context that is
+   forcing it. A thread that finds a black hole owned by another
+   context waits until that context has finished. To distinguish
+   infinite recursion from waiting for another thread, we keep track
+   of what each context is waiting for: a context that would wait for
+   a context that (transitively) waits for it is in an infinite
+   recursion.
+
+   Import from derivation in evaluation threads goes through
+   Executor::realise(), which doesn't build the requested derivations
+   right away, but waits until no evaluation thread can make progress
+   anymore (every thread is idle, waiting for a value or a batch, or
+   waiting for a realisation), and then builds everything that has
+   been requested in the meantime in one buildPaths() call. */
+
+struct Batch;
+
+struct Realisation;
+
+/* An evaluation context, i.e. a task or the work of a thread outside
+   of any task. */
+struct EvalContext
+{
+    /* The context that submitted the batch of this task. */
+    EvalContext * parent;
+
+    /* What this context is blocked on, if anything. Protected by
+       Executor::waitMutex. */
+    Value * waitingForValue = nullptr;
+    EvalContext * waitingForOwner = nullptr;
+    Batch * waitingForBatch = nullptr;
+
+    EvalContext(EvalContext * parent) : parent(parent) { }
+};
+
+
+struct Batch
+{
+    const std::function<void(size_t)> & work;
+    size_t count;
+    EvalContext * parent;
+
+    /* Index of the next task to run. Protected by Executor::mutex. */
+    size_t next = 0;
+
+    /* Number of tasks that haven't finished yet, and the contexts of
+       the tasks that are running. Protected by Executor::waitMutex. */
+    size_t remaining;
+    std::unordered_set<EvalContext *> running;
+
+    std::vector<std::exception_ptr> errors;
+
+    Batch(const std::function<void(size_t)> & work, size_t count, EvalContext * parent)
+        : work(work), count(count), parent(parent), remaining(count), errors(count)
+    { }
+};
+
+
+struct Executor
+{
+    /* Protects 'batches', 'Batch::next' and 'quit'. */
+    std::mutex mutex;
+    std::condition_variable wakeup;
+
+    /* Batches that have unclaimed tasks. */
+    std::vector<Batch *> batches;
+
+    bool quit = false;
+
+    /* Protects the waiting state of contexts and batches. */
+    std::mutex waitMutex;
+    std::condition_variable waitDone;
+
+    /* Number of threads waiting for a value or a batch. */
+    std::atomic<size_t> nrWaiters{0};
+
+    /* The contexts that currently exist, used to check whether a
+       black hole has an owner yet. */
+    std::unordered_set<EvalContext *> contexts;
+
+    /* The context of threads that aren't running a task. */
+    EvalContext rootContext{nullptr};
+
+    std::atomic<size_t> nrIdle{0};
+
+    std::vector<std::thread> threads;
+
+    /* Protects 'pendingRealisations' and the state of the
+       realisations. */
+    std::mutex realiseMutex;
+    std::condition_variable realiseDone;
+
+    /* Realisations that haven't been submitted to the store yet. */
+    std::vector<std::shared_ptr<Realisation>> pendingRealisations;
+
+    /* Number of threads waiting in realise(). */
+    std::atomic<size_t> nrRealising{0};
+
+    /* Statistics. */
+    std::atomic<unsigned long> nrBatches{0};
+    std::atomic<unsigned long> nrTasks{0};
+    std::atomic<unsigned long> nrTasksStolen{0};
+    std::atomic<unsigned long> nrWaits{0};
+    std::atomic<unsigned long> nrRealisations{0};
+    std::atomic<unsigned long> nrRealisationBatches{0};
+
+    Executor(size_t nrThreads);
+
+    ~Executor();
+
+    EvalContext & currentContext();
+
+    /* Run the tasks 0 to 'count - 1' of 'work' in this thread and in
+       idle worker threads. */
+    void run(size_t count, const std::function<void(size_t)> & work);
+
+    /* Wait until 'v' (which was found to be a black hole) has been
+       forced by another context. */
+    void waitFor(Value & v, const Pos & pos);
+
+    /* Build 'paths' for import from derivation, together with the
+       paths requested by other evaluation threads, see above. */
+    void realise(Store & store, const std::vector<StorePathWithOutputs> & paths);
+
+    /* Wake up the threads waiting for a value to be forced. */
+    void notifyWaiters()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (nrWaiters.load(std::memory_order_relaxed)) {
+            { std::lock_guard<std::mutex> lock(waitMutex); }
+            waitDone.notify_all();
+        }
+    }
+
+private:
+
+    void worker();
+
+    void runTask(Batch & batch, size_t i);
+
+    /* Whether no evaluation thread can make progress until a
+       pending realisation has been built. */
+    bool isStalled();
+
+    /* Whether 'context' cannot proceed until 'target' does. Must be
+       called with 'waitMutex' held. */
+    bool dependsOn(EvalContext * context, EvalContext * target,
+        std::unordered_set<EvalContext *> & visited);
+};
+
+
+}
@@ -1,6 +1,7 @@
 %glr-parser
 %define api.pure
 %locations
+%define api.location.type {::nix::ParserLocation}
 %define parse.error verbose
 %defines
 /* %no-lines */
@@ -30,19 +31,36 @@ namespace nix {
         SymbolTable & symbols;
         Expr * result;
         Path basePath;
-        Symbol file;
-        FileOrigin origin;
+        const PosTable::Origin & origin;
         ErrorInfo error;
         Symbol sLetBody;
-        ParseData(EvalState & state)
+        ParseData(EvalState & state, const PosTable::Origin & origin)
             : state(state)
             , symbols(state.symbols)
+            , origin(origin)
             , sLetBody(symbols.create("<let-body>"))
             { };
     };
 
+    /* Locations are offsets in the source text, which are turned into
+       positions by the position table. */
+    struct ParserLocation
+    {
+        uint32_t beginOffset, endOffset;
+    };
+
 }
 
+#define YYLLOC_DEFAULT(Cur, Rhs, N)                               \
+    do                                                            \
+        if (N) {                                                  \
+            (Cur).beginOffset = YYRHSLOC(Rhs, 1).beginOffset;     \
+            (Cur).endOffset = YYRHSLOC(Rhs, N).endOffset;         \
+        } else                                                    \
+            (Cur).beginOffset = (Cur).endOffset =                 \
+                YYRHSLOC(Rhs, 0).endOffset;                       \
+    while (0)
+
 #define YY_DECL int yylex \
     (YYSTYPE * yylval_param, YYLTYPE * yylloc_param, yyscan_t yyscanner, nix::ParseData * data)
 
@@ -246,7 +264,7 @@ static Expr * stripIndentation(const Pos & pos, SymbolTable & symbols, vector<Ex
 
 static inline Pos makeCurPos(const YYLTYPE & loc, ParseData * data)
 {
-    return Pos(data->origin, data->file, loc.first_line, loc.first_column);
+    return data->origin[loc.beginOffset];
 }
 
 #define CUR_POS makeCurPos(*yylocp, data)
@@ -561,6 +579,8 @@ formal
 #include <unistd.h>
 
 #include "eval.hh"
+#include "ast-cache.hh"
+#include "bytecode.hh"
 #include "filetransfer.hh"
 #include "fetchers.hh"
 #include "store-api.hh"
@@ -572,20 +592,29 @@ namespace nix {
 Expr * EvalState::parse(const char * text, FileOrigin origin,
     const Path & path, const Path & basePath, StaticEnv & staticEnv)
 {
-    yyscan_t scanner;
-    ParseData data(*this);
-    data.origin = origin;
+    return finishParse(parseSyntax(text, addOrigin(text, origin, path), basePath), staticEnv);
+}
+
+
+const PosTable::Origin & EvalState::addOrigin(std::string_view text, FileOrigin origin, const Path & path)
+{
     switch (origin) {
-        case foFile: 
-            data.file = data.symbols.create(path);
-            break;
+        case foFile:
+            return positions.addOrigin(origin, symbols.create(path), text);
         case foStdin:
         case foString:
-            data.file = data.symbols.create(text);
-            break;
+            return positions.addOrigin(origin, symbols.create(text), text);
         default:
             assert(false);
     }
+}
+
+
+Expr * EvalState::parseSyntax(const char * text, const PosTable::Origin & origin,
+    const Path & basePath)
+{
+    yyscan_t scanner;
+    ParseData data(*this, origin);
     data.basePath = basePath;
 
     yylex_init(&scanner);
@@ -595,12 +624,21 @@ Expr * EvalState::parse(const char * text, FileOrigin origin,
 
     if (res) throw ParseError(data.error);
 
-    data.result->bindVars(staticEnv);
-
     return data.result;
 }
 
 
+Expr * EvalState::finishParse(Expr * e, StaticEnv & staticEnv)
+{
+    e->bindVars(staticEnv);
+
+    if (evalSettings.useBytecode)
+        e = compileBytecode(e);
+
+    return e;
+}
+
+
 Path resolveExprPath(Path path)
 {
     assert(path[0] == '/');
@@ -635,7 +673,20 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), foFile, path, dirOf(path), staticEnv);
+    auto text = readFile(path);
+
+    if (!evalSettings.useAstCache)
+        return parse(text.c_str(), foFile, path, dirOf(path), staticEnv);
+
+    auto & origin = addOrigin(text, foFile, path);
+    auto cacheFile = getAstCacheFile(path, text);
+    auto e = lookupAstCache(symbols, origin, cacheFile);
+    if (!e) {
+        e = parseSyntax(text.c_str(), origin, dirOf(path));
+        insertAstCache(cacheFile, origin, e);
+    }
+
+    return finishParse(e, staticEnv);
 }
 
 
@@ -710,8 +761,11 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
 
 std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathElem & elem)
 {
-    auto i = searchPathResolved.find(elem.second);
-    if (i != searchPathResolved.end()) return i->second;
+    {
+        auto searchPathResolved_(searchPathResolved.lock());
+        auto i = searchPathResolved_->find(elem.second);
+        if (i != searchPathResolved_->end()) return i->second;
+    }
 
     std::pair<bool, std::string> res;
 
@@ -748,7 +802,7 @@ std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathEl
 
     debug(format("resolved search path element '%s' to '%s'") % elem.second % res.second);
 
-    searchPathResolved[elem.second] = res;
+    searchPathResolved.lock()->insert_or_assign(elem.second, res);
     return res;
 }
 
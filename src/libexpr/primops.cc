@@ -11,6 +11,9 @@
 #include "value-to-json.hh"
 #include "value-to-xml.hh"
 #include "primops.hh"
+#include "regex.hh"
+#include "lru-cache.hh"
+#include "parallel-eval.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -33,10 +36,67 @@ namespace nix {
 InvalidPathError::InvalidPathError(const Path & path) :
     EvalError("path '%s' is not valid", path), path(path) {}
 
+struct PendingDerivations
+{
+    /* Queued derivations are written in batches of this size. */
+    static constexpr size_t batchSize = 1024;
+
+    /* In the order in which they were produced, so a derivation
+       only refers to derivations that precede it. */
+    Sync<std::vector<StoreText>> texts;
+};
+
+std::shared_ptr<PendingDerivations> makePendingDerivations()
+{
+    return std::make_shared<PendingDerivations>();
+}
+
+/* Called with the lock on 'texts' held, so that derivations queued by
+   other threads are not written before the ones they refer to. */
+static void writePendingDerivations(EvalState & state, std::vector<StoreText> & texts)
+{
+    if (texts.empty()) return;
+    auto batch = std::move(texts);
+    texts.clear();
+    state.store->addTextsToStore(batch, state.repair);
+}
+
+StorePath EvalState::writeDerivation(const Derivation & drv)
+{
+    if (!evalSettings.batchDrvWrites || settings.readOnlyMode)
+        return nix::writeDerivation(*store, drv, repair);
+
+    /* The hash modulo of a floating content-addressed derivation
+       isn't cached, so it has to be read back from the store when a
+       derivation that depends on it is hashed. Write it right away,
+       after the queued derivations that it may refer to. */
+    if (drv.type() == DerivationType::CAFloating) {
+        flushDerivations();
+        return nix::writeDerivation(*store, drv, repair);
+    }
+
+    auto text = storeDerivationText(*store, drv);
+    auto drvPath = store->computeStorePathForText(text.name, text.contents, text.references);
+
+    auto texts(pendingDerivations->texts.lock());
+    texts->push_back(std::move(text));
+    if (texts->size() >= PendingDerivations::batchSize)
+        writePendingDerivations(*this, *texts);
+
+    return drvPath;
+}
+
+void EvalState::flushDerivations()
+{
+    writePendingDerivations(*this, *pendingDerivations->texts.lock());
+}
+
 void EvalState::realiseContext(const PathSet & context)
 {
     std::vector<StorePathWithOutputs> drvs;
 
+    if (!context.empty()) flushDerivations();
+
     for (auto & i : context) {
         auto [ctxS, outputName] = decodeContext(i);
         auto ctx = store->parseStorePath(ctxS);
@@ -53,12 +113,20 @@ void EvalState::realiseContext(const PathSet & context)
         throw EvalError("attempted to realize '%1%' during evaluation but 'allow-import-from-derivation' is false",
             store->printStorePath(drvs.begin()->path));
 
-    /* For performance, prefetch all substitute info. */
-    StorePathSet willBuild, willSubstitute, unknown;
-    uint64_t downloadSize, narSize;
-    store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
+    /* With several evaluation threads, let the other threads
+       continue until they need a realisation too, and then build all
+       of them at once. */
+    if (executor && evalSettings.batchImportFromDerivation)
+        executor->realise(*store, drvs);
 
-    store->buildPaths(drvs);
+    else {
+        /* For performance, prefetch all substitute info. */
+        StorePathSet willBuild, willSubstitute, unknown;
+        uint64_t downloadSize, narSize;
+        store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
+
+        store->buildPaths(drvs);
+    }
 
     /* Add the output of this derivations to the allowed
        paths. */
@@ -69,7 +137,7 @@ void EvalState::realiseContext(const PathSet & context)
                 if (outputPaths.count(outputName) == 0)
                     throw Error("derivation '%s' does not have an output named '%s'",
                             store->printStorePath(drvPath), outputName);
-                allowedPaths->insert(store->printStorePath(outputPaths.at(outputName)));
+                allowPath(store->printStorePath(outputPaths.at(outputName)));
             }
         }
     }
@@ -120,7 +188,7 @@ static void import(EvalState & state, const Pos & pos, Value & vPath, Value * vS
         });
     }
 
-    Path realPath = state.checkSourcePath(state.toRealPath(path, context));
+    Path realPath = state.checkSourcePath(state.toRealPath(path, context), true);
 
     // FIXME
     auto isValidDerivationInStore = [&]() -> std::optional<StorePath> {
@@ -337,7 +405,7 @@ void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
     auto output = runProgram(program, true, commandArgs);
     Expr * parsed;
     try {
-        parsed = state.parseExprFromString(output, pos.file);
+        parsed = state.parseExprFromString(output, pos.resolve().file);
     } catch (Error & e) {
         e.addTrace(pos, "While parsing the output from '%1%'", program);
         throw;
@@ -356,7 +424,7 @@ static void prim_typeOf(EvalState & state, const Pos & pos, Value * * args, Valu
 {
     state.forceValue(*args[0], pos);
     string t;
-    switch (args[0]->type) {
+    switch (args[0]->type()) {
         case tInt: t = "int"; break;
         case tBool: t = "bool"; break;
         case tString: t = "string"; break;
@@ -393,7 +461,7 @@ static RegisterPrimOp primop_typeOf({
 static void prim_isNull(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tNull);
+    mkBool(v, args[0]->type() == tNull);
 }
 
 static RegisterPrimOp primop_isNull({
@@ -414,7 +482,7 @@ static void prim_isFunction(EvalState & state, const Pos & pos, Value * * args,
 {
     state.forceValue(*args[0], pos);
     bool res;
-    switch (args[0]->type) {
+    switch (args[0]->type()) {
         case tLambda:
         case tPrimOp:
         case tPrimOpApp:
@@ -440,7 +508,7 @@ static RegisterPrimOp primop_isFunction({
 static void prim_isInt(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tInt);
+    mkBool(v, args[0]->type() == tInt);
 }
 
 static RegisterPrimOp primop_isInt({
@@ -456,7 +524,7 @@ static RegisterPrimOp primop_isInt({
 static void prim_isFloat(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tFloat);
+    mkBool(v, args[0]->type() == tFloat);
 }
 
 static RegisterPrimOp primop_isFloat({
@@ -472,7 +540,7 @@ static RegisterPrimOp primop_isFloat({
 static void prim_isString(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tString);
+    mkBool(v, args[0]->type() == tString);
 }
 
 static RegisterPrimOp primop_isString({
@@ -488,7 +556,7 @@ static RegisterPrimOp primop_isString({
 static void prim_isBool(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tBool);
+    mkBool(v, args[0]->type() == tBool);
 }
 
 static RegisterPrimOp primop_isBool({
@@ -504,7 +572,7 @@ static RegisterPrimOp primop_isBool({
 static void prim_isPath(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tPath);
+    mkBool(v, args[0]->type() == tPath);
 }
 
 static RegisterPrimOp primop_isPath({
@@ -518,20 +586,22 @@ static RegisterPrimOp primop_isPath({
 
 struct CompareValues
 {
-    bool operator () (const Value * v1, const Value * v2) const
+    bool operator () (Value * v1, Value * v2) const
     {
-        if (v1->type == tFloat && v2->type == tInt)
+        if (v1->type() == tFloat && v2->type() == tInt)
             return v1->fpoint < v2->integer;
-        if (v1->type == tInt && v2->type == tFloat)
+        if (v1->type() == tInt && v2->type() == tFloat)
             return v1->integer < v2->fpoint;
-        if (v1->type != v2->type)
+        if (v1->type() != v2->type())
             throw EvalError("cannot compare %1% with %2%", showType(*v1), showType(*v2));
-        switch (v1->type) {
+        switch (v1->type()) {
             case tInt:
                 return v1->integer < v2->integer;
             case tFloat:
                 return v1->fpoint < v2->fpoint;
             case tString:
+                v1->flattenString();
+                v2->flattenString();
                 return strcmp(v1->string.s, v2->string.s) < 0;
             case tPath:
                 return strcmp(v1->path, v2->path) < 0;
@@ -542,11 +612,76 @@ struct CompareValues
 };
 
 
-#if HAVE_BOEHMGC
-typedef list<Value *, gc_allocator<Value *> > ValueList;
-#else
-typedef list<Value *> ValueList;
-#endif
+/* The keys that genericClosure has seen, hashed but with the same
+   notion of equality as a std::set<Value *, CompareValues>: integers
+   and floats are compared numerically, strings and paths by their
+   contents. Like such a set, it throws an error if a key can't be
+   compared with the keys before it. */
+struct ClosureKeys
+{
+    struct Hash
+    {
+        size_t operator () (Value * v) const
+        {
+            switch (v->type()) {
+                /* Integers and floats that compare equal must have
+                   the same hash. */
+                case tInt: return std::hash<double>()((double) v->integer);
+                case tFloat: return std::hash<double>()(v->fpoint);
+                case tString: return std::hash<std::string_view>()(v->string.s);
+                case tPath: return std::hash<std::string_view>()(v->path);
+                default: abort();
+            }
+        }
+    };
+
+    struct Equal
+    {
+        bool operator () (Value * v1, Value * v2) const
+        {
+            if (v1->type() == tInt && v2->type() == tInt)
+                return v1->integer == v2->integer;
+            if (v1->type() == tString)
+                return strcmp(v1->string.s, v2->string.s) == 0;
+            if (v1->type() == tPath)
+                return strcmp(v1->path, v2->path) == 0;
+            return (v1->type() == tInt ? (double) v1->integer : v1->fpoint)
+                == (v2->type() == tInt ? (double) v2->integer : v2->fpoint);
+        }
+    };
+
+    std::unordered_set<Value *, Hash, Equal> keys;
+
+    /* The first key, which determines the type of the others. */
+    Value * first = nullptr;
+
+    static int typeClass(Value * v)
+    {
+        switch (v->type()) {
+            case tInt: case tFloat: return 0;
+            case tString: return 1;
+            case tPath: return 2;
+            default: return -1;
+        }
+    }
+
+    /* Add 'key', returning false if an equal key was seen before. */
+    bool insert(Value * key)
+    {
+        if (!first)
+            first = key;
+        else if (typeClass(first) == -1 || typeClass(key) != typeClass(first))
+            throw EvalError("cannot compare %1% with %2%", showType(*key), showType(*first));
+
+        /* A single key of any type is allowed, since it isn't compared
+           with anything. */
+        if (typeClass(key) == -1) return true;
+
+        if (key->type() == tString) key->flattenString();
+
+        return keys.insert(key).second;
+    }
+};
 
 
 static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -563,7 +698,10 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
         });
     state.forceList(*startSet->value, pos);
 
-    ValueList workSet;
+    /* The elements still to be processed are those from index
+       'next'. */
+    ValueVector workSet;
+    size_t next = 0;
     for (unsigned int n = 0; n < startSet->value->listSize(); ++n)
         workSet.push_back(startSet->value->listElems()[n]);
 
@@ -577,21 +715,28 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
         });
     state.forceValue(*op->value, pos);
 
+    auto sKey = state.symbols.create("key");
+
     /* Construct the closure by applying the operator to element of
        `workSet', adding the result to `workSet', continuing until
        no new elements are found. */
-    ValueList res;
+    ValueVector res;
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
-    set<Value *, CompareValues> doneKeys;
-    while (!workSet.empty()) {
-        Value * e = *(workSet.begin());
-        workSet.pop_front();
+    ClosureKeys doneKeys;
+    while (next < workSet.size()) {
+        Value * e = workSet[next++];
+
+        /* Drop the processed elements once they make up most of the
+           work set. */
+        if (next >= 4096 && next * 2 >= workSet.size()) {
+            workSet.erase(workSet.begin(), workSet.begin() + next);
+            next = 0;
+        }
 
         state.forceAttrs(*e, pos);
 
-        Bindings::iterator key =
-            e->attrs->find(state.symbols.create("key"));
+        Bindings::iterator key = e->attrs->find(sKey);
         if (key == e->attrs->end())
             throw EvalError({
                 .hint = hintfmt("attribute 'key' required"),
@@ -599,7 +744,7 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
             });
         state.forceValue(*key->value, pos);
 
-        if (!doneKeys.insert(key->value).second) continue;
+        if (!doneKeys.insert(key->value)) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -777,8 +922,10 @@ static RegisterPrimOp primop_deepSeq({
 static void prim_trace(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    if (args[0]->type == tString)
+    if (args[0]->type() == tString) {
+        args[0]->flattenString();
         printError("trace: %1%", args[0]->string.s);
+    }
     else
         printError("trace: %1%", *args[0]);
     state.forceValue(*args[1], pos);
@@ -814,14 +961,14 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     state.forceAttrs(*args[0], pos);
 
     /* Figure out the name first (for stack backtraces). */
-    Bindings::iterator attr = args[0]->attrs->find(state.sName);
-    if (attr == args[0]->attrs->end())
+    auto attr = args[0]->attrs->get(state.sName);
+    if (!attr)
         throw EvalError({
             .hint = hintfmt("required attribute 'name' missing"),
             .errPos = pos
         });
     string drvName;
-    Pos & posDrvName(*attr->pos);
+    Pos & posDrvName(attr->pos);
     try {
         drvName = state.forceStringNoCtx(*attr->value, pos);
     } catch (Error & e) {
@@ -832,14 +979,14 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     /* Check whether attributes should be passed as a JSON file. */
     std::ostringstream jsonBuf;
     std::unique_ptr<JSONObject> jsonObject;
-    attr = args[0]->attrs->find(state.sStructuredAttrs);
-    if (attr != args[0]->attrs->end() && state.forceBool(*attr->value, pos))
+    attr = args[0]->attrs->get(state.sStructuredAttrs);
+    if (attr && state.forceBool(*attr->value, pos))
         jsonObject = std::make_unique<JSONObject>(jsonBuf);
 
     /* Check whether null attributes should be ignored. */
     bool ignoreNulls = false;
-    attr = args[0]->attrs->find(state.sIgnoreNulls);
-    if (attr != args[0]->attrs->end())
+    attr = args[0]->attrs->get(state.sIgnoreNulls);
+    if (attr)
         ignoreNulls = state.forceBool(*attr->value, pos);
 
     /* Build the derivation expression by processing the attributes. */
@@ -904,7 +1051,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
 
             if (ignoreNulls) {
                 state.forceValue(*i->value, pos);
-                if (i->value->type == tNull) continue;
+                if (i->value->type() == tNull) continue;
             }
 
             if (i->name == state.sContentAddressed) {
@@ -993,6 +1140,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
            runs. */
         if (path.at(0) == '=') {
             /* !!! This doesn't work if readOnlyMode is set. */
+            state.flushDerivations();
             StorePathSet refs;
             state.store->computeFSClosure(state.store->parseStorePath(std::string_view(path).substr(1)), refs);
             for (auto & j : refs) {
@@ -1108,20 +1256,22 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     }
 
     /* Write the resulting term into the Nix store directory. */
-    auto drvPath = writeDerivation(*state.store, drv, state.repair);
+    auto drvPath = state.writeDerivation(drv);
     auto drvPathS = state.store->printStorePath(drvPath);
 
     printMsg(lvlChatty, "instantiated '%1%' -> '%2%'", drvName, drvPathS);
 
     /* Optimisation, but required in read-only mode! because in that
        case we don't actually write store derivations, so we can't
-       read them later.
+       read them later. Likewise, a queued derivation can't be read
+       until it has been written.
 
        However, we don't bother doing this for floating CA derivations because
        their "hash modulo" is indeterminate until built. */
-    if (drv.type() != DerivationType::CAFloating)
-        drvHashes.insert_or_assign(drvPath,
-            hashDerivationModulo(*state.store, Derivation(drv), false));
+    if (drv.type() != DerivationType::CAFloating) {
+        auto h = hashDerivationModulo(*state.store, Derivation(drv), false);
+        cacheDrvHashModulo(*state.store, drvPath, h);
+    }
 
     state.mkAttrs(v, 1 + drv.outputs.size());
     mkString(*state.allocAttr(v, state.sDrvPath), drvPathS, {"=" + drvPathS});
@@ -1208,8 +1358,9 @@ static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, V
             .errPos = pos
         });
     auto path2 = state.store->toStorePath(path).first;
-    if (!settings.readOnlyMode)
+    if (!settings.readOnlyMode) {
         state.store->ensurePath(path2);
+    }
     context.insert(state.store->printStorePath(path2));
     mkString(v, path, context);
 }
@@ -1294,7 +1445,7 @@ static void prim_dirOf(EvalState & state, const Pos & pos, Value * * args, Value
 {
     PathSet context;
     Path dir = dirOf(state.coerceToString(pos, *args[0], context, false, false));
-    if (args[0]->type == tPath) mkPath(v, dir.c_str()); else mkString(v, dir, context);
+    if (args[0]->type() == tPath) mkPath(v, dir.c_str()); else mkString(v, dir, context);
 }
 
 static RegisterPrimOp primop_dirOf({
@@ -1321,7 +1472,7 @@ static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Va
             .errPos = pos
         });
     }
-    string s = readFile(state.checkSourcePath(state.toRealPath(path, context)));
+    string s = readFile(state.checkSourcePath(state.toRealPath(path, context), true));
     if (s.find((char) 0) != string::npos)
         throw Error("the contents of the file '%1%' cannot be represented as a Nix string", path);
     mkString(v, s.c_str());
@@ -1349,12 +1500,12 @@ static void prim_findFile(EvalState & state, const Pos & pos, Value * * args, Va
         state.forceAttrs(v2, pos);
 
         string prefix;
-        Bindings::iterator i = v2.attrs->find(state.symbols.create("prefix"));
-        if (i != v2.attrs->end())
+        auto i = v2.attrs->get(state.symbols.create("prefix"));
+        if (i)
             prefix = state.forceStringNoCtx(*i->value, pos);
 
-        i = v2.attrs->find(state.symbols.create("path"));
-        if (i == v2.attrs->end())
+        i = v2.attrs->get(state.symbols.create("path"));
+        if (!i)
             throw EvalError({
                 .hint = hintfmt("attribute 'path' missing"),
                 .errPos = pos
@@ -1400,7 +1551,7 @@ static void prim_hashFile(EvalState & state, const Pos & pos, Value * * args, Va
     PathSet context; // discarded
     Path p = state.coerceToPath(pos, *args[1], context);
 
-    mkString(v, hashFile(*ht, state.checkSourcePath(p)).to_string(Base16, false), context);
+    mkString(v, hashFile(*ht, state.checkSourcePath(p, true)).to_string(Base16, false), context);
 }
 
 static RegisterPrimOp primop_hashFile({
@@ -1583,10 +1734,10 @@ static RegisterPrimOp primop_toXML({
    represented (e.g., functions). */
 static void prim_toJSON(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
-    std::ostringstream out;
+    StringSink sink;
     PathSet context;
-    printValueAsJSON(state, true, *args[0], out, context);
-    mkString(v, out.str(), context);
+    printValueAsJSON(state, true, *args[0], sink, context);
+    mkString(v, *sink.s, context);
 }
 
 static RegisterPrimOp primop_toJSON({
@@ -1633,6 +1784,10 @@ static void prim_toFile(EvalState & state, const Pos & pos, Value * * args, Valu
     string name = state.forceStringNoCtx(*args[0], pos);
     string contents = state.forceString(*args[1], context, pos);
 
+    /* The references must be valid, so write any derivations that
+       they may refer to. */
+    if (!context.empty()) state.flushDerivations();
+
     StorePathSet refs;
 
     for (auto path : context) {
@@ -1742,7 +1897,7 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
     const auto path = evalSettings.pureEval && expectedHash ?
         path_ :
         state.checkSourcePath(path_);
-    PathFilter filter = filterFun ? ([&](const Path & path) {
+    PathFilter filter = [&](const Path & path) {
         auto st = lstat(path);
 
         /* Call the filter function.  The first argument is the path,
@@ -1764,7 +1919,7 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
         state.callFunction(fun2, arg2, res, noPos);
 
         return state.forceBool(res, pos);
-    }) : defaultPathFilter;
+    };
 
     std::optional<StorePath> expectedStorePath;
     if (expectedHash)
@@ -1777,9 +1932,8 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
         });
     Path dstPath;
     if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
-        dstPath = state.store->printStorePath(settings.readOnlyMode
-            ? state.store->computeStorePathForPath(name, path, method, htSHA256, filter).first
-            : state.store->addToStore(name, path, method, htSHA256, filter, state.repair));
+        dstPath = state.store->printStorePath(
+            state.addSourceToStore(name, path, method, filterFun ? &filter : nullptr));
         if (expectedHash && expectedStorePath != state.store->parseStorePath(dstPath))
             throw Error("store path mismatch in (possibly filtered) path added from '%s'", path);
     } else
@@ -1800,7 +1954,7 @@ static void prim_filterSource(EvalState & state, const Pos & pos, Value * * args
         });
 
     state.forceValue(*args[0], pos);
-    if (args[0]->type != tLambda)
+    if (args[0]->type() != tLambda)
         throw TypeError({
             .hint = hintfmt(
                 "first argument in call to 'filterSource' is not a function but %1%",
@@ -1866,25 +2020,25 @@ static void prim_path(EvalState & state, const Pos & pos, Value * * args, Value
         const string & n(attr.name);
         if (n == "path") {
             PathSet context;
-            path = state.coerceToPath(*attr.pos, *attr.value, context);
+            path = state.coerceToPath(attr.pos, *attr.value, context);
             if (!context.empty())
                 throw EvalError({
                     .hint = hintfmt("string '%1%' cannot refer to other paths", path),
-                    .errPos = *attr.pos
+                    .errPos = attr.pos
                 });
         } else if (attr.name == state.sName)
-            name = state.forceStringNoCtx(*attr.value, *attr.pos);
+            name = state.forceStringNoCtx(*attr.value, attr.pos);
         else if (n == "filter") {
             state.forceValue(*attr.value, pos);
             filterFun = attr.value;
         } else if (n == "recursive")
-            method = FileIngestionMethod { state.forceBool(*attr.value, *attr.pos) };
+            method = FileIngestionMethod { state.forceBool(*attr.value, attr.pos) };
         else if (n == "sha256")
-            expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, *attr.pos), htSHA256);
+            expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, attr.pos), htSHA256);
         else
             throw EvalError({
                 .hint = hintfmt("unsupported argument '%1%' to 'addPath'", attr.name),
-                .errPos = *attr.pos
+                .errPos = attr.pos
             });
     }
     if (path.empty())
@@ -1943,13 +2097,13 @@ static void prim_ipfsPath(EvalState & state, const Pos & pos, Value * * args, Va
     for (auto & attr : *args[0]->attrs) {
         const string & n(attr.name);
         if (attr.name == state.sName)
-            name = state.forceStringNoCtx(*attr.value, *attr.pos);
+            name = state.forceStringNoCtx(*attr.value, attr.pos);
         else if (n == "cid")
-            cid = IPFSHash::from_string(state.forceStringNoCtx(*attr.value, *attr.pos));
+            cid = IPFSHash::from_string(state.forceStringNoCtx(*attr.value, attr.pos));
         else
             throw EvalError({
                 .hint = hintfmt("unsupported argument '%1%' to 'ipfsPath'", attr.name),
-                .errPos = *attr.pos
+                .errPos = attr.pos
             });
     }
     if (name.empty())
@@ -2062,14 +2216,14 @@ void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
     // !!! Should we create a symbol here or just do a lookup?
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    auto i = args[1]->attrs->get(state.symbols.create(attr));
+    if (!i)
         throw EvalError({
             .hint = hintfmt("attribute '%1%' missing", attr),
             .errPos = pos
         });
     // !!! add to stack trace?
-    if (state.countCalls && i->pos) state.attrSelects[*i->pos]++;
+    if (state.countCalls) state.attrSelects[i->pos]++;
     state.forceValue(*i->value, pos);
     v = *i->value;
 }
@@ -2091,8 +2245,8 @@ static void prim_unsafeGetAttrPos(EvalState & state, const Pos & pos, Value * *
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    auto i = args[1]->attrs->get(state.symbols.create(attr));
+    if (!i)
         mkNull(v);
     else
         state.mkPos(v, i->pos);
@@ -2109,7 +2263,7 @@ static void prim_hasAttr(EvalState & state, const Pos & pos, Value * * args, Val
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    mkBool(v, args[1]->attrs->find(state.symbols.create(attr)) != args[1]->attrs->end());
+    mkBool(v, args[1]->attrs->get(state.symbols.create(attr)));
 }
 
 static RegisterPrimOp primop_hasAttr({
@@ -2127,7 +2281,7 @@ static RegisterPrimOp primop_hasAttr({
 static void prim_isAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tAttrs);
+    mkBool(v, args[0]->type() == tAttrs);
 }
 
 static RegisterPrimOp primop_isAttrs({
@@ -2194,8 +2348,8 @@ static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args,
         Value & v2(*args[0]->listElems()[i]);
         state.forceAttrs(v2, pos);
 
-        Bindings::iterator j = v2.attrs->find(state.sName);
-        if (j == v2.attrs->end())
+        auto j = v2.attrs->get(state.sName);
+        if (!j)
             throw TypeError({
                 .hint = hintfmt("'name' attribute missing in a call to 'listToAttrs'"),
                 .errPos = pos
@@ -2204,8 +2358,8 @@ static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args,
 
         Symbol sym = state.symbols.create(name);
         if (seen.insert(sym).second) {
-            Bindings::iterator j2 = v2.attrs->find(state.symbols.create(state.sValue));
-            if (j2 == v2.attrs->end())
+            auto j2 = v2.attrs->get(state.symbols.create(state.sValue));
+            if (!j2)
                 throw TypeError({
                     .hint = hintfmt("'value' attribute missing in a call to 'listToAttrs'"),
                     .errPos = pos
@@ -2250,8 +2404,8 @@ static void prim_intersectAttrs(EvalState & state, const Pos & pos, Value * * ar
     state.mkAttrs(v, std::min(args[0]->attrs->size(), args[1]->attrs->size()));
 
     for (auto & i : *args[0]->attrs) {
-        Bindings::iterator j = args[1]->attrs->find(i.name);
-        if (j != args[1]->attrs->end())
+        auto j = args[1]->attrs->get(i.name);
+        if (j)
             v.attrs->push_back(*j);
     }
 }
@@ -2277,8 +2431,8 @@ static void prim_catAttrs(EvalState & state, const Pos & pos, Value * * args, Va
     for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
         Value & v2(*args[1]->listElems()[n]);
         state.forceAttrs(v2, pos);
-        Bindings::iterator i = v2.attrs->find(attrName);
-        if (i != v2.attrs->end())
+        auto i = v2.attrs->get(attrName);
+        if (i)
             res[found++] = i->value;
     }
 
@@ -2307,11 +2461,11 @@ static RegisterPrimOp primop_catAttrs({
 static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    if (args[0]->type == tPrimOpApp || args[0]->type == tPrimOp) {
+    if (args[0]->type() == tPrimOpApp || args[0]->type() == tPrimOp) {
         state.mkAttrs(v, 0);
         return;
     }
-    if (args[0]->type != tLambda)
+    if (args[0]->type() != tLambda)
         throw TypeError({
             .hint = hintfmt("'functionArgs' requires a function"),
             .errPos = pos
@@ -2326,7 +2480,7 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
     for (auto & i : args[0]->lambda.fun->formals->formals) {
         // !!! should optimise booleans (allocate only once)
         Value * value = state.allocValue();
-        v.attrs->push_back(Attr(i.name, value, &i.pos));
+        v.attrs->push_back(Attr(i.name, value, i.pos));
         mkBool(*value, i.def);
     }
     v.attrs->sort();
@@ -2742,7 +2896,7 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
     auto comparator = [&](Value * a, Value * b) {
         /* Optimization: if the comparator is lessThan, bypass
            callFunction. */
-        if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan)
+        if (args[0]->type() == tPrimOp && args[0]->primOp->fun == prim_lessThan)
             return CompareValues()(a, b);
 
         Value vTmp1, vTmp2;
@@ -2884,7 +3038,7 @@ static void prim_add(EvalState & state, const Pos & pos, Value * * args, Value &
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
-    if (args[0]->type == tFloat || args[1]->type == tFloat)
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat)
         mkFloat(v, state.forceFloat(*args[0], pos) + state.forceFloat(*args[1], pos));
     else
         mkInt(v, state.forceInt(*args[0], pos) + state.forceInt(*args[1], pos));
@@ -2903,7 +3057,7 @@ static void prim_sub(EvalState & state, const Pos & pos, Value * * args, Value &
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
-    if (args[0]->type == tFloat || args[1]->type == tFloat)
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat)
         mkFloat(v, state.forceFloat(*args[0], pos) - state.forceFloat(*args[1], pos));
     else
         mkInt(v, state.forceInt(*args[0], pos) - state.forceInt(*args[1], pos));
@@ -2922,7 +3076,7 @@ static void prim_mul(EvalState & state, const Pos & pos, Value * * args, Value &
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
-    if (args[0]->type == tFloat || args[1]->type == tFloat)
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat)
         mkFloat(v, state.forceFloat(*args[0], pos) * state.forceFloat(*args[1], pos));
     else
         mkInt(v, state.forceInt(*args[0], pos) * state.forceInt(*args[1], pos));
@@ -2949,7 +3103,7 @@ static void prim_div(EvalState & state, const Pos & pos, Value * * args, Value &
             .errPos = pos
         });
 
-    if (args[0]->type == tFloat || args[1]->type == tFloat) {
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat) {
         mkFloat(v, state.forceFloat(*args[0], pos) / state.forceFloat(*args[1], pos));
     } else {
         NixInt i1 = state.forceInt(*args[0], pos);
@@ -3162,7 +3316,19 @@ static RegisterPrimOp primop_hashString({
 
 struct RegexCache
 {
-    std::unordered_map<std::string, std::regex> cache;
+    /* Regexes that are evicted remain valid as long as they are in
+       use. */
+    Sync<LRUCache<std::string, std::shared_ptr<const Regex>>> cache{
+        LRUCache<std::string, std::shared_ptr<const Regex>>(1024)};
+
+    std::shared_ptr<const Regex> get(const std::string & re)
+    {
+        if (auto regex = cache.lock()->get(re))
+            return *regex;
+        auto regex = std::make_shared<const Regex>(re, evalSettings.useRegexAutomaton);
+        cache.lock()->upsert(re, regex);
+        return regex;
+    }
 };
 
 std::shared_ptr<RegexCache> makeRegexCache()
@@ -3176,27 +3342,26 @@ void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = state.regexCache->cache.find(re);
-        if (regex == state.regexCache->cache.end())
-            regex = state.regexCache->cache.emplace(re, std::regex(re, std::regex::extended)).first;
+        auto regex = state.regexCache->get(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        std::smatch match;
-        if (!std::regex_match(str, match, regex->second)) {
+        auto match = regex->match(str);
+        if (!match) {
             mkNull(v);
             return;
         }
 
         // the first match is the whole string
-        const size_t len = match.size() - 1;
+        const size_t len = match->size() - 1;
         state.mkList(v, len);
         for (size_t i = 0; i < len; ++i) {
-            if (!match[i+1].matched)
+            auto & group = (*match)[i + 1];
+            if (!group)
                 mkNull(*(v.listElems()[i] = state.allocValue()));
             else
-                mkString(*(v.listElems()[i] = state.allocValue()), match[i + 1].str().c_str());
+                mkString(*(v.listElems()[i] = state.allocValue()), *group);
         }
 
     } catch (std::regex_error &e) {
@@ -3253,22 +3418,21 @@ static RegisterPrimOp primop_match({
 
 /* Split a string with a regular expression, and return a list of the
    non-matching parts interleaved by the lists of the matching groups. */
-static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto regex = state.regexCache->get(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        auto begin = std::sregex_iterator(str.begin(), str.end(), regex);
-        auto end = std::sregex_iterator();
+        auto matches = regex->search(str);
 
         // Any matches results are surrounded by non-matching results.
-        const size_t len = std::distance(begin, end);
+        const size_t len = matches.size();
         state.mkList(v, 2 * len + 1);
         size_t idx = 0;
         Value * elem;
@@ -3278,13 +3442,13 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
             return;
         }
 
-        for (std::sregex_iterator i = begin; i != end; ++i) {
-            assert(idx <= 2 * len + 1 - 3);
-            std::smatch match = *i;
+        size_t prevEnd = 0;
+        for (auto & match : matches) {
+            size_t start = match[0]->data() - str.data();
 
             // Add a string for non-matched characters.
             elem = v.listElems()[idx++] = state.allocValue();
-            mkString(*elem, match.prefix().str().c_str());
+            mkString(*elem, std::string_view(str).substr(prevEnd, start - prevEnd));
 
             // Add a list for matched substrings.
             const size_t slen = match.size() - 1;
@@ -3293,18 +3457,20 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
             // Start at 1, beacause the first match is the whole string.
             state.mkList(*elem, slen);
             for (size_t si = 0; si < slen; ++si) {
-                if (!match[si + 1].matched)
+                auto & group = match[si + 1];
+                if (!group)
                     mkNull(*(elem->listElems()[si] = state.allocValue()));
                 else
-                    mkString(*(elem->listElems()[si] = state.allocValue()), match[si + 1].str().c_str());
+                    mkString(*(elem->listElems()[si] = state.allocValue()), *group);
             }
 
-            // Add a string for non-matched suffix characters.
-            if (idx == 2 * len) {
-                elem = v.listElems()[idx++] = state.allocValue();
-                mkString(*elem, match.suffix().str().c_str());
-            }
+            prevEnd = start + match[0]->size();
         }
+
+        // Add a string for non-matched suffix characters.
+        elem = v.listElems()[idx++] = state.allocValue();
+        mkString(*elem, std::string_view(str).substr(prevEnd));
+
         assert(idx == 2 * len + 1);
 
     } catch (std::regex_error &e) {
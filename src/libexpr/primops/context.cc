@@ -144,30 +144,36 @@ static void prim_appendContext(EvalState & state, const Pos & pos, Value * * arg
 
     auto sPath = state.symbols.create("path");
     auto sAllOutputs = state.symbols.create("allOutputs");
+
+    /* The keys may refer to derivations that haven't been written
+       yet. */
+    if (!settings.readOnlyMode && args[1]->attrs->size())
+        state.flushDerivations();
+
     for (auto & i : *args[1]->attrs) {
         if (!state.store->isStorePath(i.name))
             throw EvalError({
                 .hint = hintfmt("Context key '%s' is not a store path", i.name),
-                .errPos = *i.pos
+                .errPos = i.pos
             });
         if (!settings.readOnlyMode) {
             auto path = state.store->parseStorePath(i.name);
             state.store->ensurePath(path);
         }
-        state.forceAttrs(*i.value, *i.pos);
+        state.forceAttrs(*i.value, i.pos);
         auto iter = i.value->attrs->find(sPath);
         if (iter != i.value->attrs->end()) {
-            if (state.forceBool(*iter->value, *iter->pos))
+            if (state.forceBool(*iter->value, iter->pos))
                 context.insert(i.name);
         }
 
         iter = i.value->attrs->find(sAllOutputs);
         if (iter != i.value->attrs->end()) {
-            if (state.forceBool(*iter->value, *iter->pos)) {
+            if (state.forceBool(*iter->value, iter->pos)) {
                 if (!isDerivation(i.name)) {
                     throw EvalError({
                         .hint = hintfmt("Tried to add all-outputs context of %s, which is not a derivation, to a string", i.name),
-                        .errPos = *i.pos
+                        .errPos = i.pos
                     });
                 }
                 context.insert("=" + string(i.name));
@@ -176,15 +182,15 @@ static void prim_appendContext(EvalState & state, const Pos & pos, Value * * arg
 
         iter = i.value->attrs->find(state.sOutputs);
         if (iter != i.value->attrs->end()) {
-            state.forceList(*iter->value, *iter->pos);
+            state.forceList(*iter->value, iter->pos);
             if (iter->value->listSize() && !isDerivation(i.name)) {
                 throw EvalError({
                     .hint = hintfmt("Tried to add derivation output context of %s, which is not a derivation, to a string", i.name),
-                    .errPos = *i.pos
+                    .errPos = i.pos
                 });
             }
             for (unsigned int n = 0; n < iter->value->listSize(); ++n) {
-                auto name = state.forceStringNoCtx(*iter->value->listElems()[n], *iter->pos);
+                auto name = state.forceStringNoCtx(*iter->value->listElems()[n], iter->pos);
                 context.insert("!" + name + "!" + string(i.name));
             }
         }
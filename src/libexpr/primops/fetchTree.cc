@@ -95,25 +95,25 @@ static void fetchTree(
 
     state.forceValue(*args[0]);
 
-    if (args[0]->type == tAttrs) {
+    if (args[0]->type() == tAttrs) {
         state.forceAttrs(*args[0], pos);
 
         fetchers::Attrs attrs;
 
         for (auto & attr : *args[0]->attrs) {
             state.forceValue(*attr.value);
-            if (attr.value->type == tPath || attr.value->type == tString)
+            if (attr.value->type() == tPath || attr.value->type() == tString)
                 addURI(
                     state,
                     attrs,
                     attr.name,
-                    state.coerceToString(*attr.pos, *attr.value, context, false, false)
+                    state.coerceToString(attr.pos, *attr.value, context, false, false)
                 );
-            else if (attr.value->type == tString)
+            else if (attr.value->type() == tString)
                 addURI(state, attrs, attr.name, attr.value->string.s);
-            else if (attr.value->type == tBool)
+            else if (attr.value->type() == tBool)
                 attrs.emplace(attr.name, fetchers::Explicit<bool>{attr.value->boolean});
-            else if (attr.value->type == tInt)
+            else if (attr.value->type() == tInt)
                 attrs.emplace(attr.name, attr.value->integer);
             else
                 throw TypeError("fetchTree argument '%s' is %s while a string, Boolean or integer is expected",
@@ -151,8 +151,7 @@ static void fetchTree(
 
     auto [tree, input2] = input.fetch(state.store);
 
-    if (state.allowedPaths)
-        state.allowedPaths->insert(tree.actualPath);
+    state.allowPath(tree.actualPath);
 
     emitTreeAttrs(state, tree, input2, v, emptyRevFallback);
 }
@@ -173,22 +172,22 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
 
     state.forceValue(*args[0]);
 
-    if (args[0]->type == tAttrs) {
+    if (args[0]->type() == tAttrs) {
 
         state.forceAttrs(*args[0], pos);
 
         for (auto & attr : *args[0]->attrs) {
             string n(attr.name);
             if (n == "url")
-                url = state.forceStringNoCtx(*attr.value, *attr.pos);
+                url = state.forceStringNoCtx(*attr.value, attr.pos);
             else if (n == "sha256")
-                expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, *attr.pos), htSHA256);
+                expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, attr.pos), htSHA256);
             else if (n == "name")
-                name = state.forceStringNoCtx(*attr.value, *attr.pos);
+                name = state.forceStringNoCtx(*attr.value, attr.pos);
             else
                 throw EvalError({
                     .hint = hintfmt("unsupported argument '%s' to '%s'", attr.name, who),
-                    .errPos = *attr.pos
+                    .errPos = attr.pos
                 });
             }
 
@@ -216,8 +215,7 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
             unpack ? FileIngestionMethod::Recursive : FileIngestionMethod::Flat, *expectedHash, name);
         if (substitutableStorePath) {
             auto substitutablePath = state.store->toRealPath(*substitutableStorePath);
-            if (state.allowedPaths)
-                state.allowedPaths->insert(substitutablePath);
+            state.allowPath(substitutablePath);
 
             mkString(v, substitutablePath, PathSet({substitutablePath}));
             return;
@@ -243,8 +241,7 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
                 *url, expectedHash->to_string(Base32, true), hash.to_string(Base32, true));
     }
 
-    if (state.allowedPaths)
-        state.allowedPaths->insert(path);
+    state.allowPath(path);
 
     mkString(v, path, PathSet({path}));
 }
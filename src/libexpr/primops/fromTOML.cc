@@ -3,14 +3,684 @@
 
 #include "../../cpptoml/cpptoml.h"
 
+#include <deque>
+#include <unordered_map>
+
 namespace nix {
 
+/* A parser that reads TOML directly into Nix values, without building
+   a cpptoml tree first. It follows the structure of cpptoml's parser
+   (which, among other things, reads the input line by line) so that
+   it produces the same values, but it only handles the common subset
+   of TOML: it gives up on multi-line strings, dates and times,
+   non-decimal integers, infinity and NaN, and on anything that
+   cpptoml would reject, in which case the caller falls back to
+   cpptoml. Strings without escapes are copied straight from the
+   input, and tables are only turned into attribute sets at the end,
+   since TOML allows them to be extended later in the document. */
+class TOMLParser
+{
+    struct Fallback { };
+
+    struct Table;
+    struct TableArray;
+
+    struct Node
+    {
+        enum Kind { Int, Float, Bool, String, Array, Table, TableArray } kind;
+        Value * value = nullptr;
+        TOMLParser::Table * table = nullptr;
+        TOMLParser::TableArray * tables = nullptr;
+    };
+
+    struct Table
+    {
+#if HAVE_BOEHMGC
+        std::vector<std::pair<Symbol, Node>, traceable_allocator<std::pair<Symbol, Node>>> entries;
+#else
+        std::vector<std::pair<Symbol, Node>> entries;
+#endif
+
+        /* Index of 'entries', only used for large tables. */
+        std::unordered_map<Symbol, size_t> index;
+
+        static constexpr size_t indexThreshold = 16;
+
+        Node * get(const Symbol & name)
+        {
+            if (entries.size() <= indexThreshold) {
+                for (auto & i : entries)
+                    if (i.first == name) return &i.second;
+                return nullptr;
+            }
+            auto i = index.find(name);
+            return i == index.end() ? nullptr : &entries[i->second].second;
+        }
+
+        void insert(const Symbol & name, const Node & node)
+        {
+            entries.emplace_back(name, node);
+            if (entries.size() > indexThreshold) {
+                if (index.empty())
+                    for (size_t n = 0; n < entries.size(); ++n)
+                        index.emplace(entries[n].first, n);
+                else
+                    index.emplace(name, entries.size() - 1);
+            }
+        }
+    };
+
+    struct TableArray
+    {
+        std::vector<Table *> tables;
+        bool isInline;
+    };
+
+    EvalState & state;
+    std::string_view input;
+    size_t nextLine_ = 0;
+
+    /* The current position and the end of the current line. */
+    const char * it = nullptr, * end = nullptr;
+
+    std::deque<Table> tables;
+    std::deque<TableArray> tableArrays;
+
+    /* The last string that contained escapes. */
+    std::string buf;
+
+    [[noreturn]] static void fail() { throw Fallback(); }
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    static bool isHex(char c)
+    {
+        return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+
+    Table * newTable() { return &tables.emplace_back(); }
+
+    /* Lines end in "\n" or "\r\n". */
+    bool nextLine()
+    {
+        if (nextLine_ == input.size()) return false;
+        auto start = input.data() + nextLine_;
+        auto nl = (const char *) memchr(start, '\n', input.size() - nextLine_);
+        it = start;
+        if (nl) {
+            end = nl > start && nl[-1] == '\r' ? nl - 1 : nl;
+            nextLine_ = nl + 1 - input.data();
+        } else {
+            end = input.data() + input.size();
+            nextLine_ = input.size();
+        }
+        return true;
+    }
+
+    void consumeWhitespace()
+    {
+        while (it != end && (*it == ' ' || *it == '\t')) ++it;
+    }
+
+    void skipWhitespaceAndComments()
+    {
+        consumeWhitespace();
+        while (it == end || *it == '#') {
+            if (!nextLine()) fail();
+            consumeWhitespace();
+        }
+    }
+
+    void eolOrComment()
+    {
+        if (it != end && *it != '#') fail();
+    }
+
+    uint32_t parseHex(uint32_t place)
+    {
+        uint32_t value = 0;
+        for (; place > 0; place /= 16) {
+            if (it == end || !isHex(*it)) fail();
+            char c = *it++;
+            value += place * (isDigit(c) ? c - '0' : 10 + c - (c >= 'a' ? 'a' : 'A'));
+        }
+        return value;
+    }
+
+    void parseUnicode()
+    {
+        bool large = *it++ == 'U';
+        auto cp = parseHex(large ? 0x10000000 : 0x1000);
+        if ((cp > 0xd7ff && cp < 0xe000) || cp > 0x10ffff) fail();
+        if (cp <= 0x7f)
+            buf.push_back(cp);
+        else if (cp <= 0x7ff) {
+            buf.push_back(0xc0 | ((cp >> 6) & 0x1f));
+            buf.push_back(0x80 | (cp & 0x3f));
+        } else if (cp <= 0xffff) {
+            /* Sic: cpptoml masks the second byte with 0x1f. */
+            buf.push_back(0xe0 | ((cp >> 12) & 0x0f));
+            buf.push_back(0x80 | ((cp >> 6) & 0x1f));
+            buf.push_back(0x80 | (cp & 0x3f));
+        } else {
+            buf.push_back(0xf0 | ((cp >> 18) & 0x07));
+            buf.push_back(0x80 | ((cp >> 12) & 0x3f));
+            buf.push_back(0x80 | ((cp >> 6) & 0x3f));
+            buf.push_back(0x80 | (cp & 0x3f));
+        }
+    }
+
+    void parseEscape()
+    {
+        if (++it == end) fail();
+        switch (*it) {
+            case 'b': buf.push_back('\b'); break;
+            case 't': buf.push_back('\t'); break;
+            case 'n': buf.push_back('\n'); break;
+            case 'f': buf.push_back('\f'); break;
+            case 'r': buf.push_back('\r'); break;
+            case '"': buf.push_back('"'); break;
+            case '\\': buf.push_back('\\'); break;
+            case 'u': case 'U': parseUnicode(); return;
+            default: fail();
+        }
+        ++it;
+    }
+
+    /* Parse a single-line string starting at the delimiter at 'it'.
+       The result points into the input or to 'buf'. */
+    std::string_view parseStringLiteral(char delim)
+    {
+        auto start = ++it;
+        bool escaped = false;
+        while (it != end) {
+            if (delim == '"' && *it == '\\') {
+                if (!escaped) {
+                    buf.clear();
+                    escaped = true;
+                }
+                buf.append(start, it);
+                parseEscape();
+                start = it;
+            }
+            else if (*it == delim) {
+                std::string_view s;
+                if (escaped) {
+                    buf.append(start, it);
+                    s = buf;
+                } else
+                    s = std::string_view(start, it - start);
+                ++it;
+                consumeWhitespace();
+                return s;
+            }
+            else
+                ++it;
+        }
+        fail();
+    }
+
+    Symbol parseSimpleKey()
+    {
+        consumeWhitespace();
+        if (it == end) fail();
+
+        if (*it == '"' || *it == '\'')
+            return state.symbols.create(parseStringLiteral(*it));
+
+        auto keyEnd = it;
+        while (keyEnd != end && *keyEnd != '.' && *keyEnd != '=' && *keyEnd != ']') ++keyEnd;
+        if (keyEnd == it) fail();
+        auto last = keyEnd;
+        while (last != it + 1 && (last[-1] == ' ' || last[-1] == '\t')) --last;
+        for (auto i = it; i != last; ++i)
+            if (*i == '#' || *i == ' ' || *i == '\t' || *i == '[' || *i == ']') fail();
+        auto key = state.symbols.create(std::string_view(it, last - it));
+        it = keyEnd;
+        return key;
+    }
+
+    /* Parse a dotted key ending in 'keyEnd'. 'handler' is called for
+       every part but the last. */
+    template<typename Handler>
+    Symbol parseKey(char keyEnd, Handler && handler)
+    {
+        while (it != end && *it != keyEnd) {
+            auto part = parseSimpleKey();
+            consumeWhitespace();
+            if (it == end || *it == keyEnd) return part;
+            if (*it != '.') fail();
+            handler(part);
+            ++it;
+        }
+        fail();
+    }
+
+    void parseTable(Table * & curr)
+    {
+        if (++it == end) fail();
+        if (*it == '[')
+            parseTableArray(curr);
+        else
+            parseSingleTable(curr);
+    }
+
+    void parseSingleTable(Table * & curr)
+    {
+        if (it == end || *it == ']') fail();
+
+        bool inserted = false;
+
+        auto handler = [&](const Symbol & part) {
+            if (part.empty()) fail();
+            if (auto node = curr->get(part)) {
+                if (node->kind == Node::Table)
+                    curr = node->table;
+                else if (node->kind == Node::TableArray)
+                    curr = node->tables->tables.back();
+                else
+                    fail();
+            } else {
+                inserted = true;
+                auto table = newTable();
+                curr->insert(part, {Node::Table, nullptr, table});
+                curr = table;
+            }
+        };
+
+        handler(parseKey(']', handler));
+
+        if (it == end || *it != ']') fail();
+
+        /* A table that already exists may only be defined if it was
+           implicitly created by a header like [a.b]. */
+        if (!inserted) {
+            if (curr->entries.empty()) fail();
+            for (auto & i : curr->entries)
+                if (i.second.kind < Node::Array) fail();
+        }
+
+        ++it;
+        consumeWhitespace();
+        eolOrComment();
+    }
+
+    void parseTableArray(Table * & curr)
+    {
+        if (++it == end || *it == ']') fail();
+
+        auto handler = [&](const Symbol & part) {
+            if (part.empty()) fail();
+            bool last = it != end && *it == ']';
+            if (auto node = curr->get(part)) {
+                if (last) {
+                    if (node->kind != Node::TableArray || node->tables->isInline) fail();
+                    curr = node->tables->tables.emplace_back(newTable());
+                }
+                else if (node->kind == Node::Table)
+                    curr = node->table;
+                else if (node->kind == Node::TableArray)
+                    curr = node->tables->tables.back();
+                else
+                    fail();
+            } else {
+                auto table = newTable();
+                if (last) {
+                    auto & array = tableArrays.emplace_back(TableArray{{table}, false});
+                    curr->insert(part, {Node::TableArray, nullptr, nullptr, &array});
+                } else
+                    curr->insert(part, {Node::Table, nullptr, table});
+                curr = table;
+            }
+        };
+
+        handler(parseKey(']', handler));
+
+        for (int n = 0; n < 2; ++n) {
+            if (it == end || *it != ']') fail();
+            ++it;
+        }
+
+        consumeWhitespace();
+        eolOrComment();
+    }
+
+    void parseKeyValue(Table * curr)
+    {
+        auto handler = [&](const Symbol & part) {
+            if (auto node = curr->get(part)) {
+                if (node->kind != Node::Table) fail();
+                curr = node->table;
+            } else {
+                auto table = newTable();
+                curr->insert(part, {Node::Table, nullptr, table});
+                curr = table;
+            }
+        };
+
+        auto key = parseKey('=', handler);
+
+        if (curr->get(key)) fail();
+        if (it == end || *it != '=') fail();
+        ++it;
+        consumeWhitespace();
+        curr->insert(key, parseValue());
+        consumeWhitespace();
+    }
+
+    /* The type of the value at 'it', as far as cpptoml's parser is
+       concerned, where the value ends at 'valEnd'. Dates and times
+       are not supported. */
+    Node::Kind valueType(const char * valEnd)
+    {
+        if (it == valEnd) fail();
+
+        if (*it == '"' || *it == '\'') return Node::String;
+
+        /* Anything that might be a time or a date. */
+        size_t n = 0;
+        while (it + n != end && (isDigit(it[n]) || it[n] == ':' || it[n] == '.')) ++n;
+        if (n >= 8 && it[2] == ':' && it[5] == ':') fail();
+        n = 0;
+        while (it + n != end && (isDigit(it[n]) || it[n] == '-' || it[n] == ' ' || it[n] == 'T'
+                || it[n] == 'Z' || it[n] == ':' || it[n] == '+' || it[n] == '.')) ++n;
+        if (n >= 10 && it[4] == '-' && it[7] == '-') fail();
+
+        if (isDigit(*it) || *it == '-' || *it == '+' || *it == 'i' || *it == 'n') {
+            if ((*it == 'i' || *it == 'n') && (valEnd - it < 3
+                    || std::string_view(it, 3) != (*it == 'i' ? "inf" : "nan")))
+                fail();
+            auto p = it;
+            if (*p == '-' || *p == '+') ++p;
+            if (p == valEnd) fail();
+            if (*p == 'i' || *p == 'n') return Node::Float;
+            while (p != valEnd && isDigit(*p)) ++p;
+            return p != valEnd && *p == '.' ? Node::Float : Node::Int;
+        }
+
+        if (*it == 't' || *it == 'f') return Node::Bool;
+        if (*it == '[') return Node::Array;
+        if (*it == '{') return Node::Table;
+
+        fail();
+    }
+
+    Node parseValue()
+    {
+        switch (valueType(end)) {
+
+            case Node::String: {
+                char delim = *it;
+                if (end - it >= 3 && it[1] == delim && it[2] == delim) fail();
+                auto v = state.allocValue();
+                mkString(*v, parseStringLiteral(delim));
+                return {Node::String, v};
+            }
+
+            case Node::Int: case Node::Float:
+                return parseNumber();
+
+            case Node::Bool: {
+                std::string_view s = *it == 't' ? "true" : "false";
+                if ((size_t) (end - it) < s.size() || std::string_view(it, s.size()) != s) fail();
+                it += s.size();
+                auto v = state.allocValue();
+                mkBool(*v, s[0] == 't');
+                return {Node::Bool, v};
+            }
+
+            case Node::Array:
+                return parseArray();
+
+            case Node::Table:
+                return {Node::Table, nullptr, parseInlineTable()};
+
+            default:
+                abort();
+        }
+    }
+
+    /* Parse a decimal integer or float the way cpptoml does. */
+    Node parseNumber()
+    {
+        auto numEnd = it;
+        while (numEnd != end && (isDigit(*numEnd) || *numEnd == '_' || *numEnd == '.' || *numEnd == 'e'
+                || *numEnd == 'E' || *numEnd == '-' || *numEnd == '+' || *numEnd == 'x'
+                || *numEnd == 'o' || *numEnd == 'b')) ++numEnd;
+
+        auto p = it;
+
+        auto eatSign = [&]() {
+            if (p != end && (*p == '-' || *p == '+')) ++p;
+        };
+
+        auto checkNoLeadingZero = [&]() {
+            if (p != end && *p == '0' && p + 1 != numEnd && p[1] != '.') fail();
+        };
+
+        auto eatDigits = [&]() {
+            auto start = p;
+            while (p != end && isDigit(*p)) {
+                ++p;
+                if (p != end && *p == '_') {
+                    ++p;
+                    if (p == end || !isDigit(*p)) fail();
+                }
+            }
+            if (p == start) fail();
+        };
+
+        /* Hexadecimal, octal and binary integers. */
+        if (p != end && *p == '0' && p + 1 != numEnd && (p[1] == 'x' || p[1] == 'o' || p[1] == 'b'))
+            fail();
+
+        eatSign();
+        checkNoLeadingZero();
+
+        /* Infinity and NaN. */
+        if (end - p >= 3 && (std::string_view(p, 3) == "inf" || std::string_view(p, 3) == "nan"))
+            fail();
+
+        eatDigits();
+
+        bool isFloat = false;
+
+        if (p != end && (*p == '.' || *p == 'e' || *p == 'E')) {
+            isFloat = true;
+            bool isExp = *p != '.';
+            if (++p == end) fail();
+
+            auto eatExp = [&]() {
+                eatSign();
+                checkNoLeadingZero();
+                eatDigits();
+            };
+
+            if (isExp)
+                eatExp();
+            else {
+                eatDigits();
+                if (p != end && (*p == 'e' || *p == 'E')) {
+                    ++p;
+                    eatExp();
+                }
+            }
+        }
+
+        std::string s;
+        s.reserve(p - it);
+        for (; it != p; ++it)
+            if (*it != '_') s.push_back(*it);
+
+        auto v = state.allocValue();
+        char * numberEnd;
+        errno = 0;
+        if (isFloat) {
+            auto f = strtod(s.c_str(), &numberEnd);
+            if (errno == ERANGE) fail();
+            mkFloat(*v, f);
+            return {Node::Float, v};
+        } else {
+            auto n = strtoll(s.c_str(), &numberEnd, 10);
+            if (errno == ERANGE) fail();
+            mkInt(*v, n);
+            return {Node::Int, v};
+        }
+    }
+
+    Node parseArray()
+    {
+        ++it;
+        skipWhitespaceAndComments();
+
+        auto v = state.allocValue();
+
+        if (*it == ']') {
+            ++it;
+            state.mkList(*v, 0);
+            return {Node::Array, v};
+        }
+
+        auto valEnd = it;
+        while (valEnd != end && *valEnd != ',' && *valEnd != ']' && *valEnd != '#') ++valEnd;
+
+        auto type = valueType(valEnd);
+
+        /* Arrays of inline tables are table arrays, and all other
+           arrays must be homogeneous. */
+        if (type == Node::Table) {
+            auto & array = tableArrays.emplace_back(TableArray{{}, true});
+            while (it != end && *it != ']') {
+                if (*it != '{') fail();
+                array.tables.push_back(parseInlineTable());
+                if (!nextElement()) break;
+            }
+            if (it == end || *it != ']') fail();
+            ++it;
+            return {Node::TableArray, nullptr, nullptr, &array};
+        }
+
+        ValueVector elems;
+
+        while (it != end && *it != ']') {
+            Node elem;
+            if (type == Node::Array) {
+                if (*it != '[') fail();
+                elem = parseArray();
+            } else {
+                elem = parseValue();
+                /* Integers are allowed in arrays of floats. */
+                if (elem.kind != type && !(type == Node::Float && elem.kind == Node::Int)) fail();
+            }
+            elems.push_back(toValue(elem));
+            if (!nextElement()) break;
+        }
+
+        if (it == end || *it != ']') fail();
+        ++it;
+
+        state.mkList(*v, elems.size());
+        for (size_t n = 0; n < elems.size(); ++n)
+            v->listElems()[n] = elems[n];
+        return {Node::Array, v};
+    }
+
+    /* Skip the comma after an element of an array, if any. */
+    bool nextElement()
+    {
+        skipWhitespaceAndComments();
+        if (*it != ',') return false;
+        ++it;
+        skipWhitespaceAndComments();
+        return true;
+    }
+
+    Table * parseInlineTable()
+    {
+        auto table = newTable();
+        do {
+            if (++it == end) fail();
+            consumeWhitespace();
+            if (it != end && *it != '}') {
+                parseKeyValue(table);
+                consumeWhitespace();
+            }
+        } while (it != end && *it == ',');
+
+        if (it == end || *it != '}') fail();
+        ++it;
+        consumeWhitespace();
+        return table;
+    }
+
+    void toValue(Table & table, Value & v)
+    {
+        state.mkAttrs(v, table.entries.size());
+        for (auto & i : table.entries)
+            v.attrs->push_back(Attr(i.first, toValue(i.second)));
+        v.attrs->sort();
+    }
+
+    Value * toValue(Node & node)
+    {
+        if (node.kind == Node::Table) {
+            auto v = state.allocValue();
+            toValue(*node.table, *v);
+            return v;
+        }
+        if (node.kind == Node::TableArray) {
+            auto v = state.allocValue();
+            auto & tables = node.tables->tables;
+            state.mkList(*v, tables.size());
+            for (size_t n = 0; n < tables.size(); ++n)
+                toValue(*tables[n], *(v->listElems()[n] = state.allocValue()));
+            return v;
+        }
+        return node.value;
+    }
+
+public:
+
+    TOMLParser(EvalState & state, std::string_view input)
+        : state(state), input(input)
+    { }
+
+    /* Parse the input into 'v'. Returns false if the input should be
+       parsed by cpptoml instead. */
+    bool parse(Value & v)
+    {
+        try {
+            auto root = newTable();
+            auto curr = root;
+            while (nextLine()) {
+                consumeWhitespace();
+                if (it == end || *it == '#') continue;
+                if (*it == '[') {
+                    curr = root;
+                    parseTable(curr);
+                } else {
+                    parseKeyValue(curr);
+                    consumeWhitespace();
+                    eolOrComment();
+                }
+            }
+            toValue(*root, v);
+            return true;
+        } catch (Fallback &) {
+            return false;
+        }
+    }
+};
+
 static void prim_fromTOML(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     using namespace cpptoml;
 
     auto toml = state.forceStringNoCtx(*args[0], pos);
 
+    if (evalSettings.useFastTOML && TOMLParser(state, toml).parse(v))
+        return;
+
     std::istringstream tomlStream(toml);
 
     std::function<void(Value &, std::shared_ptr<base>)> visit;
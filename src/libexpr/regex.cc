@@ -0,0 +1,1036 @@
+#include "regex.hh"
+
+#include <bitset>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+
+namespace nix {
+
+
+/* The automaton is a program for a Pike VM (see
+   https://swtch.com/~rsc/regexp/regexp2.html), i.e. a set of threads
+   that each have a position in the program and their own group
+   positions, which all advance by one character of the input at a
+   time.
+
+   libstdc++'s std::regex explores the paths through the regular
+   expression depth-first, trying the left side of `|' before the
+   right side and repeating a quantified expression once more before
+   leaving it, and returns the longest match, with the groups of the
+   first path that produced it. To get the same results:
+
+   - Threads are kept in the order in which the backtracking matcher
+     would explore them, and a thread that arrives at an instruction
+     that an earlier thread has already reached at the same position
+     is dropped, since it can't do better. This is only valid if no
+     path can come back to the same instruction without consuming
+     input, so regular expressions in which an unbounded quantifier
+     applies to something that can match the empty string (such as
+     `(a*)*') are left to std::regex.
+
+   - A match replaces the best match found so far if it starts
+     earlier, or starts at the same position and is longer.
+
+   - The backtracking matcher only tries to leave a quantified
+     expression if repeating it once more didn't produce a match. In
+     a search, where every match counts, leaving could have produced
+     a longer match, so before searching we compute for every
+     position of the input whether repeating can get to the end of
+     the regular expression, and don't leave where it can. In a full
+     match, anything found by leaving loses against the match found
+     by repeating, so this isn't needed there.
+
+   - `^' only matches at the start and `$' only at the end of the
+     input, and `.' matches every character except NUL. Bracket
+     expressions are turned into sets of characters by asking
+     std::regex which characters they match. */
+
+namespace {
+
+enum class Op : uint8_t { Char, Set, Any, Split, Jmp, Open, Close, Bol, Eol, Match };
+
+struct Inst
+{
+    Op op;
+    unsigned char c = 0;
+
+    /* The successors of Split (preferring 'x') and Jmp, the set of
+       Set, or the group of Open and Close. */
+    uint32_t x = 0, y = 0;
+
+    /* For a Split that leaves a quantified expression through 'y':
+       the index of its row in the table of positions where
+       repeating can match, or -1 if leaving can't produce a longer
+       match. */
+    int32_t prune = -1;
+
+    /* Whether this is such a Split. */
+    bool quantifier = false;
+};
+
+struct Node
+{
+    enum Kind { Empty, Char, Set, Any, Cat, Alt, Group, Repeat, Bol, Eol };
+
+    Kind kind;
+    unsigned char c = 0;
+    /* The set of Set, or the group of Group. */
+    size_t index = 0;
+    /* The bounds of Repeat. */
+    size_t min = 0, max = 0;
+    std::vector<Node> children;
+
+    Node(Kind kind = Empty) : kind(kind) { }
+};
+
+const size_t unbounded = SIZE_MAX;
+const size_t npos = SIZE_MAX;
+
+/* Limits beyond which std::regex is used. */
+const size_t maxRepeat = 1000;
+const size_t maxInsts = 20000;
+
+/* The maximum number of bits used by Program::backtrack(). */
+const size_t maxVisited = 32 * 1024 * 1024;
+
+/* Thrown for regular expressions that the automaton can't handle. */
+struct Unsupported { };
+
+bool nullable(const Node & node)
+{
+    switch (node.kind) {
+    case Node::Char: case Node::Set: case Node::Any:
+        return false;
+    case Node::Cat:
+        for (auto & child : node.children)
+            if (!nullable(child)) return false;
+        return true;
+    case Node::Alt:
+        for (auto & child : node.children)
+            if (nullable(child)) return true;
+        return false;
+    case Node::Group:
+        return nullable(node.children[0]);
+    case Node::Repeat:
+        return node.min == 0 || nullable(node.children[0]);
+    default:
+        return true;
+    }
+}
+
+/* A parser for the extended regular expressions accepted by
+   std::regex. Since the regular expression has already been compiled
+   by std::regex, it doesn't need to report errors; it throws
+   Unsupported for anything it doesn't understand. */
+struct Parser
+{
+    const std::string & re;
+    size_t pos = 0;
+    size_t nrGroups = 1;
+
+    std::vector<std::bitset<256>> sets;
+    std::map<std::string, size_t> setIndices;
+
+    Parser(const std::string & re) : re(re) { }
+
+    bool at(char c) { return pos < re.size() && re[pos] == c; }
+
+    Node parseDisjunction()
+    {
+        Node alt(Node::Alt);
+        alt.children.push_back(parseAlternative());
+        while (at('|')) {
+            pos++;
+            alt.children.push_back(parseAlternative());
+        }
+        if (alt.children.size() == 1) return std::move(alt.children[0]);
+        return alt;
+    }
+
+    Node parseAlternative()
+    {
+        Node cat(Node::Cat);
+
+        while (pos < re.size() && !at('|') && !at(')')) {
+            char c = re[pos];
+
+            /* Anchors can't be quantified. */
+            if (c == '^' || c == '$') {
+                pos++;
+                cat.children.push_back(Node(c == '^' ? Node::Bol : Node::Eol));
+                continue;
+            }
+
+            Node atom;
+            if (c == '(') {
+                pos++;
+                atom.kind = Node::Group;
+                atom.index = nrGroups++;
+                atom.children.push_back(parseDisjunction());
+                if (!at(')')) throw Unsupported();
+                pos++;
+            } else if (c == '[')
+                atom = parseBracket();
+            else if (c == '.') {
+                pos++;
+                atom.kind = Node::Any;
+            } else if (c == '\\') {
+                if (pos + 1 == re.size()) throw Unsupported();
+                atom.kind = Node::Char;
+                atom.c = re[pos + 1];
+                pos += 2;
+            } else if (c == '*' || c == '+' || c == '?' || c == '{' || c == 0)
+                throw Unsupported();
+            else {
+                pos++;
+                atom.kind = Node::Char;
+                atom.c = c;
+            }
+
+            while (pos < re.size()) {
+                Node rep(Node::Repeat);
+                c = re[pos];
+                if (c == '*') {
+                    pos++;
+                    rep.max = unbounded;
+                } else if (c == '+') {
+                    pos++;
+                    rep.min = 1;
+                    rep.max = unbounded;
+                } else if (c == '?') {
+                    pos++;
+                    rep.max = 1;
+                } else if (c == '{') {
+                    pos++;
+                    rep.min = rep.max = parseNumber();
+                    if (at(',')) {
+                        pos++;
+                        rep.max = at('}') ? unbounded : parseNumber();
+                    }
+                    if (!at('}') || rep.max < rep.min) throw Unsupported();
+                    pos++;
+                } else
+                    break;
+                rep.children.push_back(std::move(atom));
+                atom = std::move(rep);
+            }
+
+            cat.children.push_back(std::move(atom));
+        }
+
+        if (cat.children.size() == 1) return std::move(cat.children[0]);
+        return cat;
+    }
+
+    size_t parseNumber()
+    {
+        if (pos == re.size() || !isdigit(re[pos])) throw Unsupported();
+        size_t n = 0;
+        while (pos < re.size() && isdigit(re[pos])) {
+            n = n * 10 + (re[pos++] - '0');
+            if (n > maxRepeat) throw Unsupported();
+        }
+        return n;
+    }
+
+    Node parseBracket()
+    {
+        /* Find the end of the bracket expression the way
+           std::regex's scanner does: a `]' right after `[' or `[^'
+           is an ordinary character, and `[.', `[:' and `[=' extend
+           to the next `.]', `:]' or `=]'. Backslashes aren't
+           special. */
+        auto start = pos++;
+        if (at('^')) pos++;
+        bool first = true;
+        while (true) {
+            if (pos == re.size()) throw Unsupported();
+            if (re[pos] == ']' && !first) {
+                pos++;
+                break;
+            }
+            if (re[pos] == '[' && pos + 1 < re.size()
+                && (re[pos + 1] == '.' || re[pos + 1] == ':' || re[pos + 1] == '='))
+            {
+                auto end = re.find(re[pos + 1], pos + 2);
+                if (end == std::string::npos || end + 1 == re.size() || re[end + 1] != ']')
+                    throw Unsupported();
+                pos = end + 2;
+            } else
+                pos++;
+            first = false;
+        }
+
+        Node node(Node::Set);
+        auto text = re.substr(start, pos - start);
+        auto i = setIndices.find(text);
+        if (i != setIndices.end()) {
+            node.index = i->second;
+            return node;
+        }
+
+        auto set = bracketSet(text);
+
+        node.index = sets.size();
+        setIndices.emplace(text, sets.size());
+        sets.push_back(set);
+        return node;
+    }
+
+    /* Compute the characters matched by the bracket expression
+       'text' the way std::regex does. */
+    static std::bitset<256> bracketSet(const std::string & text)
+    {
+        /* Let std::regex itself decide about collating elements and
+           equivalence classes, which depend on the locale. */
+        if (text.find("[.") != std::string::npos || text.find("[=") != std::string::npos) {
+            std::bitset<256> set;
+            try {
+                std::regex bracket(text, std::regex::extended);
+                for (int ch = 1; ch < 256; ++ch) {
+                    char buf = (char) ch;
+                    if (std::regex_match(&buf, &buf + 1, bracket))
+                        set.set(ch);
+                }
+            } catch (std::regex_error &) {
+                throw Unsupported();
+            }
+            return set;
+        }
+
+        std::regex_traits<char> traits;
+        std::vector<char> chars;
+        std::vector<std::pair<char, char>> ranges;
+        std::regex_traits<char>::char_class_type classes{};
+
+        size_t i = 1, end = text.size() - 1;
+        bool negate = text[i] == '^';
+        if (negate) i++;
+
+        /* The last character, which may start a range, or whether the
+           last element was a class, which may not. */
+        std::optional<char> last;
+        bool lastIsClass = false;
+
+        auto pushChar = [&](char c) {
+            if (last) chars.push_back(*last);
+            last = c;
+            lastIsClass = false;
+        };
+
+        for (bool first = true; i < end; first = false) {
+            char c = text[i];
+            if (c == '[' && text[i + 1] == ':') {
+                auto close = text.find(':', i + 2);
+                auto name = text.substr(i + 2, close - i - 2);
+                auto mask = traits.lookup_classname(name.begin(), name.end());
+                if (mask == std::regex_traits<char>::char_class_type()) throw Unsupported();
+                classes |= mask;
+                if (last) chars.push_back(*last);
+                last.reset();
+                lastIsClass = true;
+                i = close + 2;
+            } else if (c == '-' && !first) {
+                /* A `-' is only allowed at the start, at the end,
+                   and as the end of a range. */
+                i++;
+                if (i == end)
+                    pushChar('-');
+                else if (!last || (text[i] == '[' && text[i + 1] == ':'))
+                    throw Unsupported();
+                else {
+                    if (*last > text[i]) throw Unsupported();
+                    ranges.push_back({*last, text[i]});
+                    last.reset();
+                    i++;
+                }
+            } else {
+                pushChar(c);
+                i++;
+            }
+        }
+        if (last) chars.push_back(*last);
+
+        std::bitset<256> set;
+        for (int ch = 1; ch < 256; ++ch) {
+            char c = (char) ch;
+            bool matches = traits.isctype(c, classes);
+            for (auto d : chars)
+                if (c == d) matches = true;
+            for (auto & [lo, hi] : ranges)
+                if (lo <= c && c <= hi) matches = true;
+            set[ch] = matches != negate;
+        }
+        return set;
+    }
+};
+
+}
+
+
+struct Regex::Program
+{
+    std::vector<Inst> insts;
+    std::vector<std::bitset<256>> sets;
+
+    /* The number of groups, including group 0. */
+    size_t nrGroups;
+
+    /* The Splits with a row in the table computed by canRepeat(). */
+    std::vector<uint32_t> pruned;
+
+    /* The instructions in an order in which every instruction comes
+       after the instructions that it can reach without consuming
+       input. */
+    std::vector<uint32_t> order;
+
+    /* The characters with which a match can start, if a match can't
+       be empty. */
+    std::optional<std::bitset<256>> firstChars;
+
+    Program(const std::string & re)
+    {
+        Parser parser(re);
+        auto root = parser.parseDisjunction();
+        if (parser.pos != re.size()) throw Unsupported();
+        nrGroups = parser.nrGroups;
+        sets = std::move(parser.sets);
+
+        compile(root);
+        emit(Inst{.op = Op::Match});
+
+        analyse();
+    }
+
+    size_t emit(Inst inst)
+    {
+        if (insts.size() == maxInsts) throw Unsupported();
+        insts.push_back(inst);
+        return insts.size() - 1;
+    }
+
+    void compile(const Node & node)
+    {
+        switch (node.kind) {
+
+        case Node::Empty:
+            break;
+
+        case Node::Char:
+            emit(Inst{.op = Op::Char, .c = node.c});
+            break;
+
+        case Node::Set:
+            emit(Inst{.op = Op::Set, .x = (uint32_t) node.index});
+            break;
+
+        case Node::Any:
+            emit(Inst{.op = Op::Any});
+            break;
+
+        case Node::Bol:
+            emit(Inst{.op = Op::Bol});
+            break;
+
+        case Node::Eol:
+            emit(Inst{.op = Op::Eol});
+            break;
+
+        case Node::Cat:
+            for (auto & child : node.children)
+                compile(child);
+            break;
+
+        case Node::Alt: {
+            std::vector<size_t> jumps;
+            for (size_t i = 0; i + 1 < node.children.size(); ++i) {
+                auto split = emit(Inst{.op = Op::Split});
+                insts[split].x = split + 1;
+                compile(node.children[i]);
+                jumps.push_back(emit(Inst{.op = Op::Jmp}));
+                insts[split].y = insts.size();
+            }
+            compile(node.children.back());
+            for (auto jump : jumps)
+                insts[jump].x = insts.size();
+            break;
+        }
+
+        case Node::Group:
+            emit(Inst{.op = Op::Open, .x = (uint32_t) node.index});
+            compile(node.children[0]);
+            emit(Inst{.op = Op::Close, .x = (uint32_t) node.index});
+            break;
+
+        case Node::Repeat: {
+            auto & child = node.children[0];
+
+            if (node.max == unbounded) {
+                if (nullable(child)) throw Unsupported();
+                for (size_t i = 1; i < node.min; ++i)
+                    compile(child);
+                if (node.min) {
+                    /* x+: repeat after every iteration. */
+                    auto start = insts.size();
+                    compile(child);
+                    auto split = emit(Inst{.op = Op::Split, .x = (uint32_t) start, .quantifier = true});
+                    insts[split].y = split + 1;
+                } else {
+                    auto split = emit(Inst{.op = Op::Split, .quantifier = true});
+                    insts[split].x = split + 1;
+                    compile(child);
+                    emit(Inst{.op = Op::Jmp, .x = (uint32_t) split});
+                    insts[split].y = insts.size();
+                }
+            }
+
+            else {
+                /* x{2,4} is x x (x (x)?)?. */
+                for (size_t i = 0; i < node.min; ++i)
+                    compile(child);
+                std::vector<size_t> splits;
+                for (size_t i = node.min; i < node.max; ++i) {
+                    auto split = emit(Inst{.op = Op::Split, .quantifier = true});
+                    insts[split].x = split + 1;
+                    splits.push_back(split);
+                    compile(child);
+                }
+                for (auto split : splits)
+                    insts[split].y = insts.size();
+            }
+
+            break;
+        }
+        }
+    }
+
+    static bool consumes(const Inst & inst)
+    {
+        return inst.op == Op::Char || inst.op == Op::Set || inst.op == Op::Any;
+    }
+
+    /* Call 'f' on the successors of 'pc' that are reached without
+       consuming input. */
+    template<typename F>
+    void forEachEpsilon(uint32_t pc, F f) const
+    {
+        auto & inst = insts[pc];
+        switch (inst.op) {
+        case Op::Split: f(inst.x); f(inst.y); break;
+        case Op::Jmp: f(inst.x); break;
+        case Op::Open: case Op::Close: case Op::Bol: case Op::Eol: f(pc + 1); break;
+        default: break;
+        }
+    }
+
+    void analyse()
+    {
+        auto size = insts.size();
+
+        /* Find the instructions from which a consuming instruction
+           can be reached. */
+        std::vector<std::vector<uint32_t>> preds(size);
+        for (uint32_t pc = 0; pc < size; ++pc) {
+            forEachEpsilon(pc, [&](uint32_t next) { preds[next].push_back(pc); });
+            if (consumes(insts[pc])) preds[pc + 1].push_back(pc);
+        }
+        std::vector<bool> canConsume(size);
+        std::vector<uint32_t> todo;
+        for (uint32_t pc = 0; pc < size; ++pc)
+            if (consumes(insts[pc])) {
+                canConsume[pc] = true;
+                todo.push_back(pc);
+            }
+        while (!todo.empty()) {
+            auto pc = todo.back();
+            todo.pop_back();
+            for (auto pred : preds[pc])
+                if (!canConsume[pred]) {
+                    canConsume[pred] = true;
+                    todo.push_back(pred);
+                }
+        }
+
+        /* Leaving a quantified expression can only produce a longer
+           match if input can be consumed after it. */
+        for (uint32_t pc = 0; pc < size; ++pc) {
+            auto & inst = insts[pc];
+            if (inst.quantifier && canConsume[inst.y]) {
+                inst.prune = pruned.size();
+                pruned.push_back(pc);
+            }
+        }
+
+        /* Sort the instructions topologically. */
+        if (!pruned.empty()) {
+            std::vector<bool> visited(size);
+            std::vector<std::pair<uint32_t, bool>> stack;
+            for (uint32_t root = 0; root < size; ++root) {
+                stack.push_back({root, false});
+                while (!stack.empty()) {
+                    auto [pc, done] = stack.back();
+                    stack.pop_back();
+                    if (done) {
+                        order.push_back(pc);
+                        continue;
+                    }
+                    if (visited[pc]) continue;
+                    visited[pc] = true;
+                    stack.push_back({pc, true});
+                    forEachEpsilon(pc, [&](uint32_t next) {
+                        if (!visited[next]) stack.push_back({next, false});
+                    });
+                }
+            }
+        }
+
+        /* Compute the characters that can start a match. */
+        std::bitset<256> first;
+        std::vector<bool> visited(size);
+        todo = {0};
+        while (!todo.empty()) {
+            auto pc = todo.back();
+            todo.pop_back();
+            if (visited[pc]) continue;
+            visited[pc] = true;
+            auto & inst = insts[pc];
+            switch (inst.op) {
+            case Op::Char: first.set(inst.c); break;
+            case Op::Set: first |= sets[inst.x]; break;
+            case Op::Any: first.set().reset(0); break;
+            case Op::Match: return;
+            default: forEachEpsilon(pc, [&](uint32_t next) { todo.push_back(next); });
+            }
+        }
+        firstChars = first;
+    }
+
+    bool matches(const Inst & inst, char c) const
+    {
+        switch (inst.op) {
+        case Op::Char: return (unsigned char) c == inst.c;
+        case Op::Set: return sets[inst.x].test((unsigned char) c);
+        case Op::Any: return c != 0;
+        default: abort();
+        }
+    }
+
+    /* Compute for every position 'p' of 's' and every Split in
+       'pruned' whether repeating can get to the end of the regular
+       expression. The result for Split 'k' is at 'p * pruned.size() +
+       k'. */
+    std::vector<bool> canRepeat(std::string_view s) const
+    {
+        auto n = s.size();
+        std::vector<bool> table((n + 1) * pruned.size());
+        std::vector<char> cur(insts.size()), next(insts.size());
+
+        for (size_t p = n + 1; p-- > 0; ) {
+            for (auto pc : order) {
+                auto & inst = insts[pc];
+                bool res;
+                switch (inst.op) {
+                case Op::Split: res = cur[inst.x] || cur[inst.y]; break;
+                case Op::Jmp: res = cur[inst.x]; break;
+                case Op::Open: case Op::Close: res = cur[pc + 1]; break;
+                case Op::Bol: res = p == 0 && cur[pc + 1]; break;
+                case Op::Eol: res = p == n && cur[pc + 1]; break;
+                case Op::Match: res = true; break;
+                default: res = p < n && matches(inst, s[p]) && next[pc + 1];
+                }
+                cur[pc] = res;
+            }
+            for (size_t k = 0; k < pruned.size(); ++k)
+                table[p * pruned.size() + k] = cur[insts[pruned[k]].x];
+            std::swap(cur, next);
+        }
+
+        return table;
+    }
+
+    struct Threads
+    {
+        /* The instructions of the threads, in order of priority, and
+           their group positions. */
+        std::vector<uint32_t> pcs;
+        std::vector<size_t> groups;
+
+        /* Whether an instruction has been reached at the current
+           position. */
+        std::vector<uint32_t> seen;
+        uint32_t generation = 0;
+
+        Threads(size_t size) : seen(size) { clear(); }
+
+        void clear()
+        {
+            pcs.clear();
+            groups.clear();
+            generation++;
+        }
+    };
+
+    /* State that is kept across the calls of exec() for the same
+       input. */
+    struct Scratch
+    {
+        /* The result of canRepeat(), for searches. */
+        std::vector<bool> table;
+
+        /* The (position, instruction) pairs that backtrack() has
+           visited, and the range of words in which it has set
+           bits. */
+        std::vector<uint64_t> visited;
+        size_t dirtyFrom = npos, dirtyTo = 0;
+
+        struct Job { uint32_t pc; size_t p, slot, value; };
+        std::vector<Job> stack;
+
+        std::vector<size_t> groups;
+    };
+
+    /* Find the leftmost-longest match in 's' starting at or after
+       'from' (or exactly at 'from' and ending at the end of 's' if
+       'full'), as std::regex would, and store its group positions
+       in 'best'. A group 'g' is unmatched if 'best[2 * g + 1]' is
+       npos. */
+    bool exec(std::string_view s, size_t from, bool full,
+        Scratch & scratch, std::vector<size_t> & best) const
+    {
+        auto table = full ? nullptr : &scratch.table;
+        if ((s.size() + 1) * insts.size() <= maxVisited)
+            return backtrack(s, from, full, table, scratch, best);
+        else
+            return pike(s, from, full, table, best);
+    }
+
+    /* Explore the paths depth-first like std::regex does, but without
+       visiting the same instruction at the same position twice: if
+       it was visited before, either that led to a match, which can't
+       be improved on, or it didn't, and it won't now. This needs a
+       bit for every position and instruction, so it's only used for
+       inputs that aren't too long. */
+    bool backtrack(std::string_view s, size_t from, bool full,
+        const std::vector<bool> * table, Scratch & scratch, std::vector<size_t> & best) const
+    {
+        auto n = s.size();
+        auto m = insts.size();
+        auto nrSlots = 2 * nrGroups;
+
+        auto & visited = scratch.visited;
+        if (scratch.dirtyFrom <= scratch.dirtyTo)
+            std::fill(visited.begin() + scratch.dirtyFrom, visited.begin() + scratch.dirtyTo + 1, 0);
+        scratch.dirtyFrom = npos;
+        scratch.dirtyTo = 0;
+        auto words = ((n + 1) * m + 63) / 64;
+        if (visited.size() < words) visited.resize(words);
+
+        auto & stack = scratch.stack;
+        auto & groups = scratch.groups;
+        groups.assign(nrSlots, npos);
+        bool found = false;
+
+        for (size_t start = from; start <= n && (!full || start == from); ++start) {
+
+            /* Skip positions where no match can start. */
+            if (!full && firstChars) {
+                while (start < n && !firstChars->test((unsigned char) s[start])) ++start;
+                if (start == n) break;
+            }
+
+            scratch.dirtyFrom = std::min(scratch.dirtyFrom, start * m / 64);
+            groups[0] = start;
+            stack.push_back({0, start, npos, 0});
+
+            while (!stack.empty()) {
+                auto job = stack.back();
+                stack.pop_back();
+                if (job.slot != npos) {
+                    groups[job.slot] = job.value;
+                    continue;
+                }
+
+                auto pc = job.pc;
+                auto p = job.p;
+
+                while (true) {
+                    auto bit = p * m + pc;
+                    auto & word = visited[bit / 64];
+                    auto mask = (uint64_t) 1 << (bit % 64);
+                    if (word & mask) break;
+                    word |= mask;
+                    scratch.dirtyTo = std::max(scratch.dirtyTo, bit / 64);
+
+                    auto & inst = insts[pc];
+                    switch (inst.op) {
+
+                    case Op::Char: case Op::Set: case Op::Any:
+                        if (p == n || !matches(inst, s[p])) break;
+                        pc++;
+                        p++;
+                        continue;
+
+                    case Op::Jmp:
+                        pc = inst.x;
+                        continue;
+
+                    case Op::Split:
+                        if (inst.prune < 0 || !table || !(*table)[p * pruned.size() + inst.prune])
+                            stack.push_back({inst.y, p, npos, 0});
+                        pc = inst.x;
+                        continue;
+
+                    case Op::Open: case Op::Close: {
+                        auto slot = 2 * inst.x + (inst.op == Op::Close ? 1 : 0);
+                        stack.push_back({0, 0, slot, groups[slot]});
+                        groups[slot] = p;
+                        pc++;
+                        continue;
+                    }
+
+                    case Op::Bol:
+                        if (p != 0) break;
+                        pc++;
+                        continue;
+
+                    case Op::Eol:
+                        if (p != n) break;
+                        pc++;
+                        continue;
+
+                    case Op::Match:
+                        if (full && p != n) break;
+                        if (!found || p > best[1]) {
+                            best = groups;
+                            best[1] = p;
+                            found = true;
+                        }
+                        /* In a full match, the first match wins. */
+                        if (full) {
+                            stack.clear();
+                            return true;
+                        }
+                        break;
+                    }
+
+                    break;
+                }
+            }
+
+            if (found) return true;
+        }
+
+        return false;
+    }
+
+    /* Run all paths in lockstep, so that every instruction is
+       visited at most once at every position, but only one bit per
+       instruction is needed. */
+    bool pike(std::string_view s, size_t from, bool full,
+        const std::vector<bool> * table, std::vector<size_t> & best) const
+    {
+        auto n = s.size();
+        auto nrSlots = 2 * nrGroups;
+
+        Threads clist(insts.size()), nlist(insts.size());
+        std::vector<size_t> initial(nrSlots);
+
+        struct Entry { uint32_t pc; size_t slot, value; };
+        std::vector<Entry> stack;
+
+        /* Add a thread at 'pc' and the threads it leads to without
+           consuming input, in order of priority. */
+        auto add = [&](Threads & list, uint32_t pc, size_t p, size_t * groups) {
+            stack.push_back({pc, npos, 0});
+            while (!stack.empty()) {
+                auto e = stack.back();
+                stack.pop_back();
+                if (e.slot != npos) {
+                    groups[e.slot] = e.value;
+                    continue;
+                }
+                pc = e.pc;
+                while (list.seen[pc] != list.generation) {
+                    list.seen[pc] = list.generation;
+                    auto & inst = insts[pc];
+                    if (inst.op == Op::Jmp)
+                        pc = inst.x;
+                    else if (inst.op == Op::Split) {
+                        if (inst.prune < 0 || !table || !(*table)[p * pruned.size() + inst.prune])
+                            stack.push_back({inst.y, npos, 0});
+                        pc = inst.x;
+                    }
+                    else if (inst.op == Op::Open || inst.op == Op::Close) {
+                        /* Like std::regex, entering a group only
+                           records its start; the group counts as
+                           matched once it has been left. */
+                        auto slot = 2 * inst.x + (inst.op == Op::Close ? 1 : 0);
+                        stack.push_back({0, slot, groups[slot]});
+                        groups[slot] = p;
+                        pc++;
+                    }
+                    else if (inst.op == Op::Bol) {
+                        if (p != 0) break;
+                        pc++;
+                    }
+                    else if (inst.op == Op::Eol) {
+                        if (p != n) break;
+                        pc++;
+                    }
+                    else {
+                        list.pcs.push_back(pc);
+                        list.groups.insert(list.groups.end(), groups, groups + nrSlots);
+                        break;
+                    }
+                }
+            }
+        };
+
+        bool found = false;
+
+        for (size_t p = from; ; ++p) {
+
+            if (!found && (!full || p == from)) {
+                /* Skip positions where no match can start. */
+                if (!full && firstChars && clist.pcs.empty()) {
+                    while (p < n && !firstChars->test((unsigned char) s[p])) ++p;
+                    if (p == n) break;
+                }
+                std::fill(initial.begin(), initial.end(), npos);
+                initial[0] = p;
+                add(clist, 0, p, initial.data());
+            }
+
+            for (size_t t = 0; t < clist.pcs.size(); ++t) {
+                auto pc = clist.pcs[t];
+                auto groups = &clist.groups[t * nrSlots];
+                if (found && groups[0] > best[0]) continue;
+                auto & inst = insts[pc];
+                if (inst.op == Op::Match) {
+                    if (full && p != n) continue;
+                    if (!found || groups[0] < best[0] || (groups[0] == best[0] && p > best[1])) {
+                        best.assign(groups, groups + nrSlots);
+                        best[1] = p;
+                        found = true;
+                    }
+                }
+                else if (p < n && matches(inst, s[p]))
+                    add(nlist, pc + 1, p + 1, groups);
+            }
+
+            if (p >= n) break;
+            std::swap(clist, nlist);
+            nlist.clear();
+            if (clist.pcs.empty() && (found || full)) break;
+        }
+
+        return found;
+    }
+
+    Groups toGroups(std::string_view s, const std::vector<size_t> & positions) const
+    {
+        Groups groups;
+        for (size_t g = 0; g < nrGroups; ++g) {
+            if (positions[2 * g + 1] == npos)
+                groups.push_back(std::nullopt);
+            else
+                groups.push_back(s.substr(positions[2 * g], positions[2 * g + 1] - positions[2 * g]));
+        }
+        return groups;
+    }
+};
+
+
+static Regex::Groups toGroups(const std::cmatch & match)
+{
+    Regex::Groups groups;
+    for (auto & group : match) {
+        if (group.matched)
+            groups.push_back(std::string_view(group.first, group.length()));
+        else
+            groups.push_back(std::nullopt);
+    }
+    return groups;
+}
+
+
+Regex::Regex(const std::string & re, bool useAutomaton)
+{
+    /* Always compile with std::regex first, so that invalid regular
+       expressions produce the same errors. */
+    std::regex regex(re, std::regex::extended);
+
+    if (useAutomaton) {
+        try {
+            program = std::make_unique<Program>(re);
+            return;
+        } catch (Unsupported &) {
+        }
+    }
+
+    fallback = std::move(regex);
+}
+
+
+Regex::~Regex()
+{
+}
+
+
+std::optional<Regex::Groups> Regex::match(std::string_view s) const
+{
+    if (!program) {
+        std::cmatch match;
+        if (!std::regex_match(s.data(), s.data() + s.size(), match, *fallback))
+            return std::nullopt;
+        return toGroups(match);
+    }
+
+    /* Matches are usually done on short strings, so reuse the
+       buffers. */
+    static thread_local Program::Scratch scratch;
+    std::vector<size_t> positions;
+    if (!program->exec(s, 0, true, scratch, positions))
+        return std::nullopt;
+    return program->toGroups(s, positions);
+}
+
+
+std::vector<Regex::Groups> Regex::search(std::string_view s) const
+{
+    std::vector<Groups> res;
+
+    if (!program) {
+        auto end = std::cregex_iterator();
+        for (auto i = std::cregex_iterator(s.data(), s.data() + s.size(), *fallback); i != end; ++i)
+            res.push_back(toGroups(*i));
+        return res;
+    }
+
+    Program::Scratch scratch;
+    if (!program->pruned.empty())
+        scratch.table = program->canRepeat(s);
+
+    /* After an empty match, std::sregex_iterator looks for a
+       non-empty match at the same position, which can't exist since
+       the search would have returned it, and then searches from the
+       next position. */
+    std::vector<size_t> positions;
+    size_t from = 0;
+    while (program->exec(s, from, false, scratch, positions)) {
+        res.push_back(program->toGroups(s, positions));
+        auto start = positions[0], end = positions[1];
+        if (start == end) {
+            if (end == s.size()) break;
+            from = end + 1;
+        } else
+            from = end;
+    }
+
+    return res;
+}
+
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+
+/* An extended POSIX regular expression, as used by `builtins.match'
+   and `builtins.split'.
+
+   The results are always those that std::regex (as implemented by
+   libstdc++) would produce, since that's what Nix has always used.
+   However, std::regex uses a backtracking matcher that takes
+   exponential time in the worst case and recurses for every
+   character of the input. So most regular expressions are instead
+   executed by an automaton that simulates all of the backtracking
+   matcher's paths in lockstep, which takes time linear in the length
+   of the input (see regex.cc). The few regular expressions for which
+   the automaton can't reproduce the results of std::regex are
+   executed by std::regex. */
+class Regex
+{
+public:
+
+    /* The groups of a match, group 0 being the entire match. Groups
+       that didn't participate in the match are std::nullopt. The
+       strings point into the input. */
+    typedef std::vector<std::optional<std::string_view>> Groups;
+
+    /* Compile 're'. Throws std::regex_error if 're' is not a valid
+       regular expression. If 'useAutomaton' is false, 're' is always
+       executed by std::regex. */
+    Regex(const std::string & re, bool useAutomaton = true);
+
+    ~Regex();
+
+    /* Match 's' in its entirety, like std::regex_match(). */
+    std::optional<Groups> match(std::string_view s) const;
+
+    /* Return the successive matches in 's', like
+       std::sregex_iterator. */
+    std::vector<Groups> search(std::string_view s) const;
+
+    /* Whether this regular expression is executed by the automaton. */
+    bool usesAutomaton() const { return (bool) program; }
+
+    struct Program;
+
+private:
+
+    std::unique_ptr<Program> program;
+
+    /* Only set if 'program' isn't. */
+    std::optional<std::regex> fallback;
+};
+
+
+}
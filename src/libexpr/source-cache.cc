@@ -0,0 +1,199 @@
+#include "source-cache.hh"
+#include "serialise.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "globals.hh"
+
+#include <sys/stat.h>
+
+namespace nix {
+
+static uint64_t nanoseconds(const struct timespec & t)
+{
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void fingerprint(Sink & sink, const Path & path, const std::string & relPath,
+    const struct stat & st, PathFilter & filter, time_t cutoff, bool & racy)
+{
+    checkInterrupt();
+
+#if __APPLE__
+    auto & mtime = st.st_mtimespec;
+    auto & ctime = st.st_ctimespec;
+#else
+    auto & mtime = st.st_mtim;
+    auto & ctime = st.st_ctim;
+#endif
+
+    /* Timestamps have a limited resolution, so a file that is
+       modified again soon after we've seen it may keep its
+       timestamps. */
+    if (mtime.tv_sec >= cutoff || ctime.tv_sec >= cutoff) racy = true;
+
+    sink << relPath << (uint64_t) st.st_mode << (uint64_t) st.st_ino;
+
+    if (S_ISREG(st.st_mode))
+        sink << (uint64_t) st.st_size << nanoseconds(mtime) << nanoseconds(ctime);
+
+    else if (S_ISLNK(st.st_mode))
+        sink << readLink(path);
+
+    else if (S_ISDIR(st.st_mode)) {
+        std::set<std::string> names;
+        for (auto & i : readDirectory(path))
+            names.insert(i.name);
+        for (auto & name : names) {
+            auto child = path + "/" + name;
+            if (filter(child))
+                fingerprint(sink, child, relPath + "/" + name, lstat(child), filter, cutoff, racy);
+        }
+    }
+}
+
+bool fingerprintSourcePath(Sink & sink, const Path & path, bool recursive, PathFilter & filter)
+{
+    auto cutoff = time(0) - 2;
+    bool racy = false;
+
+    if (recursive)
+        fingerprint(sink, path, "", lstat(path), filter, cutoff, racy);
+    else {
+        struct stat st;
+        if (stat(path.c_str(), &st))
+            throw SysError("getting status of '%1%'", path);
+        fingerprint(sink, path, "", st, filter, cutoff, racy);
+    }
+
+    return racy;
+}
+
+
+static const char * schema = R"sql(
+
+create table if not exists SourcePaths (
+    key       text primary key not null,
+    storePath text not null,
+    timestamp integer not null
+);
+
+create table if not exists LastPurge (
+    dummy            text primary key,
+    value            integer
+);
+
+)sql";
+
+class SourcePathCacheImpl : public SourcePathCache
+{
+public:
+
+    /* How often to purge old entries from the cache. */
+    const int purgeInterval = 24 * 3600;
+
+    /* Entries that haven't been written for this long are purged. */
+    const int maxAge = 30 * 24 * 3600;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertPath, queryPath;
+        bool failed = false;
+    };
+
+    Sync<State> _state;
+
+    SourcePathCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/source-paths-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertPath.create(state->db,
+            "insert or replace into SourcePaths(key, storePath, timestamp) values (?, ?, ?)");
+
+        state->queryPath.create(state->db,
+            "select storePath from SourcePaths where key = ?");
+
+        /* Periodically purge old entries from the database. */
+        retrySQLite<void>([&]() {
+            auto now = time(0);
+
+            SQLiteStmt queryLastPurge(state->db, "select value from LastPurge");
+            auto queryLastPurge_(queryLastPurge.use());
+
+            if (!queryLastPurge_.next() || queryLastPurge_.getInt(0) < now - purgeInterval) {
+                SQLiteStmt(state->db, "delete from SourcePaths where timestamp < ?")
+                    .use()(now - maxAge).exec();
+
+                SQLiteStmt(state->db,
+                    "insert or replace into LastPurge(dummy, value) values ('', ?)")
+                    .use()(now).exec();
+            }
+        });
+    }
+
+    /* Run a cache operation, disabling the cache on the first SQLite
+       error: the cache is only an optimisation. */
+    template<typename F>
+    void doSQLite(State & state, F && fun)
+    {
+        if (state.failed) return;
+        try {
+            retrySQLite<void>(fun);
+        } catch (SQLiteError &) {
+            ignoreException();
+            state.failed = true;
+        }
+    }
+
+    std::optional<std::string> lookup(const Hash & key) override
+    {
+        auto state(_state.lock());
+
+        std::optional<std::string> res;
+
+        doSQLite(*state, [&]() {
+            auto queryPath(state->queryPath.use()(key.to_string(Base32, false)));
+            if (queryPath.next())
+                res = queryPath.getStr(0);
+        });
+
+        return res;
+    }
+
+    void upsert(const Hash & key, const std::string & storePath) override
+    {
+        auto state(_state.lock());
+
+        doSQLite(*state, [&]() {
+            state->insertPath.use()
+                (key.to_string(Base32, false))
+                (storePath)
+                (time(0)).exec();
+        });
+    }
+};
+
+std::shared_ptr<SourcePathCache> getSourcePathCache()
+{
+    static std::shared_ptr<SourcePathCache> cache = []() -> std::shared_ptr<SourcePathCache> {
+        try {
+            return std::make_shared<SourcePathCacheImpl>();
+        } catch (Error & e) {
+            debug("not using the source path cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+
+    return cache;
+}
+
+}
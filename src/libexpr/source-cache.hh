@@ -0,0 +1,44 @@
+#pragma once
+
+#include "hash.hh"
+#include "types.hh"
+#include "util.hh"
+
+#include <optional>
+
+namespace nix {
+
+struct Sink;
+
+/* Write a fingerprint of the source tree 'path' to 'sink': the names,
+   types, sizes, modification and change times, inode numbers and
+   permissions of 'path' and of the files below it that pass 'filter'
+   (in the same way as dumpPath()), and the targets of symlinks. If
+   'recursive' is false, 'path' is treated as a single file (following
+   symlinks). Returns whether any of the files was modified so
+   recently that a later modification might not change the
+   fingerprint. */
+bool fingerprintSourcePath(Sink & sink, const Path & path, bool recursive, PathFilter & filter);
+
+/* A persistent cache of the store paths of the source trees copied to
+   the store by the evaluator (path literals, `builtins.path` and
+   `builtins.filterSource`), keyed on a hash of their fingerprint and
+   of how they were added. Because the filter is applied while
+   computing the fingerprint, the key covers exactly the files that
+   end up in the store path, regardless of what the filter is. */
+class SourcePathCache
+{
+public:
+
+    virtual ~SourcePathCache() { }
+
+    virtual std::optional<std::string> lookup(const Hash & key) = 0;
+
+    virtual void upsert(const Hash & key, const std::string & storePath) = 0;
+};
+
+/* Return a singleton cache object that can be used concurrently by
+   multiple threads, or nullptr if the cache cannot be opened. */
+std::shared_ptr<SourcePathCache> getSourcePathCache();
+
+}
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <deque>
 #include <map>
-#include <unordered_set>
+#include <mutex>
+#include <vector>
 
 #include "types.hh"
 
@@ -65,35 +67,119 @@ public:
     }
 
     friend std::ostream & operator << (std::ostream & str, const Symbol & sym);
+    friend struct std::hash<Symbol>;
 };
 
+/* The symbol table is an open-addressing hash table (with linear
+   probing) of pointers into 'store', which is never shrunk and whose
+   elements therefore never move.  Each slot caches the hash of its
+   string, so lookups compare strings only on a full hash match and
+   growing the table doesn't rehash anything.  Looking up an existing
+   symbol doesn't allocate.  If `concurrent' is set, create() takes a
+   lock, so that it can be called from several evaluation threads. */
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
-    Symbols symbols;
+    struct Slot
+    {
+        size_t hash;
+        const string * s = nullptr;
+    };
+
+    std::deque<string> store;
+    std::vector<Slot> slots;
+    size_t mask = 0;
+
+    /* Statistics. */
+    size_t nrLookups = 0;
+    size_t nrProbes = 0;
+
+    void grow()
+    {
+        std::vector<Slot> slots2(slots.empty() ? 1024 : slots.size() * 2);
+        size_t mask2 = slots2.size() - 1;
+        for (auto & slot : slots) {
+            if (!slot.s) continue;
+            size_t i = slot.hash & mask2;
+            while (slots2[i].s) i = (i + 1) & mask2;
+            slots2[i] = slot;
+        }
+        slots = std::move(slots2);
+        mask = mask2;
+    }
+
+    Symbol createUnlocked(std::string_view s)
+    {
+        nrLookups++;
+
+        /* Keep the load factor below 1/2. */
+        if ((store.size() + 1) * 2 > slots.size()) grow();
+
+        size_t hash = std::hash<std::string_view>()(s);
+        size_t i = hash & mask;
+        while (true) {
+            auto & slot = slots[i];
+            if (!slot.s) break;
+            if (slot.hash == hash && *slot.s == s)
+                return Symbol(slot.s);
+            nrProbes++;
+            i = (i + 1) & mask;
+        }
+
+        auto & str = store.emplace_back(s);
+        slots[i] = Slot{hash, &str};
+        return Symbol(&str);
+    }
+
+    std::mutex mutex;
 
 public:
+    bool concurrent = false;
+
     Symbol create(std::string_view s)
     {
-        // FIXME: avoid allocation if 's' already exists in the symbol table.
-        std::pair<Symbols::iterator, bool> res = symbols.emplace(std::string(s));
-        return Symbol(&*res.first);
+        if (!concurrent) return createUnlocked(s);
+        std::lock_guard<std::mutex> lock(mutex);
+        return createUnlocked(s);
     }
 
     size_t size() const
     {
-        return symbols.size();
+        return store.size();
     }
 
     size_t totalSize() const;
 
+    size_t capacity() const
+    {
+        return slots.size();
+    }
+
+    size_t lookups() const
+    {
+        return nrLookups;
+    }
+
+    size_t probes() const
+    {
+        return nrProbes;
+    }
+
     template<typename T>
     void dump(T callback)
     {
-        for (auto & s : symbols)
+        for (auto & s : store)
             callback(s);
     }
 };
 
 }
+
+/* Symbols are hashed by identity, just like they are compared. */
+template<> struct std::hash<nix::Symbol>
+{
+    std::size_t operator()(const nix::Symbol & sym) const noexcept
+    {
+        return std::hash<const std::string *>()(sym.s);
+    }
+};
@@ -2,6 +2,8 @@
 #include "json.hh"
 #include "eval-inline.hh"
 #include "util.hh"
+#include "serialise.hh"
+#include "finally.hh"
 
 #include <cstdlib>
 #include <iomanip>
@@ -16,7 +18,7 @@ void printValueAsJSON(EvalState & state, bool strict,
 
     if (strict) state.forceValue(v);
 
-    switch (v.type) {
+    switch (v.type()) {
 
         case tInt:
             out.write(v.integer);
@@ -27,6 +29,7 @@ void printValueAsJSON(EvalState & state, bool strict,
             break;
 
         case tString:
+            v.flattenString();
             copyContext(v, context);
             out.write(v.string.s);
             break;
@@ -90,6 +93,187 @@ void printValueAsJSON(EvalState & state, bool strict,
     printValueAsJSON(state, strict, v, out, context);
 }
 
+/* Writes JSON to a sink directly, rather than through the JSONWriter
+   classes and an std::ostream. */
+struct JSONSinkWriter
+{
+    static constexpr size_t bufSize = 64 * 1024;
+
+    EvalState & state;
+    bool strict;
+    bool memoize;
+    Sink & sink;
+    PathSet & context;
+    std::string buf;
+
+    JSONSinkWriter(EvalState & state, bool strict, bool memoize, Sink & sink, PathSet & context)
+        : state(state), strict(strict), memoize(memoize), sink(sink), context(context)
+    {
+        buf.reserve(bufSize);
+    }
+
+    void flush()
+    {
+        if (!buf.empty()) {
+            sink(buf);
+            buf.clear();
+        }
+    }
+
+    void put(std::string_view s)
+    {
+        buf.append(s);
+        if (buf.size() >= bufSize) flush();
+    }
+
+    /* Escape 's' the same way as toJSON(). */
+    void putString(std::string_view s)
+    {
+        buf.push_back('"');
+        auto start = s.begin();
+        for (auto i = s.begin(); i != s.end(); ++i) {
+            char c = *i;
+            if (c != '"' && c != '\\' && (c < 0 || c >= 32)) continue;
+            buf.append(start, i);
+            start = i + 1;
+            if (c == '"' || c == '\\') {
+                buf.push_back('\\');
+                buf.push_back(c);
+            }
+            else if (c == '\n') buf.append("\\n");
+            else if (c == '\r') buf.append("\\r");
+            else if (c == '\t') buf.append("\\t");
+            else {
+                char hex[8];
+                snprintf(hex, sizeof(hex), "\\u%04x", (unsigned int) c);
+                buf.append(hex);
+            }
+        }
+        buf.append(start, s.end());
+        put("\"");
+    }
+
+    /* Write an element of a list or attribute set. */
+    void writeChild(Value & v)
+    {
+        /* With multiple evaluation threads, only forceValue() may
+           claim a thunk. */
+        if (memoize || !strict || state.isParallel() || (v.type() != tThunk && v.type() != tApp)) {
+            write(v);
+            return;
+        }
+
+        /* Evaluate the thunk into a temporary value. It's a black
+           hole in the meantime, like in forceValue(), so that
+           infinite recursion is still detected. */
+        Value tmp;
+        if (v.type() == tThunk) {
+            Env * env = v.thunk.env();
+            Expr * expr = v.thunk.expr;
+            v.setType(tBlackhole);
+            Finally restore([&]() { v.setThunk(env, expr); });
+            expr->eval(state, *env, tmp);
+        } else
+            state.callFunction(*v.app.left(), *v.app.right, tmp, noPos);
+
+        write(tmp);
+    }
+
+    void write(Value & v)
+    {
+        checkInterrupt();
+
+        if (strict) state.forceValue(v);
+
+        switch (v.type()) {
+
+            case tInt:
+                put(std::to_string(v.integer));
+                break;
+
+            case tBool:
+                put(v.boolean ? "true" : "false");
+                break;
+
+            case tString:
+                v.flattenString();
+                copyContext(v, context);
+                putString(v.string.s);
+                break;
+
+            case tPath:
+                putString(state.copyPathToStore(context, v.path));
+                break;
+
+            case tNull:
+                put("null");
+                break;
+
+            case tAttrs: {
+                auto maybeString = state.tryAttrsToString(noPos, v, context, false, false);
+                if (maybeString) {
+                    putString(*maybeString);
+                    break;
+                }
+                auto i = v.attrs->get(state.sOutPath);
+                if (!i) {
+                    buf.push_back('{');
+                    bool first = true;
+                    for (auto a : v.attrs->lexicographicOrder()) {
+                        if (!first) buf.push_back(',');
+                        first = false;
+                        putString((const std::string &) a->name);
+                        buf.push_back(':');
+                        writeChild(*a->value);
+                    }
+                    put("}");
+                } else
+                    writeChild(*i->value);
+                break;
+            }
+
+            case tList1: case tList2: case tListN: {
+                buf.push_back('[');
+                for (unsigned int n = 0; n < v.listSize(); ++n) {
+                    if (n) buf.push_back(',');
+                    writeChild(*v.listElems()[n]);
+                }
+                put("]");
+                break;
+            }
+
+            case tExternal: {
+                std::ostringstream str;
+                {
+                    JSONPlaceholder out(str);
+                    v.external->printValueAsJSON(state, strict, out, context);
+                }
+                put(str.str());
+                break;
+            }
+
+            case tFloat: {
+                /* Like std::ostream's default formatting. */
+                char s[64];
+                snprintf(s, sizeof(s), "%g", v.fpoint);
+                put(s);
+                break;
+            }
+
+            default:
+                throw TypeError("cannot convert %1% to JSON", showType(v));
+        }
+    }
+};
+
+void printValueAsJSON(EvalState & state, bool strict,
+    Value & v, Sink & sink, PathSet & context, bool memoize)
+{
+    JSONSinkWriter writer(state, strict, memoize, sink, context);
+    writer.write(v);
+    writer.flush();
+}
+
 void ExternalValueBase::printValueAsJSON(EvalState & state, bool strict,
     JSONPlaceholder & out, PathSet & context) const
 {
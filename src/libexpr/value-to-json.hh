@@ -9,6 +9,7 @@
 namespace nix {
 
 class JSONPlaceholder;
+struct Sink;
 
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, JSONPlaceholder & out, PathSet & context);
@@ -16,4 +17,15 @@ void printValueAsJSON(EvalState & state, bool strict,
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, std::ostream & str, PathSet & context);
 
+/* Write 'v' as JSON to 'sink', through a buffer of a fixed size. The
+   output is the same as that of the functions above. If 'memoize' is
+   false, the thunks inside 'v' are evaluated into temporary values
+   rather than updated in place, so the parts of 'v' that have been
+   written can be garbage-collected while the rest is still being
+   evaluated. The memory needed is then proportional to the depth of
+   'v' rather than its size, but values that occur more than once in
+   'v' are evaluated more than once. */
+void printValueAsJSON(EvalState & state, bool strict,
+    Value & v, Sink & sink, PathSet & context, bool memoize = true);
+
 }
@@ -21,8 +21,9 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
     Value & v, XMLWriter & doc, PathSet & context, PathSet & drvsSeen);
 
 
-static void posToXML(XMLAttrs & xmlAttrs, const Pos & pos)
+static void posToXML(XMLAttrs & xmlAttrs, const Pos & pos_)
 {
+    auto pos = pos_.resolve();
     xmlAttrs["path"] = pos.file;
     xmlAttrs["line"] = (format("%1%") % pos.line).str();
     xmlAttrs["column"] = (format("%1%") % pos.column).str();
@@ -42,7 +43,7 @@ static void showAttrs(EvalState & state, bool strict, bool location,
 
         XMLAttrs xmlAttrs;
         xmlAttrs["name"] = i;
-        if (location && a.pos != &noPos) posToXML(xmlAttrs, *a.pos);
+        if (location && a.pos) posToXML(xmlAttrs, a.pos);
 
         XMLOpenElement _(doc, "attr", xmlAttrs);
         printValueAsXML(state, strict, location,
@@ -58,7 +59,7 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
 
     if (strict) state.forceValue(v);
 
-    switch (v.type) {
+    switch (v.type()) {
 
         case tInt:
             doc.writeEmptyElement("int", singletonAttrs("value", (format("%1%") % v.integer).str()));
@@ -70,11 +71,13 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
 
         case tString:
             /* !!! show the context? */
+            v.flattenString();
             copyContext(v, context);
             doc.writeEmptyElement("string", singletonAttrs("value", v.string.s));
             break;
 
         case tPath:
+            if (state.accessLog) state.accessLog->add(AccessLog::Kind::PathUsed, v.path);
             doc.writeEmptyElement("path", singletonAttrs("value", v.path));
             break;
 
@@ -92,14 +95,16 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
                 a = v.attrs->find(state.sDrvPath);
                 if (a != v.attrs->end()) {
                     if (strict) state.forceValue(*a->value);
-                    if (a->value->type == tString)
+                    a->value->flattenString();
+                    if (a->value->type() == tString)
                         xmlAttrs["drvPath"] = drvPath = a->value->string.s;
                 }
 
                 a = v.attrs->find(state.sOutPath);
                 if (a != v.attrs->end()) {
                     if (strict) state.forceValue(*a->value);
-                    if (a->value->type == tString)
+                    a->value->flattenString();
+                    if (a->value->type() == tString)
                         xmlAttrs["outPath"] = a->value->string.s;
                 }
 
@@ -2,6 +2,9 @@
 
 #include "symbol-table.hh"
 
+#include <cassert>
+#include <cstring>
+
 #if HAVE_BOEHMGC
 #include <gc/gc_allocator.h>
 #endif
@@ -35,6 +38,8 @@ struct Env;
 struct Expr;
 struct ExprLambda;
 struct PrimOp;
+struct StringRope;
+struct ListTree;
 class Symbol;
 struct Pos;
 class EvalState;
@@ -88,13 +93,65 @@ class ExternalValueBase
 std::ostream & operator << (std::ostream & str, const ExternalValueBase & v);
 
 
+/* On 64-bit platforms, values are packed into two words. Values whose
+   payload fits in one word (integers, floats, Booleans, paths, sets,
+   ...) store their type in the first word and their payload in the
+   second. Other values (thunks, applications, strings, lists, ...)
+   store a pointer in the first word, with their type encoded in its
+   lower 3 bits (`tag'), and another word in the second. Thus a value
+   is 16 bytes rather than 24 (which the garbage collector rounds up
+   to 32). Other platforms use a separate type field. Two-element
+   lists are stored like longer lists (i.e. tList2 is not used).
+
+   The pointers that carry a tag are only accessible through accessor
+   functions (e.g. `thunk.env()'), and two-word values can only be
+   created through the corresponding setters (e.g. `setThunk()'). */
+#if UINTPTR_MAX == UINT64_MAX
+#define NIX_TAGGED_VALUES 1
+#else
+#define NIX_TAGGED_VALUES 0
+#endif
+
 struct Value
 {
-    ValueType type;
+private:
+
+    static constexpr uintptr_t tagMask = NIX_TAGGED_VALUES ? 7 : 0;
+
+    enum : uintptr_t {
+        tagSingle = 0,
+        tagThunk,
+        tagApp,
+        tagLambda,
+        tagPrimOpApp,
+        tagString,
+        tagList,
+        tagRope,
+    };
+
+#if !NIX_TAGGED_VALUES
+    ValueType internalType;
+#endif
+
+public:
+
     union
     {
-        NixInt integer;
-        bool boolean;
+        /* Values whose payload fits in one word. */
+        struct {
+            uintptr_t typeWord;
+            union {
+                uintptr_t payloadWord;
+                NixInt integer;
+                bool boolean;
+                const char * path;
+                Bindings * attrs;
+                Value * smallList[1];
+                PrimOp * primOp;
+                ExternalValueBase * external;
+                NixFloat fpoint;
+            };
+        };
 
         /* Strings in the evaluator carry a so-called `context' which
            is a list of strings representing store paths.  This is to
@@ -115,64 +172,304 @@ struct Value
            derivation, and the other store paths in C will be added to
            the inputSrcs of the derivations.
 
-           For canonicity, the store paths should be in sorted order. */
+           For canonicity, the store paths should be in sorted order.
+           Contexts are interned by the context table (see
+           context-table.hh), so they're immutable and equal contexts
+           are the same pointer.
+
+           A string produced by concatenation may instead be a rope,
+           in which case `s' is null and `rope' points to a tree of
+           string fragments (see StringRope below).  Such a
+           string must be flattened by calling flattenString() before
+           `s' or `context' are accessed.  This makes building a large
+           string by repeated appending (e.g. with foldl') linear
+           rather than quadratic.  On 64-bit platforms, flattening
+           only fills in `s': the value keeps pointing to the rope,
+           which holds the context, so that a value is never seen in
+           an inconsistent state by other evaluation threads. */
         struct {
+            uintptr_t context_;
             const char * s;
-            const char * * context; // must be in sorted order
+            const char * * context() const // must be in sorted order
+            {
+                return (context_ & tagMask) == tagRope
+                    ? ropeContext(context_)
+                    : (const char * *) (context_ & ~tagMask);
+            }
         } string;
+        struct {
+            uintptr_t rope_;
+            const char * s; // null
+            StringRope * rope() const { return (StringRope *) (rope_ & ~tagMask); }
+        } rope;
 
-        const char * path;
-        Bindings * attrs;
         struct {
+            uintptr_t elems_;
             size_t size;
-            Value * * elems;
+            Value * * elems() const { return (Value * *) (elems_ & ~tagMask); }
         } bigList;
-        Value * smallList[2];
+        /* A list produced by concatenation may instead be a tree of
+           list fragments (see ListTree below), indicated by
+           `listTreeBit' being set in `size'.  listElems() flattens
+           such a list, so callers never see this representation. */
+        struct {
+            uintptr_t tree_;
+            size_t size;
+            ListTree * tree() const { return (ListTree *) (tree_ & ~tagMask); }
+        } listTree;
         struct {
-            Env * env;
+            uintptr_t env_;
             Expr * expr;
+            Env * env() const { return (Env *) (env_ & ~tagMask); }
         } thunk;
         struct {
-            Value * left, * right;
+            uintptr_t left_;
+            Value * right;
+            Value * left() const { return (Value *) (left_ & ~tagMask); }
         } app;
         struct {
-            Env * env;
+            uintptr_t env_;
             ExprLambda * fun;
+            Env * env() const { return (Env *) (env_ & ~tagMask); }
         } lambda;
-        PrimOp * primOp;
         struct {
-            Value * left, * right;
+            uintptr_t left_;
+            Value * right;
+            Value * left() const { return (Value *) (left_ & ~tagMask); }
         } primOpApp;
-        ExternalValueBase * external;
-        NixFloat fpoint;
     };
 
+    ValueType type() const
+    {
+#if NIX_TAGGED_VALUES
+        static constexpr ValueType types[] = {
+            (ValueType) 0, tThunk, tApp, tLambda, tPrimOpApp, tString, tListN, tString
+        };
+        auto tag = typeWord & tagMask;
+        return tag == tagSingle ? (ValueType) (typeWord >> 3) : types[tag];
+#else
+        return internalType;
+#endif
+    }
+
+    /* Set the type of a value whose payload fits in one word (see
+       above). The payload must be set separately. */
+    void setType(ValueType type)
+    {
+#if NIX_TAGGED_VALUES
+        typeWord = (uintptr_t) type << 3;
+#else
+        internalType = type;
+#endif
+    }
+
+private:
+
+    static const char * * ropeContext(uintptr_t rope_);
+
+    void setTagged(ValueType type, uintptr_t tag, uintptr_t & word, const void * p)
+    {
+#if NIX_TAGGED_VALUES
+        assert(!((uintptr_t) p & tagMask));
+        word = (uintptr_t) p | tag;
+#else
+        internalType = type;
+        word = (uintptr_t) p;
+#endif
+    }
+
+public:
+
+    void setThunk(Env * env, Expr * expr)
+    {
+        setTagged(tThunk, tagThunk, thunk.env_, env);
+        thunk.expr = expr;
+    }
+
+    void setApp(Value * left, Value * right)
+    {
+        setTagged(tApp, tagApp, app.left_, left);
+        app.right = right;
+    }
+
+    void setLambda(Env * env, ExprLambda * fun)
+    {
+        setTagged(tLambda, tagLambda, lambda.env_, env);
+        lambda.fun = fun;
+    }
+
+    void setPrimOpApp(Value * left, Value * right)
+    {
+        setTagged(tPrimOpApp, tagPrimOpApp, primOpApp.left_, left);
+        primOpApp.right = right;
+    }
+
+    void setString(const char * s, const char * * context)
+    {
+        setTagged(tString, tagString, string.context_, context);
+        string.s = s;
+    }
+
+    void setRope(StringRope * r)
+    {
+        setTagged(tString, tagRope, rope.rope_, r);
+        rope.s = 0;
+    }
+
+    bool isRope() const
+    {
+#if NIX_TAGGED_VALUES
+        return (typeWord & tagMask) == tagRope;
+#else
+        return type() == tString && !string.s;
+#endif
+    }
+
+    void setList(Value * * elems, size_t size)
+    {
+        setTagged(tListN, tagList, bigList.elems_, elems);
+        bigList.size = size;
+    }
+
+    void setListTree(ListTree * tree, size_t size)
+    {
+        setTagged(tListN, tagList, listTree.tree_, tree);
+        listTree.size = size | listTreeBit;
+    }
+
+    static constexpr size_t listTreeBit = (size_t) 1 << (sizeof(size_t) * 8 - 1);
+
     bool isList() const
     {
-        return type == tList1 || type == tList2 || type == tListN;
+        auto t = type();
+        return t == tList1 || t == tList2 || t == tListN;
+    }
+
+    bool isListTree() const
+    {
+        return type() == tListN && (bigList.size & listTreeBit);
     }
 
     Value * * listElems()
     {
-        return type == tList1 || type == tList2 ? smallList : bigList.elems;
+        if (type() == tList1) return smallList;
+        if (bigList.size & listTreeBit) return flattenList();
+        return bigList.elems();
     }
 
     const Value * const * listElems() const
     {
-        return type == tList1 || type == tList2 ? smallList : bigList.elems;
+        /* Flattening doesn't change the list's contents, so it's
+           fine to do this on a const value. */
+        return const_cast<Value *>(this)->listElems();
     }
 
     size_t listSize() const
     {
-        return type == tList1 ? 1 : type == tList2 ? 2 : bigList.size;
+        return type() == tList1 ? 1 : bigList.size & ~listTreeBit;
     }
 
+    /* Return the elements of a list tree, flattening it if
+       necessary. The result is cached in the tree rather than in
+       the value, so other evaluation threads never see a value that
+       is half-way converted. */
+    Value * * flattenList();
+
     /* Check whether forcing this value requires a trivial amount of
        computation. In particular, function applications are
        non-trivial. */
     bool isTrivial() const;
 
     std::vector<std::pair<Path, std::string>> getContext();
+
+    /* If this is a string stored as a rope, convert it to a
+       contiguous string. */
+    void flattenString()
+    {
+        if (type() == tString && !string.s) flattenRope();
+    }
+
+    void flattenRope();
+
+#if NIX_TAGGED_VALUES
+    /* Support for forcing values that are shared between evaluation
+       threads (see EvalState::forceValueShared()). A thunk is claimed
+       by atomically replacing its first word, and the result of
+       forcing it is published by writing the second word and then
+       atomically writing the first. */
+    uintptr_t loadTypeWord() const
+    {
+        return __atomic_load_n(&typeWord, __ATOMIC_ACQUIRE);
+    }
+
+    bool claim(uintptr_t expected, uintptr_t desired)
+    {
+        return __atomic_compare_exchange_n(&typeWord, &expected, desired,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+
+    void publish(uintptr_t first, uintptr_t second)
+    {
+        __atomic_store_n(&payloadWord, second, __ATOMIC_RELAXED);
+        __atomic_store_n(&typeWord, first, __ATOMIC_RELEASE);
+    }
+
+    static uintptr_t singleTypeWord(ValueType type)
+    {
+        return (uintptr_t) type << 3;
+    }
+#endif
+};
+
+
+#if NIX_TAGGED_VALUES
+static_assert(sizeof(Value) == 16);
+#endif
+
+
+/* A node in the tree representing a string that was built by
+   concatenation. Leaves point to the (immutable) contents of the
+   concatenated strings, so appending to a rope only allocates a new
+   root rather than copying the existing string. */
+struct StringRope
+{
+    /* Length of the string represented by this node. */
+    size_t size;
+
+    /* For leaves and for nodes that have been flattened, the
+       NUL-terminated contents of the string; null otherwise. */
+    const char * s;
+
+    /* For other nodes, the two halves of the string. */
+    StringRope * left, * right;
+
+    /* The context of the string. Only meaningful for nodes that are
+       directly referenced by a value. */
+    const char * * context;
+};
+
+
+inline const char * * Value::ropeContext(uintptr_t rope_)
+{
+    return ((StringRope *) (rope_ & ~tagMask))->context;
+}
+
+
+/* A node in the tree representing a list that was built by
+   concatenation. Leaves point to the (immutable) element arrays of the
+   concatenated lists, so appending to a list only allocates a new root
+   rather than copying the existing elements. */
+struct ListTree
+{
+    /* Number of elements in the list represented by this node. */
+    size_t size;
+
+    /* For leaves and for nodes that have been flattened, the
+       elements; null otherwise. */
+    Value * * elems;
+
+    /* For other nodes, the two halves of the list. */
+    ListTree * left, * right;
 };
 
 
@@ -180,14 +477,14 @@ struct Value
    Value to ensure that the target isn't kept alive unnecessarily. */
 static inline void clearValue(Value & v)
 {
-    v.app.left = v.app.right = 0;
+    memset(&v, 0, sizeof(v));
 }
 
 
 static inline void mkInt(Value & v, NixInt n)
 {
     clearValue(v);
-    v.type = tInt;
+    v.setType(tInt);
     v.integer = n;
 }
 
@@ -195,7 +492,7 @@ static inline void mkInt(Value & v, NixInt n)
 static inline void mkFloat(Value & v, NixFloat n)
 {
     clearValue(v);
-    v.type = tFloat;
+    v.setType(tFloat);
     v.fpoint = n;
 }
 
@@ -203,7 +500,7 @@ static inline void mkFloat(Value & v, NixFloat n)
 static inline void mkBool(Value & v, bool b)
 {
     clearValue(v);
-    v.type = tBool;
+    v.setType(tBool);
     v.boolean = b;
 }
 
@@ -211,31 +508,25 @@ static inline void mkBool(Value & v, bool b)
 static inline void mkNull(Value & v)
 {
     clearValue(v);
-    v.type = tNull;
+    v.setType(tNull);
 }
 
 
 static inline void mkApp(Value & v, Value & left, Value & right)
 {
-    v.type = tApp;
-    v.app.left = &left;
-    v.app.right = &right;
+    v.setApp(&left, &right);
 }
 
 
 static inline void mkPrimOpApp(Value & v, Value & left, Value & right)
 {
-    v.type = tPrimOpApp;
-    v.app.left = &left;
-    v.app.right = &right;
+    v.setPrimOpApp(&left, &right);
 }
 
 
 static inline void mkStringNoCopy(Value & v, const char * s)
 {
-    v.type = tString;
-    v.string.s = s;
-    v.string.context = 0;
+    v.setString(s, 0);
 }
 
 
@@ -251,7 +542,7 @@ void mkString(Value & v, const char * s);
 static inline void mkPathNoCopy(Value & v, const char * s)
 {
     clearValue(v);
-    v.type = tPath;
+    v.setType(tPath);
     v.path = s;
 }
 
@@ -479,6 +479,30 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddTextsToStore: {
+        std::vector<StoreText> texts;
+        auto count = readNum<size_t>(from);
+        for (size_t n = 0; n < count; n++) {
+            StoreText text;
+            text.name = readString(from);
+            text.contents = readString(from);
+            text.references = worker_proto::read(*store, from, Phantom<StorePathSet> {});
+            texts.push_back(std::move(text));
+        }
+        bool repairBool;
+        from >> repairBool;
+        auto repair = RepairFlag{repairBool};
+        if (repair && !trusted)
+            throw Error("repairing is not allowed because you are not in 'trusted-users'");
+        logger->startWork();
+        auto paths = store->addTextsToStore(texts, repair);
+        logger->stopWork();
+        Strings paths2;
+        for (auto & i : paths) paths2.push_back(store->printStorePath(i));
+        to << paths2;
+        break;
+    }
+
     case wopExportPath: {
         auto path = store->parseStorePath(readString(from));
         readInt(from); // obsolete
@@ -1,4 +1,5 @@
 #include "derivations.hh"
+#include "drv-hash-cache.hh"
 #include "store-api.hh"
 #include "globals.hh"
 #include "util.hh"
@@ -70,8 +71,7 @@ bool BasicDerivation::isBuiltin() const
 }
 
 
-StorePath writeDerivation(Store & store,
-    const Derivation & drv, RepairFlag repair, bool readOnly)
+StoreText storeDerivationText(const Store & store, const Derivation & drv)
 {
     auto references = drv.inputSrcs;
     for (auto & i : drv.inputDrvs)
@@ -79,11 +79,21 @@ StorePath writeDerivation(Store & store,
     /* Note that the outputs of a derivation are *not* references
        (that can be missing (of course) and should not necessarily be
        held during a garbage collection). */
-    auto suffix = std::string(drv.name) + drvExtension;
-    auto contents = drv.unparse(store, false);
+    return {
+        .name = std::string(drv.name) + drvExtension,
+        .contents = drv.unparse(store, false),
+        .references = std::move(references),
+    };
+}
+
+
+StorePath writeDerivation(Store & store,
+    const Derivation & drv, RepairFlag repair, bool readOnly)
+{
+    auto text = storeDerivationText(store, drv);
     return readOnly || settings.readOnlyMode
-        ? store.computeStorePathForText(suffix, contents, references)
-        : store.addTextToStore(suffix, contents, references, repair);
+        ? store.computeStorePathForText(text.name, text.contents, text.references)
+        : store.addTextToStore(text.name, text.contents, text.references, repair);
 }
 
 
@@ -429,7 +439,7 @@ DerivationType BasicDerivation::type() const
 }
 
 
-DrvHashes drvHashes;
+Sync<DrvHashes> drvHashes;
 
 /* pathDerivationModulo and hashDerivationModulo are mutually recursive
  */
@@ -437,20 +447,41 @@ DrvHashes drvHashes;
 /* Look up the derivation by value and memoize the
    `hashDerivationModulo` call.
  */
-static const DrvHashModulo & pathDerivationModulo(Store & store, const StorePath & drvPath)
+static DrvHashModulo pathDerivationModulo(Store & store, const StorePath & drvPath)
 {
-    auto h = drvHashes.find(drvPath);
-    if (h == drvHashes.end()) {
-        assert(store.isValidPath(drvPath));
-        // Cache it
-        h = drvHashes.insert_or_assign(
-            drvPath,
-            hashDerivationModulo(
-                store,
-                store.readDerivation(drvPath),
-                false)).first;
+    {
+        auto hashes(drvHashes.lock());
+        auto h = hashes->find(drvPath);
+        if (h != hashes->end()) return h->second;
+    }
+
+    /* Store derivations are immutable, so a hash computed by a
+       previous process is still valid. */
+    auto diskCache = getDrvHashDiskCache();
+    if (diskCache) {
+        if (auto h = diskCache->lookup(store.printStorePath(drvPath))) {
+            drvHashes.lock()->insert_or_assign(drvPath, *h);
+            return *h;
+        }
     }
-    return h->second;
+
+    if (!store.isValidPath(drvPath))
+        throw Error("cannot compute the hash of derivation '%s' because it is not in the store",
+            store.printStorePath(drvPath));
+    auto h = hashDerivationModulo(
+        store,
+        store.readDerivation(drvPath),
+        false);
+    // Cache it
+    cacheDrvHashModulo(store, drvPath, h);
+    return h;
+}
+
+void cacheDrvHashModulo(const Store & store, const StorePath & drvPath, const DrvHashModulo & h)
+{
+    drvHashes.lock()->insert_or_assign(drvPath, h);
+    if (auto diskCache = getDrvHashDiskCache())
+        diskCache->upsert(store.printStorePath(drvPath), h);
 }
 
 /* See the header for interface details. These are the implementation details.
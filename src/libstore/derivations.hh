@@ -150,9 +150,14 @@ struct Derivation : BasicDerivation
 
 
 class Store;
+struct StoreText;
 
 enum RepairFlag : bool { NoRepair = false, Repair = true };
 
+/* Return the name, contents and references of the store derivation
+   for 'drv', as written by writeDerivation(). */
+StoreText storeDerivationText(const Store & store, const Derivation & drv);
+
 /* Write a derivation to the Nix store, and return its path. */
 StorePath writeDerivation(Store & store,
     const Derivation & drv,
@@ -209,7 +214,12 @@ DrvHashModulo hashDerivationModulo(Store & store, const Derivation & drv, bool m
 /* Memoisation of hashDerivationModulo(). */
 typedef std::map<StorePath, DrvHashModulo> DrvHashes;
 
-extern DrvHashes drvHashes; // FIXME: global, not thread-safe
+extern Sync<DrvHashes> drvHashes;
+
+/* Record the result of hashDerivationModulo(..., false) for the store
+   derivation 'drvPath', both in 'drvHashes' and in the persistent
+   derivation hash cache. */
+void cacheDrvHashModulo(const Store & store, const StorePath & drvPath, const DrvHashModulo & h);
 
 /* Memoisation of `readDerivation(..).resove()`. */
 typedef std::map<
@@ -0,0 +1,218 @@
+#include "drv-hash-cache.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+
+#include <sqlite3.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists DrvHashes (
+    drvPath   text primary key not null,
+    fixed     integer not null,
+    hash      text not null,
+    timestamp integer not null
+);
+
+create table if not exists LastPurge (
+    dummy            text primary key,
+    value            integer
+);
+
+)sql";
+
+class DrvHashDiskCacheImpl : public DrvHashDiskCache
+{
+public:
+
+    /* How often to purge old entries from the cache. */
+    const int purgeInterval = 24 * 3600;
+
+    /* Entries that haven't been written for this long are purged.
+       They are simply recomputed (and written again) when needed. */
+    const int maxAge = 30 * 24 * 3600;
+
+    /* Number of entries to buffer before writing them in a single
+       transaction. */
+    static constexpr size_t batchSize = 256;
+
+    struct Entry
+    {
+        Path drvPath;
+        bool fixed;
+        std::string hash;
+    };
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertHash, queryHash;
+        std::vector<Entry> pending;
+        bool failed = false;
+    };
+
+    Sync<State> _state;
+
+    DrvHashDiskCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/drv-hashes-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertHash.create(state->db,
+            "insert or replace into DrvHashes(drvPath, fixed, hash, timestamp) values (?, ?, ?, ?)");
+
+        state->queryHash.create(state->db,
+            "select fixed, hash from DrvHashes where drvPath = ?");
+
+        /* Periodically purge old entries from the database. */
+        retrySQLite<void>([&]() {
+            auto now = time(0);
+
+            SQLiteStmt queryLastPurge(state->db, "select value from LastPurge");
+            auto queryLastPurge_(queryLastPurge.use());
+
+            if (!queryLastPurge_.next() || queryLastPurge_.getInt(0) < now - purgeInterval) {
+                SQLiteStmt(state->db, "delete from DrvHashes where timestamp < ?")
+                    .use()(now - maxAge).exec();
+
+                debug("deleted %d entries from the derivation hash cache", sqlite3_changes(state->db));
+
+                SQLiteStmt(state->db,
+                    "insert or replace into LastPurge(dummy, value) values ('', ?)")
+                    .use()(now).exec();
+            }
+        });
+    }
+
+    ~DrvHashDiskCacheImpl()
+    {
+        try {
+            auto state(_state.lock());
+            flush(*state);
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    /* Run a cache operation, disabling the cache on the first SQLite
+       error: failing to cache a hash should never fail evaluation. */
+    template<typename F>
+    void doSQLite(State & state, F && fun)
+    {
+        if (state.failed) return;
+        try {
+            retrySQLite<void>(fun);
+        } catch (SQLiteError &) {
+            ignoreException();
+            state.failed = true;
+        }
+    }
+
+    void flush(State & state)
+    {
+        if (state.pending.empty()) return;
+
+        doSQLite(state, [&]() {
+            auto now = time(0);
+            SQLiteTxn txn(state.db);
+            for (auto & entry : state.pending)
+                state.insertHash.use()
+                    (entry.drvPath)
+                    (entry.fixed)
+                    (entry.hash)
+                    (now).exec();
+            txn.commit();
+        });
+
+        state.pending.clear();
+    }
+
+    std::optional<DrvHashModulo> lookup(const Path & drvPath) override
+    {
+        auto state(_state.lock());
+
+        std::optional<DrvHashModulo> res;
+
+        doSQLite(*state, [&]() {
+            auto queryHash(state->queryHash.use()(drvPath));
+            if (!queryHash.next()) return;
+
+            auto hash = queryHash.getStr(1);
+
+            try {
+                if (!queryHash.getInt(0)) {
+                    res = Hash::parseAnyPrefixed(hash);
+                    return;
+                }
+
+                CaOutputHashes outputHashes;
+                for (auto & s : tokenizeString<Strings>(hash, " ")) {
+                    auto eq = s.rfind('=');
+                    if (eq == std::string::npos)
+                        throw Error("invalid output hash '%s'", s);
+                    outputHashes.insert_or_assign(
+                        s.substr(0, eq),
+                        Hash::parseAnyPrefixed(s.substr(eq + 1)));
+                }
+                res = std::move(outputHashes);
+            } catch (Error &) {
+                debug("ignoring invalid cached hash for '%s'", drvPath);
+            }
+        });
+
+        return res;
+    }
+
+    void upsert(const Path & drvPath, const DrvHashModulo & hash) override
+    {
+        Entry entry { .drvPath = drvPath };
+
+        std::visit(overloaded {
+            [&](const Hash & drvHash) {
+                entry.fixed = false;
+                entry.hash = drvHash.to_string(Base32, true);
+            },
+            [&](const CaOutputHashes & outputHashes) {
+                entry.fixed = true;
+                for (auto & [outputName, h] : outputHashes) {
+                    if (!entry.hash.empty()) entry.hash += ' ';
+                    entry.hash += outputName + "=" + h.to_string(Base32, true);
+                }
+            },
+        }, hash);
+
+        auto state(_state.lock());
+        if (state->failed) return;
+        state->pending.push_back(std::move(entry));
+        if (state->pending.size() >= batchSize)
+            flush(*state);
+    }
+};
+
+std::shared_ptr<DrvHashDiskCache> getDrvHashDiskCache()
+{
+    if (!settings.drvHashCache) return nullptr;
+
+    static std::shared_ptr<DrvHashDiskCache> cache = []() -> std::shared_ptr<DrvHashDiskCache> {
+        try {
+            return std::make_shared<DrvHashDiskCacheImpl>();
+        } catch (Error & e) {
+            debug("not using the derivation hash cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+
+    return cache;
+}
+
+}
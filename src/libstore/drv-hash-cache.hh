@@ -0,0 +1,28 @@
+#pragma once
+
+#include "derivations.hh"
+
+namespace nix {
+
+/* A persistent cache of hashDerivationModulo() results for store
+   derivations, keyed by their (printed) store path. Since a store
+   derivation is immutable, entries never need to be invalidated. */
+class DrvHashDiskCache
+{
+public:
+
+    virtual ~DrvHashDiskCache() { }
+
+    virtual std::optional<DrvHashModulo> lookup(const Path & drvPath) = 0;
+
+    /* Record a hash. Writes may be buffered; they are flushed in
+       batches and when the cache is destroyed. */
+    virtual void upsert(const Path & drvPath, const DrvHashModulo & hash) = 0;
+};
+
+/* Return a singleton cache object that can be used concurrently by
+   multiple threads, or nullptr if the cache is disabled or cannot be
+   opened. */
+std::shared_ptr<DrvHashDiskCache> getDrvHashDiskCache();
+
+}
@@ -661,6 +661,17 @@ public:
           mismatch if the build isn't reproducible.
         )"};
 
+    Setting<bool> drvHashCache{
+        this, true, "drv-hash-cache",
+        R"(
+          Whether to cache the hashes of store derivations that are
+          computed when instantiating derivations in a database under
+          `~/.cache/nix`. Since these hashes depend on the entire
+          closure of input derivations, this avoids reading and hashing
+          every `.drv` file in that closure again in each new Nix
+          process.
+        )"};
+
     /* ?Who we trust to use the daemon in safe ways */
     Setting<Strings> allowedUsers{
         this, {"*"}, "allowed-users",
@@ -1284,51 +1284,87 @@ StorePath LocalStore::addToStoreFromDump(Source & source0, const string & name,
 StorePath LocalStore::addTextToStore(const string & name, const string & s,
     const StorePathSet & references, RepairFlag repair)
 {
-    auto hash = hashString(htSHA256, s);
-    auto dstPath = makeTextPath(name, TextInfo {
-        { .hash = hash },
-        references,
-    });
+    return addTextsToStore({{name, s, references}}, repair).front();
+}
 
-    addTempRoot(dstPath);
 
-    if (repair || !isValidPath(dstPath)) {
+StorePaths LocalStore::addTextsToStore(const std::vector<StoreText> & texts,
+    RepairFlag repair)
+{
+    struct Todo
+    {
+        const StoreText & text;
+        Hash hash;
+        StorePath path;
+    };
 
-        auto realPath = Store::toRealPath(dstPath);
+    StorePaths paths;
+    std::vector<Todo> todo;
+    StorePathSet seen;
 
-        PathLocks outputLock({realPath});
+    for (auto & text : texts) {
+        auto hash = hashString(htSHA256, text.contents);
+        auto dstPath = makeTextPath(text.name, TextInfo {
+            { .hash = hash },
+            text.references,
+        });
 
-        if (repair || !isValidPath(dstPath)) {
+        addTempRoot(dstPath);
 
-            deletePath(realPath);
+        if (seen.insert(dstPath).second && (repair || !isValidPath(dstPath)))
+            todo.push_back({text, hash, dstPath});
 
-            autoGC();
+        paths.push_back(std::move(dstPath));
+    }
 
-            writeFile(realPath, s);
+    if (todo.empty()) return paths;
 
-            canonicalisePathMetaData(realPath, -1);
+    PathSet realPaths;
+    for (auto & i : todo)
+        realPaths.insert(Store::toRealPath(i.path));
 
-            StringSink sink;
-            dumpString(s, sink);
-            auto narHash = hashString(htSHA256, *sink.s);
+    PathLocks outputLocks(realPaths);
 
-            optimisePath(realPath);
+    autoGC();
 
-            ValidPathInfo info {
-                dstPath,
-                std::pair<HashResult, ContentAddress> {
-                    { narHash, sink.s->size() },
-                    TextHash { .hash = hash },
-                },
-            };
-            info.references = references;
-            registerValidPath(info);
-        }
+    /* Write all files that are (still) invalid, then register them in
+       a single transaction. */
+    ValidPathInfos infos;
 
-        outputLock.setDeletion(true);
+    for (auto & i : todo) {
+        if (!repair && isValidPath(i.path)) continue;
+
+        auto realPath = Store::toRealPath(i.path);
+
+        deletePath(realPath);
+
+        writeFile(realPath, i.text.contents);
+
+        canonicalisePathMetaData(realPath, -1);
+
+        StringSink sink;
+        dumpString(i.text.contents, sink);
+        auto narHash = hashString(htSHA256, *sink.s);
+
+        optimisePath(realPath);
+
+        ValidPathInfo info {
+            i.path,
+            std::pair<HashResult, ContentAddress> {
+                { narHash, sink.s->size() },
+                TextHash { .hash = i.hash },
+            },
+        };
+        info.references = i.text.references;
+        infos.push_back(std::move(info));
     }
 
-    return dstPath;
+    if (!infos.empty())
+        registerValidPaths(infos);
+
+    outputLocks.setDeletion(true);
+
+    return paths;
 }
 
 
@@ -157,6 +157,9 @@ public:
     StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair) override;
 
+    StorePaths addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair) override;
+
     void buildPaths(
         const std::vector<StorePathWithOutputs> & paths,
         BuildMode buildMode) override;
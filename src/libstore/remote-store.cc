@@ -645,6 +645,32 @@ StorePath RemoteStore::addTextToStore(const string & name, const string & s,
 }
 
 
+StorePaths RemoteStore::addTextsToStore(const std::vector<StoreText> & texts,
+    RepairFlag repair)
+{
+    std::optional<ConnectionHandle> conn_(getConnection());
+    auto & conn = *conn_;
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 27) {
+        conn_.reset();
+        return Store::addTextsToStore(texts, repair);
+    }
+
+    conn->to << wopAddTextsToStore << texts.size();
+    for (auto & text : texts) {
+        conn->to << text.name << text.contents;
+        worker_proto::write(*this, conn->to, text.references);
+    }
+    conn->to << repair;
+    conn.processStderr();
+
+    StorePaths paths;
+    for (auto & s : readStrings<Strings>(conn->from))
+        paths.push_back(parseStorePath(s));
+    return paths;
+}
+
+
 void RemoteStore::buildPaths(const std::vector<StorePathWithOutputs> & drvPaths, BuildMode buildMode)
 {
     auto conn(getConnection());
@@ -358,6 +358,15 @@ StorePath Store::computeStorePathForText(const string & name, const string & s,
 }
 
 
+StorePaths Store::addTextsToStore(const std::vector<StoreText> & texts, RepairFlag repair)
+{
+    StorePaths paths;
+    for (auto & text : texts)
+        paths.push_back(addTextToStore(text.name, text.contents, text.references, repair));
+    return paths;
+}
+
+
 StorePath Store::addToStore(const string & name, const Path & _srcPath,
     FileIngestionMethod method, HashType hashAlgo, PathFilter & filter, RepairFlag repair)
 {
@@ -170,6 +170,14 @@ struct BuildResult
     }
 };
 
+/* A regular file to be added by Store::addTextsToStore(). */
+struct StoreText
+{
+    std::string name;
+    std::string contents;
+    StorePathSet references;
+};
+
 /* Useful for many store functions which can take advantage of content
    addresses or work with regular store paths */
 typedef std::variant<StorePath, StorePathDescriptor> OwnedStorePathOrDesc;
@@ -477,6 +485,13 @@ public:
     virtual StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair = NoRepair) = 0;
 
+    /* Like addTextToStore(), but for several files at once, so that
+       stores can register them in a single operation. A text may
+       refer to texts that precede it in 'texts'. Returns the store
+       paths in the same order. */
+    virtual StorePaths addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair = NoRepair);
+
     /* Write a NAR dump of a store path. */
     virtual void narFromPath(StorePathOrDesc desc, Sink & sink) = 0;
 
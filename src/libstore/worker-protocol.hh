@@ -6,7 +6,7 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION 0x11a
+#define PROTOCOL_VERSION 0x11b
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -51,6 +51,7 @@ typedef enum {
     wopQueryMissing = 40,
     wopQueryDerivationOutputMap = 41,
     wopSync = 42,
+    wopAddTextsToStore = 43,
 } WorkerOp;
 
 
@@ -70,17 +70,25 @@ struct ErrPos {
     int line = 0;
     int column = 0;
     string file;
-    FileOrigin origin;
+    FileOrigin origin = foString;
+
+    ErrPos() { }
+
+    ErrPos(FileOrigin origin, const string & file, int line, int column)
+        : line(line), column(column), file(file), origin(origin)
+    { }
 
     operator bool() const
     {
         return line != 0;
     }
 
-    // convert from the Pos struct, found in libexpr.
+    // convert from the Pos struct, found in libexpr, which is resolved
+    // to its file, line and column.
     template <class P>
-    ErrPos& operator=(const P &pos)
+    ErrPos& operator=(const P &pos_)
     {
+        auto pos = pos_.resolve();
         origin = pos.origin;
         line = pos.line;
         column = pos.column;
@@ -45,7 +45,7 @@ namespace nix {
                 .hint = hintfmt("this hint has %1% templated %2%!!",
                     "yellow",
                     "values"),
-                .errPos = Pos(foFile, problem_file, 02, 13)
+                .errPos = ErrPos(foFile, problem_file, 02, 13)
             });
 
         auto str = testing::internal::GetCapturedStderr();
@@ -186,7 +186,7 @@ namespace nix {
                 .hint = hintfmt("this hint has %1% templated %2%!!",
                     "yellow",
                     "values"),
-                .errPos = Pos(foString, problem_file, 02, 13),
+                .errPos = ErrPos(foString, problem_file, 02, 13),
             });
 
         auto str = testing::internal::GetCapturedStderr();
@@ -204,7 +204,7 @@ namespace nix {
                 .hint = hintfmt("this hint has %1% templated %2%!!",
                     "yellow",
                     "values"),
-                .errPos = Pos(foFile, problem_file, 02, 13)
+                .errPos = ErrPos(foFile, problem_file, 02, 13)
             });
 
         auto str = testing::internal::GetCapturedStderr();
@@ -254,7 +254,7 @@ namespace nix {
                 .hint = hintfmt("this hint has %1% templated %2%!!",
                     "yellow",
                     "values"),
-                .errPos = Pos(foStdin, problem_file, 2, 13),
+                .errPos = ErrPos(foStdin, problem_file, 2, 13),
             });
 
 
@@ -276,12 +276,12 @@ namespace nix {
                 .name = "wat",
                 .description = "show-traces",
                 .hint = hintfmt("it has been %1% days since our last error", "zero"),
-                .errPos = Pos(foString, problem_file, 2, 13),
+                .errPos = ErrPos(foString, problem_file, 2, 13),
             });
 
-        e.addTrace(Pos(foStdin, oneliner_file, 1, 19), "while trying to compute %1%", 42);
+        e.addTrace(ErrPos(foStdin, oneliner_file, 1, 19), "while trying to compute %1%", 42);
         e.addTrace(std::nullopt, "while doing something without a %1%", "pos");
-        e.addTrace(Pos(foFile, invalidfilename, 100, 1), "missing %s", "nix file");
+        e.addTrace(ErrPos(foFile, invalidfilename, 100, 1), "missing %s", "nix file");
 
         testing::internal::CaptureStderr();
 
@@ -303,12 +303,12 @@ namespace nix {
                 .name = "wat",
                 .description = "hide traces",
                 .hint = hintfmt("it has been %1% days since our last error", "zero"),
-                .errPos = Pos(foString, problem_file, 2, 13),
+                .errPos = ErrPos(foString, problem_file, 2, 13),
             });
 
-        e.addTrace(Pos(foStdin, oneliner_file, 1, 19), "while trying to compute %1%", 42);
+        e.addTrace(ErrPos(foStdin, oneliner_file, 1, 19), "while trying to compute %1%", 42);
         e.addTrace(std::nullopt, "while doing something without a %1%", "pos");
-        e.addTrace(Pos(foFile, invalidfilename, 100, 1), "missing %s", "nix file");
+        e.addTrace(ErrPos(foFile, invalidfilename, 100, 1), "missing %s", "nix file");
 
         testing::internal::CaptureStderr();
 
@@ -366,7 +366,7 @@ namespace nix {
     TEST(errpos, invalidPos) {
 
       // contains an invalid symbol, which we should not dereference!
-      Pos invalid;
+      Pos::Resolved invalid;
 
       // constructing without access violation.
       ErrPos ep(invalid);
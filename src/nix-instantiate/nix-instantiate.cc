@@ -49,12 +49,23 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 vRes = v;
             else
                 state.autoCallFunction(autoArgs, v, vRes);
-            if (output == okXML)
+            /* Queued derivations are written before printing the
+               result (which may refer to them), so that write errors
+               are reported. */
+            if (output == okXML) {
                 printValueAsXML(state, strict, location, vRes, std::cout, context);
-            else if (output == okJSON)
-                printValueAsJSON(state, strict, vRes, std::cout, context);
+                state.flushDerivations();
+            }
+            else if (output == okJSON) {
+                std::cout.flush();
+                FdSink out(STDOUT_FILENO);
+                printValueAsJSON(state, strict, vRes, out, context, false);
+                out.flush();
+                state.flushDerivations();
+            }
             else {
                 if (strict) state.forceValueDeep(vRes);
+                state.flushDerivations();
                 std::cout << vRes << std::endl;
             }
         } else {
@@ -188,6 +199,8 @@ static int main_nix_instantiate(int argc, char * * argv)
                 evalOnly, outputKind, xmlOutputSourceLocation, e);
         }
 
+        state->flushDerivations();
+
         state->printStats();
 
         store->sync();
@@ -104,14 +104,15 @@ struct CmdBundle : InstallableCommand
             throw Error("the bundler '%s' does not produce a derivation", bundler.what());
 
         PathSet context2;
-        StorePath drvPath = store->parseStorePath(evalState->coerceToPath(*attr1->pos, *attr1->value, context2));
+        StorePath drvPath = store->parseStorePath(evalState->coerceToPath(attr1->pos, *attr1->value, context2));
 
         auto attr2 = vRes->attrs->get(evalState->sOutPath);
         if (!attr2)
             throw Error("the bundler '%s' does not produce a derivation", bundler.what());
 
-        StorePath outPath = store->parseStorePath(evalState->coerceToPath(*attr2->pos, *attr2->value, context2));
+        StorePath outPath = store->parseStorePath(evalState->coerceToPath(attr2->pos, *attr2->value, context2));
 
+        evalState->flushDerivations();
         store->buildPaths({{drvPath}});
 
         auto outPathS = store->printStorePath(outPath);
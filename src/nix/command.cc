@@ -104,7 +104,7 @@ void StorePathCommand::run(ref<Store> store)
     run(store, *storePaths.begin());
 }
 
-Strings editorFor(const Pos & pos)
+Strings editorFor(const ErrPos & pos)
 {
     auto editor = getEnv("EDITOR").value_or("cat");
     auto args = tokenizeString<Strings>(editor);
@@ -209,7 +209,7 @@ std::set<StorePath> toDerivations(ref<Store> store,
 
 /* Helper function to generate args that invoke $EDITOR on
    filename:lineno. */
-Strings editorFor(const Pos & pos);
+Strings editorFor(const ErrPos & pos);
 
 struct MixProfile : virtual StoreCommand
 {
@@ -31,14 +31,16 @@ struct CmdEdit : InstallableCommand
     {
         auto state = getEvalState();
 
-        auto [v, pos] = installable->toValue(*state);
+        auto [v, valuePos] = installable->toValue(*state);
+
+        ErrPos pos = valuePos;
 
         try {
             pos = findDerivationFilename(*state, *v, installable->what());
         } catch (NoPositionInfo &) {
         }
 
-        if (pos == noPos)
+        if (!pos)
             throw Error("cannot find position information for '%s", installable->what());
 
         stopProgressBar();
@@ -77,14 +77,24 @@ struct CmdEval : MixJSON, InstallableCommand
             v = vRes;
         }
 
+        /* Queued derivations are written before printing the result
+           (which may refer to them), so that write errors are
+           reported. */
         if (raw) {
+            auto s = state->coerceToString(noPos, *v, context);
+            state->flushDerivations();
             stopProgressBar();
-            std::cout << state->coerceToString(noPos, *v, context);
+            std::cout << s;
         } else if (json) {
-            JSONPlaceholder jsonOut(std::cout);
-            printValueAsJSON(*state, true, *v, jsonOut, context);
+            /* Write the result as it is evaluated, without keeping
+               the parts that have been written. */
+            FdSink out(STDOUT_FILENO);
+            printValueAsJSON(*state, true, *v, out, context, false);
+            out.flush();
+            state->flushDerivations();
         } else {
             state->forceValueDeep(*v);
+            state->flushDerivations();
             logger->stdout_("%s", *v);
         }
     }
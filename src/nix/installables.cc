@@ -421,10 +421,10 @@ ref<eval_cache::EvalCache> openEvalCache(
     EvalState & state,
     std::shared_ptr<flake::LockedFlake> lockedFlake)
 {
-    auto fingerprint = lockedFlake->getFingerprint(*state.store);
+    auto sources = lockedFlake->getCacheSources(*state.store);
     return make_ref<nix::eval_cache::EvalCache>(
         evalSettings.useEvalCache && evalSettings.pureEval
-            ? std::optional { std::cref(fingerprint) }
+            ? std::optional { std::cref(sources) }
             : std::nullopt,
         state,
         [&state, lockedFlake]()
@@ -478,6 +478,23 @@ std::tuple<std::string, FlakeRef, InstallableValue::DerivationInfo> InstallableF
             attr->getAttr(state->sOutputName)->getString()
         };
 
+        /* Read the metadata through the cursor, so that 'nix profile'
+           doesn't have to evaluate anything if it's cached. */
+        std::vector<std::string> outputsToInstall;
+        if (auto aMeta = attr->maybeGetAttr("meta")) {
+            if (auto aOutputsToInstall = aMeta->maybeGetAttr("outputsToInstall"))
+                outputsToInstall = aOutputsToInstall->getListOfStrings();
+            if (auto aPriority = aMeta->maybeGetAttr("priority"))
+                drvInfo.priority = aPriority->getInt();
+        }
+
+        if (outputsToInstall.empty())
+            drvInfo.outputsToInstall.insert_or_assign(drvInfo.outputName, drvInfo.outPath);
+        else
+            for (auto & output : outputsToInstall)
+                drvInfo.outputsToInstall.insert_or_assign(output,
+                    state->store->parseStorePath(attr->getAttr(output)->getAttr(state->sOutPath)->getString()));
+
         return {attrPath, lockedFlake->flake.lockedRef, std::move(drvInfo)};
     }
 
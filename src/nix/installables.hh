@@ -84,6 +84,11 @@ struct InstallableValue : Installable
         StorePath drvPath;
         std::optional<StorePath> outPath;
         std::string outputName;
+        /* The outputs named by 'meta.outputsToInstall' (or just the
+           output above) and their paths. Only set for flakes. */
+        std::map<std::string, std::optional<StorePath>> outputsToInstall;
+        /* The value of 'meta.priority'. Only set for flakes. */
+        NixInt priority = 5;
     };
 
     virtual std::vector<DerivationInfo> toDerivations() = 0;
@@ -28,7 +28,7 @@ struct ProfileElement
     StorePathSet storePaths;
     std::optional<ProfileElementSource> source;
     bool active = true;
-    // FIXME: priority
+    NixInt priority = 5;
 };
 
 struct ProfileManifest
@@ -53,6 +53,7 @@ struct ProfileManifest
                 for (auto & p : e["storePaths"])
                     element.storePaths.insert(state.store->parseStorePath((std::string) p));
                 element.active = e["active"];
+                element.priority = e.value("priority", 5);
                 if (e.value("uri", "") != "") {
                     element.source = ProfileElementSource{
                         parseFlakeRef(e["originalUri"]),
@@ -76,6 +77,7 @@ struct ProfileManifest
             for (auto & drvInfo : drvInfos) {
                 ProfileElement element;
                 element.storePaths = {state.store->parseStorePath(drvInfo.queryOutPath())};
+                element.priority = drvInfo.queryMetaInt("priority", 5);
                 elements.emplace_back(std::move(element));
             }
         }
@@ -91,6 +93,7 @@ struct ProfileManifest
             nlohmann::json obj;
             obj["storePaths"] = paths;
             obj["active"] = element.active;
+            obj["priority"] = element.priority;
             if (element.source) {
                 obj["originalUri"] = element.source->originalRef.to_string();
                 obj["uri"] = element.source->resolvedRef.to_string();
@@ -114,7 +117,7 @@ struct ProfileManifest
         for (auto & element : elements) {
             for (auto & path : element.storePaths) {
                 if (element.active)
-                    pkgs.emplace_back(store->printStorePath(path), true, 5);
+                    pkgs.emplace_back(store->printStorePath(path), true, element.priority);
                 references.insert(path);
             }
         }
@@ -188,16 +191,21 @@ struct CmdProfileInstall : InstallablesCommand, MixDefaultProfile
                 auto [attrPath, resolvedRef, drv] = installable2->toDerivation();
 
                 ProfileElement element;
-                if (!drv.outPath)
-                    throw UnimplementedError("CA derivations are not yet supported by 'nix profile'");
-                element.storePaths = {*drv.outPath}; // FIXME
+                StringSet outputs;
+                for (auto & [outputName, outPath] : drv.outputsToInstall) {
+                    if (!outPath)
+                        throw UnimplementedError("CA derivations are not yet supported by 'nix profile'");
+                    element.storePaths.insert(*outPath);
+                    outputs.insert(outputName);
+                }
                 element.source = ProfileElementSource{
                     installable2->flakeRef,
                     resolvedRef,
                     attrPath,
                 };
+                element.priority = drv.priority;
 
-                pathsToBuild.push_back({drv.drvPath, StringSet{"out"}}); // FIXME
+                pathsToBuild.push_back({drv.drvPath, outputs});
 
                 manifest.elements.emplace_back(std::move(element));
             } else
@@ -359,16 +367,22 @@ struct CmdProfileUpgrade : virtual SourceExprCommand, MixDefaultProfile, MixProf
                 printInfo("upgrading '%s' from flake '%s' to '%s'",
                     element.source->attrPath, element.source->resolvedRef, resolvedRef);
 
-                if (!drv.outPath)
-                    throw UnimplementedError("CA derivations are not yet supported by 'nix profile'");
-                element.storePaths = {*drv.outPath}; // FIXME
+                StringSet outputs;
+                element.storePaths.clear();
+                for (auto & [outputName, outPath] : drv.outputsToInstall) {
+                    if (!outPath)
+                        throw UnimplementedError("CA derivations are not yet supported by 'nix profile'");
+                    element.storePaths.insert(*outPath);
+                    outputs.insert(outputName);
+                }
                 element.source = ProfileElementSource{
                     installable.flakeRef,
                     resolvedRef,
                     attrPath,
                 };
+                element.priority = drv.priority;
 
-                pathsToBuild.push_back({drv.drvPath, StringSet{"out"}}); // FIXME
+                pathsToBuild.push_back({drv.drvPath, outputs});
             }
         }
 
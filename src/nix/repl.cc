@@ -444,13 +444,13 @@ bool NixRepl::processLine(string line)
         Value v;
         evalString(arg, v);
 
-        Pos pos;
+        ErrPos pos;
 
-        if (v.type == tPath || v.type == tString) {
+        if (v.type() == tPath || v.type() == tString) {
             PathSet context;
             auto filename = state->coerceToString(noPos, v, context);
-            pos.file = state->symbols.create(filename);
-        } else if (v.type == tLambda) {
+            pos = ErrPos(foFile, filename, 0, 0);
+        } else if (v.type() == tLambda) {
             pos = v.lambda.fun->pos;
         } else {
             // assume it's a derivation
@@ -510,6 +510,7 @@ bool NixRepl::processLine(string line)
         Value v;
         evalString(arg, v);
         printValue(std::cout, v, 1000000000) << std::endl;
+        state->flushDerivations();
     }
 
     else if (command == ":q" || command == ":quit")
@@ -551,14 +552,13 @@ bool NixRepl::processLine(string line)
         {
             Expr * e = parseString(string(line, p + 1));
             Value & v(*state->allocValue());
-            v.type = tThunk;
-            v.thunk.env = env;
-            v.thunk.expr = e;
+            v.setThunk(env, e);
             addVarToScope(state->symbols.create(name), v);
         } else {
             Value v;
             evalString(line, v);
             printValue(std::cout, v, 1) << std::endl;
+            state->flushDerivations();
         }
     }
 
@@ -669,7 +669,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
 
     state->forceValue(v);
 
-    switch (v.type) {
+    switch (v.type()) {
 
     case tInt:
         str << ANSI_CYAN << v.integer << ANSI_NORMAL;
@@ -681,6 +681,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
 
     case tString:
         str << ANSI_YELLOW;
+        v.flattenString();
         printStringValue(str, v.string.s);
         str << ANSI_NORMAL;
         break;
@@ -702,7 +703,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
             str << "«derivation ";
             Bindings::iterator i = v.attrs->find(state->sDrvPath);
             PathSet context;
-            Path drvPath = i != v.attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "???";
+            Path drvPath = i != v.attrs->end() ? state->coerceToPath(i->pos, *i->value, context) : "???";
             str << drvPath << "»";
         }
 
@@ -819,6 +820,9 @@ struct CmdRepl : StoreCommand, MixEvalArgs
     void run(ref<Store> store) override
     {
         evalSettings.pureEval = false;
+        /* The REPL can run for a long time, so don't keep all values
+           alive until it exits. */
+        evalSettings.useArena = false;
         auto repl = std::make_unique<NixRepl>(searchPath, openStore());
         repl->autoArgs = getAutoArgs(*repl->state);
         repl->mainLoop(files);
@@ -9,6 +9,8 @@
 #include "shared.hh"
 #include "eval-cache.hh"
 #include "attr-path.hh"
+#include "installables.hh"
+#include "sqlite.hh"
 
 #include <regex>
 #include <fstream>
@@ -30,6 +32,226 @@ std::string hilite(const std::string & s, const std::smatch & m, std::string pos
           + std::string(m.suffix());
 }
 
+struct PackageInfo
+{
+    std::string attrPath;
+    std::string pname, version;
+    std::string description;
+};
+
+/* Return the trigram (three consecutive bytes) at 'p', lower-cased in
+   the same way as by case-insensitive regexes. */
+static uint32_t trigram(const char * p)
+{
+    auto lower = [](char c) -> uint32_t
+    {
+        return (unsigned char) (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+    };
+    return lower(p[0]) << 16 | lower(p[1]) << 8 | lower(p[2]);
+}
+
+static void addTrigrams(std::string_view s, std::set<uint32_t> & trigrams)
+{
+    for (size_t i = 0; i + 3 <= s.size(); ++i)
+        trigrams.insert(trigram(s.data() + i));
+}
+
+/* Whether the extended regex 're' matches only the string 're'
+   itself. */
+static bool isLiteral(std::string_view re)
+{
+    return re.find_first_of("\\.[]()*+?{}|^$") == re.npos;
+}
+
+static const char * schema = R"sql(
+create table if not exists Packages (
+    id          integer primary key not null,
+    attrPath    text not null,
+    pname       text not null,
+    version     text not null,
+    description text not null
+);
+
+create table if not exists Trigrams (
+    trigram     integer primary key not null,
+    packages    blob not null
+);
+
+create table if not exists Complete (
+    complete    integer not null
+);
+)sql";
+
+/* An index of the packages in a locked flake, so that searching it
+   again doesn't require evaluation. It stores the packages in the
+   order in which they were found, and for every trigram in their
+   attribute paths, names and descriptions, the IDs of the packages
+   containing it (as delta-encoded varints). A package can only match
+   a literal search term if it contains all of the term's trigrams,
+   so only those packages need to be matched against the regexes.
+   Other search terms are handled by matching every package. */
+struct SearchIndex
+{
+    SQLite db;
+    SQLiteStmt queryPackage, queryPackages, queryTrigram;
+
+    SearchIndex(const Hash & key)
+    {
+        Path cacheDir = getCacheDir() + "/nix/search-index-v1";
+        createDirs(cacheDir);
+
+        db = SQLite(cacheDir + "/" + key.to_string(Base16, false) + ".sqlite");
+        db.isCache();
+        db.exec(schema);
+
+        queryPackage.create(db,
+            "select attrPath, pname, version, description from Packages where id = ?");
+
+        queryPackages.create(db,
+            "select attrPath, pname, version, description from Packages order by id");
+
+        queryTrigram.create(db,
+            "select packages from Trigrams where trigram = ?");
+    }
+
+    /* Whether the index has been written completely. */
+    bool isComplete()
+    {
+        SQLiteStmt queryComplete(db, "select 1 from Complete");
+        return queryComplete.use().next();
+    }
+
+    void write(const std::vector<PackageInfo> & packages)
+    {
+        SQLiteTxn txn(db);
+
+        db.exec("delete from Packages; delete from Trigrams; delete from Complete");
+
+        SQLiteStmt insertPackage(db,
+            "insert into Packages(id, attrPath, pname, version, description) values (?, ?, ?, ?, ?)");
+
+        /* The last package ID and the postings of each trigram. */
+        std::map<uint32_t, std::pair<uint64_t, std::string>> postings;
+
+        for (const auto & [n, package] : enumerate(packages)) {
+            uint64_t id = n + 1;
+
+            insertPackage.use()
+                (id)
+                (package.attrPath)
+                (package.pname)
+                (package.version)
+                (package.description)
+                .exec();
+
+            std::set<uint32_t> trigrams;
+            addTrigrams(package.attrPath, trigrams);
+            addTrigrams(package.pname, trigrams);
+            addTrigrams(package.description, trigrams);
+
+            for (auto t : trigrams) {
+                auto & [lastId, ids] = postings[t];
+                for (auto delta = id - lastId; ; delta >>= 7) {
+                    if (delta < 0x80) {
+                        ids.push_back((char) delta);
+                        break;
+                    }
+                    ids.push_back((char) (delta | 0x80));
+                }
+                lastId = id;
+            }
+        }
+
+        SQLiteStmt insertTrigram(db,
+            "insert into Trigrams(trigram, packages) values (?, ?)");
+
+        for (auto & [t, posting] : postings)
+            insertTrigram.use()
+                ((int64_t) t)
+                ((const unsigned char *) posting.second.data(), posting.second.size())
+                .exec();
+
+        db.exec("insert into Complete values (1)");
+
+        txn.commit();
+    }
+
+    /* Return the IDs of the packages that contain every trigram of
+       the literal search terms, or nothing if the terms don't have
+       any trigrams. */
+    std::optional<std::vector<uint64_t>> getCandidates(const std::vector<std::string> & terms)
+    {
+        std::set<uint32_t> trigrams;
+        for (auto & term : terms)
+            if (isLiteral(term))
+                addTrigrams(term, trigrams);
+
+        if (trigrams.empty()) return std::nullopt;
+
+        std::optional<std::vector<uint64_t>> res;
+
+        for (auto t : trigrams) {
+            std::vector<uint64_t> ids;
+
+            auto query(queryTrigram.use()((int64_t) t));
+            if (query.next()) {
+                /* The postings don't contain zero bytes, since the
+                   deltas are non-zero. */
+                uint64_t id = 0, delta = 0;
+                unsigned int shift = 0;
+                for (unsigned char c : query.getStr(0)) {
+                    delta |= (uint64_t) (c & 0x7f) << shift;
+                    if (c & 0x80)
+                        shift += 7;
+                    else {
+                        id += delta;
+                        ids.push_back(id);
+                        delta = 0;
+                        shift = 0;
+                    }
+                }
+            }
+
+            if (res) {
+                std::vector<uint64_t> res2;
+                std::set_intersection(res->begin(), res->end(), ids.begin(), ids.end(),
+                    std::back_inserter(res2));
+                *res = std::move(res2);
+            } else
+                res = std::move(ids);
+
+            if (res->empty()) break;
+        }
+
+        return res;
+    }
+
+    static PackageInfo getPackage(SQLiteStmt::Use & query)
+    {
+        return PackageInfo {
+            .attrPath = query.getStr(0),
+            .pname = query.getStr(1),
+            .version = query.getStr(2),
+            .description = query.getStr(3)
+        };
+    }
+
+    PackageInfo getPackage(uint64_t id)
+    {
+        auto query(queryPackage.use()(id));
+        if (!query.next())
+            throw Error("package %d is missing from the search index", id);
+        return getPackage(query);
+    }
+
+    void forEachPackage(std::function<void(const PackageInfo &)> fun)
+    {
+        auto query(queryPackages.use());
+        while (query.next())
+            fun(getPackage(query));
+    }
+};
+
 struct CmdSearch : InstallableCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -96,89 +318,136 @@ struct CmdSearch : InstallableCommand, MixJSON
 
         uint64_t results = 0;
 
-        std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath)> visit;
-
-        visit = [&](eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath)
+        auto show = [&](const PackageInfo & package)
         {
-            Activity act(*logger, lvlInfo, actUnknown,
-                fmt("evaluating '%s'", concatStringsSep(".", attrPath)));
+            size_t found = 0;
+
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
+
+            for (auto & regex : regexes) {
+                std::regex_search(package.attrPath, attrPathMatch, regex);
+                std::regex_search(package.pname, nameMatch, regex);
+                std::regex_search(package.description, descriptionMatch, regex);
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                    found++;
+            }
+
+            if (found == res.size()) {
+                results++;
+                if (json) {
+                    auto jsonElem = jsonOut->object(package.attrPath);
+                    jsonElem.attr("pname", package.pname);
+                    jsonElem.attr("version", package.version);
+                    jsonElem.attr("description", package.description);
+                } else {
+                    if (results > 1) logger->stdout_("");
+                    logger->stdout_(
+                        "* %s%s",
+                        wrap("\e[0;1m", hilite(package.attrPath, attrPathMatch, "\e[0;1m")),
+                        package.version != "" ? " (" + package.version + ")" : "");
+                    if (package.description != "")
+                        logger->stdout_(
+                            "  %s", hilite(package.description, descriptionMatch, ANSI_NORMAL));
+                }
+            }
+        };
+
+        /* Use the search index if the installable is a locked flake. */
+        std::unique_ptr<SearchIndex> index;
+        auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable);
+        if (flake && evalSettings.useEvalCache && evalSettings.pureEval) {
+            auto key = hashString(htSHA256,
+                fmt("%s;%s",
+                    flake->getLockedFlake()->getFingerprint(*store).to_string(Base16, false),
+                    concatStringsSep(";", flake->getActualAttrPaths())));
             try {
-                auto recurse = [&]()
-                {
-                    for (const auto & attr : cursor.getAttrs()) {
-                        auto cursor2 = cursor.getAttr(attr);
-                        auto attrPath2(attrPath);
-                        attrPath2.push_back(attr);
-                        visit(*cursor2, attrPath2);
-                    }
-                };
-
-                if (cursor.isDerivation()) {
-                    size_t found = 0;
-
-                    DrvName name(cursor.getAttr("name")->getString());
-
-                    auto aMeta = cursor.maybeGetAttr("meta");
-                    auto aDescription = aMeta ? aMeta->maybeGetAttr("description") : nullptr;
-                    auto description = aDescription ? aDescription->getString() : "";
-                    std::replace(description.begin(), description.end(), '\n', ' ');
-                    auto attrPath2 = concatStringsSep(".", attrPath);
-
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-
-                    for (auto & regex : regexes) {
-                        std::regex_search(attrPath2, attrPathMatch, regex);
-                        std::regex_search(name.name, nameMatch, regex);
-                        std::regex_search(description, descriptionMatch, regex);
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                            found++;
-                    }
+                index = std::make_unique<SearchIndex>(key);
+            } catch (SQLiteError &) {
+                ignoreException();
+            }
+        }
+
+        if (index && index->isComplete()) {
+            if (auto candidates = index->getCandidates(res))
+                for (auto id : *candidates)
+                    show(index->getPackage(id));
+            else
+                index->forEachPackage(show);
+        }
+
+        else {
+            std::vector<PackageInfo> packages;
 
-                    if (found == res.size()) {
-                        results++;
-                        if (json) {
-                            auto jsonElem = jsonOut->object(attrPath2);
-                            jsonElem.attr("pname", name.name);
-                            jsonElem.attr("version", name.version);
-                            jsonElem.attr("description", description);
-                        } else {
-                            auto name2 = hilite(name.name, nameMatch, "\e[0;2m");
-                            if (results > 1) logger->stdout_("");
-                            logger->stdout_(
-                                "* %s%s",
-                                wrap("\e[0;1m", hilite(attrPath2, attrPathMatch, "\e[0;1m")),
-                                name.version != "" ? " (" + name.version + ")" : "");
-                            if (description != "")
-                                logger->stdout_(
-                                    "  %s", hilite(description, descriptionMatch, ANSI_NORMAL));
+            std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath)> visit;
+
+            visit = [&](eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath)
+            {
+                Activity act(*logger, lvlInfo, actUnknown,
+                    fmt("evaluating '%s'", concatStringsSep(".", attrPath)));
+                try {
+                    auto recurse = [&]()
+                    {
+                        for (const auto & attr : cursor.getAttrs()) {
+                            auto cursor2 = cursor.getAttr(attr);
+                            auto attrPath2(attrPath);
+                            attrPath2.push_back(attr);
+                            visit(*cursor2, attrPath2);
                         }
-                    }
-                }
+                    };
 
-                else if (
-                    attrPath.size() == 0
-                    || (attrPath[0] == "legacyPackages" && attrPath.size() <= 2)
-                    || (attrPath[0] == "packages" && attrPath.size() <= 2))
-                    recurse();
+                    if (cursor.isDerivation()) {
+                        DrvName name(cursor.getAttr("name")->getString());
 
-                else if (attrPath[0] == "legacyPackages" && attrPath.size() > 2) {
-                    auto attr = cursor.maybeGetAttr(state->sRecurseForDerivations);
-                    if (attr && attr->getBool())
+                        auto aMeta = cursor.maybeGetAttr("meta");
+                        auto aDescription = aMeta ? aMeta->maybeGetAttr("description") : nullptr;
+                        auto description = aDescription ? aDescription->getString() : "";
+                        std::replace(description.begin(), description.end(), '\n', ' ');
+
+                        PackageInfo package {
+                            .attrPath = concatStringsSep(".", attrPath),
+                            .pname = name.name,
+                            .version = name.version,
+                            .description = std::move(description)
+                        };
+
+                        show(package);
+
+                        if (index) packages.push_back(std::move(package));
+                    }
+
+                    else if (
+                        attrPath.size() == 0
+                        || (attrPath[0] == "legacyPackages" && attrPath.size() <= 2)
+                        || (attrPath[0] == "packages" && attrPath.size() <= 2))
                         recurse();
+
+                    else if (attrPath[0] == "legacyPackages" && attrPath.size() > 2) {
+                        auto attr = cursor.maybeGetAttr(state->sRecurseForDerivations);
+                        if (attr && attr->getBool())
+                            recurse();
+                    }
+
+                } catch (EvalError & e) {
+                    if (!(attrPath.size() > 0 && attrPath[0] == "legacyPackages"))
+                        throw;
                 }
+            };
 
-            } catch (EvalError & e) {
-                if (!(attrPath.size() > 0 && attrPath[0] == "legacyPackages"))
-                    throw;
-            }
-        };
+            for (auto & [cursor, prefix] : installable->getCursors(*state))
+                visit(*cursor, parseAttrPath(*state, prefix));
 
-        for (auto & [cursor, prefix] : installable->getCursors(*state))
-            visit(*cursor, parseAttrPath(*state, prefix));
+            if (index) {
+                try {
+                    index->write(packages);
+                } catch (SQLiteError &) {
+                    ignoreException();
+                }
+            }
+        }
 
         if (!json && !results)
             throw Error("no results for the given search term(s)!");
@@ -0,0 +1,8 @@
+# Allocate many short-lived values, environments and attribute sets.
+{ n }:
+
+let
+  step = acc: i:
+    let x = { inherit i; sq = i * i; next = i + 1; };
+    in acc + x.sq - x.i * x.next + x.next;
+in builtins.foldl' step 0 (builtins.genList (i: i) n)
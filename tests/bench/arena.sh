@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+# Compare wall time and peak RSS of an evaluation with and without
+# the evaluation arena (which requires a Nix built with
+# --enable-eval-arena).
+#
+# Usage: [RUNS=3] tests/bench/arena.sh [file.nix] [n]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+file=${1:-$(dirname "$0")/alloc.nix}
+n=${2:-1000000}
+
+printHeader arena
+compareSetting eval-arena -- --eval --strict "$file" --arg n "$n"
@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+# Compare the startup time of instantiating a nixpkgs attribute with a
+# cold AST cache, a warm AST cache and the cache disabled.
+#
+# Usage: [RUNS=3] tests/bench/ast-cache.sh <nixpkgs> [attr]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+nixpkgs=$1
+attr=${2:-hello}
+
+export XDG_CACHE_HOME=$(mktemp -d)
+trap 'rm -rf "$XDG_CACHE_HOME"' EXIT
+
+cmd=(nix-instantiate "$nixpkgs" -A "$attr")
+
+printHeader cache
+timeRuns disabled -- "${cmd[@]}" --option eval-ast-cache false
+# Every cold run gets an empty cache directory of its own.
+timeRuns cold -- env XDG_CACHE_HOME="$XDG_CACHE_HOME/cold-@SEED@" "${cmd[@]}"
+"${cmd[@]}" > /dev/null
+timeRuns warm -- "${cmd[@]}"
+echo "cache size: $(du -sh "$XDG_CACHE_HOME/nix/ast-v2" | cut -f1)"
@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+# Evaluate a benchmark expression for doubling values of 'n' and print
+# the CPU time and memory use reported by NIX_SHOW_STATS, so that the
+# scaling behaviour (linear vs. quadratic) is easy to see.
+#
+# Usage: tests/bench/bench.sh tests/bench/list-append.nix [start] [steps] [nix-instantiate flags...]
+
+set -euo pipefail
+
+file=$1
+n=${2:-1000}
+steps=${3:-6}
+shift $(( $# < 3 ? $# : 3 ))
+
+stats=$(mktemp)
+trap 'rm -f "$stats"' EXIT
+
+printf '%10s %10s %10s %14s\n' n cpuTime ratio heapBytes
+prev=
+for ((i = 0; i < steps; i++)); do
+    NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$stats" \
+        nix-instantiate --eval --strict "$file" --arg n "$n" "$@" > /dev/null
+    time=$(jq .cpuTime "$stats")
+    bytes=$(jq '.gc.totalBytes // 0' "$stats")
+    ratio=-
+    if [[ -n $prev ]]; then
+        ratio=$(awk "BEGIN { printf \"%.2f\", $time / ($prev > 0 ? $prev : 1e-6) }")
+    fi
+    printf '%10d %10.3f %10s %14d\n' "$n" "$time" "$ratio" "$bytes"
+    prev=$time
+    n=$((n * 2))
+done
@@ -0,0 +1,47 @@
+# Helpers for the benchmark scripts in this directory that compare
+# variants of an evaluation. Each variant is run $RUNS times (3 by
+# default), and each run prints one line of the results table.
+
+runs=${RUNS:-3}
+
+# Print the header of the results table, given the names of the label
+# columns.
+printHeader() {
+    printf '%-14s ' "$@"
+    printf '%10s %12s\n' wallTime maxRSS_KiB
+}
+
+# Run a command 'runs' times, printing the given labels followed by the
+# wall time and peak RSS of each run. '@SEED@' in the command is
+# replaced by a string that is different for each run, for benchmarks
+# that mustn't reuse the results of previous runs.
+#
+# Usage: timeRuns <label>... -- <command>...
+timeRuns() {
+    local labels=() args=() arg out time rss i
+    while [[ $1 != -- ]]; do labels+=("$1"); shift; done
+    shift
+    for ((i = 0; i < runs; i++)); do
+        args=()
+        for arg in "$@"; do args+=("${arg//@SEED@/$i-$RANDOM$RANDOM}"); done
+        out=$( { /usr/bin/time -f '%e %M' "${args[@]}" > /dev/null; } 2>&1 | tail -n1)
+        read -r time rss <<< "$out"
+        printf '%-14s ' "${labels[@]}"
+        printf '%10s %12s\n' "$time" "$rss"
+    done
+}
+
+# Run 'nix-instantiate' with the given arguments with the boolean
+# setting 'setting' turned off and on. The value of the setting is
+# printed after the labels.
+#
+# Usage: compareSetting <setting> <label>... -- <nix-instantiate args>...
+compareSetting() {
+    local setting=$1 labels=() value
+    shift
+    while [[ $1 != -- ]]; do labels+=("$1"); shift; done
+    shift
+    for value in false true; do
+        timeRuns "${labels[@]}" "$value" -- nix-instantiate "$@" --option "$setting" "$value"
+    done
+}
@@ -0,0 +1,23 @@
+# A chain of 'n' derivations, each depending on the previous one, or
+# if 'top' is set, a single derivation that depends on that existing
+# store derivation, e.g. the end of a chain instantiated earlier.
+# Changing 'seed' changes every derivation.
+{ n ? 2000, seed ? "", top ? null }:
+
+let
+  mk = name: deps: derivation {
+    inherit name deps seed;
+    system = builtins.currentSystem;
+    builder = "/bin/sh";
+    args = [ "-c" "echo > $out" ];
+  };
+
+  # Instantiate each derivation before the next one, so that deep
+  # chains don't overflow the stack.
+  chain = builtins.foldl'
+    (prev: i: builtins.seq prev.drvPath (mk "chain-${toString i}" [ prev ]))
+    (mk "chain-0" [ ])
+    (builtins.genList (i: i + 1) n);
+in
+
+if top == null then chain else mk "top" [ (import top) ]
@@ -0,0 +1,19 @@
+#!/usr/bin/env bash
+# Compare the wall time of instantiating a small derivation on top of a
+# chain of existing store derivations with and without the persistent
+# derivation hash cache. Without it, every new process reads and hashes
+# each '.drv' file in the chain again.
+#
+# Usage: [RUNS=3] tests/bench/drv-hash-cache.sh [n]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+expr=$(cd "$(dirname "$0")" && pwd)/drv-chain.nix
+n=${1:-2000}
+
+top=$(nix-instantiate "$expr" --arg n "$n")
+
+printHeader n cache
+compareSetting drv-hash-cache "$n" -- "$expr" --arg top "$top" --argstr seed @SEED@
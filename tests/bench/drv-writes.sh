@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+# Compare the wall time of instantiating a chain of new derivations
+# with and without batched writing of store derivations.
+#
+# Usage: [RUNS=3] tests/bench/drv-writes.sh [n]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+expr=$(cd "$(dirname "$0")" && pwd)/drv-chain.nix
+n=${1:-20000}
+
+printHeader n batched
+compareSetting eval-batch-drv-writes "$n" -- "$expr" --arg n "$n" --argstr seed @SEED@
@@ -0,0 +1,7 @@
+# Parse a JSON document and force the result.
+{ file }:
+
+with builtins;
+
+let doc = fromJSON (readFile file);
+in deepSeq doc (length (attrNames doc.packages))
@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+# Compare the wall time and peak RSS of builtins.fromJSON on generated
+# documents of about 10, 30 and 100 MB, with and without the fast
+# JSON parser.
+#
+# Usage: [RUNS=3] tests/bench/from-json.sh
+
+set -euo pipefail
+
+dir=$(dirname "$0")
+source "$dir/common.sh"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+printHeader MB fast
+for n in 25000 75000 250000; do
+    doc=$tmp/doc-$n.json
+    nix-instantiate --eval --strict --json "$dir/json-doc.nix" --arg n "$n" > "$doc"
+    size=$(( $(stat -c %s "$doc") / 1000000 ))
+    compareSetting eval-fast-json "$size" -- --eval --strict "$dir/from-json.nix" --arg file "$doc"
+done
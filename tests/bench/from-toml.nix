@@ -0,0 +1,26 @@
+# Parse a Cargo.lock file, or a generated one with 'n' packages, and
+# force the result.
+{ file ? null, n ? 5000 }:
+
+with builtins;
+
+let
+  package = i: ''
+
+    [[package]]
+    name = "crate-${toString i}"
+    version = "1.${toString (i / 7)}.${toString (i - i / 7 * 7)}"
+    source = "registry+https://github.com/rust-lang/crates.io-index"
+    checksum = "${hashString "sha256" (toString i)}"
+    dependencies = [
+     "crate-${toString (i / 2)}",
+     "crate-${toString (i / 3)} 0.1.0",
+    ]
+  '';
+
+  text =
+    if file != null then readFile file
+    else "version = 3\n" + concatStringsSep "" (genList package n);
+
+  lock = fromTOML text;
+in deepSeq lock (length lock.package)
@@ -0,0 +1,20 @@
+#!/usr/bin/env bash
+# Compare the wall time of builtins.fromTOML with and without the fast
+# TOML parser, on the given Cargo.lock files or on a generated one.
+#
+# Usage: [RUNS=3] tests/bench/from-toml.sh [Cargo.lock...]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+expr=$(dirname "$0")/from-toml.nix
+
+printHeader file fast
+if [[ $# -eq 0 ]]; then
+    compareSetting eval-fast-toml "generated" -- --eval --strict "$expr" --arg n 20000
+else
+    for file in "$@"; do
+        compareSetting eval-fast-toml "$file" -- --eval --strict "$expr" --arg file "$(realpath "$file")"
+    done
+fi
@@ -0,0 +1,18 @@
+# Compute the closure of a synthetic graph of 'n' nodes in which every
+# node has two successors, once with integer and once with string keys.
+{ n }:
+
+let
+  mod = i: i - builtins.div i n * n;
+  succ = i: [ (mod (i * 2)) (mod (i * 3 + 1)) ];
+
+  ints = builtins.genericClosure {
+    startSet = [ { key = 0; } ];
+    operator = x: map (key: { inherit key; }) (succ x.key);
+  };
+
+  strings = builtins.genericClosure {
+    startSet = [ { key = "0"; i = 0; } ];
+    operator = x: map (i: { key = toString i; inherit i; }) (succ x.i);
+  };
+in builtins.length ints + builtins.length strings
@@ -0,0 +1,12 @@
+# 'n' independent imports from derivation, each of which takes
+# 'delay' seconds to build. Changing 'seed' changes every derivation.
+{ n ? 16, delay ? 1, seed ? "" }:
+
+builtins.genList (i:
+  import (derivation {
+    name = "ifd-${toString i}";
+    inherit seed;
+    system = builtins.currentSystem;
+    builder = "/bin/sh";
+    args = [ "-c" "sleep ${toString delay}; echo ${toString i} > $out" ];
+  })) n
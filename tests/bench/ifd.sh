@@ -0,0 +1,17 @@
+#!/usr/bin/env bash
+# Compare the wall time of evaluating independent imports from
+# derivation with several evaluation threads, with and without
+# batching their builds.
+#
+# Usage: [RUNS=3] tests/bench/ifd.sh [n]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+expr=$(cd "$(dirname "$0")" && pwd)/ifd.nix
+n=${1:-16}
+
+printHeader n batched
+compareSetting eval-batch-ifd "$n" -- --eval --strict "$expr" --arg n "$n" --argstr seed @SEED@ \
+    --option eval-cores 8 --option max-jobs "$n"
@@ -0,0 +1,26 @@
+# Generate a JSON document shaped like an npm lock file with 'n'
+# packages (about 400 bytes each), for tests/bench/from-json.sh.
+{ n }:
+
+with builtins;
+
+let
+  name = i: "package-${toString i}";
+in {
+  lockfileVersion = 2;
+  packages = listToAttrs (genList (i: {
+    name = "node_modules/${name i}";
+    value = {
+      version = "${toString (i / 100)}.${toString (i / 10 - i / 100 * 10)}.${toString (i - i / 10 * 10)}";
+      resolved = "https://registry.npmjs.org/${name i}/-/${name i}-1.0.0.tgz";
+      integrity = "sha512-${hashString "sha256" (name i)}==";
+      dev = i / 2 * 2 == i;
+      license = "MIT";
+      dependencies = listToAttrs (genList (j: {
+        name = name (i * 7 + j);
+        value = "^${toString j}.0.0";
+      }) 4);
+      engines.node = ">=10 \"quoted\" é";
+    };
+  }) n);
+}
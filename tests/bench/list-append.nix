@@ -0,0 +1,6 @@
+# Build a list of 'n' elements by appending one element at a time.
+{ n }:
+
+let
+  xs = builtins.foldl' (acc: x: acc ++ [ x ]) [] (builtins.genList (x: x) n);
+in builtins.elemAt xs (n - 1)
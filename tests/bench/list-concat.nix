@@ -0,0 +1,8 @@
+# Build a list of 'n' elements by concatenating chunks of 10 elements,
+# as lib.concatMap-style folds do.
+{ n }:
+
+let
+  chunks = builtins.genList (i: builtins.genList (j: i * 10 + j) 10) (n / 10);
+  xs = builtins.foldl' (acc: chunk: acc ++ chunk) [] chunks;
+in builtins.elemAt xs (n - 1)
@@ -0,0 +1,9 @@
+# Parse a generated expression of 'n' attributes, each a small function
+# application, to measure the memory used by parse trees.
+{ n }:
+
+let
+  text = "{\n" + builtins.concatStringsSep "" (builtins.genList (i:
+    "  a${toString i} = { x ? ${toString i}, y }: if x < y then [ x y ] else { inherit x y; z = x + y; };\n") n) + "}\n";
+  e = import (builtins.toFile "parse-bench.nix" text);
+in builtins.length (builtins.attrNames e)
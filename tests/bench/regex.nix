@@ -0,0 +1,22 @@
+# Match and split strings with regular expressions of the kind used
+# in Nixpkgs.
+{ n }:
+
+with builtins;
+
+let
+  names = genList (i: "pkg-${toString i}-lib-${toString (i * 7)}.${toString (i / 3)}-unstable") n;
+
+  parse = s: [
+    (match "(.*)-([^-]*)" s)
+    (match "([^-]+)-([0-9]+)\\.([0-9]+).*" s)
+    (match "[[:alnum:]-]+\\.([0-9]+).*" s)
+    (split "[-.]" s)
+    (split "([0-9]+)" s)
+  ];
+
+  text = concatStringsSep "\n" (genList (i: "  line ${toString i}: foo = bar; # baz") (n / 10));
+in
+  length (concatMap parse names)
+  + length (split "\n" text)
+  + length (split "[[:space:]]+" text)
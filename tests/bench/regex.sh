@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+# Compare the wall time of evaluating regular expressions with the
+# regex automaton and with std::regex.
+#
+# Usage: [RUNS=3] tests/bench/regex.sh [file.nix] [n]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+file=${1:-$(dirname "$0")/regex.nix}
+n=${2:-100000}
+
+printHeader automaton
+compareSetting eval-regex-automaton -- --eval --strict "$file" --arg n "$n"
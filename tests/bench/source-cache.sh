@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+# Compare the wall time of copying an unchanged source tree to the
+# store with 'builtins.path' and 'builtins.filterSource', with and
+# without the persistent source path cache. The tree consists of
+# 'files' files of 'size' KiB each.
+#
+# Usage: [RUNS=3] tests/bench/source-cache.sh [files] [size]
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+files=${1:-20000}
+size=${2:-64}
+
+tree=$(mktemp -d)
+trap 'rm -rf "$tree"' EXIT
+
+for ((i = 0; i < files; i++)); do
+    dir=$tree/src/$((i % 100))
+    mkdir -p "$dir"
+    head -c $((size * 1024)) /dev/urandom > "$dir/$i"
+done
+
+# Let the timestamps of the new files age, so that they can be cached.
+sleep 3
+
+printHeader function cache
+compareSetting eval-source-cache builtins.path -- \
+    --eval -E "builtins.path { path = $tree/src; }"
+compareSetting eval-source-cache builtins.filterSource -- \
+    --eval -E "builtins.filterSource (p: t: true) $tree/src"
@@ -0,0 +1,20 @@
+# Build 'n' strings that refer to a few derivations, in the way that
+# derivation-heavy code (e.g. NixOS modules) does, merging the same
+# string contexts over and over.
+{ n }:
+
+let
+  mkDrv = name: derivation {
+    inherit name;
+    builder = "/bin/false";
+    system = "x86_64-linux";
+  };
+
+  drvs = builtins.genList (i: mkDrv "dep-${toString i}") 20;
+
+  line = i:
+    let d = builtins.elemAt drvs (i - builtins.div i 20 * 20);
+    in "export PATH=${d}/bin:${builtins.head drvs}/bin:$PATH # ${toString i}\n";
+
+  script = builtins.foldl' (acc: i: acc + line i) "" (builtins.genList (i: i) n);
+in builtins.stringLength script + builtins.length (builtins.attrNames (builtins.getContext script))
@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# Compare the wall time and peak RSS of 'nix-instantiate --eval --json',
+# which streams its output, with 'builtins.toJSON', which keeps the
+# evaluated value and the whole document in memory, for documents of
+# about 10, 30 and 100 MB.
+#
+# Usage: [RUNS=3] tests/bench/to-json.sh
+
+set -euo pipefail
+
+source "$(dirname "$0")/common.sh"
+
+doc=$(cd "$(dirname "$0")" && pwd)/json-doc.nix
+
+printHeader n mode
+for n in 25000 75000 250000; do
+    timeRuns "$n" toJSON -- \
+        nix-instantiate --eval -E "builtins.stringLength (builtins.toJSON (import $doc { n = $n; }))"
+    timeRuns "$n" stream -- \
+        nix-instantiate --eval --strict --json "$doc" --arg n "$n"
+done
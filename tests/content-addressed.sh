@@ -25,3 +25,13 @@ testDerivation transitivelyDependentCA
 
 nix-instantiate --experimental-features ca-derivations ./content-addressed.nix -A rootCA --arg seed 5
 nix-collect-garbage --experimental-features ca-derivations --option keep-derivations true
+
+# Input-addressed derivations can't depend on floating content-addressed
+# ones yet. This must be an error, also when derivations are written in
+# batches.
+for batch in false true; do
+    expect 1 nix-instantiate --experimental-features ca-derivations --option eval-batch-drv-writes $batch \
+        -E 'with import ./config.nix; mkDerivation { name = "legacy"; buildCommand = "echo ${(import ./content-addressed.nix {}).rootCA} > $out"; }' \
+        2> $TEST_ROOT/log
+    grep -q "not yet allowed to depend on CA derivations" $TEST_ROOT/log
+done
@@ -716,3 +716,165 @@ git -C $flakeB commit -a -m 'Foo'
 
 # Test list-inputs with circular dependencies
 nix flake list-inputs $flakeA
+
+# Test that the evaluation cache is reused, and invalidated, according
+# to the sources that an attribute depends on.
+flakeCacheDir=$TEST_ROOT/flakeCache
+flakeCacheDepDir=$TEST_ROOT/flakeCacheDep
+
+for repo in $flakeCacheDir $flakeCacheDepDir; do
+    rm -rf $repo
+    mkdir $repo
+    git -C $repo init
+    git -C $repo config user.email "foobar@example.com"
+    git -C $repo config user.name "Foobar"
+done
+
+cat > $flakeCacheDepDir/flake.nix <<EOF
+{
+  outputs = { self }: { x = "1"; };
+}
+EOF
+
+git -C $flakeCacheDepDir add flake.nix
+git -C $flakeCacheDepDir commit -m 'Initial'
+
+cat > $flakeCacheDir/flake.nix <<EOF
+{
+  inputs.dep.url = git+file://$flakeCacheDepDir;
+
+  outputs = { self, dep }: with import ./config.nix; {
+    packages.$system = {
+      plain = mkDerivation { name = "plain"; buildCommand = "mkdir \$out"; };
+      reads = mkDerivation { name = "reads"; buildCommand = "mkdir \$out"; DATA = builtins.readFile ./data.txt; };
+      usesSelf = mkDerivation { name = "uses-self"; buildCommand = "mkdir \$out"; SELF = self.outPath; };
+      usesReadDir = mkDerivation { name = "uses-read-dir"; buildCommand = "mkdir \$out"; FILES = builtins.attrNames (builtins.readDir ./.); };
+      usesDep = mkDerivation { name = "uses-dep"; buildCommand = "mkdir \$out"; X = dep.x; };
+    };
+  };
+}
+EOF
+
+echo foo > $flakeCacheDir/data.txt
+echo bar > $flakeCacheDir/other.txt
+cp ./config.nix $flakeCacheDir/
+git -C $flakeCacheDir add flake.nix data.txt other.txt config.nix
+nix flake update $flakeCacheDir
+git -C $flakeCacheDir add flake.lock
+git -C $flakeCacheDir commit -m 'Initial'
+
+rm -rf $TEST_HOME/.cache/nix/eval-cache-v4
+
+attrs="plain reads usesSelf usesReadDir usesDep"
+
+for attr in $attrs; do
+    nix build --dry-run $flakeCacheDir#$attr
+done
+
+# Everything is cached now.
+for attr in $attrs; do
+    NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#$attr
+done
+
+# Updating an input only invalidates the attributes that use it, and
+# those that use the entire root source tree (which contains the lock
+# file).
+echo '{ outputs = { self }: { x = "2"; }; }' > $flakeCacheDepDir/flake.nix
+git -C $flakeCacheDepDir commit -a -m 'Update'
+nix flake update $flakeCacheDir
+git -C $flakeCacheDir commit -a -m 'Update dep'
+
+NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#plain
+NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#reads
+for attr in usesSelf usesReadDir usesDep; do
+    expect 1 env NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#$attr
+    nix build --dry-run $flakeCacheDir#$attr
+done
+
+# Editing a file invalidates the attributes that read it, and those
+# that use the entire root source tree.
+echo bar > $flakeCacheDir/data.txt
+git -C $flakeCacheDir commit -a -m 'Edit data.txt'
+
+NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#plain
+NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#usesDep
+for attr in reads usesSelf usesReadDir; do
+    expect 1 env NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#$attr
+    nix build --dry-run $flakeCacheDir#$attr
+done
+
+# Editing a file that no attribute reads only invalidates the latter.
+echo baz > $flakeCacheDir/other.txt
+git -C $flakeCacheDir commit -a -m 'Edit other.txt'
+
+NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#reads
+for attr in usesSelf usesReadDir; do
+    expect 1 env NIX_ALLOW_EVAL=0 nix build --dry-run $flakeCacheDir#$attr
+done
+
+# The rows that depend on old sources have been garbage-collected,
+# together with the rows below them.
+if [[ -n $(type -p sqlite3) ]]; then
+    cacheDb=$(echo $TEST_HOME/.cache/nix/eval-cache-v4/*.sqlite)
+    [[ $(sqlite3 $cacheDb "select count(*) from Attributes where name = 'reads'") = 1 ]]
+    [[ $(sqlite3 $cacheDb "select count(*) from Attributes where name = 'usesDep'") = 1 ]]
+    [[ $(sqlite3 $cacheDb "select count(*) from Attributes where name = 'usesSelf'") = 0 ]]
+    [[ $(sqlite3 $cacheDb "select count(*) from Attributes where parent != 0 and parent not in (select rowid from Attributes)") = 0 ]]
+fi
+
+# Test that integers, lists of strings and paths are read back from the
+# evaluation cache, including when more rows are written than fit in
+# one batch.
+flakeMetaDir=$TEST_ROOT/flakeMeta
+
+rm -rf $flakeMetaDir
+mkdir -p $flakeMetaDir/tmpl
+git -C $flakeMetaDir init
+git -C $flakeMetaDir config user.email "foobar@example.com"
+git -C $flakeMetaDir config user.name "Foobar"
+
+cat > $flakeMetaDir/flake.nix <<EOF
+{
+  outputs = { self }: with import ./config.nix; {
+    packages.$system = {
+      multi = mkDerivation {
+        name = "multi";
+        outputs = [ "out" "dev" "doc" ];
+        buildCommand = "mkdir -p \$out/bin \$dev/include \$doc/share";
+        meta.outputsToInstall = [ "out" "dev" ];
+        meta.priority = 3;
+      };
+    } // builtins.listToAttrs (builtins.genList (n: {
+      name = "pkg\${toString n}";
+      value = mkDerivation { name = "pkg\${toString n}"; buildCommand = "mkdir \$out"; };
+    }) 200);
+    templates.t = { path = ./tmpl; description = "A template"; };
+  };
+}
+EOF
+
+echo hello > $flakeMetaDir/tmpl/hello.txt
+cp ./config.nix $flakeMetaDir/
+git -C $flakeMetaDir add flake.nix config.nix tmpl/hello.txt
+nix flake update $flakeMetaDir
+git -C $flakeMetaDir add flake.lock
+git -C $flakeMetaDir commit -m 'Initial'
+
+rm -rf $TEST_HOME/.cache/nix/eval-cache-v4
+
+nix flake show $flakeMetaDir > $TEST_ROOT/show1
+nix profile install --profile $TEST_ROOT/metaProfile1 $flakeMetaDir#multi
+nix flake new -t $flakeMetaDir#t $TEST_ROOT/fromTemplate1
+
+NIX_ALLOW_EVAL=0 nix flake show $flakeMetaDir > $TEST_ROOT/show2
+diff $TEST_ROOT/show1 $TEST_ROOT/show2
+[[ $(grep -c "package 'pkg" $TEST_ROOT/show2) = 200 ]]
+
+NIX_ALLOW_EVAL=0 nix profile install --profile $TEST_ROOT/metaProfile2 $flakeMetaDir#multi
+[[ -d $TEST_ROOT/metaProfile2/bin ]]
+[[ -d $TEST_ROOT/metaProfile2/include ]]
+[[ ! -e $TEST_ROOT/metaProfile2/share ]]
+grep -q '"priority":3' $TEST_ROOT/metaProfile2/manifest.json
+
+NIX_ALLOW_EVAL=0 nix flake new -t $flakeMetaDir#t $TEST_ROOT/fromTemplate2
+[[ $(cat $TEST_ROOT/fromTemplate2/hello.txt) = hello ]]
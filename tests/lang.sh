@@ -32,10 +32,20 @@ done
 for i in lang/eval-fail-*.nix; do
     echo "evaluating $i (should fail)";
     i=$(basename $i .nix)
-    if nix-instantiate --eval lang/$i.nix; then
+    if nix-instantiate --eval lang/$i.nix 2> $TEST_ROOT/$i.err; then
         echo "FAIL: $i shouldn't evaluate"
         fail=1
     fi
+    cat $TEST_ROOT/$i.err >&2
+
+    # The bytecode evaluator must fail with the same error.
+    if nix-instantiate --option eval-bytecode true --eval lang/$i.nix 2> $TEST_ROOT/$i.err.bytecode; then
+        echo "FAIL: $i shouldn't evaluate with bytecode"
+        fail=1
+    elif ! diff $TEST_ROOT/$i.err $TEST_ROOT/$i.err.bytecode; then
+        echo "FAIL: bytecode evaluation error of $i not as expected"
+        fail=1
+    fi
 done
 
 for i in lang/eval-okay-*.nix; do
@@ -54,6 +64,24 @@ for i in lang/eval-okay-*.nix; do
             echo "FAIL: evaluation result of $i not as expected"
             fail=1
         fi
+
+        # The bytecode evaluator must produce the same results.
+        if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option eval-bytecode true --eval --strict lang/$i.nix > lang/$i.out; then
+            echo "FAIL: $i should evaluate with bytecode"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: bytecode evaluation result of $i not as expected"
+            fail=1
+        fi
+
+        # So must the parallel evaluator.
+        if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option eval-cores 4 --eval --strict lang/$i.nix > lang/$i.out; then
+            echo "FAIL: $i should evaluate in parallel"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: parallel evaluation result of $i not as expected"
+            fail=1
+        fi
     fi
 
     if test -e lang/$i.exp.xml; then
@@ -68,4 +96,38 @@ for i in lang/eval-okay-*.nix; do
     fi
 done
 
+# Every file evaluated above has been parsed before, so this time its
+# parse tree must come from the AST cache.
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats.json \
+    nix-instantiate --eval --strict lang/eval-okay-arithmetic.nix > /dev/null
+if ! jq -e '.astCache.hits > 0 and .astCache.misses == 0' < $TEST_ROOT/stats.json > /dev/null; then
+    echo "FAIL: parse tree of lang/eval-okay-arithmetic.nix was not cached"
+    fail=1
+fi
+
+# The profiler writes one line per sampled call stack. Sample often
+# enough that even a short evaluation yields some samples.
+profileExpr="builtins.foldl' (x: y: x + y) 0 (builtins.genList (x: x * x) 200000)"
+
+rm -f $TEST_ROOT/eval.folded
+nix-instantiate --eval --strict --option eval-profiler flamegraph \
+    --option eval-profiler-frequency 10000 \
+    --option eval-profile-file $TEST_ROOT/eval.folded -E "$profileExpr" > /dev/null
+if ! test -s $TEST_ROOT/eval.folded || grep -qv ' [0-9][0-9]*$' $TEST_ROOT/eval.folded; then
+    echo "FAIL: flamegraph evaluation profile not written"
+    fail=1
+fi
+
+rm -f $TEST_ROOT/eval.pprof
+nix-instantiate --eval --strict --option eval-profiler pprof \
+    --option eval-profiler-frequency 10000 \
+    --option eval-profile-file $TEST_ROOT/eval.pprof -E "$profileExpr" > /dev/null
+if ! test -s $TEST_ROOT/eval.pprof; then
+    echo "FAIL: pprof evaluation profile not written"
+    fail=1
+elif [[ -n $(type -p pprof) ]] && ! pprof -raw $TEST_ROOT/eval.pprof > /dev/null; then
+    echo "FAIL: pprof evaluation profile can't be read"
+    fail=1
+fi
+
 exit $fail
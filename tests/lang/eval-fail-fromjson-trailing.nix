@@ -0,0 +1 @@
+builtins.fromJSON "[1, 2] 3"
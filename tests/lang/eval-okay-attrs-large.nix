@@ -0,0 +1,16 @@
+let
+  names = builtins.genList (n: "a${toString n}") 100;
+  s = builtins.listToAttrs (map (name: { inherit name; value = name; }) names);
+  t = s // { extra = 1; a7 = 7; };
+in [
+  s.a0
+  s.a99
+  (s.a100 or "none")
+  (s ? a50)
+  (s ? b)
+  (builtins.getAttr "a42" s)
+  t.extra
+  t.a7
+  t.a8
+  (builtins.length (builtins.attrNames t))
+]
@@ -0,0 +1,22 @@
+let
+  f = x: if x > 2 then x - 1 else x + 1;
+  s = { a = { b = 3; }; c = null; };
+in [
+  (f 5)
+  (f 1)
+  s.a.b
+  (s.a.x or 7)
+  (s.c.d or 8)
+  (s ? a.b)
+  (s ? a.x)
+  (s ? c.d)
+  (true && !false)
+  (false && throw "unreachable")
+  (true || throw "unreachable")
+  (false -> throw "unreachable")
+  (true -> false)
+  (s.a == { b = 3; })
+  (s.a != { b = 3; })
+  (assert s.a.b == 3; "ok")
+  (builtins.tryEval (assert s.a.b == 4; 1)).success
+]
@@ -0,0 +1,17 @@
+# Large strings built by repeated concatenation are represented as
+# ropes; check that they behave like ordinary strings.
+let
+  lines = builtins.genList (i: "line ${toString i}\n") 500;
+  s = builtins.foldl' (acc: l: acc + l) "" lines;
+  s2 = builtins.concatStringsSep "" lines;
+in [
+  (builtins.stringLength s)
+  (s == s2)
+  (builtins.substring 0 14 s)
+  (builtins.substring (builtins.stringLength s - 9) 9 s)
+  (builtins.hashString "md5" s == builtins.hashString "md5" s2)
+  ("${s}x" == s2 + "x")
+  (s < s2 + "a")
+  ({ ${s} = 1; }).${s2}
+  (builtins.fromJSON (builtins.toJSON s) == s)
+]
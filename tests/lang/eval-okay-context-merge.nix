@@ -0,0 +1,49 @@
+let
+  mkDrv = name: derivation {
+    inherit name;
+    builder = "/bin/false";
+    system = "x86_64-linux";
+    outputs = [ "out" "dev" ];
+  };
+
+  a = mkDrv "a";
+  b = mkDrv "b";
+
+  ctx = s: builtins.getContext s;
+
+  outputs = s: builtins.mapAttrs (n: v: v.outputs) (ctx s);
+
+  strip = builtins.unsafeDiscardStringContext;
+
+  # A long string, so that concatenating it produces a rope.
+  long = builtins.concatStringsSep "" (builtins.genList (i: "${a}") 100);
+
+in
+
+# Merging a context with itself or with the empty context doesn't
+# change it.
+assert ctx "${a}${a}" == ctx "${a}";
+assert ctx "x${a}y" == ctx "${a}";
+assert ctx ("" + a + "") == ctx "${a}";
+
+# Merging is commutative and associative.
+assert ctx "${a}${b}" == ctx "${b}${a}";
+assert ctx "${a}${b.dev}${a.dev}" == ctx "${a.dev}${b.dev}${a}";
+assert ctx ("${a}${b}" + "${a.dev}") == ctx ("${a}" + "${b}${a.dev}");
+
+assert outputs "${a}${b.dev}${a.dev}" == {
+  ${strip a.drvPath} = [ "dev" "out" ];
+  ${strip b.drvPath} = [ "dev" ];
+};
+
+# Ropes keep the merged context.
+assert ctx (long + "${b}") == ctx "${a}${b}";
+assert ctx (long + long) == ctx "${a}";
+
+# Contexts survive strings derived from other strings.
+assert ctx (builtins.substring 0 5 "${a}${b}") == ctx "${a}${b}";
+assert ctx (toString [ a b ]) == ctx "${a} ${b}";
+
+assert !builtins.hasContext (strip "${a}${b}");
+
+true
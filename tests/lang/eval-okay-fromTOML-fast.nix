@@ -0,0 +1,53 @@
+with builtins;
+
+# Documents that exercise the fast path of fromTOML.
+
+assert fromTOML ''
+  # This file is automatically @generated by Cargo.
+  version = 3
+
+  [[package]]
+  name = "a"
+  version = "0.1.0"
+  dependencies = [
+   "b",
+   "c 1.0.0", # comment
+  ]
+
+  [[package]]
+  name = "b"
+  version = "1.2.3"
+  source = "registry+https://github.com/rust-lang/crates.io-index"
+'' == {
+  version = 3;
+  package = [
+    { name = "a"; version = "0.1.0"; dependencies = [ "b" "c 1.0.0" ]; }
+    { name = "b"; version = "1.2.3"; source = "registry+https://github.com/rust-lang/crates.io-index"; }
+  ];
+};
+
+assert fromTOML ''
+  a.b = 1
+  "quoted key" = 'literal \n'
+  c = { x = 1_000, y = [ 1.5, 2 ], z = { } }
+  d = [ { x = 1 }, { x = -2 } ]
+  e = [ [ "a" ], [ true ] ]
+  f = "\"\té\U0001F600"
+  [a.c]
+  d = 1e2
+  [g]
+  h.i = false
+'' == {
+  a = { b = 1; c = { d = 100.0; }; };
+  "quoted key" = "literal \\n";
+  c = { x = 1000; y = [ 1.5 2 ]; z = { }; };
+  d = [ { x = 1; } { x = -2; } ];
+  e = [ [ "a" ] [ true ] ];
+  f = "\"\té😀";
+  g = { h = { i = false; }; };
+};
+
+# Features that are left to cpptoml.
+assert fromTOML "a = 0x10\nb = '''x'''" == { a = 16; b = "x"; };
+
+true
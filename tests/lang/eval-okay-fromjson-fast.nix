@@ -0,0 +1,23 @@
+with builtins;
+
+# Documents that exercise the fast path of fromJSON.
+
+assert fromJSON ''{"a": 1, "b": 2, "a": 3}'' == { a = 3; b = 2; };
+assert fromJSON ''[[], {}, [{"a": []}], {"": null}]'' == [ [] {} [ { a = []; } ] { "" = null; } ];
+assert fromJSON " [ 1 , -2 , true , false , null ] " == [ 1 (-2) true false null ];
+
+# Numbers
+assert isInt (fromJSON "-0") && fromJSON "-0" == 0;
+assert isFloat (fromJSON "1e3") && fromJSON "1e3" == 1000.0;
+assert fromJSON "1.5E-1" == 0.15;
+assert fromJSON "9223372036854775807" == 9223372036854775807;
+assert fromJSON "18446744073709551615" == -1;
+assert isFloat (fromJSON "18446744073709551616");
+
+# Strings
+assert fromJSON ''"a string that is longer than a machine word"'' == "a string that is longer than a machine word";
+assert fromJSON ''"several \"escapes\" in\na longer string\t"'' == "several \"escapes\" in\na longer string\t";
+assert fromJSON ''"é→😀 and é→😀"'' == "é→😀 and é→😀";
+assert fromJSON ''{"a": "b"}'' == { a = "b"; };
+
+true
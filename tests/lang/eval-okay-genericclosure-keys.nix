@@ -0,0 +1,30 @@
+let
+
+  closure = startSet: operator:
+    map (x: x.key) (builtins.genericClosure { inherit startSet operator; });
+
+in
+
+# Integers and floats with the same value are the same key.
+assert closure [ { key = 1; } ] (x: [ { key = 1.0; } { key = 2; } { key = 2.0; } { key = 2.5; } ])
+  == [ 1 2 2.5 ];
+
+# Elements are returned in the order in which they are first reached.
+assert closure [ { key = 0; } ] (x: if x.key >= 6 then [] else [ { key = x.key + 2; } { key = x.key + 1; } ])
+  == [ 0 2 1 4 3 6 5 7 ];
+
+# Strings are compared by their contents, including strings built by
+# concatenation.
+assert closure [ { key = "a"; } ] (x: [ { key = "a" + ""; } { key = "${x.key}b"; } ])
+  == [ "a" "ab" ];
+
+assert closure [ { key = "a"; } { key = "a"; } { key = "b"; } ] (x: [])
+  == [ "a" "b" ];
+
+assert closure [ { key = /foo; } ] (x: [ { key = /foo; } { key = /bar; } ])
+  == [ /foo /bar ];
+
+# A single key may be of any type.
+assert closure [ { key = true; } ] (x: []) == [ true ];
+
+true
@@ -0,0 +1,18 @@
+# Large lists built by repeated concatenation are represented as
+# trees; check that they behave like ordinary lists.
+let
+  xs = builtins.foldl' (acc: x: acc ++ [ x ]) [] (builtins.genList (x: x) 100);
+  ys = builtins.foldl' (acc: x: [ x ] ++ acc) [] (builtins.genList (x: x) 100);
+  zs = xs ++ ys ++ [ 1 2 ] ++ xs;
+in [
+  (builtins.length xs)
+  (builtins.elemAt xs 57)
+  (xs == builtins.genList (x: x) 100)
+  (builtins.head ys)
+  (builtins.length zs)
+  (builtins.elemAt zs 150)
+  (builtins.elemAt zs 201)
+  (builtins.foldl' (a: b: a + b) 0 zs)
+  (builtins.sort builtins.lessThan ys == xs)
+  (builtins.concatLists [ xs [ 1 ] ys ] == xs ++ [ 1 ] ++ ys)
+]
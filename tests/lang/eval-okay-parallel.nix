@@ -0,0 +1,12 @@
+let
+  fib = n: if n < 2 then n else fib (n - 1) + fib (n - 2);
+  shared = fib 15;
+  range = builtins.genList (i: i) 8;
+in {
+  fibs = map fib range;
+  sums = map (i: shared + i) range;
+  nested = builtins.listToAttrs (map (i: {
+    name = "a${toString i}";
+    value = { x = shared; y = fib i; };
+  }) range);
+}
@@ -26,4 +26,11 @@ assert match "[[:space:]]+([[:upper:]]+)[[:space:]]+" "  FOO   " == [ "FOO" ];
 assert splitFN "/path/to/foobar.nix" == [ "/path/to/" "/path/to" "foobar" "nix" ];
 assert splitFN "foobar.cc" == [ null null "foobar" "cc" ];
 
+# Groups keep the substring of their last iteration
+assert  match "(a|(b))*" "ba"            == [ "a" "b" ];
+assert  match "((a)|b)+" "ab"            == [ "b" "a" ];
+assert  match "a{2,3}(a*)" "aaaaa"       == [ "aa" ];
+assert  match "([^/]*/)*(.*)" "a/b/c"    == [ "b/" "c" ];
+assert  match "(a*)*" "b"                == null;
+
 true
@@ -45,4 +45,11 @@ assert  split  "([ac])" "abc"    == [ "" [ "a" ] "b" [ "c" ] "" ];
 assert  split  "(a)|(c)" "abc"   == [ "" [ "a" null ] "b" [ null "c" ] "" ];
 assert  split  "([[:upper:]]+)" "  FOO   " == [ "  " [ "FOO" ] "   " ];
 
+# Empty matches and repetitions
+assert  split  "a*" "baa"        == [ "" [ ] "b" [ ] "" [ ] "" ];
+assert  split  "x*" ""           == [ "" [ ] "" ];
+assert  split  "a*(ab)?" "aabab" == [ "" [ null ] "" [ null ] "b" [ null ] "" [ null ] "b" [ null ] "" ];
+assert  split  "^a" "aaa"        == [ "" [ ] "aa" ];
+assert  split  "a$" "aaa"        == [ "aa" [ ] "" ];
+
 true
@@ -0,0 +1,15 @@
+with builtins;
+
+assert toJSON (fromJSON ''"\u0001\u001f\t\r\n \" \\ é"'') == ''"\u0001\u001f\t\r\n \" \\ é"'';
+assert toJSON 0.1 == "0.1";
+assert toJSON 1.0e20 == "1e+20";
+assert toJSON 1.5e-7 == "1.5e-07";
+assert toJSON 123456789.0 == "1.23457e+08";
+assert toJSON [] == "[]";
+assert toJSON {} == "{}";
+assert toJSON { b = [ null ]; a = { outPath = "x"; }; } == ''{"a":"x","b":[null]}'';
+
+# Longer than the output buffer.
+assert stringLength (toJSON (genList (i: "a\"b") 20000)) == 2 + 20000 * 7 - 1;
+
+true
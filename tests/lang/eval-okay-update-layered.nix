@@ -0,0 +1,18 @@
+let
+  base = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 40));
+  l1 = base // { a1 = "one"; new = "new"; };
+  l2 = l1 // { a2 = "two"; new = "newer"; };
+in [
+  l1.a0
+  l1.a1
+  l1.new
+  l2.a1
+  l2.a2
+  l2.new
+  l2.a39
+  (l2 ? a40)
+  (builtins.length (builtins.attrNames l2))
+  (builtins.attrNames l2 == builtins.attrNames (base // { new = 0; }))
+  (l2 == (base // { a1 = "one"; a2 = "two"; new = "newer"; }))
+  (builtins.head (builtins.attrValues (base // { a0 = "x"; })))
+]
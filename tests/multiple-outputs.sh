@@ -28,6 +28,22 @@ drvPath=$(cat $outPath/drv)
 outPath=$(nix-store -q $drvPath)
 (! [ -e "$outPath" ])
 
+# Printing a derivation path writes the derivation.
+drvPath=$(nix-instantiate --eval -E 'with import ./multiple-outputs.nix; d.drvPath' | tr -d '"')
+[ -e "$drvPath" ]
+
+# A file that refers to a derivation that hasn't been written to the
+# store yet.
+refsPath=$(nix-instantiate --eval -E 'with import ./multiple-outputs.nix; builtins.toFile "refs" (builtins.unsafeDiscardOutputDependency a.drvPath)' | tr -d '"')
+[[ $(nix-store -q --references $refsPath) =~ multiple-outputs-a.drv ]]
+
+# Reading a new derivation whose context has been discarded writes it
+# first.
+freshDrv='name: builtins.unsafeDiscardStringContext (with import ./config.nix; mkDerivation { inherit name; buildCommand = "mkdir $out"; }).drvPath'
+[[ $(nix-instantiate --eval -E "builtins.pathExists (($freshDrv) \"discarded-exists\")") = true ]]
+nix-instantiate --eval -E "builtins.readFile (($freshDrv) \"discarded-read\")" | grep -q Derive
+nix-instantiate --eval -E "builtins.hashFile \"sha256\" (($freshDrv) \"discarded-hash\")"
+
 # Do a build of something that depends on a derivation with multiple
 # outputs.
 echo "building b..."
@@ -23,3 +23,52 @@ clearCache
 nix search -f search.nix '' |grep -q foo
 nix search -f search.nix '' |grep -q bar
 nix search -f search.nix '' |grep -q hello
+
+## Search index
+
+# Searching a flake builds an index of its packages, which later
+# searches of the same flake use instead of evaluating it. Check that
+# the index gives the same results as the evaluator for literal terms
+# (which are looked up by trigram), regexes and terms that are too
+# short to have trigrams (which match every indexed package).
+flakeDir=$TEST_ROOT/search-flake
+rm -rf $flakeDir
+mkdir $flakeDir
+cp search.nix config.nix $flakeDir/
+
+cat > $flakeDir/flake.nix <<EOF
+{
+  outputs = { self }: {
+    legacyPackages.$system = import ./search.nix;
+  };
+}
+EOF
+
+# Write the lock file now, so that the flake's fingerprint doesn't
+# change after the first search.
+nix flake update path:$flakeDir
+
+rm -rf $TEST_HOME/.cache/nix/search-index-v1 $TEST_HOME/.cache/nix/eval-cache-v4
+
+(( $(nix search --json path:$flakeDir hello | jq length) == 1 ))
+[[ -n $(ls $TEST_HOME/.cache/nix/search-index-v1) ]]
+
+# Without the evaluation cache, the second search can only succeed
+# without evaluating if it uses the index.
+rm -rf $TEST_HOME/.cache/nix/eval-cache-v4
+
+checkIndex() {
+    expected=$(nix search --json --option eval-cache false path:$flakeDir "$@" | jq -S .)
+    actual=$(NIX_ALLOW_EVAL=0 nix search --json path:$flakeDir "$@" | jq -S .)
+    [[ $actual = $expected ]]
+}
+
+checkIndex hello
+checkIndex 'broken bar'
+checkIndex hello empty
+checkIndex he
+checkIndex '^(foo|bar)'
+checkIndex 'f.o' bar
+checkIndex he 'file$'
+checkIndex ''
+checkIndex nosuchpackageexists